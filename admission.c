@@ -0,0 +1,290 @@
+#include "admission.h"
+#include "metrics.h"
+#include "logger.h"
+
+/*This file implements inbound admission control, see admission.h*/
+
+/*a token bucket. Brief description:
+  tokens  ->  what's left, negative if in debt
+  rate    ->  tokens it gets back per second
+  burst   ->  most tokens it can hold
+  last    ->  when it was last refilled, in nanoseconds (metrics_now)*/
+struct admit_bucket {
+	double tokens, rate, burst;
+	uint64_t last;
+};
+
+/*a peer's budgets. Brief description:
+  mutex   ->  the receiver thread and the pool workers validating its archives
+              both take from its budgets
+  open    ->  whether there's a peer on this socket
+  kicked  ->  set once it's to be disconnected
+  claimed ->  bytes of the current message already taken by admit_claim*/
+struct admit_peer {
+	pthread_mutex_t mutex;
+	int open, kicked;
+	uint64_t claimed;
+	struct admit_bucket bytes, cpu, msgs[ADMIT_TYPES];
+};
+
+/*rate and burst of each message type's budget. The periodic requests come
+  every few seconds, the responses to them at about the same pace, archives
+  whenever the peer (or anyone it hears from) adds a message, and the Hello
+  handshake and tips only once per connection. A bootstrapping peer asks for a
+  couple of ranges at a time, and sends them back as fast as we ask. Fork-point
+  searches take a few probes each*/
+static const double msg_budgets[ADMIT_TYPES][2] = {
+	{1, 10},			//unknown
+	{1, 10},			//PeerRequest
+	{1, 10},			//PeerList
+	{1, 10},			//ArchiveRequest
+	{20, 200},		//ArchiveResponse
+	{1, 10},			//PeerRequestExt
+	{1, 10},			//PeerListExt
+	{4, 128},			//ArchiveRequestCh, one per channel
+	{20, 200},		//ArchiveResponseCh
+	{1, 10},			//HelloRequest
+	{1, 10},			//Hello
+	{1, 10},			//TipRequest
+	{1, 10},			//Tip
+	{64, 256},		//RangeRequest
+	{64, 256},		//Range
+	{16, 64},			//ProbeRequest
+	{16, 64}			//Probe
+};
+
+/*whether budgets are enforced, and every peer's budgets*/
+static int enabled = 0;
+static struct admit_peer *peers;
+
+/*validation slots, validations waits on slot_cond for one to free up*/
+static pthread_mutex_t slot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t slot_cond = PTHREAD_COND_INITIALIZER;
+static int validations = 0, max_slots = 1;
+
+static void bucket_init(struct admit_bucket *b, double rate, double burst,
+	uint64_t now) {
+	b->tokens = b->burst = burst;
+	b->rate = rate;
+	b->last = now;
+}
+
+/*refills the bucket up to now, takes amount out of it, and returns how long
+  (in seconds) it'll take to pay back its debt, 0 if it's not in debt*/
+static double bucket_take(struct admit_bucket *b, double amount, uint64_t now) {
+	if (now > b->last) {
+		b->tokens += (now - b->last) / 1e9 * b->rate;
+		if (b->tokens > b->burst) {
+			b->tokens = b->burst;
+		}
+		b->last = now;
+	}
+	b->tokens -= amount;
+	return b->tokens < 0 ? -b->tokens / b->rate : 0;
+}
+
+/*the peer on the given socket, NULL if it has no budgets*/
+static struct admit_peer *find_peer(int sock) {
+	if (!enabled || sock < 0 || sock >= ADMIT_MAX_SOCK) {
+		return NULL;
+	}
+	return &peers[sock];
+}
+
+/*Deals with a peer that has to wait the given number of seconds (0 if none) to
+  get back within the given budget: we wait, or tell the caller to disconnect
+  it if that's too long. Called with the peer's lock held, releases it*/
+static int settle(struct admit_peer *p, int sock, int budget, double wait) {
+	if (wait > ADMIT_MAX_DEBT) {
+		p->kicked = 1;
+	}
+	int kicked = p->kicked;
+	pthread_mutex_unlock(&p->mutex);
+
+	if (kicked) {
+		metrics_add(M_ADMIT_KICKED, 1);
+		log_event(LOG_WARN, EV_ADMIT_KICKED, sock, budget, 0);
+		return -1;
+	}
+
+	if (wait > 0) {
+		struct timespec ts;
+		ts.tv_sec = (time_t) wait;
+		ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+		metrics_add(M_ADMIT_THROTTLED, 1);
+		log_event(LOG_INFO, EV_ADMIT_THROTTLED, sock, budget,
+			(uint64_t) (wait * 1e6));
+		nanosleep(&ts, NULL);
+	}
+	return 0;
+}
+
+void admit_init(int max_validations) {
+	int i;
+
+	peers = calloc(ADMIT_MAX_SOCK, sizeof(struct admit_peer));
+	for (i = 0; i < ADMIT_MAX_SOCK; i++) {
+		pthread_mutex_init(&peers[i].mutex, NULL);
+	}
+	max_slots = max_validations > 0 ? max_validations : 1;
+	enabled = 1;
+}
+
+void admit_open(int sock) {
+	struct admit_peer *p = find_peer(sock);
+	uint64_t now = metrics_now();
+	int i;
+
+	if (p == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&p->mutex);
+	bucket_init(&p->bytes, ADMIT_BYTES_RATE, ADMIT_BYTES_BURST, now);
+	bucket_init(&p->cpu, ADMIT_CPU_RATE, ADMIT_CPU_BURST, now);
+	for (i = 0; i < ADMIT_TYPES; i++) {
+		bucket_init(&p->msgs[i], msg_budgets[i][0], msg_budgets[i][1], now);
+	}
+	p->claimed = 0;
+	p->kicked = 0;
+	p->open = 1;
+	pthread_mutex_unlock(&p->mutex);
+}
+
+void admit_close(int sock) {
+	struct admit_peer *p = find_peer(sock);
+
+	if (p == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&p->mutex);
+	p->open = 0;
+	pthread_mutex_unlock(&p->mutex);
+}
+
+int admit_message(int sock, uint8_t type) {
+	struct admit_peer *p = find_peer(sock);
+
+	if (p == NULL) {
+		return 0;
+	}
+	if (type >= ADMIT_TYPES) {
+		type = 0;
+	}
+
+	pthread_mutex_lock(&p->mutex);
+	if (!p->open) {
+		pthread_mutex_unlock(&p->mutex);
+		return 0;
+	}
+	double wait = bucket_take(&p->msgs[type], 1, metrics_now());
+	return settle(p, sock, ADMIT_BUDGET_MSGS + type, wait);
+}
+
+int admit_bytes(int sock, uint64_t bytes) {
+	struct admit_peer *p = find_peer(sock);
+
+	if (p == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&p->mutex);
+	if (!p->open) {
+		pthread_mutex_unlock(&p->mutex);
+		return 0;
+	}
+	bytes = bytes > p->claimed ? bytes - p->claimed : 0;
+	p->claimed = 0;
+	double wait = bucket_take(&p->bytes, bytes, metrics_now());
+	return settle(p, sock, ADMIT_BUDGET_BYTES, wait);
+}
+
+int admit_claim(int sock, uint64_t bytes) {
+	struct admit_peer *p = find_peer(sock);
+
+	if (p == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&p->mutex);
+	if (!p->open) {
+		pthread_mutex_unlock(&p->mutex);
+		return 0;
+	}
+
+	/*what's left of its budget, plus all it can get back before we give up*/
+	double wait = bucket_take(&p->bytes, 0, metrics_now());
+	double most = p->bytes.tokens + p->bytes.rate * ADMIT_MAX_DEBT;
+	if (wait > 0 || bytes > most) {
+		p->kicked = 1;
+		pthread_mutex_unlock(&p->mutex);
+		log_event(LOG_WARN, EV_ADMIT_CLAIM, sock, bytes,
+			(uint64_t) (most > 0 ? most : 0));
+		return -1;
+	}
+
+	/*it's paid for now, admit_bytes makes it wait for it afterwards*/
+	bucket_take(&p->bytes, bytes, metrics_now());
+	p->claimed += bytes;
+	pthread_mutex_unlock(&p->mutex);
+	return 0;
+}
+
+int admit_validation(int sock) {
+	struct admit_peer *p = find_peer(sock);
+
+	if (!enabled) {
+		return ADMIT_OK;
+	}
+
+	/*a peer that already cost us more than its share doesn't get more*/
+	if (p != NULL) {
+		pthread_mutex_lock(&p->mutex);
+		if (p->open) {
+			double wait = bucket_take(&p->cpu, 0, metrics_now());
+			if (wait > ADMIT_MAX_DEBT) {
+				p->kicked = 1;
+			}
+			if (p->kicked || wait > 0) {
+				int kicked = p->kicked;
+				pthread_mutex_unlock(&p->mutex);
+				metrics_add(M_ADMIT_SKIPPED, 1);
+				log_event(LOG_INFO, EV_ADMIT_SKIPPED, sock, (uint64_t) (wait * 1e6), 0);
+				return kicked ? ADMIT_KICK : ADMIT_SKIP;
+			}
+		}
+		pthread_mutex_unlock(&p->mutex);
+	}
+
+	pthread_mutex_lock(&slot_mutex);
+	while (validations >= max_slots) {
+		pthread_cond_wait(&slot_cond, &slot_mutex);
+	}
+	validations++;
+	metrics_gauge(G_VALIDATIONS, validations);
+	pthread_mutex_unlock(&slot_mutex);
+	return ADMIT_OK;
+}
+
+void admit_validation_done(int sock, uint64_t cpu_ns) {
+	struct admit_peer *p = find_peer(sock);
+
+	if (!enabled) {
+		return;
+	}
+
+	if (p != NULL) {
+		pthread_mutex_lock(&p->mutex);
+		if (p->open) {
+			bucket_take(&p->cpu, cpu_ns / 1e9, metrics_now());
+		}
+		pthread_mutex_unlock(&p->mutex);
+	}
+
+	pthread_mutex_lock(&slot_mutex);
+	validations--;
+	metrics_gauge(G_VALIDATIONS, validations);
+	pthread_cond_signal(&slot_cond);
+	pthread_mutex_unlock(&slot_mutex);
+}
@@ -0,0 +1,96 @@
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <string.h>				//memsets
+#include <time.h>					//clocks and nanosleeps
+#include <pthread.h>			//a lock per peer, and the validation slots
+
+/*Inbound admission control. Every peer gets a budget of bytes it may send us,
+  of messages of each type, and of CPU time we spend validating the archives it
+  sends, each one a token bucket: it refills at a steady rate, up to a burst,
+  and whatever a peer uses is taken out of it. A peer can go into debt, but
+  then it's throttled: its receiver thread sleeps until the debt is paid back,
+  so we stop reading from it (and TCP makes it stop sending), and we don't
+  validate any archive it sends until its CPU budget is back. A peer whose debt
+  would take longer than ADMIT_MAX_DEBT seconds to pay back is disconnected,
+  and so is one that claims to be sending more than its byte budget could ever
+  cover (a PeerList or archive with a huge size in its header), before we
+  allocate anything for it.
+
+  On top of that, there's a global cap on archives being validated at once, so
+  no number of peers can keep every core busy validating: once it's reached,
+  the receiver threads that want to hand the compute pool another archive wait
+  for a slot to free up.
+
+  Until admit_init is called every peer has unlimited budgets and there's no
+  cap, which is what the programs that run the node's code in virtual time (the
+  simulator, the replay driver) need.*/
+
+/*budgets, per peer. Bytes are whatever the peer sends us, CPU is a fraction of
+  a core (seconds of validation per second) and its burst is in seconds*/
+#define ADMIT_BYTES_RATE (16 << 20)
+#define ADMIT_BYTES_BURST (64 << 20)
+#define ADMIT_CPU_RATE 0.25
+#define ADMIT_CPU_BURST 2.0
+
+/*longest a peer's debt may take to pay back before we disconnect it, seconds*/
+#define ADMIT_MAX_DEBT 10.0
+
+/*highest socket number we keep budgets for, peers on sockets past it (there
+  shouldn't be any) are never limited*/
+#define ADMIT_MAX_SOCK 4096
+
+/*message types we keep a budget for (1 to ADMIT_TYPES-1), anything else shares
+  the budget of type 0*/
+#define ADMIT_TYPES 17
+
+/*which budget a peer went over, for the logs: ADMIT_BUDGET_MSGS + t is the
+  budget for messages of type t*/
+enum {
+	ADMIT_BUDGET_BYTES = 0,
+	ADMIT_BUDGET_CPU,
+	ADMIT_BUDGET_MSGS
+};
+
+/*what to do with an archive a peer sent us (see admit_validation)*/
+enum {
+	ADMIT_OK = 0,
+	ADMIT_SKIP,
+	ADMIT_KICK
+};
+
+/*Starts enforcing budgets, with at most max_validations archives validated at
+  once (at least 1)*/
+void admit_init(int max_validations);
+
+/*Gives the peer on the given socket full budgets*/
+void admit_open(int sock);
+
+/*Forgets about the peer on the given socket*/
+void admit_close(int sock);
+
+/*Takes a message of the given type out of the peer's budget, and waits until
+  the peer is within it. Returns 0 if the message can be handled, -1 if the
+  peer should be disconnected*/
+int admit_message(int sock, uint8_t type);
+
+/*Takes the bytes of the message the peer just sent out of its budget (the ones
+  not already claimed), and waits until the peer is within it. Returns 0 if we
+  can keep reading from it, -1 if it should be disconnected*/
+int admit_bytes(int sock, uint64_t bytes);
+
+/*Checks a size claim at the start of a message: the peer says it's going to
+  send at least the given number of bytes, which we refuse if it's more than
+  its byte budget could ever cover. Returns 0 if the message can be read, -1 if
+  it can't (and the peer should be disconnected, which admit_bytes makes sure
+  of)*/
+int admit_claim(int sock, uint64_t bytes);
+
+/*Asks to validate an archive the peer sent. Returns ADMIT_OK once there's a
+  validation slot for it (waiting for one if need be), and then
+  admit_validation_done must be called after validating it. Returns ADMIT_SKIP
+  if the peer is out of CPU budget, so the archive should be dropped, or
+  ADMIT_KICK if it should be disconnected too*/
+int admit_validation(int sock);
+
+/*Frees the validation slot taken by admit_validation, charging the CPU time
+  spent validating (in nanoseconds) to the peer on the given socket*/
+void admit_validation_done(int sock, uint64_t cpu_ns);
@@ -0,0 +1,485 @@
+#include "main.h"
+#include "api.h"
+#include "archive.h"
+#include "channel.h"
+#include "search.h"
+
+/*This file implements the local client API, see api.h*/
+
+/*globals owned by main.c*/
+extern struct channel_table *channels;
+
+/*most messages the notifier indexes at a time, before letting go of the
+  channel's read lock (so a big archive doesn't keep writers waiting)*/
+#define INDEX_BATCH 4096
+
+/*a connected client. Brief description:
+  sock        ->  its socket
+  send_mutex  ->  taken to write whole messages to the socket, acks and deltas
+                  come from different threads
+  refs        ->  the client thread, plus every queued submission and
+                  notification in flight, it's freed when it drops to 0
+  ch          ->  the channel it submits to and follows
+  subscribed  ->  whether it wants deltas
+  sent        ->  how many messages of the channel's archive it has*/
+struct api_client {
+	int sock;
+	pthread_mutex_t send_mutex;
+	int refs;
+	struct channel *ch;
+	int subscribed;
+	uint32_t sent;
+	struct api_client *next;
+};
+
+/*a message submitted by a client, waiting to be mined*/
+struct api_submission {
+	struct api_client *client;
+	struct channel *ch;
+	uint32_t tag;
+	uint8_t msg[257];
+	struct api_submission *next;
+};
+
+/*everything below is protected by api_mutex: the list of clients, the queue of
+  submissions (the committer thread waits on queue_cond for it to have
+  something), and what subscribers need to hear about (the notifier thread
+  waits on notify_cond for dirty to be set, each channel's api_changed says
+  where its archive changed)*/
+static pthread_mutex_t api_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t notify_cond = PTHREAD_COND_INITIALIZER;
+static struct api_client *clients = NULL;
+static struct api_submission *queue_head = NULL, *queue_tail = NULL;
+static int dirty = 0;
+
+/*whether the API is being served, and how messages get into the archive*/
+static int serving = 0;
+static int (*commit_fn)(struct channel *ch, uint8_t *msg);
+
+/*every channel also keeps the message number and byte offset in its archive
+  the notifier last walked to (api_msg and api_off), so it doesn't walk the
+  whole archive every time. Only the notifier moves them (under the channel's
+  read lock), and api_notify resets them (under the write lock) if the archive
+  changed before that point*/
+
+/*drops a reference to a client, closing and freeing it at the last one*/
+static void release_client(struct api_client *client) {
+	pthread_mutex_lock(&api_mutex);
+	int last = --client->refs == 0;
+	pthread_mutex_unlock(&api_mutex);
+
+	if (last) {
+		close(client->sock);
+		pthread_mutex_destroy(&client->send_mutex);
+		free(client);
+	}
+}
+
+/*sends a whole message to a client. If it fails, the connection is shut down,
+  so the client's thread finds out and gets rid of it. Returns 0 on success,
+  -1 on failure*/
+static int send_client(struct api_client *client, uint8_t *hdr, uint32_t hdrlen,
+	uint8_t *body, uint32_t bodylen) {
+	int rv = 0;
+
+	pthread_mutex_lock(&client->send_mutex);
+	if (send(client->sock, hdr, hdrlen, MSG_NOSIGNAL) != (ssize_t) hdrlen ||
+		(bodylen > 0 && send(client->sock, body, bodylen, MSG_NOSIGNAL) !=
+		(ssize_t) bodylen)) {
+		shutdown(client->sock, SHUT_RDWR);
+		rv = -1;
+	}
+	pthread_mutex_unlock(&client->send_mutex);
+	return rv;
+}
+
+static void put_uint32(uint8_t *buf, uint32_t v) {
+	buf[0] = (v >> 24) & 0xFF;
+	buf[1] = (v >> 16) & 0xFF;
+	buf[2] = (v >> 8) & 0xFF;
+	buf[3] = v & 0xFF;
+}
+
+static uint32_t get_uint32(uint8_t *buf) {
+	return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+/*Runs a client's search on the index of its channel, and sends it the results.
+  The index is brought up to date first, which the notifier has usually done
+  already*/
+static void search_client(struct api_client *client, uint32_t tag,
+	uint32_t before, int limit, const char *query) {
+	uint32_t results[SEARCH_MAX_RESULTS], len = 7;
+	uint8_t *reply = malloc(7 + SEARCH_MAX_RESULTS * 260);
+	struct channel *ch = client->ch;
+	int found, i;
+
+	archive_rdlock(ch);
+	search_update(ch->search, ch->arch, UINT32_MAX);
+	found = search_query(ch->search, query, before, limit, results);
+	for (i = 0; i < found; i++) {
+		uint8_t *rec = ch->arch->str + ch->arch->index[results[i]];
+		put_uint32(reply + len, results[i]);
+		memcpy(reply + len + 4, rec, rec[0] + 1);
+		len += rec[0] + 5;
+	}
+	archive_unlock(ch);
+
+	reply[0] = API_RESULTS;
+	put_uint32(reply+1, tag);
+	reply[5] = found < 0 ? API_INVALID : API_OK;
+	reply[6] = found < 0 ? 0 : found;
+	send_client(client, reply, len, NULL, 0);
+	free(reply);
+}
+
+/*Reads requests from a client until it goes away (or breaks the protocol)*/
+static void *client_thread(void *args) {
+	struct api_client *client = (struct api_client*) args;
+	uint8_t type, buf[10];
+	char name[CHANNEL_NAME_LEN+1], query[256];
+
+	while (recv(client->sock, &type, 1, MSG_WAITALL) == 1) {
+		if (type == API_SUBMIT) {
+			struct api_submission *sub = calloc(1, sizeof(struct api_submission));
+
+			if (recv(client->sock, buf, 5, MSG_WAITALL) != 5 || (buf[4] > 0 &&
+				recv(client->sock, sub->msg, buf[4], MSG_WAITALL) != buf[4])) {
+				free(sub);
+				break;
+			}
+			sub->client = client;
+			sub->tag = get_uint32(buf);
+
+			pthread_mutex_lock(&api_mutex);
+			sub->ch = client->ch;
+			client->refs++;
+			if (queue_tail == NULL) {
+				queue_head = sub;
+			}
+			else {
+				queue_tail->next = sub;
+			}
+			queue_tail = sub;
+			pthread_cond_signal(&queue_cond);
+			pthread_mutex_unlock(&api_mutex);
+		}
+
+		else if (type == API_SUBSCRIBE) {
+			if (recv(client->sock, buf, 4, MSG_WAITALL) != 4) {
+				break;
+			}
+
+			pthread_mutex_lock(&api_mutex);
+			client->subscribed = 1;
+			client->sent = get_uint32(buf);
+			dirty = 1;
+			pthread_cond_signal(&notify_cond);
+			pthread_mutex_unlock(&api_mutex);
+		}
+
+		else if (type == API_CHANNEL) {
+			if (recv(client->sock, buf, 1, MSG_WAITALL) != 1 || buf[0] == 0 ||
+				buf[0] > CHANNEL_NAME_LEN ||
+				recv(client->sock, name, buf[0], MSG_WAITALL) != buf[0]) {
+				break;
+			}
+			name[buf[0]] = 0;
+
+			/*joining it if we're not in it, which fails if we're in too many*/
+			struct channel *ch = channel_join(channels, name);
+			if (ch == NULL) {
+				break;
+			}
+
+			/*from now on it's a client of that channel, and has none of it*/
+			pthread_mutex_lock(&api_mutex);
+			client->ch = ch;
+			client->sent = 0;
+			dirty = 1;
+			pthread_cond_signal(&notify_cond);
+			pthread_mutex_unlock(&api_mutex);
+		}
+
+		else if (type == API_SEARCH) {
+			if (recv(client->sock, buf, 10, MSG_WAITALL) != 10 || (buf[9] > 0 &&
+				recv(client->sock, query, buf[9], MSG_WAITALL) != buf[9])) {
+				break;
+			}
+			query[buf[9]] = 0;
+
+			/*only this thread moves the client to another channel*/
+			search_client(client, get_uint32(buf), get_uint32(buf+4), buf[8], query);
+		}
+
+		else {
+			break;
+		}
+	}
+
+	/*take it off the list, whatever is still queued for it finishes first*/
+	pthread_mutex_lock(&api_mutex);
+	struct api_client **aux = &clients;
+	while (*aux != client) {
+		aux = &(*aux)->next;
+	}
+	*aux = client->next;
+	pthread_mutex_unlock(&api_mutex);
+
+	shutdown(client->sock, SHUT_RDWR);
+	release_client(client);
+	return NULL;
+}
+
+/*Mines submitted messages, one at a time, and acks them*/
+static void *committer_thread() {
+	uint8_t ack[10];
+
+	while (1) {
+		pthread_mutex_lock(&api_mutex);
+		while (queue_head == NULL) {
+			pthread_cond_wait(&queue_cond, &api_mutex);
+		}
+		struct api_submission *sub = queue_head;
+		queue_head = sub->next;
+		if (queue_head == NULL) {
+			queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&api_mutex);
+
+		/*the message needs a newline or a 0 at the end, it always has the 0*/
+		int position = commit_fn(sub->ch, sub->msg);
+
+		ack[0] = API_ACK;
+		put_uint32(ack+1, sub->tag);
+		ack[5] = position > 0 ? API_OK : API_INVALID;
+		put_uint32(ack+6, position > 0 ? position : 0);
+		send_client(sub->client, ack, 10, NULL, 0);
+
+		release_client(sub->client);
+		free(sub);
+	}
+	return NULL;
+}
+
+/*Sends every subscriber of a channel what it's missing of the channel's
+  archive. The buffers are the notifier's, kept from one call to the next*/
+static void notify_channel(struct channel *ch, struct api_client ***subs,
+	uint32_t **from, uint32_t *cap, uint32_t **offs, uint32_t *offcap) {
+	uint32_t nsubs = 0, i;
+
+	pthread_mutex_lock(&api_mutex);
+
+	/*subscribers past where the archive changed go back to that point*/
+	uint32_t first = ch->api_changed, lowest = UINT32_MAX;
+	ch->api_changed = UINT32_MAX;
+
+	struct api_client *client;
+	for (client = clients; client != NULL; client = client->next) {
+		if (!client->subscribed || client->ch != ch) {
+			continue;
+		}
+		if (client->sent > first) {
+			client->sent = first;
+		}
+		if (nsubs == *cap) {
+			*cap = *cap ? *cap * 2 : 16;
+			*subs = realloc(*subs, *cap * sizeof(struct api_client*));
+			*from = realloc(*from, *cap * sizeof(uint32_t));
+		}
+		client->refs++;
+		(*subs)[nsubs] = client;
+		(*from)[nsubs++] = client->sent;
+		if (client->sent < lowest) {
+			lowest = client->sent;
+		}
+	}
+	pthread_mutex_unlock(&api_mutex);
+
+	if (nsubs == 0) {
+		return;
+	}
+
+	/*copy the part of the archive someone is missing, and find where each
+	  message in it begins, so we don't hold the lock while sending*/
+	archive_rdlock(ch);
+	uint32_t size = ch->arch->size, copylen = 0;
+	uint8_t *copy = NULL;
+
+	if (lowest < size) {
+		if (ch->api_msg > lowest) {
+			ch->api_msg = 0;
+			ch->api_off = 5;
+		}
+		while (ch->api_msg < lowest) {
+			ch->api_off += ch->arch->str[ch->api_off] + 33;
+			ch->api_msg++;
+		}
+
+		if (size - lowest + 1 > *offcap) {
+			*offcap = (size - lowest + 1) * 2;
+			*offs = realloc(*offs, *offcap * sizeof(uint32_t));
+		}
+		(*offs)[0] = 0;
+		for (i = 0; i < size - lowest; i++) {
+			(*offs)[i+1] = (*offs)[i] + ch->arch->str[ch->api_off + (*offs)[i]] + 33;
+		}
+		copylen = (*offs)[size - lowest];
+		copy = malloc(copylen);
+		memcpy(copy, ch->arch->str + ch->api_off, copylen);
+	}
+	archive_unlock(ch);
+
+	for (i = 0; i < nsubs; i++) {
+		uint8_t hdr[9];
+		uint32_t start = (*from)[i] < size ? (*from)[i] : size;
+
+		/*only clients that are missing something, or have too much*/
+		if ((*from)[i] != size) {
+			hdr[0] = API_DELTA;
+			put_uint32(hdr+1, start);
+			put_uint32(hdr+5, size - start);
+			if (send_client((*subs)[i], hdr, 9, copy ? copy + (*offs)[start - lowest] :
+				NULL, copy ? copylen - (*offs)[start - lowest] : 0) == 0) {
+				pthread_mutex_lock(&api_mutex);
+				/*unless the archive (or the client's channel) changed before that
+				  point in the meantime*/
+				if ((*subs)[i]->ch == ch && (*subs)[i]->sent == (*from)[i]) {
+					(*subs)[i]->sent = size;
+				}
+				pthread_mutex_unlock(&api_mutex);
+			}
+		}
+		release_client((*subs)[i]);
+	}
+	free(copy);
+}
+
+/*Indexes whatever the channel's index is missing of its archive, a batch at a
+  time*/
+static void index_channel(struct channel *ch) {
+	int done;
+
+	do {
+		archive_rdlock(ch);
+		done = search_update(ch->search, ch->arch, INDEX_BATCH);
+		archive_unlock(ch);
+	} while (!done);
+}
+
+/*Sends every subscriber what it's missing of its channel's archive, whenever
+  it changes (or someone subscribes), then brings the channels' indexes up to
+  date*/
+static void *notifier_thread() {
+	struct api_client **subs = NULL;
+	uint32_t *from = NULL, *offs = NULL, cap = 0, offcap = 0;
+	int i, count;
+
+	while (1) {
+		pthread_mutex_lock(&api_mutex);
+		while (!dirty) {
+			pthread_cond_wait(&notify_cond, &api_mutex);
+		}
+		dirty = 0;
+		pthread_mutex_unlock(&api_mutex);
+
+		count = __atomic_load_n(&channels->count, __ATOMIC_ACQUIRE);
+		for (i = 0; i < count; i++) {
+			notify_channel(channels->list[i], &subs, &from, &cap, &offs, &offcap);
+		}
+		for (i = 0; i < count; i++) {
+			index_channel(channels->list[i]);
+		}
+	}
+	return NULL;
+}
+
+/*Accepts clients, and launches a thread for each one*/
+static void *accept_thread(void *args) {
+	int mysock = (int) (intptr_t) args, sock;
+	struct timeval timeout = {10, 0};
+
+	while (1) {
+		if ((sock = accept(mysock, NULL, NULL)) == -1) {
+			continue;
+		}
+
+		/*a client that stops reading doesn't get to hold everyone else up*/
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+		struct api_client *client = calloc(1, sizeof(struct api_client));
+		client->sock = sock;
+		client->refs = 1;
+		client->ch = channels->list[0];
+		pthread_mutex_init(&client->send_mutex, NULL);
+
+		pthread_mutex_lock(&api_mutex);
+		client->next = clients;
+		clients = client;
+		pthread_mutex_unlock(&api_mutex);
+
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, client_thread, client) != 0) {
+			fprintf(stderr, "Could not start a thread for an API client!\n");
+			shutdown(sock, SHUT_RDWR);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+int api_serve(const char *path, int (*commit)(struct channel *ch, uint8_t *msg)) {
+	struct sockaddr_un addr;
+	int sock;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+		return -1;
+	}
+	unlink(path);
+	if (bind(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+		listen(sock, 64) == -1) {
+		close(sock);
+		return -1;
+	}
+
+	commit_fn = commit;
+	serving = 1;
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, committer_thread, NULL);
+	pthread_detach(thread);
+	pthread_create(&thread, NULL, notifier_thread, NULL);
+	pthread_detach(thread);
+	pthread_create(&thread, NULL, accept_thread, (void*) (intptr_t) sock);
+	pthread_detach(thread);
+	return 0;
+}
+
+void api_notify(struct channel *ch, uint32_t first) {
+	if (!serving) {
+		return;
+	}
+
+	search_forget(ch->search, first);
+	if (first < ch->api_msg) {
+		ch->api_msg = 0;
+		ch->api_off = 5;
+	}
+
+	pthread_mutex_lock(&api_mutex);
+	if (first < ch->api_changed) {
+		ch->api_changed = first;
+	}
+	dirty = 1;
+	pthread_cond_signal(&notify_cond);
+	pthread_mutex_unlock(&api_mutex);
+}
@@ -0,0 +1,89 @@
+#include <stdio.h>				//error reports
+#include <stdlib.h>				//mallocs, frees and the like
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <string.h>				//memsets and memcpys
+#include <unistd.h>				//closes and unlinks
+#include <pthread.h>			//accept, client, committer and notifier threads
+#include <sys/socket.h>		//UNIX domain sockets
+#include <sys/un.h>				//sockaddr_un
+
+/*Local client API. Besides typing messages into the terminal, local programs
+  (bots, bridges, load generators) can connect to the node over a UNIX domain
+  socket, as many of them at once as they like, to submit messages and to
+  follow the active archive as it grows.
+
+  Everything on the socket is a type byte followed by fixed fields, with every
+  number in network byte order, like the peer protocol:
+    Submit    (client -> node)  type 1, tag (4 bytes), length (1 byte), message
+    Subscribe (client -> node)  type 2, from (4 bytes)
+    Channel   (client -> node)  type 3, length (1 byte), channel name
+    Search    (client -> node)  type 4, tag (4 bytes), before (4 bytes), limit
+                                (1 byte), length (1 byte), query
+    Ack       (node -> client)  type 129, tag (4 bytes), status (1 byte),
+                                position (4 bytes)
+    Delta     (node -> client)  type 130, first (4 bytes), count (4 bytes),
+                                count messages in archive format (length,
+                                message, code, MD5 hash)
+    Results   (node -> client)  type 131, tag (4 bytes), status (1 byte), count
+                                (1 byte), then count times: position (4 bytes),
+                                length (1 byte), message
+
+  Submitted messages are queued and mined one at a time, and each one is acked,
+  with the tag the client gave it, once it's in the active archive and was
+  published to our peers (status 0, position being its number in the archive),
+  or as soon as we find it's not a valid message (status 1).
+
+  A client that subscribes, saying it already has the first 'from' messages
+  of the archive, gets a Delta with whatever it's missing, then another one
+  every time the active archive changes. A Delta means "the archive is your
+  first 'first' messages, followed by these ones", so when the active archive
+  is replaced by a branch that parts ways with the old one, subscribers are
+  told to drop the messages past that point, and get the new ones.
+
+  Clients start out in the default channel (see channel.h). A Channel request
+  moves the client to another one, joining it if the node isn't in it yet, and
+  from then on its submissions go to that channel, and it's told about that
+  channel's archive (having none of it, so a subscriber gets all of it in the
+  next Delta). Acks of messages submitted before that still come.
+
+  A Search looks for the messages of the client's channel that have every word
+  in the query (a word ending in '*' being a prefix, see search.h), and gets
+  back Results with the same tag: up to limit of them (at most
+  SEARCH_MAX_RESULTS), newest first, among the messages before position
+  'before' (0 for all of them), each one with its position in the archive. To
+  get the next page, search again with the last position as 'before'. Status 1
+  means the query was refused (no words, too many or too broad a prefix).
+  Every channel keeps a full-text index of its archive while the API is being
+  served, so searches don't go through the archive.*/
+
+/*message types of the client API*/
+enum {
+	API_SUBMIT = 1,
+	API_SUBSCRIBE = 2,
+	API_CHANNEL = 3,
+	API_SEARCH = 4,
+	API_ACK = 129,
+	API_DELTA = 130,
+	API_RESULTS = 131
+};
+
+/*defined in channel.h*/
+struct channel;
+
+/*ack (and results) statuses*/
+enum {
+	API_OK = 0,
+	API_INVALID = 1
+};
+
+/*Starts serving the client API on a UNIX domain socket at the given path
+  (replacing whatever file is there). Messages submitted by clients are added
+  to their channel's archive with commit, which must return 0 for invalid
+  messages. Returns 0 on success, -1 if the socket couldn't be set up*/
+int api_serve(const char *path, int (*commit)(struct channel *ch, uint8_t *msg));
+
+/*Lets subscribers know that the channel's archive changed from message number
+  first (counting from 0) on. Called by whoever changed it, while still holding
+  the write lock (so changes are reported in order). Does nothing if the API
+  isn't being served*/
+void api_notify(struct channel *ch, uint32_t first);
@@ -1,52 +1,178 @@
 #include "archive.h"
+#include "metrics.h"
 
 /*This file implements all the data structures and operations related to the
   chat archive. This means the structure that stores an archive, as well as the
   operations related to changing it. It also contains all the operations related
   to incoming potential archives, such as hash validation and whatnot.*/
 
-/*parses the message, checking if all characters are valid (printable). For
-  valid messages, returns number of characters in the message. Returns 0 for
-  invalid strings (empty or containing illegal characters)*/
-int parse_message (uint8_t *msg) {
-  int count = 0;
+/*mask applied to the first 2 bytes of every MD5 hash before checking that they
+  are zero (see archive.h), only a variable in the benchmarks' build*/
+#ifdef BENCH
+uint16_t hash_mask = 0xFFFF;
+#endif
+
+/*Printable checks. A byte is printable if it's 32 to 126: adding 96 to it maps
+  those to -128..-34 as a signed byte, and every other byte to something above
+  -34, so a single signed compare tells them apart, 16 bytes at a time with
+  SSE2 (which every x86-64 has) or 32 with AVX2, whichever the CPU running us
+  supports (picked the first time around). Every byte on other architectures is
+  checked one by one.
+
+  There are two kinds of checks: whether a buffer of a known length is all
+  printable (archive records), and how many bytes from the start of a string
+  are (typed and submitted messages, which end at the first byte that isn't,
+  hopefully a newline or the terminating 0). The latter only does aligned
+  loads, which never cross into the next page, so it's safe to read a little
+  past the end of the string*/
+static int printable_scalar (const uint8_t *buf, uint32_t len) {
+  uint32_t i;
 
-  /*iterate over characters in string, validating (and counting) each*/
-  while (*msg) {
-    /*newline=end of message, don't increment count, it's not part of payload*/
-    if (*msg == 10) {
-      break;
+  for (i = 0; i < len; i++) {
+    if (buf[i] < 32 || buf[i] > 126) {
+      return 0;
     }
+  }
+  return 1;
+}
+
 
-    /*illegal characters*/
-    if (*msg < 32 || *msg > 126) {
+#if !ARCHIVE_SIMD
+static uint32_t prefix_scalar (const uint8_t *str) {
+  const uint8_t *p = str;
+
+  while (*p >= 32 && *p <= 126) {
+    p++;
+  }
+  return p - str;
+}
+
+#else
+/*mask of the bytes of a vector that aren't printable*/
+static inline uint32_t bad_sse2 (__m128i v) {
+  __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8(96));
+  return _mm_movemask_epi8(_mm_cmpgt_epi8(shifted, _mm_set1_epi8(-34)));
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t bad_avx2 (__m256i v) {
+  __m256i shifted = _mm256_add_epi8(v, _mm256_set1_epi8(96));
+  return _mm256_movemask_epi8(_mm256_cmpgt_epi8(shifted, _mm256_set1_epi8(-34)));
+}
+
+static int printable_sse2 (const uint8_t *buf, uint32_t len) {
+  uint32_t i;
+
+  for (i = 0; i + 16 <= len; i += 16) {
+    if (bad_sse2(_mm_loadu_si128((const __m128i*) (buf + i)))) {
       return 0;
     }
+  }
+  return printable_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static int printable_avx2 (const uint8_t *buf, uint32_t len) {
+  uint32_t i;
 
-    count++;
-    msg++;
+  for (i = 0; i + 32 <= len; i += 32) {
+    if (bad_avx2(_mm256_loadu_si256((const __m256i*) (buf + i)))) {
+      return 0;
+    }
   }
 
-  return count;
+  /*the rest is done right here, calling SSE code from AVX code is slow*/
+  if (i + 16 <= len) {
+    if (bad_sse2(_mm_loadu_si128((const __m128i*) (buf + i)))) {
+      return 0;
+    }
+    i += 16;
+  }
+  return printable_scalar(buf + i, len - i);
 }
 
-/*Attempts to insert message 'msg' in the given chat archive. To do so, we
-  check if the message is valid, then mine a 16 byte code that generates a valid
-  MD5 hash for the string. Then format the string for the entire msg+metadata
-  properly, and include it in the archive structure, updating it accordingly.
-  Returns 1 if message was added successfully, 0 otherwise.
+static uint32_t prefix_sse2 (const uint8_t *str) {
+  const uint8_t *p = (const uint8_t*) ((uintptr_t) str & ~(uintptr_t) 15);
+  uint32_t mask = bad_sse2(_mm_load_si128((const __m128i*) p)) &
+    (0xFFFFu << (str - p));
 
-  Note that we do not validate the archive before attempting to add the message,
-  we just assume it is already valid, since all archives are validated when
-  initially received.*/
-int add_message (struct archive *arch, uint8_t *msg) {
+  while (mask == 0) {
+    p += 16;
+    mask = bad_sse2(_mm_load_si128((const __m128i*) p));
+  }
+  return p + __builtin_ctz(mask) - str;
+}
+
+__attribute__((target("avx2")))
+static uint32_t prefix_avx2 (const uint8_t *str) {
+  const uint8_t *p = (const uint8_t*) ((uintptr_t) str & ~(uintptr_t) 31);
+  uint32_t mask = bad_avx2(_mm256_load_si256((const __m256i*) p)) &
+    (0xFFFFFFFFu << (str - p));
+
+  while (mask == 0) {
+    p += 32;
+    mask = bad_avx2(_mm256_load_si256((const __m256i*) p));
+  }
+  return p + __builtin_ctz(mask) - str;
+}
+#endif
+
+/*the checks for the CPU we're running on, picked by pick_checks*/
+static int (*printable_fn)(const uint8_t*, uint32_t) = NULL;
+static uint32_t (*prefix_fn)(const uint8_t*) = NULL;
+
+static void pick_checks () {
+#if ARCHIVE_SIMD
+  int avx2 = __builtin_cpu_supports("avx2");
+  __atomic_store_n(&prefix_fn, avx2 ? prefix_avx2 : prefix_sse2, __ATOMIC_RELAXED);
+  __atomic_store_n(&printable_fn, avx2 ? printable_avx2 : printable_sse2,
+    __ATOMIC_RELAXED);
+#else
+  __atomic_store_n(&prefix_fn, prefix_scalar, __ATOMIC_RELAXED);
+  __atomic_store_n(&printable_fn, printable_scalar, __ATOMIC_RELAXED);
+#endif
+}
+
+/*Returns 1 if all len bytes of buf are printable, 0 otherwise*/
+static int printable (const uint8_t *buf, uint32_t len) {
+  if (__atomic_load_n(&printable_fn, __ATOMIC_RELAXED) == NULL) {
+    pick_checks();
+  }
+  return printable_fn(buf, len);
+}
+
+/*Returns how many bytes from the start of a 0 terminated string are printable*/
+static uint32_t printable_prefix (const uint8_t *str) {
+  if (__atomic_load_n(&prefix_fn, __ATOMIC_RELAXED) == NULL) {
+    pick_checks();
+  }
+  return prefix_fn(str);
+}
+
+/*parses the message, checking if all characters are valid (printable). For
+  valid messages, returns number of characters in the message. Returns 0 for
+  invalid strings (empty or containing illegal characters)*/
+int parse_message (uint8_t *msg) {
+  /*the message ends at a newline (which isn't part of the payload) or at the
+    terminating 0, anything else that isn't printable makes it invalid*/
+  uint32_t count = printable_prefix(msg);
+
+  if (msg[count] != 0 && msg[count] != 10) {
+    return 0;
+  }
+  return count;
+}
+
+/*Parses message 'msg' and gets it ready to be mined on top of the given
+  archive, returning the mining struct, or NULL if the message is invalid. The
+  input sequence is a copy, so mining doesn't need any lock on the archive.*/
+struct mining *start_mining (struct archive *arch, uint8_t *msg) {
   uint16_t len;
-  uint8_t *code, *md5;
 
   /*parse message and get length, return if message is invalid*/
   len = parse_message(msg);
   if (len == 0) {
-    return 0;
+    return NULL;
   }
 
   /*print message back to user*/
@@ -57,31 +183,102 @@ int add_message (struct archive *arch, uint8_t *msg) {
   }
   fprintf(stdout, "\n");
 
-  /*realloc archive string to fit the new message, then concatenate it*/
-  arch->str = realloc(arch->str, arch->len + len + 33);
-  *(arch->str + arch->len) = len;
-  memcpy(arch->str + arch->len + 1, msg, len);
+  struct mining *m = (struct mining*) malloc(sizeof(struct mining));
+  m->msglen = len;
+  m->size = arch->size;
+  m->len = arch->len;
+  m->found = 0;
+
+  /*the sequence we hash is the last 19 messages (from the offset on), then the
+    new message and its code, and we leave room for the hash after it*/
+  m->hashlen = arch->len - arch->offset + len + 17;
+  m->input = (uint8_t*) malloc(m->hashlen + 16);
+  memcpy(m->input, arch->str + arch->offset, arch->len - arch->offset);
+  *(m->input + arch->len - arch->offset) = len;
+  memcpy(m->input + arch->len - arch->offset + 1, msg, len);
+  memset(m->input + m->hashlen - 16, 0, 32);
+
+  return m;
+}
 
-  /*get pointers to the beginning of the code/md5 hash sections of sequence*/
-  code = arch->str + arch->len + len + 1;
-  md5 = code+16;
+/*Tries codes first, first+step, first+2*step... for the message being mined,
+  until one of them generates a valid MD5 hash, or some other miner found one.
+  The first miner to find a code stores it, and its hash, in m->result. Returns
+  how many hashes we computed. Any number of threads can mine the same message
+  at once, as long as each one is given its own first code.*/
+uint64_t mine_range (struct mining *m, uint64_t first, uint64_t step) {
+  uint8_t *buf, *code, *md5;
+  uint64_t tries = 0;
+
+  /*work on our own copy, other miners are changing the code in theirs*/
+  buf = (uint8_t*) malloc(m->hashlen + 16);
+  memcpy(buf, m->input, m->hashlen);
+  code = buf + m->hashlen - 16;
+  md5 = buf + m->hashlen;
 
   /*128bit pointer for hash comparison, 16bit pointer for 2 0-byte check*/
   unsigned __int128 *mineptr = (unsigned __int128*) code;
   uint16_t *check = (uint16_t*) md5;
 
   /*mine a code that generates a valid MD5 hash*/
-  *mineptr = (unsigned __int128) 0;
-  while (1) {
-    MD5(arch->str + arch->offset, (arch->len - arch->offset + len + 17), md5);
-    /*found it (first 2 bytes are 0)*/
-    if (*check == 0) {
+  *mineptr = (unsigned __int128) first;
+  while (*(volatile int*) &m->found == 0) {
+    MD5(buf, m->hashlen, md5);
+    tries++;
+    /*found it (first 2 bytes are 0), keep it unless someone beat us to it*/
+    if ((*check & hash_mask) == 0) {
+      if (__sync_bool_compare_and_swap(&m->found, 0, 1)) {
+        memcpy(m->result, code, 32);
+      }
       break;
     }
-    *mineptr += 1;
+    *mineptr += step;
+  }
+
+  metrics_add(M_HASHES, tries);
+  free(buf);
+  return tries;
+}
+
+/*makes room in the archive's index for its first n messages*/
+static void grow_index (struct archive *arch, uint32_t n) {
+  if (n <= arch->icap) {
+    return;
+  }
+
+  uint32_t cap = arch->icap ? arch->icap : 64;
+  while (cap < n) {
+    cap *= 2;
   }
+  arch->index = realloc(arch->index, cap * sizeof(uint32_t));
+  arch->icap = cap;
+}
+
+/*Adds a mined message to the given archive, which must be the one mining
+  started on, in the same state (it doesn't validate the archive, we assume it
+  is valid, since all archives are validated when initially received). Returns
+  1 if the message was added, 0 if the archive changed since mining started
+  (the code is no good anymore, the message has to be mined again)*/
+int finish_mining (struct archive *arch, struct mining *m) {
+  uint8_t *code, *md5;
+  uint16_t len = m->msglen;
+
+  if (!m->found || arch->size != m->size || arch->len != m->len) {
+    return 0;
+  }
+
+  /*realloc archive string to fit the new message, then concatenate it along
+    with its code and hash (the end of the mining input)*/
+  arch->str = realloc(arch->str, arch->len + len + 33);
+  memcpy(arch->str + arch->len, m->input + m->hashlen - len - 17, len + 1);
+  memcpy(arch->str + arch->len + len + 1, m->result, 32);
+
+  /*get pointers to the beginning of the code/md5 hash sections of sequence*/
+  code = arch->str + arch->len + len + 1;
+  md5 = code+16;
 
   /*print the mined code and message hash*/
+  int i;
   fprintf(stdout, "code: ");
   for (i = 0; i < 16; i++) {
     fprintf(stdout, "%02x", *(code+i));
@@ -92,7 +289,10 @@ int add_message (struct archive *arch, uint8_t *msg) {
   }
   fprintf(stdout, "\n\n");
 
-  /*update archive size and length, and offset if necessary*/
+  /*update archive size and length, and offset if necessary. The new message's
+    record starts where the archive used to end*/
+  grow_index(arch, arch->size + 1);
+  arch->index[arch->size] = arch->len;
   arch->size += 1;
   arch->len += len+33;
   if (arch->size >= 20) {
@@ -111,64 +311,138 @@ int add_message (struct archive *arch, uint8_t *msg) {
   return 1;
 }
 
-/*Given an input archive, validates the MD5 hashes of all of its messages, and
-  returns whether the entire archive is valid or not. 1 -> valid archive, 0
-  otherwise.*/
-int is_valid (struct archive *arch) {
-  uint8_t *begin, *end, md5[16];
-  unsigned __int128 *calc_hash, *orig_hash;
-
-  /*skip message type/size bytes*/
-  begin = arch->str+5;
-  end = arch->str+5;
-
-  /*our calculated hash is always at the same memory address*/
-  calc_hash = (unsigned __int128*) md5;
-
-  /*now let's iterate over every message in the archive*/
-  uint32_t i, md5len = 0;
-  for (i = 1; i <= arch->size; i++) {
-    /*first compute the length of the current message*/
-    uint8_t len = *end;
-
-    /*iterate to end of message, and keep track of how many bytes we'll hash*/
-    end += len+17;
-    md5len += len+17;
-
-    /*check first 2 bytes of hash, we use a 2 byte pointer to simplify things*/
-    uint16_t *f2bytes = (uint16_t*) end;
-    if (*f2bytes != 0) {
-      fprintf(stderr, "Non-zero bytes in MD5 Hash. Invalid archive!\n");
-      return 0;
-    }
+/*Frees a mining struct*/
+void free_mining (struct mining *m) {
+  free(m->input);
+  free(m);
+}
+
+/*Attempts to insert message 'msg' in the given chat archive. To do so, we
+  check if the message is valid, then mine a 16 byte code that generates a valid
+  MD5 hash for the string. Then format the string for the entire msg+metadata
+  properly, and include it in the archive structure, updating it accordingly.
+  Returns 1 if message was added successfully, 0 otherwise.
+
+  This does all the mining on the calling thread, the node itself spreads it
+  over the compute pool (see commit_message in main.c).*/
+int add_message (struct archive *arch, uint8_t *msg) {
+  struct mining *m = start_mining(arch, msg);
+  if (m == NULL) {
+    return 0;
+  }
+
+  uint64_t start = metrics_now();
+  mine_range(m, 0, 1);
+  metrics_add(M_MINED, 1);
+  metrics_observe(H_MINE, metrics_now() - start);
 
-    /*update offset starting from 20th message*/
-    if (i > 19) {
-      arch->offset += ((*begin) + 33);
+  finish_mining(arch, m);
+  free_mining(m);
+  return 1;
+}
+
+uint32_t scan_archive (struct archive *arch) {
+  uint8_t *str = arch->str;
+  uint32_t i, pos = 5, sound = arch->size;
+  uint16_t zeroes;
+
+  /*one pass over the records, noting down where each one starts, nothing gets
+    hashed until we know every one of them is sound*/
+  grow_index(arch, arch->size);
+  for (i = 0; i < arch->size; i++) {
+    /*the record must fit in what's left of the string*/
+    if (pos >= arch->len || arch->len - pos < (uint32_t) str[pos] + 33) {
+      sound = i;
+      break;
     }
+    uint8_t len = str[pos];
+    arch->index[i] = pos;
 
-    /*if sequence is over 20 messages long, remove first message from md5 input
-    string, and recompute its length*/
-    if (i > 20) {
-      md5len -= ((*begin) + 33);
-      begin += ((*begin) + 33);
+    /*non-empty, printable message, and a hash starting with 2 zero bytes*/
+    memcpy(&zeroes, str + pos + len + 17, 2);
+    if (len == 0 || !printable(str + pos + 1, len) || (zeroes & hash_mask) != 0) {
+      sound = i;
+      break;
     }
+    pos += len + 33;
+  }
+
+  if (sound < arch->size) {
+    fprintf(stderr, "Malformed message in archive. Invalid archive!\n");
+  }
+
+  /*the offset is where the last 19 (sound) records start*/
+  arch->offset = sound >= 20 ? arch->index[sound - 19] : 5;
+  return sound;
+}
 
-    /*calculate hash for byte sequence, and compare with original hash*/
-    MD5(begin, md5len, md5);
+/*Does the actual work for check_messages, which only wraps it to time it.
+  checked gets the number of bytes that actually got hashed*/
+static uint32_t check_hashes (struct archive *arch, uint32_t first,
+  uint32_t count, uint32_t *checked) {
+  uint8_t md5[16];
+  uint32_t i;
 
-    orig_hash = (unsigned __int128*) end;
+  *checked = 0;
+  for (i = first; i < count; i++) {
+    /*every message's hash covers the 19 records before it, then its own
+      length, content and code, which the index tells us where to find*/
+    uint32_t begin = arch->index[i < 19 ? 0 : i - 19];
+    uint32_t end = arch->index[i] + arch->str[arch->index[i]] + 17;
 
-    if (*calc_hash != *orig_hash) {
+    MD5(arch->str + begin, end - begin, md5);
+    *checked += end - begin;
+
+    if (memcmp(md5, arch->str + end, 16) != 0) {
       fprintf(stderr, "Hash Mismatch! Invalid archive.\n");
-      return 0;
+      return i;
     }
+  }
+  return count;
+}
+
+uint32_t check_messages (struct archive *arch, uint32_t first, uint32_t count) {
+  uint32_t checked;
+  uint64_t start = metrics_now();
+  uint32_t valid = check_hashes(arch, first, count, &checked);
+
+  metrics_add(M_VALID_RUNS, 1);
+  metrics_add(M_VALID_BYTES, checked);
+  metrics_add(M_VALID_SKIPPED, first);
+  metrics_observe(H_VALIDATE, metrics_now() - start);
+  return valid;
+}
+
+uint32_t valid_messages (struct archive *arch, uint32_t first) {
+  uint32_t sound = scan_archive(arch);
+  return check_messages(arch, first < sound ? first : sound, sound);
+}
 
-    /*update end pointer past the md5 hash, and update md5 input string length*/
-    end += 16;
-    md5len += 16;
+/*Given an input archive, validates the MD5 hashes of all of its messages, and
+  returns whether the entire archive is valid or not. 1 -> valid archive, 0
+  otherwise.*/
+int is_valid (struct archive *arch) {
+  return valid_messages(arch, 0) == arch->size;
+}
+
+uint8_t *message_hash (struct archive *arch, uint32_t i) {
+  uint8_t *rec = arch->str + arch->index[i];
+  return rec + *rec + 17;
+}
+
+/*Returns how many messages, from the beginning, two archives have in common*/
+uint32_t common_messages (struct archive *a, struct archive *b) {
+  uint8_t *pa = a->str+5, *pb = b->str+5;
+  uint32_t i;
+
+  for (i = 0; i < a->size && i < b->size; i++) {
+    if (*pa != *pb || memcmp(pa, pb, *pa + 33) != 0) {
+      break;
+    }
+    pa += *pa + 33;
+    pb += *pb + 33;
   }
-  return 1;
+  return i;
 }
 
 /*prints an archive to given stream, for either debugging or updating archive*/
@@ -185,7 +459,10 @@ void print_archive (struct archive *arch, FILE *stream) {
 
   ptr+=5;
 
-  /*loop through messages*/
+  /*loop through messages, the content goes out whole, and the code and hash
+    are turned into hex in one go*/
+  static const char digits[] = "0123456789abcdef";
+  char hex[64];
   uint32_t i, j;
   for (i = 0; i < size; i++) {
     uint8_t len;
@@ -194,25 +471,105 @@ void print_archive (struct archive *arch, FILE *stream) {
     fprintf(stream, "msg[%d]: ", len);
 
     /*message content*/
-    for (j = 0; j < len; j++, ptr++) {
-      fprintf(stream, "%c", *ptr);
-    }
+    fwrite(ptr, 1, len, stream);
+    ptr += len;
 
-    /*16 byte hashing code*/
-    fprintf(stream, "\ncode: ");
-    for (j = 0; j < 16; j++, ptr++) {
-      fprintf(stream, "%02x", *ptr);
+    /*16 byte hashing code, then 16 byte MD5 hash*/
+    for (j = 0; j < 32; j++, ptr++) {
+      hex[2*j] = digits[*ptr >> 4];
+      hex[2*j+1] = digits[*ptr & 15];
     }
+    fprintf(stream, "\ncode: %.32s\nmd5: %.32s\n", hex, hex + 32);
+  }
+
+  fprintf(stream, "---------- ARCHIVE FINISH ----------\n");
+}
+
+/*Brings the archive's memfd up to date with its string (only the bytes added
+  since the last call are written), and replaces the archive's latest snapshot.
+  Must be called by whoever holds the archive's write lock, after changing it.*/
+void sync_snapshot (struct archive *arch) {
+  struct archive_snapshot *snap;
 
-    /*16 byte MD5 hash*/
-    fprintf(stream, "\nmd5: ");
-    for (j = 0; j < 16; j++, ptr++) {
-      fprintf(stream, "%02x", *ptr);
+  /*create the memfd the first time around, if we can't we'll just use copies*/
+  if (arch->fd == -1) {
+    arch->fd = memfd_create("archive", MFD_CLOEXEC);
+    arch->flen = 0;
+  }
+
+  /*append only the new bytes to the file, old snapshots never read past their
+    own length, so this can't mess with sends that are still going on*/
+  if (arch->fd != -1) {
+    while (arch->flen < arch->len) {
+      ssize_t w = pwrite(arch->fd, arch->str + arch->flen, arch->len - arch->flen,
+        arch->flen);
+      if (w <= 0) {
+        close(arch->fd);
+        arch->fd = -1;
+        break;
+      }
+      arch->flen += w;
     }
-    fprintf(stream, "\n");
   }
 
-  fprintf(stream, "---------- ARCHIVE FINISH ----------\n");
+  snap = (struct archive_snapshot*) malloc(sizeof(struct archive_snapshot));
+  snap->len = arch->len;
+  snap->refs = 1;
+  memcpy(snap->hdr, arch->str, 5);
+
+  /*each snapshot gets its own dup, so the file lives as long as any of them*/
+  if (arch->fd != -1 && (snap->fd = dup(arch->fd)) != -1) {
+    snap->buf = NULL;
+  }
+  else {
+    snap->fd = -1;
+    snap->buf = (uint8_t*) malloc(arch->len);
+    memcpy(snap->buf, arch->str, arch->len);
+  }
+
+  if (arch->snap != NULL) {
+    release_snapshot(arch->snap);
+  }
+  arch->snap = snap;
+}
+
+/*Returns the archive's latest snapshot with its reference count incremented,
+  or NULL if there is none. The caller must hold at least a read lock on the
+  archive, and call release_snapshot when done with it (no lock needed then).*/
+struct archive_snapshot *acquire_snapshot (struct archive *arch) {
+  struct archive_snapshot *snap = arch->snap;
+
+  if (snap != NULL) {
+    __atomic_add_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL);
+  }
+  return snap;
+}
+
+/*Drops a reference to a snapshot, freeing it once nobody is using it*/
+void release_snapshot (struct archive_snapshot *snap) {
+  if (__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+
+  if (snap->fd != -1) {
+    close(snap->fd);
+  }
+  free(snap->buf);
+  free(snap);
+}
+
+/*Frees an archive structure, along with its memfd and latest snapshot (which
+  stays alive until any in-flight sends release it)*/
+void free_archive (struct archive *arch) {
+  if (arch->snap != NULL) {
+    release_snapshot(arch->snap);
+  }
+  if (arch->fd != -1) {
+    close(arch->fd);
+  }
+  free(arch->str);
+  free(arch->index);
+  free(arch);
 }
 
 /*Initializes a new archive structure, and returns it. New archives have size 0,
@@ -220,7 +577,8 @@ void print_archive (struct archive *arch, FILE *stream) {
   initially 5 characters long, containing only the message type and the 4 bytes
   indicating amount of messages (which is obviously 0).
   Offset is initially 5, since there are no messages in the archive (obvs), and
-  we ignore the type+size bytes*/
+  we ignore the type+size bytes. There is no memfd or snapshot until the first
+  call to sync_snapshot*/
 struct archive *init_archive() {
   struct archive *newarchive;
 
@@ -235,5 +593,12 @@ struct archive *init_archive() {
   newarchive->len = 5;
   newarchive->size = 0;
 
+  newarchive->fd = -1;
+  newarchive->flen = 0;
+  newarchive->snap = NULL;
+
+  newarchive->index = NULL;
+  newarchive->icap = 0;
+
   return newarchive;
 }
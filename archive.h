@@ -1,9 +1,39 @@
+#define _GNU_SOURCE       //memfd_create
 #include <stdint.h>       //portable types (uint8_t, uint32_t, etc...)
 #include <stdlib.h>       //mallocs, callocs, frees and the like
 #include <stdio.h>        //printing! :D, mostly for debugging and error reports
 #include <string.h>       //memsets, memcpys and other memory shenanigans
+#include <unistd.h>       //pwrites, dups and closes for archive snapshots
+#include <sys/mman.h>     //memfd_create
 #include <openssl/md5.h>	//MD5 hashing is fun
 
+/*printable checks use SSE2/AVX2 on x86-64 (see archive.c), unless compiled
+  with -DNO_SIMD, and plain loops everywhere else*/
+#if defined(__x86_64__) && !defined(NO_SIMD)
+#define ARCHIVE_SIMD 1
+#include <immintrin.h>		//SSE2 and AVX2 intrinsics
+#else
+#define ARCHIVE_SIMD 0
+#endif
+
+/*struct that stores an immutable snapshot of an archive's string, so it can be
+  sent to peers with sendfile() straight from the page cache, without copying
+  the whole archive into every socket buffer from user space.
+  fd    ->  our own dup of the archive's memfd, the file only ever grows while
+            the archive is alive, so the first len bytes never change under us
+  buf   ->  fallback copy of the string, only used if memfd_create failed
+  hdr   ->  type+size bytes as of this snapshot (the ones in the file may be
+            newer, so we always send these from memory)
+  len   ->  length of the archive string at the time of the snapshot
+  refs  ->  reference count, the snapshot is freed when it drops to 0*/
+struct archive_snapshot {
+  int fd;
+  uint8_t *buf;
+  uint8_t hdr[5];
+  uint32_t len;
+  int refs;
+};
+
 /*struct that stores an archive. Brief description of its member fields:
   size  ->  number of chat messages in the archive
   str   ->  string representation of the entire archive, in the format it is
@@ -13,42 +43,157 @@
             from the end of the archive is, so we can easily access which
             sequence we need to hash to add new messages
             this offset is first defined when validating an archive for the
-            first time, and is then updated if messages are added*/
+            first time, and is then updated if messages are added
+  fd    ->  memfd mirroring str, used for zero-copy sends (-1 until the first
+            snapshot is taken)
+  flen  ->  how many bytes of str have already been written to fd
+  snap  ->  latest snapshot, replaced by sync_snapshot whenever str changes
+  index ->  where every message's record starts in str (index[i] for message
+            number i, counting from 0), filled in when the archive is validated
+            and as messages are added, so any message (and its hash) is a
+            lookup away instead of a walk from the beginning
+  icap  ->  how many entries index has room for*/
 struct archive {
   uint8_t *str;
   uint32_t offset;
   uint32_t size;
   uint32_t len;
+  int fd;
+  uint32_t flen;
+  struct archive_snapshot *snap;
+  uint32_t *index;
+  uint32_t icap;
 };
 
+/*mask applied to the first 2 bytes of every MD5 hash before checking that they
+  are zero. It is always 0xFFFF in the actual protocol, and a constant in the
+  node, so nothing can ever turn off the proof of work. Only the benchmarks
+  (built with -DBENCH, archive code included) get a variable they can lower, to
+  generate huge synthetic archives without mining every message for real*/
+#ifdef BENCH
+extern uint16_t hash_mask;
+#else
+static const uint16_t hash_mask = 0xFFFF;
+#endif
+
 /*parses the message, checking if all characters are valid (printable). For
   valid messages, returns number of characters in the message. Returns 0 for
   invalid strings (empty or containing illegal characters)*/
 int parse_message (uint8_t *msg);
 
+/*a message being mined on top of an archive. Brief description:
+  input   ->  copy of the sequence that gets hashed: the archive from its offset
+              on, then the new message's length, content and code, plus room
+              for the hash after it
+  hashlen ->  number of bytes of input that get hashed
+  msglen  ->  length of the new message
+  size    ->  size of the archive when mining started
+  len     ->  length of the archive when mining started
+  found   ->  set by the first miner to find a valid code
+  result  ->  the code it found, followed by the resulting hash*/
+struct mining {
+  uint8_t *input;
+  uint32_t hashlen;
+  uint16_t msglen;
+  uint32_t size;
+  uint32_t len;
+  int found;
+  uint8_t result[32];
+};
+
+/*Parses message 'msg' and gets it ready to be mined on top of the given
+  archive, returning the mining struct, or NULL if the message is invalid. The
+  input sequence is a copy, so mining doesn't need any lock on the archive.*/
+struct mining *start_mining (struct archive *arch, uint8_t *msg);
+
+/*Tries codes first, first+step, first+2*step... for the message being mined,
+  until one of them generates a valid MD5 hash, or some other miner found one.
+  The first miner to find a code stores it, and its hash, in m->result. Returns
+  how many hashes we computed. Any number of threads can mine the same message
+  at once, as long as each one is given its own first code.*/
+uint64_t mine_range (struct mining *m, uint64_t first, uint64_t step);
+
+/*Adds a mined message to the given archive, which must be the one mining
+  started on, in the same state (it doesn't validate the archive, we assume it
+  is valid, since all archives are validated when initially received). Returns
+  1 if the message was added, 0 if the archive changed since mining started
+  (the code is no good anymore, the message has to be mined again)*/
+int finish_mining (struct archive *arch, struct mining *m);
+
+/*Frees a mining struct*/
+void free_mining (struct mining *m);
+
 /*Attempts to insert message 'msg' in the given chat archive. To do so, we
   check if the message is valid, then mine a 16 byte code that generates a valid
   MD5 hash for the string. Then format the string for the entire msg+metadata
   properly, and include it in the archive structure, updating it accordingly.
   Returns 1 if message was added successfully, 0 otherwise.
 
-  Note that we do not validate the archive before attempting to add the message,
-  we just assume it is already valid, since all archives are validated when
-  initially received.*/
+  This does all the mining on the calling thread, the node itself spreads it
+  over the compute pool (see commit_message in main.c).*/
 int add_message (struct archive *arch, uint8_t *msg);
 
+/*Checks the structure of an input archive in a single pass, without hashing
+  anything: every record must fit in the archive's string, its message must be
+  1 to 255 printable characters, and its hash must start with 2 zero bytes.
+  Fills in the archive's index and offset as it goes. Returns how many records
+  from the beginning are sound, so if that's less than the archive's size, the
+  archive is invalid, whatever its hashes say.*/
+uint32_t scan_archive (struct archive *arch);
+
+/*Validates the MD5 hashes of the first count messages of an archive whose
+  index scan_archive filled in, except for the first 'first' ones, which the
+  caller already knows are valid. Returns how many messages from the
+  beginning are valid (count if they all are).*/
+uint32_t check_messages (struct archive *arch, uint32_t first, uint32_t count);
+
+/*Validates the messages of an input archive that come after the first 'first'
+  ones, which the caller already knows are valid (say, because they're shared
+  with an archive validated before): scan_archive, then check_messages on the
+  sound ones. Returns how many messages from the beginning of the archive are
+  valid, so the archive is valid if that's its size. Either way, the archive's
+  index and offset get set up.*/
+uint32_t valid_messages (struct archive *arch, uint32_t first);
+
 /*Given an input archive, validates the MD5 hashes of all of its messages, and
   returns whether the entire archive is valid or not. 1 -> valid archive, 0
   otherwise.*/
 int is_valid (struct archive *arch);
 
+/*Returns the hash of the message with the given number (counting from 0), which
+  must be in the archive's index. Every hash covers the 19 records before its
+  message, hashes included, so it stands for every message up to its own: two
+  archives with the same hash for message i have the same first i+1 messages*/
+uint8_t *message_hash (struct archive *arch, uint32_t i);
+
+/*Returns how many messages, from the beginning, two archives have in common*/
+uint32_t common_messages (struct archive *a, struct archive *b);
+
 /*prints an archive to given stream, for either debugging or updating archive*/
 void print_archive (struct archive *arch, FILE *stream);
 
+/*Brings the archive's memfd up to date with its string (only the bytes added
+  since the last call are written), and replaces the archive's latest snapshot.
+  Must be called by whoever holds the archive's write lock, after changing it.*/
+void sync_snapshot (struct archive *arch);
+
+/*Returns the archive's latest snapshot with its reference count incremented,
+  or NULL if there is none. The caller must hold at least a read lock on the
+  archive, and call release_snapshot when done with it (no lock needed then).*/
+struct archive_snapshot *acquire_snapshot (struct archive *arch);
+
+/*Drops a reference to a snapshot, freeing it once nobody is using it*/
+void release_snapshot (struct archive_snapshot *snap);
+
+/*Frees an archive structure, along with its memfd and latest snapshot (which
+  stays alive until any in-flight sends release it)*/
+void free_archive (struct archive *arch);
+
 /*Initializes a new archive structure, and returns it. New archives have size 0,
   so that any new valid archive can overwrite them. Its string representation is
   initially 5 characters long, containing only the message type and the 4 bytes
   indicating amount of messages (which is obviously 0).
   Offset is initially 5, since there are no messages in the archive (obvs), and
-  we ignore the type+size bytes*/
+  we ignore the type+size bytes. There is no memfd or snapshot until the first
+  call to sync_snapshot*/
 struct archive *init_archive();
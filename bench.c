@@ -0,0 +1,358 @@
+#include "main.h"
+#include "peerlist.h"
+#include "archive.h"
+#include "channel.h"
+
+/*Microbenchmarks for the node's hot paths: mining (add_message), validation
+  (is_valid), the structural scan that comes before it (scan_archive), message
+  parsing, peer list maintenance and archive reception
+  (process_archive, fed through a socketpair). Every result is printed to stdout
+  as a single line of JSON, so runs can be diffed/plotted across changes, while
+  everything the benchmarked code prints itself goes to /dev/null.
+
+  Usage: ./bench [-x] [filter]
+    -x      also run the huge cases (10M message archives, ~2GB of memory)
+    filter  only run benchmarks whose name contains this string*/
+
+/*globals owned by main.c*/
+extern struct peer_list *peerlist;
+extern pthread_mutex_t peerlist_mutex;
+extern struct channel_table *channels;
+
+/*where results go (the real stdout, since we silence the stdout stream)*/
+static FILE *results;
+
+/*fixed seed, so every run benchmarks exactly the same synthetic data*/
+#define BENCH_SEED 51511
+
+static double now_s() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*fills msg with a random printable message of 1 to maxlen characters, followed
+  by a newline and the terminating 0, same as what fgets gives us*/
+static int random_message(uint8_t *msg, int maxlen) {
+	int len = 1 + rand() % maxlen, i;
+
+	for (i = 0; i < len; i++) {
+		msg[i] = 32 + rand() % 95;
+	}
+	msg[len] = '\n';
+	msg[len+1] = 0;
+	return len;
+}
+
+/*Generates a synthetic archive with n random messages. Mining every message
+  for real would take forever for big archives, so we lower the hash mask while
+  generating: every hash is still computed (and checked by is_valid) exactly as
+  usual, only the proof of work is skipped.*/
+static struct archive *gen_archive(uint32_t n) {
+	struct archive *arch = init_archive();
+	uint8_t msg[258];
+	uint32_t i;
+	uint16_t mask = hash_mask;
+
+	hash_mask = 0;
+	for (i = 0; i < n; i++) {
+		random_message(msg, 255);
+		add_message(arch, msg);
+	}
+	hash_mask = mask;
+
+	return arch;
+}
+
+/*add_message at various window lengths (number of messages already in the
+  archive, up to the full 20 message window), at the real difficulty*/
+static void bench_mining() {
+	uint32_t windows[] = {0, 1, 5, 10, 19, 20, 100};
+	unsigned w;
+
+	for (w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+		struct archive *arch = gen_archive(windows[w]);
+		uint8_t msg[258];
+		int i, count = 8;
+		uint64_t hashes = 0;
+		double elapsed = 0;
+
+		/*mine a few messages, always starting from the same window length*/
+		for (i = 0; i < count; i++) {
+			struct archive *copy = init_archive();
+			free(copy->str);
+			copy->str = malloc(arch->len + 300);
+			memcpy(copy->str, arch->str, arch->len);
+			copy->len = arch->len;
+			copy->size = arch->size;
+			copy->offset = arch->offset;
+
+			random_message(msg, 64);
+			double start = now_s();
+			add_message(copy, msg);
+			elapsed += now_s() - start;
+
+			/*the mined code is the number of hashes we tried, minus one*/
+			unsigned __int128 code;
+			memcpy(&code, copy->str + copy->len - 32, 16);
+			hashes += (uint64_t) code + 1;
+			free_archive(copy);
+		}
+
+		fprintf(results, "{\"bench\":\"mining\",\"window\":%u,\"messages\":%d,"
+			"\"hashes\":%llu,\"seconds\":%.6f,\"hashes_per_s\":%.0f,"
+			"\"ms_per_message\":%.3f}\n", windows[w], count,
+			(unsigned long long) hashes, elapsed, hashes / elapsed,
+			elapsed * 1000 / count);
+		free_archive(arch);
+	}
+}
+
+/*is_valid on archives from 1k messages up to 1M (or 10M with -x). Since the
+  archives weren't really mined, we validate them with the same lowered mask
+  they were generated with (which costs exactly the same as the real check)*/
+static void bench_validation(int huge) {
+	uint32_t sizes[] = {1000, 10000, 100000, 1000000, 10000000};
+	unsigned s, nsizes = huge ? 5 : 4;
+	uint16_t mask = hash_mask;
+
+	for (s = 0; s < nsizes; s++) {
+		struct archive *arch = gen_archive(sizes[s]);
+		hash_mask = 0;
+
+		/*repeat small ones so each measurement takes a reasonable amount of time*/
+		int reps = sizes[s] >= 100000 ? 1 : 1000000 / sizes[s] / 10, i, valid = 1;
+		double start = now_s();
+		for (i = 0; i < reps; i++) {
+			arch->offset = 5;
+			valid &= is_valid(arch);
+		}
+		double elapsed = now_s() - start;
+
+		fprintf(results, "{\"bench\":\"is_valid\",\"messages\":%u,\"bytes\":%u,"
+			"\"reps\":%d,\"valid\":%d,\"seconds\":%.6f,\"mb_per_s\":%.2f,"
+			"\"messages_per_s\":%.0f}\n", sizes[s], arch->len, reps, valid, elapsed,
+			(double) arch->len * reps / elapsed / 1e6,
+			(double) sizes[s] * reps / elapsed);
+		free_archive(arch);
+		hash_mask = mask;
+	}
+}
+
+/*scan_archive alone, on archives from 1k messages up to 1M: what it costs to
+  reject a malformed archive, compared with validating it (is_valid). Same
+  lowered mask as bench_validation*/
+static void bench_scan() {
+	uint32_t sizes[] = {1000, 10000, 100000, 1000000};
+	unsigned s;
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		struct archive *arch = gen_archive(sizes[s]);
+		uint16_t mask = hash_mask;
+		hash_mask = 0;
+
+		int reps = 10000000 / sizes[s], i, sound = 1;
+		double start = now_s();
+		for (i = 0; i < reps; i++) {
+			sound &= scan_archive(arch) == arch->size;
+		}
+		double elapsed = now_s() - start;
+
+		fprintf(results, "{\"bench\":\"scan_archive\",\"messages\":%u,\"bytes\":%u,"
+			"\"reps\":%d,\"sound\":%d,\"seconds\":%.6f,\"mb_per_s\":%.2f,"
+			"\"messages_per_s\":%.0f}\n", sizes[s], arch->len, reps, sound, elapsed,
+			(double) arch->len * reps / elapsed / 1e6,
+			(double) sizes[s] * reps / elapsed);
+		free_archive(arch);
+		hash_mask = mask;
+	}
+}
+
+/*parse_message on random messages of every length*/
+static void bench_parse() {
+	int count = 1000000, i, n = 1024;
+	uint8_t (*msgs)[258] = malloc(n * sizeof(*msgs));
+	uint64_t bytes = 0, total = 0;
+
+	for (i = 0; i < n; i++) {
+		random_message(msgs[i], 255);
+	}
+
+	double start = now_s();
+	for (i = 0; i < count; i++) {
+		int len = parse_message(msgs[i & (n - 1)]);
+		bytes += len;
+		total += len > 0;
+	}
+	double elapsed = now_s() - start;
+
+	fprintf(results, "{\"bench\":\"parse_message\",\"messages\":%d,\"valid\":%llu,"
+		"\"bytes\":%llu,\"seconds\":%.6f,\"mb_per_s\":%.2f}\n", count,
+		(unsigned long long) total, (unsigned long long) bytes, elapsed,
+		bytes / elapsed / 1e6);
+	free(msgs);
+}
+
+/*building the peer list (add_peer rebuilds its string every time) and looking
+  peers up in it, at thousands of peers*/
+static void bench_peerlist() {
+	uint32_t sizes[] = {100, 1000, 5000};
+	unsigned s;
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		struct peer_list *list = init_list();
+		uint32_t i, found = 0, lookups = 100000;
+
+		double start = now_s();
+		for (i = 0; i < sizes[s]; i++) {
+			add_peer(list, 0x0A000000 + i, DEFAULT_PORT, i, 0);
+		}
+		double add_elapsed = now_s() - start;
+
+		start = now_s();
+		for (i = 0; i < lookups; i++) {
+			found += is_connected(list, 0x0A000000 + (i * 7919) % (2 * sizes[s]),
+				DEFAULT_PORT);
+		}
+		double lookup_elapsed = now_s() - start;
+
+		start = now_s();
+		for (i = 0; i < 100; i++) {
+			list_to_str(list);
+		}
+		double str_elapsed = now_s() - start;
+
+		fprintf(results, "{\"bench\":\"peerlist\",\"peers\":%u,"
+			"\"add_peer_us\":%.3f,\"is_connected_ns\":%.1f,\"list_to_str_us\":%.3f,"
+			"\"found\":%u}\n", sizes[s], add_elapsed * 1e6 / sizes[s],
+			lookup_elapsed * 1e9 / lookups, str_elapsed * 1e6 / 100, found);
+
+		while (list->size) {
+			remove_peer(list, list->head->next->sock);
+		}
+		free(list->str);
+		free(list->head);
+		free(list);
+	}
+}
+
+/*writer side of the socketpair, sends an archive (minus the type byte, which
+  the receiver thread would have already consumed before process_archive)*/
+struct feeder_args {
+	int sock;
+	struct archive *arch;
+	int reps;
+};
+
+static void *feeder(void *ptr) {
+	struct feeder_args *args = (struct feeder_args*) ptr;
+	int i;
+
+	for (i = 0; i < args->reps; i++) {
+		uint32_t sent = 1;
+		while (sent < args->arch->len) {
+			ssize_t w = send(args->sock, args->arch->str + sent,
+				args->arch->len - sent, 0);
+			if (w <= 0) {
+				return NULL;
+			}
+			sent += w;
+		}
+	}
+	return NULL;
+}
+
+/*process_archive reading archives from an in-memory socketpair. Every archive
+  received is longer than the (empty) active archive, so each one gets parsed,
+  validated (with the lowered mask, see above) and swapped in*/
+static void bench_process_archive() {
+	uint32_t sizes[] = {100, 1000, 10000, 100000};
+	unsigned s;
+	struct channel *ch = channels->list[0];
+	uint16_t mask = hash_mask;
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		struct archive *arch = gen_archive(sizes[s]);
+		int socks[2], i, reps = sizes[s] >= 10000 ? 3 : 100000 / sizes[s];
+		struct feeder_args args;
+		pthread_t thread;
+
+		hash_mask = 0;
+		socketpair(AF_UNIX, SOCK_STREAM, 0, socks);
+		args.sock = socks[1];
+		args.arch = arch;
+		args.reps = reps;
+
+		double start = now_s();
+		pthread_create(&thread, NULL, feeder, &args);
+		for (i = 0; i < reps; i++) {
+			/*reset the active archive, so the received one always replaces it*/
+			pthread_rwlock_wrlock(&ch->lock);
+			free_archive(ch->arch);
+			ch->arch = init_archive();
+			pthread_rwlock_unlock(&ch->lock);
+
+			process_archive(socks[0], ch);
+		}
+		double elapsed = now_s() - start;
+		pthread_join(thread, NULL);
+
+		fprintf(results, "{\"bench\":\"process_archive\",\"messages\":%u,"
+			"\"bytes\":%u,\"reps\":%d,\"accepted\":%d,\"seconds\":%.6f,"
+			"\"mb_per_s\":%.2f}\n", sizes[s], arch->len, reps,
+			ch->arch->size == sizes[s], elapsed,
+			(double) arch->len * reps / elapsed / 1e6);
+
+		close(socks[0]);
+		close(socks[1]);
+		free_archive(arch);
+		hash_mask = mask;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int huge = 0, i;
+	char *filter = NULL;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-x") == 0) {
+			huge = 1;
+		}
+		else {
+			filter = argv[i];
+		}
+	}
+
+	/*keep the real stdout for results, and silence everything else*/
+	results = fdopen(dup(STDOUT_FILENO), "w");
+	setvbuf(results, NULL, _IOLBF, 0);
+	freopen("/dev/null", "w", stdout);
+
+	srand(BENCH_SEED);
+
+	/*the node's globals, as main() would set them up*/
+	peerlist = init_list();
+	pthread_mutex_init(&peerlist_mutex, NULL);
+	channels = channels_init(0);
+
+	if (filter == NULL || strstr("parse_message", filter)) {
+		bench_parse();
+	}
+	if (filter == NULL || strstr("peerlist", filter)) {
+		bench_peerlist();
+	}
+	if (filter == NULL || strstr("mining", filter)) {
+		bench_mining();
+	}
+	if (filter == NULL || strstr("is_valid", filter)) {
+		bench_validation(huge);
+	}
+	if (filter == NULL || strstr("scan_archive", filter)) {
+		bench_scan();
+	}
+	if (filter == NULL || strstr("process_archive", filter)) {
+		bench_process_archive();
+	}
+
+	return 0;
+}
@@ -0,0 +1,604 @@
+#include "boot.h"
+#include "archive.h"
+#include "timer.h"
+#include "metrics.h"
+#include "logger.h"
+
+/*This file implements the parallel bootstrap, see boot.h*/
+
+/*how often the bootstrap checks on its tips and ranges, in milliseconds*/
+#define BOOT_TICK 250
+
+/*what the bootstrap is up to: nothing, waiting for tips, or fetching ranges*/
+enum {
+	BOOT_OFF = 0,
+	BOOT_WAITING,
+	BOOT_FETCHING
+};
+
+/*where a range is at*/
+enum {
+	RANGE_TODO = 0,
+	RANGE_INFLIGHT,
+	RANGE_DONE
+};
+
+/*a tip a peer reported*/
+struct boot_tip {
+	int sock;
+	uint32_t size;
+	uint8_t hash[16];
+};
+
+/*a peer we fetch ranges from. Brief description:
+  inflight  ->  ranges we asked it for that haven't arrived yet
+  gone      ->  set once it disconnected, or sent us an invalid range*/
+struct boot_source {
+	int sock;
+	int inflight;
+	int gone;
+};
+
+/*a range of the archive. Brief description:
+  first     ->  number of its first message
+  count     ->  messages in it
+  state     ->  RANGE_TODO, RANGE_INFLIGHT or RANGE_DONE
+  sock      ->  peer it's in flight from, or came from
+  avoid     ->  peer it last failed with, which only gets it again if nobody
+                else can take it (-1 for none)
+  tries     ->  times it failed
+  deadline  ->  when it's due, if it's in flight (metrics_now)
+  recs      ->  once it's in, the records the peer sent, lead-in first
+  len       ->  bytes in recs
+  off       ->  where the range's own records start in recs*/
+struct boot_range {
+	uint32_t first, count;
+	int state, sock, avoid, tries;
+	uint64_t deadline;
+	uint8_t *recs;
+	uint32_t len, off;
+};
+
+/*a RangeRequest to send, once the lock is released*/
+struct boot_request {
+	int sock;
+	uint32_t first, count;
+};
+
+/*the bootstrap. Everything's protected by mutex, which is never held while
+  talking to peers or validating. Brief description:
+  phase     ->  BOOT_OFF, BOOT_WAITING or BOOT_FETCHING
+  chid      ->  channel being bootstrapped
+  since     ->  when the current phase started (metrics_now)
+  tips      ->  tips reported so far while waiting, the first one at tip_since
+  target    ->  size and last hash of the archive we're fetching
+  sources   ->  peers we fetch it from
+  ranges    ->  the archive's ranges, ndone of them in*/
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static int phase = BOOT_OFF;
+static uint32_t chid;
+static const struct boot_ops *ops;
+static uint64_t since, tip_since;
+static struct boot_tip tips[BOOT_TIPS];
+static int ntips = 0;
+static uint32_t target;
+static uint8_t target_hash[16];
+static struct boot_source *sources = NULL;
+static int nsources = 0, sourcescap = 0;
+static struct boot_range *ranges = NULL;
+static int nranges = 0, ndone = 0;
+static struct timer tick;
+
+static struct boot_source *find_source(int sock) {
+	int i;
+
+	for (i = 0; i < nsources; i++) {
+		if (sources[i].sock == sock) {
+			return &sources[i];
+		}
+	}
+	return NULL;
+}
+
+/*adds a source, or brings back one that was on the same socket before (a
+  different peer by now, whatever its old ranges were got released)*/
+static void add_source(int sock) {
+	struct boot_source *s = find_source(sock);
+
+	if (s == NULL) {
+		if (nsources == sourcescap) {
+			sourcescap = sourcescap ? sourcescap * 2 : 16;
+			sources = realloc(sources, sourcescap * sizeof(struct boot_source));
+		}
+		s = &sources[nsources++];
+		s->sock = sock;
+		s->inflight = 0;
+	}
+	s->gone = 0;
+}
+
+/*forgets about everything, we're done bootstrapping*/
+static void reset() {
+	int i;
+
+	for (i = 0; i < nranges; i++) {
+		free(ranges[i].recs);
+	}
+	free(ranges);
+	free(sources);
+	ranges = NULL;
+	sources = NULL;
+	nranges = ndone = nsources = sourcescap = ntips = 0;
+	phase = BOOT_OFF;
+}
+
+static void abandon() {
+	log_event(LOG_WARN, EV_BOOT_ABORT, -1, ndone, nranges);
+	fprintf(stderr, "Bootstrap abandoned, syncing the usual way!\n");
+	reset();
+}
+
+/*Puts a range back in the to-do pile (it was in flight, or it's in but has to
+  be fetched again), to be fetched from someone other than avoid if possible.
+  failed says whether it counts as one of its tries. Returns 1 if it's been
+  tried too many times*/
+static int release(struct boot_range *r, int avoid, int failed) {
+	struct boot_source *s;
+
+	if (r->state == RANGE_INFLIGHT && (s = find_source(r->sock)) != NULL) {
+		s->inflight--;
+	}
+	if (r->state == RANGE_DONE) {
+		ndone--;
+	}
+	free(r->recs);
+	r->recs = NULL;
+	r->state = RANGE_TODO;
+	r->avoid = avoid;
+	if (failed) {
+		r->tries++;
+		metrics_add(M_BOOT_RETRIES, 1);
+	}
+	return r->tries > BOOT_TRIES;
+}
+
+/*Picks the largest tip, and splits its archive into ranges to fetch from
+  every peer that reported it*/
+static void plan() {
+	int i, best = -1;
+
+	for (i = 0; i < ntips; i++) {
+		if (best == -1 || tips[i].size > tips[best].size) {
+			best = i;
+		}
+	}
+	if (best == -1) {
+		return;
+	}
+
+	/*nothing to gain if we're already there*/
+	target = tips[best].size;
+	memcpy(target_hash, tips[best].hash, 16);
+	if (target <= ops->size(chid)) {
+		reset();
+		return;
+	}
+
+	for (i = 0; i < ntips; i++) {
+		if (tips[i].size == target && memcmp(tips[i].hash, target_hash, 16) == 0) {
+			add_source(tips[i].sock);
+		}
+	}
+
+	nranges = (target + BOOT_RANGE - 1) / BOOT_RANGE;
+	ranges = calloc(nranges, sizeof(struct boot_range));
+	for (i = 0; i < nranges; i++) {
+		ranges[i].first = i * BOOT_RANGE;
+		ranges[i].count = target - ranges[i].first < BOOT_RANGE ?
+			target - ranges[i].first : BOOT_RANGE;
+		ranges[i].sock = ranges[i].avoid = -1;
+	}
+	ndone = 0;
+	phase = BOOT_FETCHING;
+	since = metrics_now();
+	log_event(LOG_INFO, EV_BOOT_PLAN, -1, target, nsources);
+	fprintf(stdout, "Bootstrapping %u messages from %d peers\n", target,
+		nsources);
+}
+
+/*Hands out the lowest ranges still to do to the sources with the fewest in
+  flight, as long as any source has room for more. Returns the requests to
+  send (*n of them), NULL if there's none*/
+static struct boot_request *assign(int *n) {
+	struct boot_request *reqs = NULL;
+	uint64_t now = metrics_now();
+	int i, j;
+
+	*n = 0;
+	if (phase != BOOT_FETCHING) {
+		return NULL;
+	}
+
+	for (i = 0; i < nranges; i++) {
+		struct boot_range *r = &ranges[i];
+		struct boot_source *best = NULL;
+		int best_score = 0;
+
+		if (r->state != RANGE_TODO) {
+			continue;
+		}
+
+		/*the one it last failed with only gets it if nobody else can*/
+		for (j = 0; j < nsources; j++) {
+			struct boot_source *s = &sources[j];
+			if (s->gone || s->inflight >= BOOT_INFLIGHT) {
+				continue;
+			}
+			int score = s->inflight + (s->sock == r->avoid ? BOOT_INFLIGHT : 0);
+			if (best == NULL || score < best_score) {
+				best = s;
+				best_score = score;
+			}
+		}
+
+		/*every source is busy*/
+		if (best == NULL) {
+			break;
+		}
+
+		if (reqs == NULL) {
+			reqs = malloc((nsources * BOOT_INFLIGHT + 1) *
+				sizeof(struct boot_request));
+		}
+		r->state = RANGE_INFLIGHT;
+		r->sock = best->sock;
+		r->deadline = now + BOOT_RANGE_TIMEOUT * 1000000ULL;
+		best->inflight++;
+		reqs[*n].sock = best->sock;
+		reqs[*n].first = r->first;
+		reqs[*n].count = r->count;
+		(*n)++;
+	}
+	return reqs;
+}
+
+/*sends the requests assign handed out, with the lock released*/
+static void send_ranges(struct boot_request *reqs, int n, uint32_t c) {
+	int i;
+
+	for (i = 0; i < n; i++) {
+		ops->range_request(reqs[i].sock, c, reqs[i].first, reqs[i].count);
+	}
+	free(reqs);
+}
+
+/*returns 1 if there's any source left to fetch from*/
+static int sources_left() {
+	int i;
+
+	for (i = 0; i < nsources; i++) {
+		if (!sources[i].gone) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*Checks that the lead-in of range b is the end of range a, the one right
+  before it, both of them in*/
+static int lines_up(struct boot_range *a, struct boot_range *b) {
+	uint32_t lead = b->first < BOOT_LEAD ? b->first : BOOT_LEAD, i;
+	uint32_t off = a->off;
+
+	/*find where a's last lead messages start*/
+	for (i = 0; i < a->count - lead; i++) {
+		off += a->recs[off] + 33;
+	}
+	return a->len - off == b->off && memcmp(a->recs + off, b->recs, b->off) == 0;
+}
+
+/*Checks a range's hashes, given its lead-in: it's laid out in an archive
+  whose first lead messages are taken as valid. Returns 1 if it's valid, and
+  sets *off to where its own records start*/
+static int check_range(uint32_t lead, uint32_t count, uint8_t *recs,
+	uint32_t len, uint32_t *off) {
+	struct archive *arch = init_archive();
+	uint32_t i, valid;
+
+	*off = 0;
+	for (i = 0; i < lead; i++) {
+		*off += recs[*off] + 33;
+	}
+
+	arch->str = realloc(arch->str, 5 + len);
+	memcpy(arch->str + 5, recs, len);
+	arch->size = lead + count;
+	arch->len = 5 + len;
+	valid = valid_messages(arch, lead);
+	free_archive(arch);
+	return valid == lead + count;
+}
+
+/*Stitches the ranges into one archive, which must end with the tip's hash.
+  Returns NULL (and abandons the bootstrap) if it doesn't*/
+static struct archive *stitch() {
+	struct archive *arch = init_archive();
+	uint32_t len = 5;
+	int i;
+
+	for (i = 0; i < nranges; i++) {
+		len += ranges[i].len - ranges[i].off;
+	}
+	arch->str = realloc(arch->str, len);
+	arch->str[1] = (target >> 24) & 0xFF;
+	arch->str[2] = (target >> 16) & 0xFF;
+	arch->str[3] = (target >> 8) & 0xFF;
+	arch->str[4] = target & 0xFF;
+	arch->len = 5;
+	for (i = 0; i < nranges; i++) {
+		uint32_t own = ranges[i].len - ranges[i].off;
+		memcpy(arch->str + arch->len, ranges[i].recs + ranges[i].off, own);
+		arch->len += own;
+	}
+	arch->size = target;
+
+	if (memcmp(arch->str + arch->len - 16, target_hash, 16) != 0) {
+		free_archive(arch);
+		abandon();
+		return NULL;
+	}
+
+	/*every message is known valid, this only sets up the offset*/
+	valid_messages(arch, arch->size);
+	return arch;
+}
+
+/*Periodically moves on from waiting for tips, and takes back ranges that are
+  taking too long*/
+static void boot_tick(void *arg) {
+	struct boot_request *reqs = NULL;
+	uint64_t now = metrics_now();
+	uint32_t c = chid;
+	int n = 0, i, over = 0;
+	(void) arg;
+
+	pthread_mutex_lock(&mutex);
+	if (phase == BOOT_WAITING) {
+		if (ntips >= BOOT_TIPS ||
+			(ntips > 0 && (now - tip_since) / 1000000 >= BOOT_TIP_WAIT)) {
+			plan();
+		}
+		else if (ntips == 0 && (now - since) / 1000000 >= BOOT_GIVEUP) {
+			reset();
+		}
+	}
+
+	if (phase == BOOT_FETCHING) {
+		for (i = 0; i < nranges; i++) {
+			struct boot_range *r = &ranges[i];
+			if (r->state == RANGE_INFLIGHT && r->deadline < now) {
+				log_event(LOG_INFO, EV_BOOT_TIMEOUT, r->sock, r->first, 0);
+				over |= release(r, r->sock, 1);
+			}
+		}
+		if (over || !sources_left()) {
+			abandon();
+		}
+		reqs = assign(&n);
+	}
+
+	if (phase != BOOT_OFF) {
+		timer_add(&tick, BOOT_TICK);
+	}
+	pthread_mutex_unlock(&mutex);
+	send_ranges(reqs, n, c);
+}
+
+int boot_start(uint32_t c, const struct boot_ops *o) {
+	pthread_mutex_lock(&mutex);
+	if (phase != BOOT_OFF) {
+		pthread_mutex_unlock(&mutex);
+		return -1;
+	}
+	chid = c;
+	ops = o;
+	phase = BOOT_WAITING;
+	since = metrics_now();
+	timer_init(&tick, boot_tick, NULL);
+	timer_add(&tick, BOOT_TICK);
+	pthread_mutex_unlock(&mutex);
+	return 0;
+}
+
+int boot_peer(int sock) {
+	pthread_mutex_lock(&mutex);
+	int ask = phase != BOOT_OFF;
+	uint32_t c = chid;
+	pthread_mutex_unlock(&mutex);
+
+	if (ask) {
+		ops->tip_request(sock, c);
+	}
+	return ask;
+}
+
+void boot_peer_gone(int sock) {
+	struct boot_request *reqs = NULL;
+	uint32_t c = chid;
+	int i, n = 0;
+
+	pthread_mutex_lock(&mutex);
+	if (phase == BOOT_WAITING) {
+		for (i = 0; i < ntips; i++) {
+			if (tips[i].sock == sock) {
+				tips[i--] = tips[--ntips];
+			}
+		}
+	}
+
+	else if (phase == BOOT_FETCHING) {
+		struct boot_source *s = find_source(sock);
+		if (s == NULL) {
+			pthread_mutex_unlock(&mutex);
+			return;
+		}
+		for (i = 0; i < nranges; i++) {
+			if (ranges[i].state == RANGE_INFLIGHT && ranges[i].sock == sock) {
+				release(&ranges[i], -1, 0);
+			}
+		}
+		s->gone = 1;
+		if (!sources_left()) {
+			abandon();
+		}
+		reqs = assign(&n);
+	}
+	pthread_mutex_unlock(&mutex);
+	send_ranges(reqs, n, c);
+}
+
+int boot_tip(int sock, uint32_t c, uint32_t size, const uint8_t *hash) {
+	struct boot_request *reqs = NULL;
+	int i, n = 0;
+
+	pthread_mutex_lock(&mutex);
+	if (phase == BOOT_OFF || c != chid) {
+		pthread_mutex_unlock(&mutex);
+		return 0;
+	}
+
+	if (phase == BOOT_WAITING) {
+		for (i = 0; i < ntips && tips[i].sock != sock; i++);
+		if (i < BOOT_TIPS) {
+			tips[i].sock = sock;
+			tips[i].size = size;
+			memcpy(tips[i].hash, hash, 16);
+			if (ntips == 0) {
+				tip_since = metrics_now();
+			}
+			ntips += i == ntips;
+		}
+		if (ntips >= BOOT_TIPS) {
+			plan();
+		}
+	}
+
+	/*a peer that has what we're fetching helps fetch it*/
+	else if (size == target && memcmp(hash, target_hash, 16) == 0) {
+		add_source(sock);
+	}
+
+	reqs = assign(&n);
+	pthread_mutex_unlock(&mutex);
+	send_ranges(reqs, n, c);
+	return 1;
+}
+
+void boot_range(int sock, uint32_t c, uint32_t first, uint32_t lead,
+	uint32_t count, uint8_t *recs, uint32_t len) {
+	struct boot_request *reqs = NULL;
+	struct archive *arch = NULL;
+	struct boot_range *r;
+	uint32_t index = first / BOOT_RANGE, off = 0;
+	int n = 0, over = 0, valid = 0;
+
+	/*only ranges we asked this peer for, as we asked for them*/
+	pthread_mutex_lock(&mutex);
+	if (phase != BOOT_FETCHING || c != chid || first % BOOT_RANGE != 0 ||
+		index >= (uint32_t) nranges || ranges[index].state != RANGE_INFLIGHT ||
+		ranges[index].sock != sock) {
+		pthread_mutex_unlock(&mutex);
+		free(recs);
+		return;
+	}
+	r = &ranges[index];
+
+	/*the peer couldn't get it to us, someone else might*/
+	if (recs == NULL) {
+		release(r, sock, 0);
+		reqs = assign(&n);
+		pthread_mutex_unlock(&mutex);
+		send_ranges(reqs, n, c);
+		return;
+	}
+
+	uint32_t want = r->count;
+	pthread_mutex_unlock(&mutex);
+
+	if (lead == (first < BOOT_LEAD ? first : BOOT_LEAD) && count == want) {
+		valid = check_range(lead, count, recs, len, &off);
+	}
+
+	/*it may have timed out while we were at it*/
+	pthread_mutex_lock(&mutex);
+	if (phase != BOOT_FETCHING || index >= (uint32_t) nranges ||
+		ranges[index].state != RANGE_INFLIGHT || ranges[index].sock != sock) {
+		pthread_mutex_unlock(&mutex);
+		free(recs);
+		return;
+	}
+	r = &ranges[index];
+
+	/*a peer that lies about one range doesn't get to send any other*/
+	if (!valid) {
+		int i;
+		log_event(LOG_WARN, EV_BOOT_RANGE_BAD, sock, first, 0);
+		free(recs);
+		over = release(r, sock, 1);
+		for (i = 0; i < nranges; i++) {
+			if (ranges[i].state == RANGE_INFLIGHT && ranges[i].sock == sock) {
+				release(&ranges[i], sock, 0);
+			}
+		}
+		find_source(sock)->gone = 1;
+		if (!over && !sources_left()) {
+			over = 1;
+		}
+	}
+
+	else {
+		find_source(sock)->inflight--;
+		r->state = RANGE_DONE;
+		r->recs = recs;
+		r->len = len;
+		r->off = off;
+		ndone++;
+		metrics_add(M_BOOT_RANGES, 1);
+
+		/*it has to line up with its neighbours, and if it doesn't we can't tell
+		  who lied, so both go again*/
+		struct boot_range *pairs[2][2] = {{index > 0 ? r - 1 : NULL, r},
+			{r, index + 1 < (uint32_t) nranges ? r + 1 : NULL}};
+		int i;
+		for (i = 0; i < 2; i++) {
+			struct boot_range *a = pairs[i][0], *b = pairs[i][1];
+			if (a == NULL || b == NULL || a->state != RANGE_DONE ||
+				b->state != RANGE_DONE || lines_up(a, b)) {
+				continue;
+			}
+			log_event(LOG_WARN, EV_BOOT_MISMATCH, -1, a->first, b->first);
+			over |= release(a, a->sock, 1);
+			over |= release(b, b->sock, 1);
+		}
+	}
+
+	if (over) {
+		abandon();
+	}
+	else if (ndone == nranges) {
+		int from = r->sock;
+		uint64_t took = (metrics_now() - since) / 1000000;
+		if ((arch = stitch()) != NULL) {
+			log_event(LOG_INFO, EV_BOOT_DONE, -1, arch->size, took);
+			fprintf(stdout, "Bootstrapped %u messages in %llu ms\n", arch->size,
+				(unsigned long long) took);
+			reset();
+			pthread_mutex_unlock(&mutex);
+			ops->done(c, arch, from);
+			return;
+		}
+	}
+	reqs = assign(&n);
+	pthread_mutex_unlock(&mutex);
+	send_ranges(reqs, n, c);
+}
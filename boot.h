@@ -0,0 +1,100 @@
+#include <stdlib.h>				//mallocs, reallocs and frees
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <string.h>				//memcpys and memcmps
+#include <pthread.h>			//the bootstrap's lock
+
+/*defined in archive.h*/
+struct archive;
+
+/*Parallel bootstrap. A fresh node would otherwise get its whole archive from
+  whichever peer answers an ArchiveRequest first, over a single connection, so
+  how long the initial sync takes would depend on that one peer's upload speed.
+  Instead, it asks every peer it meets for its tip (TipRequest/Tip: the size of
+  its archive and the hash of its last message), and once it heard from a few
+  of them (or waited long enough) it picks the largest tip. Every peer that
+  reported that same tip is a source, and the archive is split into ranges of
+  BOOT_RANGE messages, which are fetched from the sources at the same time
+  (RangeRequest/Range), up to BOOT_INFLIGHT from each one, lowest ranges
+  first. Peers that show up with the same tip while we're at it become sources
+  too.
+
+  A Range comes with the (up to) 19 messages before it, its lead-in window, so
+  its hashes can be checked as soon as it arrives, without waiting for the
+  ranges before it. Once two neighbouring ranges are in, the lead-in of the
+  second must be the end of the first: if it isn't, one of their peers lied,
+  and both are fetched again elsewhere. A range that fails validation gets its
+  peer dropped as a source, and one that doesn't arrive within
+  BOOT_RANGE_TIMEOUT is fetched from someone else. Once every range is in, they
+  are stitched into one archive, which must end with the tip's hash, and handed
+  to the node. If a range had to be fetched too many times (or every source is
+  gone) the bootstrap is abandoned, and the node syncs the usual way, through
+  ArchiveRequests, which it never stops sending anyway.
+
+  Only one channel is bootstrapped at a time (the default one, as far as the
+  node goes), but the messages carry the channel's id, and peers serve ranges
+  of any channel they're in.*/
+
+/*messages per range, most messages a peer asks for at once, and messages in a
+  range's lead-in window (a message's hash covers the 19 before it)*/
+#define BOOT_RANGE 2048
+#define BOOT_MAX_RANGE (4 * BOOT_RANGE)
+#define BOOT_LEAD 19
+
+/*ranges in flight from each source at most*/
+#define BOOT_INFLIGHT 2
+
+/*most tips we wait for, and how long we wait for them (if we got any), in
+  milliseconds. With no tips at all after BOOT_GIVEUP, we give up*/
+#define BOOT_TIPS 8
+#define BOOT_TIP_WAIT 2000
+#define BOOT_GIVEUP 30000
+
+/*how long a range may take to arrive, in milliseconds, and how many times a
+  range is fetched before we abandon the bootstrap*/
+#define BOOT_RANGE_TIMEOUT 15000
+#define BOOT_TRIES 5
+
+/*how the bootstrap talks to the node. The requests must not block (they go out
+  from the timer wheel's thread), one that doesn't fit in the peer's send
+  buffer is just not sent, and times out. Brief description:
+  tip_request   ->  sends a TipRequest for the channel to the peer on sock
+  range_request ->  sends a RangeRequest for count messages from first on
+  size          ->  size of the channel's active archive
+  done          ->  hands over the stitched archive (which is validated, and
+                    has its offset set up), whoever gets it frees it. sock is
+                    one of the peers it came from*/
+struct boot_ops {
+	int (*tip_request)(int sock, uint32_t chid);
+	int (*range_request)(int sock, uint32_t chid, uint32_t first, uint32_t count);
+	uint32_t (*size)(uint32_t chid);
+	void (*done)(uint32_t chid, struct archive *arch, int sock);
+};
+
+/*Starts bootstrapping the given channel: from now on every peer boot_peer is
+  called for is asked for its tip. Needs the timer wheel running. Returns -1 if
+  there's a bootstrap going already*/
+int boot_start(uint32_t chid, const struct boot_ops *ops);
+
+/*Tells the bootstrap about a newly connected peer that speaks the extended
+  protocol, which gets asked for its tip if we still care. Returns 1 if it was
+  asked, 0 if we're done bootstrapping*/
+int boot_peer(int sock);
+
+/*Tells the bootstrap about a peer that went away, whatever it had in flight
+  is fetched from someone else*/
+void boot_peer_gone(int sock);
+
+/*Records the tip a peer reported for a channel (hash is its last message's
+  hash, zeroes if its archive is empty). Returns 1 if the channel is being
+  bootstrapped, 0 if the tip is none of its business*/
+int boot_tip(int sock, uint32_t chid, uint32_t size, const uint8_t *hash);
+
+/*Hands the bootstrap a Range a peer sent: the records of messages first-lead
+  to first+count-1, as they come in an archive (recs, len bytes long), which it
+  takes ownership of. The range is validated right here, on the calling
+  thread, if it's one we asked that peer for, so it should be called from a
+  compute pool task, not from a thread that reads from peers. recs may be NULL
+  if the range couldn't be taken (say, the peer's out of CPU budget), so it's
+  fetched from someone else*/
+void boot_range(int sock, uint32_t chid, uint32_t first, uint32_t lead,
+	uint32_t count, uint8_t *recs, uint32_t len);
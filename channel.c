@@ -0,0 +1,124 @@
+#include "channel.h"
+#include "archive.h"
+#include "forks.h"
+#include "search.h"
+
+/*This file implements the channel table, see channel.h*/
+
+uint32_t channel_id(const char *name) {
+	uint32_t hash = 2166136261u;
+
+	if (strcmp(name, CHANNEL_DEFAULT) == 0) {
+		return CHANNEL_DEFAULT_ID;
+	}
+	while (*name) {
+		hash ^= (uint8_t) *name++;
+		hash *= 16777619u;
+	}
+
+	/*0 is taken by the default channel*/
+	return hash ? hash : 1;
+}
+
+/*creates a channel with an empty archive*/
+static struct channel *channel_init(const char *name, int forks) {
+	struct channel *ch = calloc(1, sizeof(struct channel));
+
+	ch->id = channel_id(name);
+	strncpy(ch->name, name, CHANNEL_NAME_LEN);
+	ch->arch = init_archive();
+	pthread_rwlock_init(&ch->lock, NULL);
+	ch->forks = forks ? fork_init() : NULL;
+	pthread_mutex_init(&ch->commit_mutex, NULL);
+	pthread_mutex_init(&ch->peers_mutex, NULL);
+	ch->api_changed = UINT32_MAX;
+	ch->api_off = 5;
+	ch->search = search_init();
+	return ch;
+}
+
+struct channel_table *channels_init(int forks) {
+	struct channel_table *table = calloc(1, sizeof(struct channel_table));
+
+	pthread_mutex_init(&table->mutex, NULL);
+	table->list[0] = channel_init(CHANNEL_DEFAULT, forks);
+	table->count = 1;
+	return table;
+}
+
+struct channel *channel_find(struct channel_table *table, uint32_t id) {
+	int i, count = __atomic_load_n(&table->count, __ATOMIC_ACQUIRE);
+
+	for (i = 0; i < count; i++) {
+		if (table->list[i]->id == id) {
+			return table->list[i];
+		}
+	}
+	return NULL;
+}
+
+struct channel *channel_join(struct channel_table *table, const char *name) {
+	struct channel *ch;
+
+	if (strlen(name) == 0 || strlen(name) > CHANNEL_NAME_LEN) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&table->mutex);
+	ch = channel_find(table, channel_id(name));
+	if (ch == NULL && table->count < MAX_CHANNELS) {
+		ch = channel_init(name, table->list[0]->forks != NULL);
+		table->list[table->count] = ch;
+		__atomic_store_n(&table->count, table->count + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&table->mutex);
+	return ch;
+}
+
+int channel_add_peer(struct channel *ch, int sock) {
+	int i;
+
+	pthread_mutex_lock(&ch->peers_mutex);
+	for (i = 0; i < ch->npeers; i++) {
+		if (ch->peers[i] == sock) {
+			pthread_mutex_unlock(&ch->peers_mutex);
+			return 0;
+		}
+	}
+	if (ch->npeers == ch->peerscap) {
+		ch->peerscap = ch->peerscap ? ch->peerscap * 2 : 16;
+		ch->peers = realloc(ch->peers, ch->peerscap * sizeof(int));
+	}
+	ch->peers[ch->npeers++] = sock;
+	pthread_mutex_unlock(&ch->peers_mutex);
+	return 1;
+}
+
+void channel_remove_peer(struct channel *ch, int sock) {
+	int i;
+
+	pthread_mutex_lock(&ch->peers_mutex);
+	for (i = 0; i < ch->npeers; i++) {
+		if (ch->peers[i] == sock) {
+			ch->peers[i] = ch->peers[--ch->npeers];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&ch->peers_mutex);
+}
+
+int channel_peers(struct channel *ch, int **socks, int *cap) {
+	int n;
+
+	pthread_mutex_lock(&ch->peers_mutex);
+	n = ch->npeers;
+	if (n > *cap) {
+		*cap = n;
+		*socks = realloc(*socks, n * sizeof(int));
+	}
+	if (n > 0) {
+		memcpy(*socks, ch->peers, n * sizeof(int));
+	}
+	pthread_mutex_unlock(&ch->peers_mutex);
+	return n;
+}
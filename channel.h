@@ -0,0 +1,95 @@
+#include <stdlib.h>				//mallocs, callocs and frees
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <string.h>				//strcmps and strncpys
+#include <pthread.h>			//every channel has its own locks
+
+/*defined in archive.h, forks.h and search.h*/
+struct archive;
+struct fork_store;
+struct search_index;
+
+/*Chat channels. Every channel is a separate chat, with its own archive, and
+  its own locks and candidate store, so channels are mined, validated and
+  published independently of each other, and never wait on each other's locks.
+
+  The default channel is the chat of the original protocol (plain
+  ArchiveRequests/Responses), and every node has it. Other channels are named,
+  and nodes that joined the same channel exchange its archive with
+  ArchiveRequestCh/ArchiveResponseCh messages, which carry the channel's id, a
+  32 bit FNV-1a hash of its name. We only send a channel's archive to peers
+  that asked for that channel, so it never reaches peers that don't have it
+  (or that only speak the original protocol), and just ignore requests for
+  channels we didn't join.*/
+
+/*name and id of the default channel*/
+#define CHANNEL_DEFAULT "main"
+#define CHANNEL_DEFAULT_ID 0
+
+/*longest channel name, and most channels a node can be in*/
+#define CHANNEL_NAME_LEN 32
+#define MAX_CHANNELS 64
+
+/*a channel. Brief description:
+  id          ->  its id, 0 for the default channel
+  name        ->  its name
+  arch        ->  its active archive
+  lock        ->  rwlock for arch, same rules as the old single archive lock
+  forks       ->  store of candidate archives for this channel (NULL for none)
+  best        ->  size of the largest archive handed to the compute pool so far
+  commit_mutex->  messages are mined one at a time per channel
+  peers_mutex ->  protects the peers that asked for this channel
+  peers       ->  sockets of those peers, which get its archive when published
+  api_changed ->  for the client API: first message that changed since the
+                  subscribers were last told (protected by the API's lock)
+  api_msg     ->  for the client API: message number and byte offset of the
+  api_off         archive it last walked to (see api.c)
+  search      ->  full-text index of arch, for the client API (see search.h)*/
+struct channel {
+	uint32_t id;
+	char name[CHANNEL_NAME_LEN+1];
+	struct archive *arch;
+	pthread_rwlock_t lock;
+	struct fork_store *forks;
+	uint32_t best;
+	pthread_mutex_t commit_mutex;
+	pthread_mutex_t peers_mutex;
+	int *peers;
+	int npeers, peerscap;
+	uint32_t api_changed, api_msg, api_off;
+	struct search_index *search;
+};
+
+/*the channels a node is in, the default one being the first. Channels are
+  only ever added, and count is only bumped once the new channel is all set,
+  so the list can be read without the mutex (which is for joining)*/
+struct channel_table {
+	struct channel *list[MAX_CHANNELS];
+	int count;
+	pthread_mutex_t mutex;
+};
+
+/*Returns the id of the channel with the given name*/
+uint32_t channel_id(const char *name);
+
+/*Creates a table with only the default channel in it (with a fork store if
+  forks is set)*/
+struct channel_table *channels_init(int forks);
+
+/*Returns the channel with the given id, or NULL if we're not in it*/
+struct channel *channel_find(struct channel_table *table, uint32_t id);
+
+/*Joins the channel with the given name (if we're not in it already) and
+  returns it. Returns NULL if the name is too long or there are too many
+  channels*/
+struct channel *channel_join(struct channel_table *table, const char *name);
+
+/*Adds a peer to the channel's peers, unless it's there already. Returns 1 if
+  it was added*/
+int channel_add_peer(struct channel *ch, int sock);
+
+/*Removes a peer from the channel's peers, if it's there*/
+void channel_remove_peer(struct channel *ch, int sock);
+
+/*Copies the channel's peers into *socks (grown as needed, *cap being its size)
+  and returns how many there are*/
+int channel_peers(struct channel *ch, int **socks, int *cap);
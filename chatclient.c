@@ -0,0 +1,341 @@
+#include <stdio.h>				//printing results
+#include <stdlib.h>				//mallocs, qsorts, atois
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <string.h>				//memsets, strlens
+#include <unistd.h>				//getopt, closes
+#include <time.h>					//ack latencies
+#include <pthread.h>			//reader thread
+#include <sys/socket.h>		//UNIX domain socket
+#include <sys/un.h>				//sockaddr_un
+
+/*Client for the node's local API (./blockchain -C <socket>, see api.h). By
+  default, it submits every line typed into it as a message, and prints the
+  acks as they come. It can also follow the active archive, and generate load.
+  Everything it prints is a line of JSON.
+
+  Usage: ./chatclient [-c channel] [-s from] [-n count]
+                      [-q query [-b before] [-l limit]] <socket>
+    -c  submit to and follow the given channel, instead of the default one
+    -s  subscribe, saying we already have the first 'from' messages (0 to get
+        the whole archive), and print every message we're sent. Keeps running
+        until the node goes away
+    -n  instead of reading stdin, submit count messages as fast as the node
+        takes them, then print how long the acks took
+    -q  instead of reading stdin, search the archive for the messages with
+        every word in query ('word*' for a prefix), and print them, newest
+        first, then where the next page starts
+    -b  only search the messages before this position (for the next page)
+    -l  print at most this many results (20 by default)*/
+
+/*message types, as in api.h*/
+#define API_SUBMIT 1
+#define API_SUBSCRIBE 2
+#define API_CHANNEL 3
+#define API_SEARCH 4
+#define API_ACK 129
+#define API_DELTA 130
+#define API_RESULTS 131
+
+static int sock;
+
+/*acks still to come, and what the acks that came took (for -n)*/
+static int outstanding = 0, subscribed = 0;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static double *sent_at = NULL, *latencies = NULL;
+static int nlatencies = 0, invalid = 0, quiet = 0;
+
+static double now_s() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void put_uint32(uint8_t *buf, uint32_t v) {
+	buf[0] = (v >> 24) & 0xFF;
+	buf[1] = (v >> 16) & 0xFF;
+	buf[2] = (v >> 8) & 0xFF;
+	buf[3] = v & 0xFF;
+}
+
+static uint32_t get_uint32(uint8_t *buf) {
+	return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+static int recv_all(void *buf, uint32_t len) {
+	return recv(sock, buf, len, MSG_WAITALL) == (ssize_t) len;
+}
+
+static int submit(uint32_t tag, const char *msg) {
+	uint8_t buf[261];
+	size_t len = strlen(msg);
+
+	if (len > 255) {
+		len = 255;
+	}
+	buf[0] = API_SUBMIT;
+	put_uint32(buf+1, tag);
+	buf[5] = len;
+	memcpy(buf+6, msg, len);
+	return send(sock, buf, len + 6, MSG_NOSIGNAL) == (ssize_t) (len + 6);
+}
+
+/*prints a message, escaping what JSON wants escaped*/
+static void print_message(uint32_t index, uint8_t *msg, uint8_t len) {
+	int i;
+
+	printf("{\"index\":%u,\"message\":\"", index);
+	for (i = 0; i < len; i++) {
+		if (msg[i] == '"' || msg[i] == '\\') {
+			putchar('\\');
+		}
+		putchar(msg[i]);
+	}
+	printf("\"}\n");
+}
+
+/*Reads acks and deltas until the node goes away*/
+static void *reader_thread() {
+	uint8_t type, buf[9], msg[288];
+	uint32_t i;
+
+	while (recv_all(&type, 1)) {
+		if (type == API_ACK) {
+			if (!recv_all(buf, 9)) {
+				break;
+			}
+			uint32_t tag = get_uint32(buf), position = get_uint32(buf+5);
+
+			if (!quiet) {
+				printf("{\"ack\":%u,\"status\":\"%s\",\"position\":%u}\n", tag,
+					buf[4] == 0 ? "ok" : "invalid", position);
+				fflush(stdout);
+			}
+
+			pthread_mutex_lock(&mutex);
+			if (sent_at != NULL) {
+				latencies[nlatencies++] = now_s() - sent_at[tag];
+			}
+			invalid += buf[4] != 0;
+			outstanding--;
+			pthread_cond_broadcast(&cond);
+			pthread_mutex_unlock(&mutex);
+		}
+
+		else if (type == API_DELTA) {
+			if (!recv_all(buf, 8)) {
+				break;
+			}
+			uint32_t first = get_uint32(buf), count = get_uint32(buf+4);
+
+			/*everything we had past first is gone*/
+			printf("{\"keep\":%u,\"new\":%u}\n", first, count);
+			for (i = 0; i < count; i++) {
+				if (!recv_all(msg, 1) || !recv_all(msg+1, msg[0] + 32)) {
+					break;
+				}
+				print_message(first + i, msg+1, msg[0]);
+			}
+		}
+
+		else if (type == API_RESULTS) {
+			if (!recv_all(buf, 6)) {
+				break;
+			}
+			uint32_t position = 0;
+
+			for (i = 0; i < buf[5]; i++) {
+				if (!recv_all(msg, 5) || !recv_all(msg+5, msg[4])) {
+					break;
+				}
+				position = get_uint32(msg);
+				print_message(position, msg+5, msg[4]);
+			}
+
+			/*the next page is whatever comes before the last result*/
+			printf("{\"search\":%u,\"status\":\"%s\",\"results\":%u,\"next\":%u}\n",
+				get_uint32(buf), buf[4] == 0 ? "ok" : "invalid", buf[5], position);
+
+			pthread_mutex_lock(&mutex);
+			outstanding--;
+			pthread_cond_broadcast(&cond);
+			pthread_mutex_unlock(&mutex);
+		}
+
+		else {
+			break;
+		}
+		fflush(stdout);
+	}
+
+	/*the node went away, nothing more is coming*/
+	pthread_mutex_lock(&mutex);
+	outstanding = 0;
+	subscribed = 0;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&mutex);
+	return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(double*) a, y = *(double*) b;
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+	int opt, count = 0, limit = 20, i;
+	long from = -1, before = 0;
+	char *channel = NULL, *query = NULL;
+
+	while ((opt = getopt(argc, argv, "c:s:n:q:b:l:")) != -1) {
+		switch (opt) {
+			case 'c': {
+				channel = optarg;
+				break;
+			}
+
+			case 's': {
+				from = atol(optarg);
+				break;
+			}
+
+			case 'n': {
+				count = atoi(optarg);
+				break;
+			}
+
+			case 'q': {
+				query = optarg;
+				break;
+			}
+
+			case 'b': {
+				before = atol(optarg);
+				break;
+			}
+
+			case 'l': {
+				limit = atoi(optarg);
+				break;
+			}
+
+			default: {
+				fprintf(stderr, "Usage: ./chatclient [-c channel] [-s from] [-n count] "
+			"[-q query [-b before] [-l limit]] <socket>\n");
+				return 1;
+			}
+		}
+	}
+
+	if (argc - optind != 1) {
+		fprintf(stderr, "Usage: ./chatclient [-c channel] [-s from] [-n count] "
+			"[-q query [-b before] [-l limit]] <socket>\n");
+		return 1;
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, argv[optind], sizeof(addr.sun_path) - 1);
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+		connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+		fprintf(stderr, "Could not connect to %s!\n", argv[optind]);
+		return 1;
+	}
+
+	if (count > 0) {
+		sent_at = malloc(count * sizeof(double));
+		latencies = malloc(count * sizeof(double));
+		quiet = 1;
+	}
+
+	pthread_t reader;
+	pthread_create(&reader, NULL, reader_thread, NULL);
+
+	/*switch channels before anything else, so it all goes to that one*/
+	if (channel != NULL) {
+		uint8_t buf[34];
+		size_t len = strlen(channel) > 32 ? 32 : strlen(channel);
+		buf[0] = API_CHANNEL;
+		buf[1] = len;
+		memcpy(buf+2, channel, len);
+		send(sock, buf, len + 2, MSG_NOSIGNAL);
+	}
+
+	if (from >= 0) {
+		uint8_t buf[5];
+		buf[0] = API_SUBSCRIBE;
+		put_uint32(buf+1, from);
+		subscribed = 1;
+		send(sock, buf, 5, MSG_NOSIGNAL);
+	}
+
+	double start = now_s();
+	if (count > 0) {
+		for (i = 0; i < count; i++) {
+			char msg[64];
+			snprintf(msg, sizeof(msg), "load %d %d", (int) getpid(), i);
+
+			pthread_mutex_lock(&mutex);
+			sent_at[i] = now_s();
+			outstanding++;
+			pthread_mutex_unlock(&mutex);
+			if (!submit(i, msg)) {
+				break;
+			}
+		}
+	}
+
+	else if (query != NULL) {
+		uint8_t buf[266];
+		size_t len = strlen(query) > 255 ? 255 : strlen(query);
+		buf[0] = API_SEARCH;
+		put_uint32(buf+1, 0);
+		put_uint32(buf+5, before);
+		buf[9] = limit > 255 ? 255 : limit;
+		buf[10] = len;
+		memcpy(buf+11, query, len);
+
+		pthread_mutex_lock(&mutex);
+		outstanding++;
+		pthread_mutex_unlock(&mutex);
+		send(sock, buf, len + 11, MSG_NOSIGNAL);
+	}
+
+	else {
+		char line[258];
+		uint32_t tag = 0;
+
+		while (fgets(line, sizeof(line), stdin) != NULL) {
+			line[strcspn(line, "\n")] = 0;
+			pthread_mutex_lock(&mutex);
+			outstanding++;
+			pthread_mutex_unlock(&mutex);
+			if (!submit(tag++, line)) {
+				break;
+			}
+		}
+	}
+
+	/*wait for the acks, and for the node to go away if we're following it*/
+	pthread_mutex_lock(&mutex);
+	while (outstanding > 0 || subscribed) {
+		pthread_cond_wait(&cond, &mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	if (count > 0) {
+		double elapsed = now_s() - start;
+		qsort(latencies, nlatencies, sizeof(double), compare_doubles);
+		printf("{\"submitted\":%d,\"acked\":%d,\"invalid\":%d,\"seconds\":%.3f,"
+			"\"msgs_per_s\":%.1f,\"ack_p50\":%.6f,\"ack_p99\":%.6f,"
+			"\"ack_max\":%.6f}\n", count, nlatencies, invalid, elapsed,
+			nlatencies / elapsed,
+			nlatencies ? latencies[(nlatencies - 1) / 2] : 0,
+			nlatencies ? latencies[(int) (0.99 * (nlatencies - 1) + 0.5)] : 0,
+			nlatencies ? latencies[nlatencies - 1] : 0);
+	}
+
+	close(sock);
+	return 0;
+}
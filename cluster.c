@@ -0,0 +1,410 @@
+#include <stdio.h>				//results, and talking to the nodes' stdins
+#include <stdlib.h>				//mallocs, frees, qsort, rand
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <string.h>				//memsets and string wrangling
+#include <unistd.h>				//fork, exec, pipes and sleeping
+#include <signal.h>				//killing nodes that won't leave
+#include <time.h>					//monotonic clock, for latencies
+#include <sys/wait.h>			//reaping nodes
+#include <sys/resource.h>	//file descriptor limits, nodes need a lot of them
+#include <sys/socket.h>		//scraping the nodes' metrics
+#include <netinet/in.h>		//sockaddr_in
+#include <arpa/inet.h>		//inet_pton
+
+/*Loopback cluster harness. Starts N nodes on one host, each on its own
+  loopback address (127.0.0.1, 127.0.0.2, ...) and its own ports, connected in
+  a ring through their initial peers. Once the peer lists have spread and every
+  node is connected to every other, it types messages into random nodes, one at
+  a time, and scrapes every node's metrics endpoint until they all have the new
+  message in their active archive, recording how long that took.
+  At the end it prints a single line of JSON with the convergence latencies,
+  the traffic the whole cluster generated and the CPU time the nodes used.
+
+  Usage: ./cluster [-u] [-n nodes] [-k messages] [-w warmup seconds]
+    -u  run the nodes with the io_uring backend (to compare it against the
+        blocking sockets)
+    -n  number of nodes to start (default 10)
+    -k  number of messages to inject (default 10)
+    -w  how long to wait for the mesh to form, at most (default 60)
+
+  Every node logs to its own file in a temporary folder, which is printed out
+  and left behind, so the logs can be looked at with logdump afterwards.*/
+
+/*ports for node i are these plus i*/
+#define BASE_PORT 52000
+#define BASE_METRICS_PORT 54000
+
+/*how long we wait for a single message to reach every node*/
+#define MESSAGE_TIMEOUT 60
+
+struct cluster_node {
+	pid_t pid;
+	FILE *in;
+	char ip[24];
+	uint16_t port, metricsport;
+};
+
+static double now_s() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*Scrapes a node's metrics endpoint into buf. Returns the number of bytes read,
+  or -1 if the node couldn't be reached*/
+static int scrape(struct cluster_node *node, char *buf, int len) {
+	struct sockaddr_in addr;
+	int sock, total = 0, r;
+	const char *req = "GET /metrics HTTP/1.0\r\n\r\n";
+
+	if ((sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(node->metricsport);
+	inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+	if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+		send(sock, req, strlen(req), 0) == -1) {
+		close(sock);
+		return -1;
+	}
+
+	while (total < len - 1 && (r = recv(sock, buf + total, len - 1 - total, 0)) > 0) {
+		total += r;
+	}
+	buf[total] = 0;
+	close(sock);
+	return total;
+}
+
+/*Adds up every sample of the given metric (any labels) in a scrape. If match is
+  given, only samples whose labels contain it are counted*/
+static double metric_sum(char *scraped, const char *name, const char *match) {
+	double sum = 0;
+	size_t namelen = strlen(name);
+	char *line = scraped;
+
+	while (line != NULL && *line) {
+		char *next = strchr(line, '\n');
+
+		if (strncmp(line, name, namelen) == 0 &&
+			(line[namelen] == ' ' || line[namelen] == '{')) {
+			char *value = strchr(line, ' ');
+			int matches = match == NULL;
+
+			if (!matches) {
+				char *labels_end = strchr(line, '}');
+				char *found = strstr(line, match);
+				matches = found != NULL && labels_end != NULL && found < labels_end;
+			}
+			if (matches && value != NULL) {
+				sum += atof(value + 1);
+			}
+		}
+		line = next != NULL ? next + 1 : NULL;
+	}
+	return sum;
+}
+
+/*Reads a single metric off a node, -1 if the node couldn't be scraped*/
+static double node_metric(struct cluster_node *node, const char *name) {
+	static char buf[1 << 20];
+
+	if (scrape(node, buf, sizeof(buf)) == -1) {
+		return -1;
+	}
+	return metric_sum(buf, name, NULL);
+}
+
+/*CPU time (user + system) used so far by the given process, in seconds*/
+static double cpu_seconds(pid_t pid) {
+	char path[64], buf[1024], *p;
+	unsigned long utime = 0, stime = 0;
+	FILE *stat;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	if ((stat = fopen(path, "r")) == NULL) {
+		return 0;
+	}
+	if (fgets(buf, sizeof(buf), stat) == NULL) {
+		fclose(stat);
+		return 0;
+	}
+	fclose(stat);
+
+	/*skip past the command name, which may contain spaces, then utime and stime
+	  are the 12th and 13th fields after it*/
+	if ((p = strrchr(buf, ')')) == NULL) {
+		return 0;
+	}
+	sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		&utime, &stime);
+	return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+/*Forks and execs a node, with its stdin on a pipe we keep, and its stdout and
+  stderr thrown away (it is very chatty). Its initial peer is the node started
+  right before it, so the nodes start out connected in a ring*/
+static int start_node(struct cluster_node *nodes, int n, int i, int uring,
+	char *dir) {
+	struct cluster_node *node = &nodes[i];
+	int prev = (i + n - 1) % n, fds[2];
+
+	snprintf(node->ip, sizeof(node->ip), "127.0.%d.%d", (i + 1) / 256,
+		(i + 1) % 256);
+	node->port = BASE_PORT + i;
+	node->metricsport = BASE_METRICS_PORT + i;
+
+	if (pipe(fds) == -1) {
+		return -1;
+	}
+
+	if ((node->pid = fork()) == -1) {
+		return -1;
+	}
+
+	if (node->pid == 0) {
+		char port[8], metricsport[8], logpath[512], initial[32];
+		char *argv[16];
+		int argc = 0;
+
+		snprintf(port, sizeof(port), "%u", node->port);
+		snprintf(metricsport, sizeof(metricsport), "%u", node->metricsport);
+		snprintf(logpath, sizeof(logpath), "%s/node%d.blog", dir, i);
+		snprintf(initial, sizeof(initial), "127.0.%d.%d:%d", (prev + 1) / 256,
+			(prev + 1) % 256, BASE_PORT + prev);
+
+		argv[argc++] = "./blockchain";
+		if (uring) {
+			argv[argc++] = "-u";
+		}
+		argv[argc++] = "-b";
+		argv[argc++] = "-p";
+		argv[argc++] = port;
+		argv[argc++] = "-m";
+		argv[argc++] = metricsport;
+		argv[argc++] = "-L";
+		argv[argc++] = logpath;
+		argv[argc++] = initial;
+		argv[argc++] = node->ip;
+		argv[argc] = NULL;
+
+		dup2(fds[0], STDIN_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		freopen("/dev/null", "w", stdout);
+		freopen("/dev/null", "w", stderr);
+		execv(argv[0], argv);
+		_exit(1);
+	}
+
+	close(fds[0]);
+	node->in = fdopen(fds[1], "w");
+	setvbuf(node->in, NULL, _IOLBF, 0);
+	return 0;
+}
+
+/*Asks every node to exit, and kills whoever is still around after a while*/
+static void stop_nodes(struct cluster_node *nodes, int n) {
+	int i, alive = n;
+	double deadline = now_s() + 10;
+
+	for (i = 0; i < n; i++) {
+		fprintf(nodes[i].in, "exit\n");
+		fclose(nodes[i].in);
+	}
+
+	while (alive && now_s() < deadline) {
+		alive = 0;
+		for (i = 0; i < n; i++) {
+			if (nodes[i].pid && waitpid(nodes[i].pid, NULL, WNOHANG) == 0) {
+				alive++;
+			}
+			else {
+				nodes[i].pid = 0;
+			}
+		}
+		usleep(100000);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (nodes[i].pid) {
+			kill(nodes[i].pid, SIGKILL);
+			waitpid(nodes[i].pid, NULL, 0);
+		}
+	}
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(double*) a, y = *(double*) b;
+	return (x > y) - (x < y);
+}
+
+/*percentile of an already sorted array*/
+static double percentile(double *sorted, int n, double p) {
+	int i = (int) (p * (n - 1) + 0.5);
+	return n ? sorted[i] : 0;
+}
+
+int main(int argc, char *argv[]) {
+	int opt, n = 10, k = 10, warmup = 60, uring = 0, i, j;
+
+	while ((opt = getopt(argc, argv, "un:k:w:")) != -1) {
+		switch (opt) {
+			case 'u': {
+				uring = 1;
+				break;
+			}
+
+			case 'n': {
+				n = atoi(optarg);
+				break;
+			}
+
+			case 'k': {
+				k = atoi(optarg);
+				break;
+			}
+
+			case 'w': {
+				warmup = atoi(optarg);
+				break;
+			}
+
+			default: {
+				fprintf(stderr, "Usage: ./cluster [-u] [-n nodes] [-k messages] "
+					"[-w warmup seconds]\n");
+				return 1;
+			}
+		}
+	}
+
+	if (n < 2 || k < 1) {
+		fprintf(stderr, "Need at least 2 nodes and 1 message!\n");
+		return 1;
+	}
+
+	/*every node has a socket (and a thread) per peer, so raise the limits as
+	  far as we're allowed, the nodes inherit them*/
+	struct rlimit lim;
+	getrlimit(RLIMIT_NOFILE, &lim);
+	lim.rlim_cur = lim.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &lim);
+
+	/*writing to a node that died shouldn't take us down with it*/
+	signal(SIGPIPE, SIG_IGN);
+
+	char dir[] = "/tmp/clusterXXXXXX";
+	if (mkdtemp(dir) == NULL) {
+		fprintf(stderr, "Could not create a folder for the logs!\n");
+		return 1;
+	}
+	fprintf(stderr, "Node logs go to %s\n", dir);
+
+	struct cluster_node *nodes = calloc(n, sizeof(struct cluster_node));
+	double start = now_s();
+	for (i = 0; i < n; i++) {
+		if (start_node(nodes, n, i, uring, dir) == -1) {
+			fprintf(stderr, "Failed to start node %d!\n", i);
+			stop_nodes(nodes, i);
+			return 1;
+		}
+
+		/*wait for the node to be up (its metrics are served right before it starts
+		  listening for peers), otherwise the next node's initial connection to it
+		  fails and the ring never forms*/
+		double up = now_s();
+		while (node_metric(&nodes[i], "blockchain_peers") == -1 && now_s() - up < 5) {
+			usleep(1000);
+		}
+		usleep(20000);
+	}
+
+	/*wait for the peer lists to spread, until everyone is connected to everyone
+	  (or we get tired of waiting). Two nodes may dial each other at the same
+	  time, so a node can end up with more connections than there are peers*/
+	int meshed = 0;
+	double peers = 0;
+	while (!meshed && now_s() - start < warmup) {
+		sleep(1);
+		meshed = 1;
+		peers = 0;
+		for (i = 0; i < n; i++) {
+			double p = node_metric(&nodes[i], "blockchain_peers");
+			peers += p > 0 ? p : 0;
+			meshed &= p >= n - 1;
+		}
+		fprintf(stderr, "Warming up: %.0f of %d peer connections\n", peers,
+			n * (n - 1));
+	}
+	double mesh_seconds = now_s() - start;
+
+	/*CPU and traffic before we start, so the warm up isn't counted*/
+	double cpu_before = 0, bytes_before = 0;
+	static char buf[1 << 20];
+	for (i = 0; i < n; i++) {
+		cpu_before += cpu_seconds(nodes[i].pid);
+		if (scrape(&nodes[i], buf, sizeof(buf)) != -1) {
+			bytes_before += metric_sum(buf, "blockchain_message_bytes_total",
+				"dir=\"out\"");
+		}
+	}
+
+	/*inject messages one at a time, each into a random node, and wait until
+	  every node has it*/
+	double *latencies = malloc(k * sizeof(double));
+	int converged = 0;
+	srand(51511);
+	double inject_start = now_s();
+	for (j = 0; j < k; j++) {
+		int target = rand() % n, done = 0;
+
+		fprintf(nodes[target].in, "cluster message %d from node %d\n", j, target);
+		double sent = now_s();
+
+		while (!done && now_s() - sent < MESSAGE_TIMEOUT) {
+			done = 1;
+			for (i = 0; i < n && done; i++) {
+				done = node_metric(&nodes[i], "blockchain_archive_messages") >= j + 1;
+			}
+			if (!done) {
+				usleep(1000);
+			}
+		}
+
+		latencies[j] = now_s() - sent;
+		converged += done;
+		fprintf(stderr, "Message %d (node %d): %s after %.3fs\n", j, target,
+			done ? "converged" : "timed out", latencies[j]);
+	}
+	double inject_seconds = now_s() - inject_start;
+
+	double cpu_after = 0, bytes_after = 0;
+	for (i = 0; i < n; i++) {
+		cpu_after += cpu_seconds(nodes[i].pid);
+		if (scrape(&nodes[i], buf, sizeof(buf)) != -1) {
+			bytes_after += metric_sum(buf, "blockchain_message_bytes_total",
+				"dir=\"out\"");
+		}
+	}
+
+	stop_nodes(nodes, n);
+
+	qsort(latencies, k, sizeof(double), compare_doubles);
+	fprintf(stdout, "{\"nodes\":%d,\"uring\":%d,\"meshed\":%d,"
+		"\"mesh_seconds\":%.3f,\"peer_connections\":%.0f,\"messages\":%d,"
+		"\"converged\":%d,\"latency_p50\":%.6f,\"latency_p99\":%.6f,"
+		"\"latency_max\":%.6f,\"seconds\":%.3f,\"bytes_sent\":%.0f,"
+		"\"bytes_per_s\":%.0f,\"cpu_seconds\":%.3f,\"cpu_utilization\":%.3f,"
+		"\"logs\":\"%s\"}\n", n, uring, meshed, mesh_seconds, peers, k, converged,
+		percentile(latencies, k, 0.5), percentile(latencies, k, 0.99),
+		latencies[k-1], inject_seconds, bytes_after - bytes_before,
+		(bytes_after - bytes_before) / inject_seconds, cpu_after - cpu_before,
+		(cpu_after - cpu_before) / inject_seconds, dir);
+
+	free(latencies);
+	free(nodes);
+	return 0;
+}
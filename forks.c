@@ -0,0 +1,219 @@
+#include "forks.h"
+#include "archive.h"
+#include "metrics.h"
+
+/*This file implements the fork-aware candidate archive store, see forks.h*/
+
+static void release_chunk(struct fork_chunk *chunk) {
+	if (--chunk->refs == 0) {
+		free(chunk->str);
+		free(chunk);
+	}
+}
+
+static void free_branch(struct fork_branch *branch) {
+	uint32_t i;
+
+	for (i = 0; i < branch->nchunks; i++) {
+		release_chunk(branch->chunks[i]);
+	}
+	free(branch->chunks);
+	free(branch);
+}
+
+/*returns how many messages from the beginning the branch has in common with the
+  given messages (len bytes, in the format of an archive string, minus its
+  type+size bytes). Whole chunks are compared in one go, and only the chunk
+  where they part ways is compared message by message*/
+static uint32_t common_prefix(struct fork_branch *branch, uint8_t *str,
+	uint32_t len) {
+	uint32_t count = 0, pos = 0, c;
+
+	for (c = 0; c < branch->nchunks; c++) {
+		struct fork_chunk *chunk = branch->chunks[c];
+
+		if (chunk->len <= len - pos &&
+			memcmp(chunk->str, str + pos, chunk->len) == 0) {
+			count += chunk->count;
+			pos += chunk->len;
+			continue;
+		}
+
+		uint32_t cpos = 0;
+		while (cpos < chunk->len) {
+			uint32_t msglen = chunk->str[cpos] + 33;
+			if (msglen > len - pos ||
+				memcmp(chunk->str + cpos, str + pos, msglen) != 0) {
+				break;
+			}
+			cpos += msglen;
+			pos += msglen;
+			count++;
+		}
+		break;
+	}
+	return count;
+}
+
+/*removes the branch at index i from the store*/
+static void remove_branch(struct fork_store *store, int i) {
+	free_branch(store->branches[i]);
+	store->branches[i] = store->branches[--store->nbranches];
+}
+
+struct fork_store *fork_init() {
+	struct fork_store *store = calloc(1, sizeof(struct fork_store));
+
+	pthread_mutex_init(&store->mutex, NULL);
+	return store;
+}
+
+void fork_clear(struct fork_store *store) {
+	pthread_mutex_lock(&store->mutex);
+	while (store->nbranches > 0) {
+		remove_branch(store, 0);
+	}
+	metrics_gauge(G_FORK_BRANCHES, 0);
+	pthread_mutex_unlock(&store->mutex);
+}
+
+uint32_t fork_offer(struct fork_store *store, struct archive *arch, int trusted,
+	uint64_t *id, int *bad) {
+	uint8_t *str = arch->str + 5;
+	uint32_t len = arch->len - 5, common[FORK_MAX_BRANCHES], known = 0;
+	int i, best = -1;
+
+	*id = 0;
+	*bad = 0;
+
+	/*nothing to keep in an empty archive*/
+	if (arch->size == 0) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&store->mutex);
+	store->clock++;
+
+	/*find the branch the archive has the most in common with*/
+	for (i = 0; i < store->nbranches; i++) {
+		common[i] = common_prefix(store->branches[i], str, len);
+		if (best == -1 || common[i] > common[best]) {
+			best = i;
+		}
+	}
+
+	if (best != -1) {
+		struct fork_branch *branch = store->branches[best];
+		branch->used = store->clock;
+		*id = branch->id;
+
+		/*it has a message we already know is invalid*/
+		if (branch->bad && branch->valid < common[best]) {
+			*bad = 1;
+			pthread_mutex_unlock(&store->mutex);
+			return branch->valid;
+		}
+
+		known = common[best] < branch->valid ? common[best] : branch->valid;
+
+		/*we have the whole thing already*/
+		if (common[best] == arch->size) {
+			if (trusted && branch->valid < arch->size) {
+				branch->valid = arch->size;
+			}
+			pthread_mutex_unlock(&store->mutex);
+			return trusted ? arch->size : known;
+		}
+	}
+
+	/*it's a new branch, the chunks it has in common with the best match are
+	  shared with it, and the rest are copied from the archive*/
+	struct fork_branch *newbranch = calloc(1, sizeof(struct fork_branch));
+	uint32_t shared = best == -1 ? 0 : common[best] / FORK_CHUNK, pos = 0, n;
+
+	newbranch->chunks = malloc(((arch->size + FORK_CHUNK - 1) / FORK_CHUNK) *
+		sizeof(struct fork_chunk*));
+	for (n = 0; n < shared; n++) {
+		struct fork_chunk *chunk = store->branches[best]->chunks[n];
+		chunk->refs++;
+		pos += chunk->len;
+		newbranch->chunks[newbranch->nchunks++] = chunk;
+	}
+
+	for (n = shared * FORK_CHUNK; n < arch->size; ) {
+		struct fork_chunk *chunk = malloc(sizeof(struct fork_chunk));
+		uint32_t start = pos;
+
+		chunk->count = 0;
+		while (chunk->count < FORK_CHUNK && n < arch->size) {
+			pos += str[pos] + 33;
+			chunk->count++;
+			n++;
+		}
+		chunk->len = pos - start;
+		chunk->str = malloc(chunk->len);
+		memcpy(chunk->str, str + start, chunk->len);
+		chunk->refs = 1;
+		newbranch->chunks[newbranch->nchunks++] = chunk;
+	}
+
+	newbranch->size = arch->size;
+	newbranch->valid = trusted ? arch->size : known;
+	newbranch->id = ++store->next_id;
+	newbranch->used = store->clock;
+
+	/*branches the new one extends are superseded by it. Going backwards, since
+	  removing a branch moves the last one in its place*/
+	for (i = store->nbranches - 1; i >= 0; i--) {
+		if (common[i] == store->branches[i]->size) {
+			remove_branch(store, i);
+		}
+	}
+
+	/*make room by dropping the least recently offered branch, but never the one
+	  validated the furthest, it's most likely our active archive*/
+	if (store->nbranches == FORK_MAX_BRANCHES) {
+		int victim = -1, keep = 0;
+		for (i = 1; i < store->nbranches; i++) {
+			if (store->branches[i]->valid > store->branches[keep]->valid) {
+				keep = i;
+			}
+		}
+		for (i = 0; i < store->nbranches; i++) {
+			if (i != keep && (victim == -1 ||
+				store->branches[i]->used < store->branches[victim]->used)) {
+				victim = i;
+			}
+		}
+		remove_branch(store, victim);
+	}
+
+	store->branches[store->nbranches++] = newbranch;
+	*id = newbranch->id;
+	metrics_gauge(G_FORK_BRANCHES, store->nbranches);
+	pthread_mutex_unlock(&store->mutex);
+	return newbranch->valid;
+}
+
+void fork_validated(struct fork_store *store, uint64_t id, uint32_t valid,
+	int bad) {
+	int i;
+
+	pthread_mutex_lock(&store->mutex);
+	for (i = 0; i < store->nbranches; i++) {
+		struct fork_branch *branch = store->branches[i];
+		if (branch->id != id) {
+			continue;
+		}
+
+		if (bad) {
+			branch->valid = valid;
+			branch->bad = 1;
+		}
+		else if (valid > branch->valid) {
+			branch->valid = valid;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&store->mutex);
+}
@@ -0,0 +1,85 @@
+#include <stdlib.h>				//mallocs, reallocs and frees
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <string.h>				//memcmps and memcpys
+#include <pthread.h>			//receiver threads and pool workers share the store
+
+/*defined in archive.h*/
+struct archive;
+
+/*Fork-aware store of candidate archives. During a fork, peers keep sending us
+  their own branches of the chat, which share everything but their last few
+  messages with each other (and with our active archive). Instead of keeping
+  only the active archive and re-validating every other branch each time it's
+  sent to us, the store keeps several branches, along with how much of each
+  one is known to be valid (or invalid), so an archive we're offered again only
+  needs its messages past that point validated, if any.
+
+  Branches are stored as lists of chunks of FORK_CHUNK messages each, and
+  branches with a common prefix share the chunks inside it, reference counted,
+  so the prefix is only stored once. Every chunk of a branch is full but its
+  last one, which keeps chunks of different branches lined up.*/
+
+/*messages per chunk*/
+#define FORK_CHUNK 256
+
+/*branches kept at most, the least recently offered one goes when it's full*/
+#define FORK_MAX_BRANCHES 8
+
+/*a chunk of messages, shared by every branch it's a part of. Brief description:
+  str   ->  the messages, in the same format as in an archive's string
+  len   ->  length of str
+  count ->  number of messages in the chunk
+  refs  ->  branches using this chunk, it's freed when it drops to 0*/
+struct fork_chunk {
+	uint8_t *str;
+	uint32_t len;
+	uint32_t count;
+	int refs;
+};
+
+/*a branch, that is, a candidate archive. Brief description:
+  chunks  ->  the branch's messages, in order
+  nchunks ->  number of chunks
+  size    ->  number of messages in the branch
+  valid   ->  how many messages from the beginning are known to be valid
+  bad     ->  set if the message right after those is known to be invalid
+  id      ->  unique id, so validation results can find the branch later (it
+              may be gone by then)
+  used    ->  when it was last offered, to find the least recently used one*/
+struct fork_branch {
+	struct fork_chunk **chunks;
+	uint32_t nchunks;
+	uint32_t size;
+	uint32_t valid;
+	int bad;
+	uint64_t id;
+	uint64_t used;
+};
+
+struct fork_store {
+	pthread_mutex_t mutex;
+	struct fork_branch *branches[FORK_MAX_BRANCHES];
+	int nbranches;
+	uint64_t next_id, clock;
+};
+
+/*Creates an empty store*/
+struct fork_store *fork_init();
+
+/*Drops every branch in the store*/
+void fork_clear(struct fork_store *store);
+
+/*Offers an archive to the store. It's matched against the stored branches, and
+  stored as a branch of its own unless one of them already contains it (if it
+  extends a branch, it replaces it). If trusted is set, the whole archive is
+  known to be valid (it's one we mined ourselves, say). Returns how many
+  messages from the beginning of the archive are already known to be valid,
+  *id being set to the id of the branch it's in, and *bad to whether it's known
+  to be invalid (it contains a message that was found invalid before)*/
+uint32_t fork_offer(struct fork_store *store, struct archive *arch, int trusted,
+	uint64_t *id, int *bad);
+
+/*Records the result of validating the branch with the given id: its first
+  valid messages are valid, and if bad is set, the one after them isn't*/
+void fork_validated(struct fork_store *store, uint64_t id, uint32_t valid,
+	int bad);
@@ -0,0 +1,48 @@
+#include "logger.h"
+
+/*Offline formatter for the binary log files written by the node. Reads every
+  record in the given file and prints it as a line of text, optionally skipping
+  anything below a given log level or not related to a given peer socket.
+
+  Usage: ./logdump <logfile> [min level (0-3)] [socket]*/
+int main(int argc, char *argv[]) {
+	if (argc < 2 || argc > 4) {
+		fprintf(stderr, "Usage: ./logdump <logfile> [min level (0-3)] [socket]\n");
+		return 1;
+	}
+
+	FILE *in = fopen(argv[1], "rb");
+	if (in == NULL) {
+		fprintf(stderr, "Could not open log file %s!\n", argv[1]);
+		return 1;
+	}
+
+	/*make sure this is actually one of our log files*/
+	char magic[8];
+	if (fread(magic, 1, 8, in) != 8 || memcmp(magic, LOG_MAGIC, 8) != 0) {
+		fprintf(stderr, "%s is not a binary log file!\n", argv[1]);
+		fclose(in);
+		return 1;
+	}
+
+	int minlevel = (argc > 2) ? atoi(argv[2]) : LOG_DEBUG;
+	int sock = (argc > 3) ? atoi(argv[3]) : -1;
+
+	/*records are fixed size, so just read them in batches and print them*/
+	struct log_record recs[256];
+	size_t n, i;
+	while ((n = fread(recs, sizeof(struct log_record), 256, in)) > 0) {
+		for (i = 0; i < n; i++) {
+			if (recs[i].level < minlevel) {
+				continue;
+			}
+			if (sock != -1 && recs[i].sock != sock) {
+				continue;
+			}
+			log_format_record(&recs[i], stdout);
+		}
+	}
+
+	fclose(in);
+	return 0;
+}
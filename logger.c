@@ -0,0 +1,272 @@
+#include "logger.h"
+
+/*This file implements our logging subsystem. Instead of every peer thread
+  fprintf()ing into its own log file, each thread appends fixed size binary
+  records to its own lock-free ring buffer (single producer, single consumer),
+  and a single background thread drains all the rings into one binary log file.
+  Formatting only happens offline, when someone actually reads the log (see
+  logdump.c), so logging costs us little more than a timestamp and a memcpy.*/
+
+/*per-thread ring buffer. The owning thread only ever moves tail, and the writer
+  thread only ever moves head, so neither needs a lock
+  dead  ->  set when the owning thread exits, the writer frees the ring once
+            it has drained everything left in it*/
+struct log_ring {
+	struct log_record recs[LOG_RING_SIZE];
+	uint32_t head, tail;
+	uint32_t dropped;
+	int dead;
+	uint16_t id;
+	struct log_ring *next;
+};
+
+/*formats for every event type, indexed by event*/
+const struct log_format log_formats[EV_COUNT] = {
+	[EV_LOG_DROPPED] = {"Log ring %llu full, dropped %llu records", 0},
+	[EV_PEER_CONNECTED] = {"Connected to peer %s", 1},
+	[EV_PEER_DISCONNECTED] = {"Peer %s disconnected or timed out", 1},
+	[EV_PEERREQ_RECV] = {"Received PeerRequest, sending list of %llu peers", 0},
+	[EV_PEERREQ_SEND_FAIL] = {"Error sending peer request, broken pipe?", 0},
+	[EV_ARCHREQ_SEND_FAIL] = {"Error sending archive request, broken pipe?", 0},
+	[EV_PEERLIST_BEGIN] = {"Processing peer list with %llu clients", 0},
+	[EV_PEERLIST_ENTRY] = {"Peer list entry %s", 2},
+	[EV_PEERLIST_END] = {"Done processing peer list", 0},
+	[EV_ARCHREQ_RECV] = {"Received ArchiveRequest", 0},
+	[EV_ARCHREQ_EMPTY] = {"Current archive is empty, ignoring request", 0},
+	[EV_ARCHREQ_SENT] = {"Sent archive (size %llu, length %llu)", 0},
+	[EV_ARCHRESP_BEGIN] = {"Processing ArchiveResponse with %llu chats", 0},
+	[EV_ARCHRESP_RECEIVED] = {"Received archive (size %llu, length %llu)", 0},
+	[EV_ARCHRESP_REPLACED] = {"Active archive replaced (size %llu)", 0},
+	[EV_ARCHRESP_REJECTED] = {"Archive kept (received %llu, active %llu)", 0},
+	[EV_UNKNOWN_MSG] = {"Unknown msg type, ignoring... (byte = %llu)", 0},
+	[EV_ADMIT_THROTTLED] = {"Peer over budget %llu, throttled for %llu us", 0},
+	[EV_ADMIT_SKIPPED] = {"Peer out of CPU budget for %llu us, archive dropped", 0},
+	[EV_ADMIT_KICKED] = {"Peer way over budget %llu, disconnecting", 0},
+	[EV_ADMIT_CLAIM] = {"Peer claims to send %llu bytes, budget has %llu", 0},
+	[EV_HELLO_RECV] = {"Hello from node %llu, listening on port %llu", 0},
+	[EV_DUPLICATE_DROPPED] = {"Dropping duplicate connection to node %llu", 0},
+	[EV_PEER_IDLE] = {"Peer quiet for %llu ms, hanging up", 0},
+	[EV_REDIAL] = {"Redialing peer %s", 2},
+	[EV_RANGE_SENT] = {"Sent range of %llu messages from %llu", 0},
+	[EV_BOOT_PLAN] = {"Bootstrapping %llu messages from %llu peers", 0},
+	[EV_BOOT_RANGE_BAD] = {"Invalid range from %llu, dropping peer as a source", 0},
+	[EV_BOOT_TIMEOUT] = {"Range from %llu took too long, fetching it elsewhere", 0},
+	[EV_BOOT_MISMATCH] = {"Ranges from %llu and %llu don't line up, fetching both again", 0},
+	[EV_BOOT_DONE] = {"Bootstrapped %llu messages in %llu ms", 0},
+	[EV_BOOT_ABORT] = {"Bootstrap abandoned with %llu of %llu ranges in", 0},
+	[EV_SEEK_FOUND] = {"Archives part after %llu messages, %llu to fetch", 0},
+	[EV_SEEK_STALLED] = {"Search for fork point stalled between %llu and %llu", 0},
+	[EV_SEEK_MISMATCH] = {"Messages past %llu don't follow ours, dropped", 0}
+};
+
+/*current log level, anything below it is discarded*/
+int log_level = LOG_INFO;
+
+/*list of rings, protected by a mutex (only taken when threads create their
+  ring, and by the writer when walking the list)*/
+static struct log_ring *rings = NULL;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint16_t next_ring_id = 0;
+
+/*each thread's own ring*/
+static __thread struct log_ring *my_ring = NULL;
+static pthread_key_t ring_key;
+
+/*writer thread state*/
+static FILE *logfile = NULL;
+static pthread_t writer;
+static int stop = 0;
+
+/*marks the calling thread's ring as dead when the thread exits*/
+static void ring_destructor(void *ptr) {
+	struct log_ring *ring = (struct log_ring*) ptr;
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+/*drains every ring into the log file, and frees rings of dead threads once
+  they are empty*/
+static void drain_rings() {
+	struct log_ring **aux, *ring;
+
+	pthread_mutex_lock(&rings_mutex);
+	aux = &rings;
+	while ((ring = *aux) != NULL) {
+		/*read dead before tail, so we never free a ring with records left*/
+		int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+		uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		uint32_t head = ring->head;
+
+		/*write the pending records in at most two contiguous chunks*/
+		while (head != tail) {
+			uint32_t idx = head & (LOG_RING_SIZE - 1);
+			uint32_t n = tail - head;
+			if (n > LOG_RING_SIZE - idx) {
+				n = LOG_RING_SIZE - idx;
+			}
+			fwrite(&ring->recs[idx], sizeof(struct log_record), n, logfile);
+			head += n;
+		}
+		__atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+		/*let the reader know if we lost anything*/
+		uint32_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_ACQ_REL);
+		if (dropped) {
+			struct log_record rec;
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			memset(&rec, 0, sizeof(rec));
+			rec.ts = now.tv_sec * 1000000000ULL + now.tv_nsec;
+			rec.a = ring->id;
+			rec.b = dropped;
+			rec.sock = -1;
+			rec.event = EV_LOG_DROPPED;
+			rec.level = LOG_WARN;
+			rec.thread = ring->id;
+			fwrite(&rec, sizeof(rec), 1, logfile);
+		}
+
+		if (dead) {
+			*aux = ring->next;
+			free(ring);
+			continue;
+		}
+		aux = &ring->next;
+	}
+	pthread_mutex_unlock(&rings_mutex);
+
+	fflush(logfile);
+}
+
+/*the background writer, drains all rings every 100ms until told to stop*/
+static void *writer_thread() {
+	struct timespec interval;
+	interval.tv_sec = 0;
+	interval.tv_nsec = 100000000;
+
+	while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+		drain_rings();
+		nanosleep(&interval, NULL);
+	}
+
+	/*one last pass, so nothing logged before shutdown is lost*/
+	drain_rings();
+	return NULL;
+}
+
+/*Opens the given binary log file and launches the background writer thread,
+  which periodically drains every thread's ring into it. Returns 0 on success,
+  -1 if the file couldn't be opened (logging is then silently disabled).*/
+int log_init(const char *path, int level) {
+	log_level = level;
+
+	if ((logfile = fopen(path, "wb")) == NULL) {
+		log_level = LOG_ERROR + 1;
+		return -1;
+	}
+	fwrite(LOG_MAGIC, 1, 8, logfile);
+
+	pthread_key_create(&ring_key, ring_destructor);
+	pthread_create(&writer, NULL, writer_thread, NULL);
+	return 0;
+}
+
+/*Appends a record to the calling thread's ring, creating the ring on the
+  thread's first call. Never blocks, and never formats anything.*/
+void log_write(uint8_t level, uint8_t event, int32_t sock, uint64_t a,
+	uint64_t b) {
+	if (logfile == NULL) {
+		return;
+	}
+
+	/*first record from this thread, set up and register its ring*/
+	if (my_ring == NULL) {
+		my_ring = (struct log_ring*) calloc(1, sizeof(struct log_ring));
+		pthread_mutex_lock(&rings_mutex);
+		my_ring->id = next_ring_id++;
+		my_ring->next = rings;
+		rings = my_ring;
+		pthread_mutex_unlock(&rings_mutex);
+		pthread_setspecific(ring_key, my_ring);
+	}
+
+	uint32_t tail = my_ring->tail;
+	uint32_t head = __atomic_load_n(&my_ring->head, __ATOMIC_ACQUIRE);
+
+	/*ring is full, drop the record rather than wait for the writer*/
+	if (tail - head == LOG_RING_SIZE) {
+		__atomic_add_fetch(&my_ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	struct log_record *rec = &my_ring->recs[tail & (LOG_RING_SIZE - 1)];
+	rec->ts = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	rec->a = a;
+	rec->b = b;
+	rec->sock = sock;
+	rec->event = event;
+	rec->level = level;
+	rec->thread = my_ring->id;
+
+	__atomic_store_n(&my_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*Stops the writer thread after it drains every ring, and closes the file*/
+void log_shutdown() {
+	if (logfile == NULL) {
+		return;
+	}
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	pthread_join(writer, NULL);
+	fclose(logfile);
+	logfile = NULL;
+}
+
+/*Formats a single record as a line of text into the given stream. Used by the
+  offline formatter, but handy for debugging as well.*/
+void log_format_record(struct log_record *rec, FILE *stream) {
+	static const char *levels[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+	char msg[256];
+
+	/*timestamp with microsecond precision, then level, thread and peer socket*/
+	time_t secs = rec->ts / 1000000000ULL;
+	struct tm tm;
+	char date[32];
+	localtime_r(&secs, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+
+	fprintf(stream, "%s.%06llu %-5s t%-5u ", date,
+		(unsigned long long) (rec->ts % 1000000000ULL) / 1000,
+		rec->level <= LOG_ERROR ? levels[rec->level] : "?", rec->thread);
+	if (rec->sock >= 0) {
+		fprintf(stream, "sock %-4d ", rec->sock);
+	}
+
+	if (rec->event >= EV_COUNT) {
+		fprintf(stream, "Unknown event %u\n", rec->event);
+		return;
+	}
+
+	const struct log_format *f = &log_formats[rec->event];
+	if (f->ip) {
+		char ip[24];
+		uint32_t uip = (uint32_t) rec->a;
+		uint8_t *b = (uint8_t*) &uip;
+		if (f->ip == 2) {
+			snprintf(ip, sizeof(ip), "%d.%d.%d.%d:%u", b[0], b[1], b[2], b[3],
+				(unsigned) rec->b);
+		}
+		else {
+			snprintf(ip, sizeof(ip), "%d.%d.%d.%d", b[0], b[1], b[2], b[3]);
+		}
+		snprintf(msg, sizeof(msg), f->fmt, ip);
+	}
+	else {
+		snprintf(msg, sizeof(msg), f->fmt, (unsigned long long) rec->a,
+			(unsigned long long) rec->b);
+	}
+	fprintf(stream, "%s\n", msg);
+}
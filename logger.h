@@ -0,0 +1,122 @@
+#include <stdio.h>				//the writer thread still has to fwrite somewhere
+#include <stdlib.h>				//mallocs, frees and whatnot
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <string.h>				//memsets and memcpys
+#include <time.h>					//timestamps for log records
+#include <pthread.h>			//writer thread, thread keys for per-thread rings
+
+/*number of records in each thread's ring buffer (must be a power of 2). When a
+  ring is full, new records are dropped (and counted) instead of blocking*/
+#define LOG_RING_SIZE 4096
+
+/*log levels, records below the current level are never even built*/
+enum {
+	LOG_DEBUG = 0,
+	LOG_INFO,
+	LOG_WARN,
+	LOG_ERROR
+};
+
+/*events we know how to log (at most 256 of them, records have a byte for it).
+  Every event has a format in log_formats, which the offline formatter
+  (logdump) uses to turn binary records back into text, so we never spend any
+  CPU formatting strings on the hot paths*/
+enum {
+	EV_LOG_DROPPED = 0,
+	EV_PEER_CONNECTED,
+	EV_PEER_DISCONNECTED,
+	EV_PEERREQ_RECV,
+	EV_PEERREQ_SEND_FAIL,
+	EV_ARCHREQ_SEND_FAIL,
+	EV_PEERLIST_BEGIN,
+	EV_PEERLIST_ENTRY,
+	EV_PEERLIST_END,
+	EV_ARCHREQ_RECV,
+	EV_ARCHREQ_EMPTY,
+	EV_ARCHREQ_SENT,
+	EV_ARCHRESP_BEGIN,
+	EV_ARCHRESP_RECEIVED,
+	EV_ARCHRESP_REPLACED,
+	EV_ARCHRESP_REJECTED,
+	EV_UNKNOWN_MSG,
+	EV_ADMIT_THROTTLED,
+	EV_ADMIT_SKIPPED,
+	EV_ADMIT_KICKED,
+	EV_ADMIT_CLAIM,
+	EV_HELLO_RECV,
+	EV_DUPLICATE_DROPPED,
+	EV_PEER_IDLE,
+	EV_REDIAL,
+	EV_RANGE_SENT,
+	EV_BOOT_PLAN,
+	EV_BOOT_RANGE_BAD,
+	EV_BOOT_TIMEOUT,
+	EV_BOOT_MISMATCH,
+	EV_BOOT_DONE,
+	EV_BOOT_ABORT,
+	EV_SEEK_FOUND,
+	EV_SEEK_STALLED,
+	EV_SEEK_MISMATCH,
+	EV_COUNT
+};
+
+/*a single binary log record, always 32 bytes long. Brief description:
+  ts      ->  wall clock timestamp, in nanoseconds since the epoch
+  a, b    ->  event specific arguments (sizes, IPs, message bytes...)
+  sock    ->  socket of the peer the event relates to (-1 if none)
+  event   ->  one of the EV_* values above
+  level   ->  one of the LOG_* values above
+  thread  ->  id of the ring (thread) that logged the record. Nodes go through
+              a lot of threads (two per peer, and peers come and go), so it
+              takes 16 bits to keep them apart*/
+struct log_record {
+	uint64_t ts;
+	uint64_t a, b;
+	int32_t sock;
+	uint8_t event;
+	uint8_t level;
+	uint16_t thread;
+};
+
+/*format of each event. If ip is set, argument a is an IPv4 address (in network
+  byte order) and is printed in dotted notation through the format's %s. If ip
+  is 2, argument b is a port, and the %s gets the whole ip:port*/
+struct log_format {
+	const char *fmt;
+	int ip;
+};
+
+/*magic bytes at the beginning of every binary log file (0002 since thread ids
+  went from 8 to 16 bits)*/
+#define LOG_MAGIC "BLOG0002"
+
+/*formats for every event type, indexed by event*/
+extern const struct log_format log_formats[EV_COUNT];
+
+/*current log level, anything below it is discarded*/
+extern int log_level;
+
+/*logs an event, skipping the function call entirely if the level is too low*/
+#define log_event(level, event, sock, a, b) \
+	do { \
+		if ((level) >= log_level) { \
+			log_write((level), (event), (sock), (uint64_t) (a), (uint64_t) (b)); \
+		} \
+	} while (0)
+
+/*Opens the given binary log file and launches the background writer thread,
+  which periodically drains every thread's ring into it. Returns 0 on success,
+  -1 if the file couldn't be opened (logging is then silently disabled).*/
+int log_init(const char *path, int level);
+
+/*Appends a record to the calling thread's ring, creating the ring on the
+  thread's first call. Never blocks, and never formats anything.*/
+void log_write(uint8_t level, uint8_t event, int32_t sock, uint64_t a,
+	uint64_t b);
+
+/*Stops the writer thread after it drains every ring, and closes the file*/
+void log_shutdown();
+
+/*Formats a single record as a line of text into the given stream. Used by the
+  offline formatter, but handy for debugging as well.*/
+void log_format_record(struct log_record *rec, FILE *stream);
@@ -1,16 +1,54 @@
 #include "main.h"
 #include "peerlist.h"
 #include "archive.h"
-
-/*port is always 51511*/
-#define TCP_PORT "51511"
-
-/*enum for message types, to make message treatment code clearer*/
+#include "uring.h"
+#include "logger.h"
+#include "metrics.h"
+#include "transport.h"
+#include "trace.h"
+#include "pool.h"
+#include "forks.h"
+#include "api.h"
+#include "channel.h"
+#include "admission.h"
+#include "timer.h"
+#include "boot.h"
+#include "seek.h"
+#include "spans.h"
+
+/*enum for message types, to make message treatment code clearer. The last two
+  are our extension of the peer list exchange, carrying listen ports as well as
+  IPs. A PeerRequestExt is a lone byte, so peers that only speak the original
+  protocol just ignore it, and we only keep sending them original PeerRequests.
+  The Tip and Range messages are for the parallel bootstrap (see boot.h), the
+  Probe ones for fork-point searches (see seek.h), and they only go to peers
+  that answered our HelloRequest*/
 enum {
 	MSG_PEERREQ = 1,
 	MSG_PEERLIST,
 	MSG_ARCHREQ,
-	MSG_ARCHRESP
+	MSG_ARCHRESP,
+	MSG_PEERREQ_EX,
+	MSG_PEERLIST_EX,
+	MSG_ARCHREQ_CH,
+	MSG_ARCHRESP_CH,
+	MSG_HELLOREQ,
+	MSG_HELLO,
+	MSG_TIPREQ,
+	MSG_TIP,
+	MSG_RANGEREQ,
+	MSG_RANGE,
+	MSG_PROBEREQ,
+	MSG_PROBE
+};
+
+/*arguments for a peer's receiver thread: the peer's socket, the port it
+  listens on (the one we connected to, or the default one for incoming peers,
+  until they tell us otherwise), and whether we opened the connection*/
+struct peer_args {
+	int sock;
+	uint16_t port;
+	int outgoing;
 };
 
 /*The list of connected peers. This must be global to be shared amongst all
@@ -22,29 +60,283 @@ enum {
 struct peer_list *peerlist;
 pthread_mutex_t peerlist_mutex;
 
-/*The currently active archive, which we will broadcast to any peers that send
-  us ArchiveRequest messages. Must be global for the same reasons as the peer
-	list. This will be initialized by the main thread as soon as execution begins,
-	and we make sure it contains a proper archive before broadcasting it.
-	For syncronizing archives, we use a rwlock instead of a mutex, because only
-	1 thread will ever write changes to it (to add messages), while other threads
-	will only either replace the current active archive (which counts as writing,
-  but will hardly happen often), or read values like its size/print it.*/
-struct archive *active_arch;
-pthread_rwlock_t archive_lock;
-
-/*local device's public IP address, to avoid self-connection attempts*/
+/*The channels we're in (see channel.h), each with its currently active
+  archive, which we will broadcast to any peers that ask for it. Must be global
+  for the same reasons as the peer list. This will be initialized by the main
+	thread as soon as execution begins, and we make sure a channel's archive
+	contains a proper archive before broadcasting it.
+	For syncronizing each archive, we use a rwlock instead of a mutex, because
+	only 1 thread will ever write changes to it (to add messages), while other
+	threads will only either replace the current active archive (which counts as
+	writing, but will hardly happen often), or read values like its size/print
+	it. Every channel has its own, so channels never wait on each other.*/
+struct channel_table *channels;
+
+/*local device's public IP address and listen port (in host byte order), to
+  avoid self-connection attempts*/
 uint32_t myaddr;
+uint16_t myport = DEFAULT_PORT;
+
+/*our node id, random and never 0, which peers that speak the Hello handshake
+  tell each other so they can spot two connections between the same nodes
+  (and connections to ourselves)*/
+uint64_t node_id = 1;
+
+/*whether we bind our sockets (listening and outgoing) to the local IP address,
+  instead of any interface. Needed to run several nodes on different loopback
+  addresses of the same host (set with the -b flag)*/
+int bind_local = 0;
+
+/*whether we use the io_uring backend for accepts, connects and reads from
+  peers instead of the plain blocking calls (set with the -u flag, and only if
+  the running kernel actually supports it)*/
+int use_uring = 0;
+
+/*bytes received by the calling thread for the message it's currently reading,
+  so the receiver thread can account for whole messages in the metrics*/
+static __thread uint64_t recv_total = 0;
+
+/*per-thread timestamps of when we acquired each lock, for the hold times*/
+static __thread uint64_t archlock_since, peerlock_since;
+
+/*intervals of the periodic activity for every peer, in milliseconds (set with
+  -t), and the jitter added to each one, in percent of it (set with -j), so
+  peers that connected at the same time don't all get their requests in the
+  same tick. Brief description:
+  peerreq     ->  between a peer's PeerRequests
+  archreq     ->  between a peer's ArchiveRequests
+  idle        ->  how long a peer may go without sending us anything before we
+                  hang up on it (it sends PeerRequests every few seconds)
+  redial      ->  wait before connecting again to a peer we lost, doubled after
+  redial_max      every failed attempt, up to redial_max
+  jitter      ->  every interval is randomly up to jitter% longer or shorter*/
+static struct {
+	uint64_t peerreq, archreq, idle;
+	uint64_t redial, redial_max;
+	int jitter;
+} timing = {5000, 60000, 60000, 1000, 64000, 20};
+
+/*attempts at connecting again to a peer we lost, before giving up on it*/
+#define REDIAL_TRIES 6
+
+/*longest a send to a peer may go without making progress, in seconds, so a
+  peer that stopped reading can't hold up the thread sending to it forever.
+  The timer wheel's thread never waits on a send at all (see try_send)*/
+#define SEND_TIMEOUT 30
+
+/*Locks that serialize writers to a peer's socket, taken for the whole of
+  every message we send (an archive goes out in several syscalls), so the
+  timer wheel's requests, the receiver thread's replies and whoever publishes
+  an archive never interleave their bytes in the stream. Sockets share them
+  modulo SEND_LOCKS, which in practice gives every peer a lock of its own*/
+#define SEND_LOCKS 4096
+static pthread_mutex_t send_locks[SEND_LOCKS] = {
+	[0 ... SEND_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+/*a connected peer's timers. Brief description:
+  sock      ->  the peer's socket
+  requests  ->  its PeerRequests are due
+  archive   ->  its ArchiveRequests are due
+  idle      ->  time to check whether it went quiet
+  last_recv ->  when we last received anything from it (metrics_now)*/
+struct peer_sched {
+	int sock;
+	struct timer requests, archive, idle;
+	uint64_t last_recv;
+};
+
+/*a peer we lost, that we'll try to connect to again. Brief description:
+  host    ->  its IP (or hostname, for the initial peer)
+  port    ->  the port it listens on
+  attempt ->  attempts so far
+  tries   ->  attempts before we give up on it, 0 to never give up
+  timer   ->  next attempt is due*/
+struct redial {
+	char host[256];
+	uint16_t port;
+	int attempt, tries;
+	struct timer timer;
+};
+
+/*timers of the peer whose receiver thread this is (NULL for any other thread)
+  so receiving from it counts as hearing from it*/
+static __thread struct peer_sched *my_sched = NULL;
+
+/*the io_uring read loop's stream for the peer whose receiver thread this is
+  (NULL for any other thread, or without io_uring)*/
+static __thread struct uring_stream *my_stream = NULL;
+
+/*Receives exactly len bytes from the given socket into buf, out of what the
+  io_uring read loop received from it if it's enabled, or with a plain blocking
+  recv() otherwise. Returns the number of bytes received, or -1/0 on error or
+  closed connection, same as recv()*/
+static int socket_recv(int sock, void *buf, uint32_t len) {
+	if (my_stream != NULL && my_stream->sock == sock) {
+		return uring_stream_recv(my_stream, (uint8_t*) buf, len);
+	}
+	return recv(sock, buf, len, MSG_WAITALL);
+}
+
+/*Returns the IP address of the peer connected on the given socket*/
+static uint32_t socket_peer_ip(int sock) {
+	struct sockaddr_storage peeraddr;
+	socklen_t peersize = sizeof(peeraddr);
+
+	memset(&peeraddr, 0, sizeof(peeraddr));
+	getpeername(sock, (struct sockaddr*)&peeraddr, &peersize);
+	return ((struct sockaddr_in*) &peeraddr)->sin_addr.s_addr;
+}
+
+/*Receives exactly len bytes from the given socket into buf, through whatever
+  transport we're on, and counts them towards the current message (and records
+  them in its frame, if we're capturing traffic)*/
+static int recv_bytes(int sock, void *buf, uint32_t len) {
+	int rv = transport->recv(sock, buf, len);
+
+	if (rv > 0) {
+		recv_total += rv;
+		if (my_sched != NULL) {
+			__atomic_store_n(&my_sched->last_recv, metrics_now(), __ATOMIC_RELAXED);
+		}
+		if (trace_enabled) {
+			trace_append(buf, rv);
+		}
+	}
+	return rv;
+}
+
+/*Wrappers around a channel's archive lock and peerlist_mutex, that record how
+  long we waited for each lock and how long we held it, plus a span for every
+  wait*/
+void archive_rdlock(struct channel *ch) {
+	uint64_t start = metrics_now();
+	pthread_rwlock_rdlock(&ch->lock);
+	archlock_since = metrics_now();
+	metrics_observe(H_ARCHLOCK_WAIT, archlock_since - start);
+	SPAN_RECORD(SP_ARCHLOCK_WAIT, start, archlock_since, 0);
+}
+
+void archive_wrlock(struct channel *ch) {
+	uint64_t start = metrics_now();
+	pthread_rwlock_wrlock(&ch->lock);
+	archlock_since = metrics_now();
+	metrics_observe(H_ARCHLOCK_WAIT, archlock_since - start);
+	SPAN_RECORD(SP_ARCHLOCK_WAIT, start, archlock_since, 1);
+}
+
+void archive_unlock(struct channel *ch) {
+	metrics_observe(H_ARCHLOCK_HOLD, metrics_now() - archlock_since);
+	pthread_rwlock_unlock(&ch->lock);
+}
+
+static void peerlist_lock() {
+	uint64_t start = metrics_now();
+	pthread_mutex_lock(&peerlist_mutex);
+	peerlock_since = metrics_now();
+	metrics_observe(H_PEERLOCK_WAIT, peerlock_since - start);
+	SPAN_RECORD(SP_PEERLOCK_WAIT, start, peerlock_since, 0);
+}
 
-/*Initializes a TCP socket for a given peer's IP in port 51511, establishes the
+static void peerlist_unlock() {
+	metrics_observe(H_PEERLOCK_HOLD, metrics_now() - peerlock_since);
+	pthread_mutex_unlock(&peerlist_mutex);
+}
+
+/*Launches the receiver thread for a newly connected peer that listens on the
+  given port (its periodic requests are on the timer wheel). The thread gets a
+  heap copy of the args, since the caller's variables may change (or go out of
+  scope) before the thread gets to read them*/
+static void launch_peer_thread(int sock, uint16_t port, int outgoing) {
+	pthread_t peerRecv;
+	struct peer_args *recvargs = malloc(sizeof(struct peer_args));
+
+	recvargs->sock = sock;
+	recvargs->port = port;
+	recvargs->outgoing = outgoing;
+	pthread_create(&peerRecv, NULL, peer_receiver_thread, recvargs);
+	pthread_detach(peerRecv);
+}
+
+/*callback for the io_uring accept loop, incoming peers listen on the default
+  port until they tell us otherwise*/
+static void launch_incoming_peer(int sock) {
+	launch_peer_thread(sock, DEFAULT_PORT, 0);
+}
+
+/*the transport's start, for peers we connected to*/
+static void launch_outgoing_peer(int sock, uint16_t port) {
+	launch_peer_thread(sock, port, 1);
+}
+
+/*the transport's hangup, the receiver thread gets an EOF and cleans up*/
+static void socket_hangup(int sock) {
+	shutdown(sock, SHUT_RDWR);
+}
+
+/*the send lock of the peer on the given socket*/
+static pthread_mutex_t *send_lock(int sock) {
+	return &send_locks[(uint32_t) sock % SEND_LOCKS];
+}
+
+/*Sends a whole message to the peer on the given socket, under its send lock.
+  Returns 1 if all of it went out, 0 otherwise*/
+static int send_message(int sock, const void *buf, size_t len) {
+	pthread_mutex_lock(send_lock(sock));
+	ssize_t sent = transport->send(sock, buf, len, 0);
+	pthread_mutex_unlock(send_lock(sock));
+	return sent == (ssize_t) len;
+}
+
+/*Binds a socket that is about to connect out to our local IP address, so
+  peers see that address as the source of the connection (only with -b)*/
+static void bind_outgoing(int sock) {
+	struct sockaddr_in local;
+
+	if (!bind_local) {
+		return;
+	}
+
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = myaddr;
+	local.sin_port = 0;
+	bind(sock, (struct sockaddr*) &local, sizeof(local));
+}
+
+/*Sends our list of connected peers to the given socket, in the original or in
+  the extended format. The list is copied under the lock and sent without it,
+  so a slow peer can't hold up everyone else*/
+static void send_peerlist(int sock, int ext) {
+	uint32_t len;
+	uint8_t *buf;
+
+	peerlist_lock();
+	len = ext ? LIST_EXT_STR_LEN(peerlist->size) : LIST_STR_LEN(peerlist->size);
+	buf = (uint8_t*) malloc(len);
+	memcpy(buf, ext ? peerlist->ext_str : peerlist->str, len);
+	peerlist_unlock();
+
+	if (send_message(sock, buf, len)) {
+		metrics_msg_out(sock, ext ? MSG_PEERLIST_EX : MSG_PEERLIST, len);
+	}
+	free(buf);
+}
+
+/*Initializes a TCP socket for a given peer's IP and port, establishes the
   TCP connection to the peer, and returns the socket's file descriptor ID.
   Returns -1 if it's not able to setup the connection.
   We use select() and some non-blocking magic to force a half-second timeout on
   connections, to avoid threads being blocked for long periods of time when
-	attempting to connect to unresponsive peers*/
-int init_peer_socket (char *ip) {
+	attempting to connect to unresponsive peers. With io_uring enabled, the same
+	timeout is implemented as a linked timeout on the connect operation instead*/
+int init_peer_socket (char *ip, uint16_t port) {
 	struct addrinfo hints, *peerinfo, *aux;
 	int addrinfo_rv, sock = -1;
+	uint64_t start = metrics_now();
+	char portstr[6];
+
+	snprintf(portstr, sizeof(portstr), "%u", port);
 
 	/*initialize hints struct*/
 	memset(&hints, 0, sizeof(hints));
@@ -52,9 +344,10 @@ int init_peer_socket (char *ip) {
 	hints.ai_socktype = SOCK_STREAM;
 
 	/*get list of addresses for given peer*/
-	if ((addrinfo_rv = getaddrinfo(ip, TCP_PORT, &hints, &peerinfo)) != 0) {
+	if ((addrinfo_rv = getaddrinfo(ip, portstr, &hints, &peerinfo)) != 0) {
 		fprintf(stderr, "Error when retrieving peer address information!\n");
 		fprintf(stderr, "Addrinfo status: %s\n", gai_strerror(addrinfo_rv));
+		metrics_add(M_CONNECT_FAIL, 1);
 		return -1;
 	}
 
@@ -64,6 +357,16 @@ int init_peer_socket (char *ip) {
 			== -1) {
 			continue;
 		}
+		bind_outgoing(sock);
+
+		/*io_uring backend, connect with a 500ms linked timeout*/
+		if (use_uring) {
+			if (uring_connect(sock, aux->ai_addr, aux->ai_addrlen, 500) == 0) {
+				break;
+			}
+			close(sock);
+			continue;
+		}
 
 		/*set socket to non-blocking, then initiate connection attempt*/
 		fcntl(sock, F_SETFL, O_NONBLOCK);
@@ -104,12 +407,16 @@ int init_peer_socket (char *ip) {
 	}
 
 	freeaddrinfo(peerinfo);
+	metrics_observe(H_CONNECT, metrics_now() - start);
+	SPAN_RECORD(SP_CONNECT, start, metrics_now(), port);
 
 	/*check if we managed to connect to any address*/
 	if (aux == NULL) {
+		metrics_add(M_CONNECT_FAIL, 1);
 		return -1;
 	}
 
+	metrics_add(M_CONNECT_OK, 1);
 	return sock;
 }
 
@@ -120,6 +427,11 @@ int init_incoming_socket () {
 	int addrinfo_rv, sock = -1;
 	int re = 1;
 	struct addrinfo hints, *myinfo, *aux;
+	char portstr[6], ipstr[INET_ADDRSTRLEN];
+
+	/*listen on our port, and only on our own address if asked to*/
+	snprintf(portstr, sizeof(portstr), "%u", myport);
+	inet_ntop(AF_INET, &myaddr, ipstr, sizeof(ipstr));
 
 	/*initialize hints structure*/
 	memset(&hints, 0, sizeof(hints));
@@ -128,7 +440,7 @@ int init_incoming_socket () {
 	hints.ai_flags = AI_PASSIVE;
 
 	/*get list of available interfaces*/
-	if ((addrinfo_rv = (getaddrinfo(NULL, TCP_PORT, &hints, &myinfo)) != 0)) {
+	if ((addrinfo_rv = (getaddrinfo(bind_local ? ipstr : NULL, portstr, &hints, &myinfo)) != 0)) {
 		fprintf(stderr, "Error when retrieving local address list!\n");
 		fprintf(stderr, "Addrinfo status: %s\n", gai_strerror(addrinfo_rv));
 		return -1;
@@ -167,405 +479,1971 @@ int init_incoming_socket () {
 	return sock;
 }
 
+/*real TCP sockets, the accepting side is incoming_peers_thread*/
+const struct transport socket_transport = {
+	.connect = init_peer_socket,
+	.start = launch_outgoing_peer,
+	.send = send,
+	.sendfile = sendfile,
+	.recv = socket_recv,
+	.peer_ip = socket_peer_ip,
+	.hangup = socket_hangup,
+	.close = close
+};
+
+const struct transport *transport = &socket_transport;
+
 /*Processes a PeerList message received on the given socket, checking if there
   are any peers in it to which we are not currently connected, and connecting
   to any potential new peers.*/
-void process_peerlist (int peersock, FILE *logfile) {
+void process_peerlist (int peersock, int ext) {
 	uint32_t size;
-	uint8_t buf[4];
-
-	fprintf(logfile, "\n----------Processing peer list!----------\n");
+	uint8_t buf[6];
+
+	/*extended lists start with the sender's listen port, so now we know it,
+	  and we know they speak the extended protocol*/
+	if (ext) {
+		recv_bytes(peersock, buf, 2);
+		peerlist_lock();
+		set_peer_port(peerlist, peersock, (buf[0] << 8) | buf[1]);
+		set_peer_ext(peerlist, peersock);
+		peerlist_unlock();
+	}
 
 	/*parse size bytes to compute the number of IPs in the list*/
-	recv(peersock, buf, 4, MSG_WAITALL);
+	recv_bytes(peersock, buf, 4);
 	size = ((buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3]);
-	fprintf(logfile, "%u clients:\n", size);
+	log_event(LOG_DEBUG, EV_PEERLIST_BEGIN, peersock, size, 0);
+
+	/*a peer claiming more than its budget allows gets dropped before we read
+	  any of it*/
+	if (admit_claim(peersock, (uint64_t) size * (ext ? 6 : 4)) == -1) {
+		return;
+	}
 
 	/*iterate through addresses, checking if we're connected to them*/
 	uint32_t i;
 	for (i = 0; i < size; i++) {
 		uint32_t uip = 0;
-		recv(peersock, buf, 4, MSG_WAITALL);
+		uint16_t port = DEFAULT_PORT;
+
+		/*original lists only have IPs, so those peers use the default port*/
+		recv_bytes(peersock, buf, ext ? 6 : 4);
 		uip = ((buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) | buf[0]);
-		fprintf(logfile, "%d.%d.%d.%d\n", buf[0], buf[1], buf[2], buf[3]);
+		if (ext) {
+			port = (buf[4] << 8) | buf[5];
+		}
+		log_event(LOG_DEBUG, EV_PEERLIST_ENTRY, peersock, uip, port);
 
 		/*don't try to connect to ourselves :)*/
-		if (uip == myaddr) {
+		if (uip == myaddr && port == myport) {
 			continue;
 		}
 
 		/*make sure we're the only ones accessing the list to avoid doubles*/
-		pthread_mutex_lock(&peerlist_mutex);
+		peerlist_lock();
 
 		/*if peer is not connected, get their IP and create socket*/
-		if (!is_connected(peerlist, uip)) {
+		if (!is_connected(peerlist, uip, port)) {
 			char ip[17];
 			snprintf(ip, 17, "%d.%d.%d.%d", buf[0], buf[1], buf[2], buf[3]);
-			fprintf(stdout, "Attempting to connect to new peer %s... \n", ip);
-			int newpeersock = init_peer_socket(ip);
+			fprintf(stdout, "Attempting to connect to new peer %s:%u... \n", ip,
+				port);
+			int newpeersock = transport->connect(ip, port);
 
 			/*couldn't connect after 500ms, move on*/
 			if (newpeersock == -1) {
-				fprintf(stderr, "Failed to connect to peer %s!\n", ip);
-				pthread_mutex_unlock(&peerlist_mutex);
+				fprintf(stderr, "Failed to connect to peer %s:%u!\n", ip, port);
+				peerlist_unlock();
 				continue;
 			}
 
-			/*if connection was successful, launch threads to deal with peer*/
-			pthread_t peerReq, peerRecv;
-			pthread_create(&peerReq, NULL, peer_requester_thread, &newpeersock);
-			pthread_create(&peerRecv, NULL, peer_receiver_thread, &newpeersock);
+			/*if connection was successful, start talking to the peer*/
+			transport->start(newpeersock, port);
+		}
+
+		peerlist_unlock();
+	}
+	log_event(LOG_DEBUG, EV_PEERLIST_END, peersock, 0, 0);
+}
+
+/*updates the archive gauges after a channel's archive changed (they're about
+  the default channel only)*/
+static void archive_gauges(struct channel *ch) {
+	if (ch->id == CHANNEL_DEFAULT_ID) {
+		metrics_gauge(G_ARCHIVE_SIZE, ch->arch->size);
+		metrics_gauge(G_ARCHIVE_LEN, ch->arch->len);
+	}
+}
+
+/*an archive we were offered, waiting to be validated in the compute pool.
+  Brief description:
+  ch    ->  the channel it's for
+  arch  ->  the archive
+  sock  ->  socket of the peer who sent it (only for the logs)
+  known ->  how many of its messages the channel's fork store already knows are
+            valid (see forks.h, channels without one validate every archive
+            whole)
+  id    ->  id of its branch in the fork store*/
+struct candidate {
+	struct channel *ch;
+	struct archive *arch;
+	int sock;
+	uint32_t known;
+	uint64_t id;
+};
+
+/*Compute pool task for a received archive: if it's (still) larger than the
+  active archive and is valid, it replaces the active one, otherwise it's
+  dumped. The archive lock isn't held while validating, so the active archive
+  may have grown in the meantime, which is checked again before replacing it*/
+static void validate_candidate (void *arg) {
+	struct candidate *c = (struct candidate*) arg;
+	struct channel *ch = c->ch;
+	struct archive *new_archive = c->arch;
+	int peersock = c->sock, valid = 0;
+
+	/*by the time we get to it, some other archive might have beaten this one*/
+	archive_rdlock(ch);
+	int larger = new_archive->size > ch->arch->size;
+	archive_unlock(ch);
+
+	/*only the messages past the ones the fork store vouches for get checked,
+	  and the store gets to know how that went. The peer pays for the CPU time*/
+	struct timespec cpu_start, cpu_end;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+	if (larger) {
+		SPAN_BEGIN(span_start);
+		uint32_t count = check_messages(new_archive, c->known, new_archive->size);
+		valid = count == new_archive->size;
+		if (ch->forks != NULL) {
+			fork_validated(ch->forks, c->id, count, !valid);
+		}
+		SPAN_END(span_start, SP_VALIDATE, new_archive->size - c->known);
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+	admit_validation_done(peersock, (cpu_end.tv_sec - cpu_start.tv_sec) *
+		1000000000ULL + cpu_end.tv_nsec - cpu_start.tv_nsec);
+	free(c);
+
+	if (larger && valid) {
+		SPAN_BEGIN(span_start);
+		archive_wrlock(ch);
+		if (new_archive->size > ch->arch->size) {
+			api_notify(ch, common_messages(ch->arch, new_archive));
+			free_archive(ch->arch);
+			ch->arch = new_archive;
+			sync_snapshot(ch->arch);
+			metrics_add(M_ARCH_REPLACED, 1);
+			archive_gauges(ch);
+			log_event(LOG_INFO, EV_ARCHRESP_REPLACED, peersock, ch->arch->size, 0);
+			fprintf(stdout, "---------- Active archive replaced! ----------\n");
+			archive_unlock(ch);
+			SPAN_END(span_start, SP_REPLACE, new_archive->size);
+			return;
 		}
+		archive_unlock(ch);
+		SPAN_END(span_start, SP_REPLACE, 0);
+		larger = 0;
+	}
+
+	/*otherwise, the active stays, so dump the new one*/
+	archive_rdlock(ch);
+	uint32_t active_size = ch->arch->size;
+	archive_unlock(ch);
+	metrics_add(larger ? M_ARCH_INVALID : M_ARCH_SMALLER, 1);
+	log_event(LOG_INFO, EV_ARCHRESP_REJECTED, peersock, new_archive->size,
+		active_size);
+	free_archive(new_archive);
+}
+
+/*Takes an archive the peer on the given socket offered for a channel, whose
+  first known messages we already know are valid (because they're our own,
+  say). If it's larger than the active archive, it's handed to the compute pool
+  to be validated (and replace the current archive if it's valid), without
+  waiting for it, otherwise we dump it right away*/
+static void offer_candidate (int peersock, struct channel *ch,
+	struct archive *new_archive, uint32_t known) {
+	/*a malformed record (one that doesn't fit, isn't printable or has a hash
+	  that doesn't start with 2 zero bytes) makes the whole archive invalid, and
+	  a single pass over it finds out, before the fork store, the compute pool or
+	  the peer's CPU budget hear about it. It also fills in the archive's index,
+	  which validation hashes from*/
+	SPAN_BEGIN(span_start);
+	uint32_t scanned = scan_archive(new_archive);
+	SPAN_END(span_start, SP_SCAN, new_archive->size);
+	if (scanned < new_archive->size) {
+		metrics_add(M_ARCH_MALFORMED, 1);
+		log_event(LOG_INFO, EV_ARCHRESP_REJECTED, peersock, new_archive->size, 0);
+		free_archive(new_archive);
+		return;
+	}
+
+	/*let the fork store know about it, even if it's no longer than the active
+	  one (it may be a competing branch that grows later), and find out how much
+	  of it we already know is valid, or if it has a message we already know is
+	  invalid*/
+	uint64_t id = 0;
+	int bad = 0;
+	if (ch->forks != NULL) {
+		uint32_t stored = fork_offer(ch->forks, new_archive, 0, &id, &bad);
+		known = stored > known ? stored : known;
+	}
+
+	/*if the new archive isn't even larger than the active, dump it right away,
+	  otherwise it goes to the compute pool to be validated (see
+	  validate_candidate), so we can get back to reading. The largest archive
+	  we've been offered so far jumps the queue*/
+	archive_rdlock(ch);
+	int larger = new_archive->size > ch->arch->size;
+	uint32_t active_size = ch->arch->size;
+	archive_unlock(ch);
+
+	if (bad || !larger) {
+		metrics_add(bad ? M_ARCH_INVALID : M_ARCH_SMALLER, 1);
+		log_event(LOG_INFO, EV_ARCHRESP_REJECTED, peersock, new_archive->size,
+			active_size);
+		free_archive(new_archive);
+		return;
+	}
+
+	/*peers that already cost us too much validation don't get any more, and
+	  everyone waits for a validation slot*/
+	if (admit_validation(peersock) != ADMIT_OK) {
+		log_event(LOG_INFO, EV_ARCHRESP_REJECTED, peersock, new_archive->size,
+			active_size);
+		free_archive(new_archive);
+		return;
+	}
 
-		pthread_mutex_unlock(&peerlist_mutex);
+	int prio = POOL_NORMAL;
+	uint32_t best = ch->best;
+	while (new_archive->size > best) {
+		if (__sync_bool_compare_and_swap(&ch->best, best, new_archive->size)) {
+			prio = POOL_HIGH;
+			break;
+		}
+		best = ch->best;
 	}
-	fprintf(logfile, "----------Done processing peerlist!----------\n\n");
+
+	struct candidate *c = (struct candidate*) malloc(sizeof(struct candidate));
+	c->ch = ch;
+	c->arch = new_archive;
+	c->sock = peersock;
+	c->known = known;
+	c->id = id;
+	pool_submit(NULL, prio, validate_candidate, c);
 }
 
 /*Processes an ArchiveResponse received on the given socket. First, we parse and
   store the content of the received archive appropriately. Then, we check if the
-	new archive is larger than the one currently active. If so, we validate this
-	new archive. If the validity check is successful, we replace the current
-	archive by the new one, and dump the old archive*/
-void process_archive (int peersock, FILE *logfile) {
-	fprintf(logfile, "\n----------Processing ArchiveResponse!---------\n");
-
+	new archive is larger than the one currently active. If so, we hand it to
+	the compute pool to be validated (and replace the current archive if it's
+	valid), without waiting for it, otherwise we dump it right away*/
+void process_archive (int peersock, struct channel *ch) {
 	/*get number of chats in archive*/
 	uint8_t buf[4]; uint32_t usize = 0;
-	recv(peersock, buf, 4, MSG_WAITALL);
+	SPAN_BEGIN(span_start);
+	recv_bytes(peersock, buf, 4);
 	usize = ((buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3]);
 
-	fprintf(logfile, "Number of chats: %u\n", usize);
+	log_event(LOG_DEBUG, EV_ARCHRESP_BEGIN, peersock, usize, 0);
 
-	/*allocate an archive struct to store the received archive*/
-	struct archive *new_archive = init_archive();
-	uint8_t *ptr, *aux;
+	/*every message takes at least 33 bytes, a peer claiming more than its
+	  budget allows gets dropped before we allocate anything for it*/
+	if (admit_claim(peersock, (uint64_t) usize * 33) == -1) {
+		return;
+	}
 
-	/*initialize archive size, and allocate memory for its content.
-	At first, we need to allocate memory for the biggest possible archive*/
-	new_archive->size = usize;
-	ptr = (uint8_t *) malloc(5 + (usize * 289));
-	aux = ptr;
+	/*start with room for the smallest archive of that size, which is what the
+	  peer was charged for, and grow it as bigger messages come in, so we never
+	  hold much more than what we actually received. If we run out of memory,
+	  the rest of the archive is still read (into scratch, so we don't lose
+	  track of the stream), then thrown away*/
+	size_t cap = 5 + (size_t) usize * 33;
+	uint8_t *ptr = (uint8_t *) malloc(cap), *aux, scratch[288];
 
 	/*compute archive message type and size into new string*/
-	*aux++ = 4;
-	memcpy(aux, buf, 4);
-	aux += 4;
+	if (ptr != NULL) {
+		ptr[0] = 4;
+		memcpy(ptr + 1, buf, 4);
+	}
 
 	/*and initialize a counter for total message length (in bytes)*/
 	uint32_t len = 5;
 
-	/*now iterate over every message in the archive*/
+	/*now iterate over every message in the archive, reading each one straight
+	  into our string: its length, then its content, code and hash in one go
+	  (zeroes if the peer went away, the archive won't validate anyway)*/
 	unsigned int i;
-	uint8_t codes[32], msg[256], msglen;
+	uint8_t msglen;
 	for (i = 0; i < usize; i++) {
-		/*read message from socket*/
-		memset(msg, 0, 256);
-		recv(peersock, &msglen, 1, MSG_WAITALL);
-		recv(peersock, msg, msglen, MSG_WAITALL);
-		recv(peersock, codes, 32, MSG_WAITALL);
-
-		/*store it into our string*/
-		memcpy(aux, &msglen, 1);
-		aux++;
-		memcpy(aux, msg, msglen);
-		aux += msglen;
-		memcpy(aux, codes, 32);
-		aux += 32;
+		/*make room for the biggest message there can be (288 bytes)*/
+		if (ptr != NULL && len + sizeof(scratch) > cap) {
+			cap = 2 * cap > len + sizeof(scratch) ? 2 * cap : len + sizeof(scratch);
+			uint8_t *grown = (uint8_t *) realloc(ptr, cap);
+			if (grown == NULL) {
+				free(ptr);
+			}
+			ptr = grown;
+		}
+
+		aux = ptr != NULL ? ptr + len : scratch;
+		*aux = 0;
+		recv_bytes(peersock, aux, 1);
+		msglen = *aux++;
+		if (recv_bytes(peersock, aux, msglen + 32) != msglen + 32) {
+			memset(aux, 0, msglen + 32);
+		}
 
 		/*update total length (33 = 32 bytes of md5+code and 1 byte for msg size)*/
 		len += (msglen+33);
 	}
+	SPAN_END(span_start, SP_ARCHIVE_RECV, len);
+
+	if (ptr == NULL) {
+		fprintf(stderr, "Out of memory for an archive of %u messages!\n", usize);
+		log_event(LOG_WARN, EV_ARCHRESP_REJECTED, peersock, usize, len);
+		return;
+	}
 
 	/*now realloc the final string with only the amount of memory necessary*/
+	struct archive *new_archive = init_archive();
+	free(new_archive->str);
+	new_archive->size = usize;
 	new_archive->str = realloc(ptr, len);
 	new_archive->len = len;
 
-	fprintf(logfile, "Content of archive received:\n");
-	print_archive(new_archive, logfile);
+	log_event(LOG_INFO, EV_ARCHRESP_RECEIVED, peersock, new_archive->size,
+		new_archive->len);
 
-	/*if the new archive is valid and larger than the active, substitute it
-	  (short circuiting saves some time here if new archive is already smaller)*/
-	pthread_rwlock_rdlock(&archive_lock);
-	if (new_archive->size > active_arch->size && is_valid(new_archive)) {
-		pthread_rwlock_unlock(&archive_lock);
-		pthread_rwlock_wrlock(&archive_lock);
-		free(active_arch->str);
-		free(active_arch);
-		active_arch = new_archive;
-		fprintf(stdout, "---------- Active archive replaced! ----------\n");
+	/*an archive for a channel we're not in was only read to get past it*/
+	if (ch == NULL) {
+		log_event(LOG_INFO, EV_ARCHRESP_REJECTED, peersock, new_archive->size, 0);
+		free_archive(new_archive);
+		return;
 	}
+	offer_candidate(peersock, ch, new_archive, 0);
+}
 
-	/*otherwise, the active stays, so dump the new one*/
+/*Writes an archive snapshot to the given socket, see send_snapshot, which
+  holds the socket's send lock while we're at it*/
+static int write_snapshot (int sock, struct archive_snapshot *snap,
+	uint32_t chid) {
+	/*archives of channels other than the default one go in an
+	  ArchiveResponseCh, which is the same thing with the channel's id after the
+	  type byte*/
+	if (chid != CHANNEL_DEFAULT_ID) {
+		uint8_t hdr[5];
+		hdr[0] = MSG_ARCHRESP_CH;
+		hdr[1] = (chid >> 24) & 0xFF;
+		hdr[2] = (chid >> 16) & 0xFF;
+		hdr[3] = (chid >> 8) & 0xFF;
+		hdr[4] = chid & 0xFF;
+		if (transport->send(sock, hdr, 5, MSG_MORE) != 5) {
+			return -1;
+		}
+		if (snap->fd == -1) {
+			if (transport->send(sock, snap->buf + 1, snap->len - 1, 0) !=
+				(ssize_t) snap->len - 1) {
+				return -1;
+			}
+			metrics_msg_out(sock, MSG_ARCHRESP_CH, snap->len + 4);
+			return 0;
+		}
+		if (transport->send(sock, snap->hdr + 1, 4, MSG_MORE) != 4) {
+			return -1;
+		}
+	}
+
+	/*no memfd, just send the fallback copy the old fashioned way*/
+	else if (snap->fd == -1) {
+		if (transport->send(sock, snap->buf, snap->len, 0) != (ssize_t) snap->len) {
+			return -1;
+		}
+		metrics_msg_out(sock, MSG_ARCHRESP, snap->len);
+		return 0;
+	}
+
+	/*header first, MSG_MORE so it gets coalesced with the start of the body*/
+	else if (transport->send(sock, snap->hdr, 5, MSG_MORE) != 5) {
+		return -1;
+	}
+
+	/*sendfile with an explicit offset doesn't touch the file position, so any
+	  number of threads can do this on the same snapshot at the same time*/
+	off_t off = 5;
+	while (off < snap->len) {
+		ssize_t sent = transport->sendfile(sock, snap->fd, &off, snap->len - off);
+		if (sent <= 0) {
+			return -1;
+		}
+	}
+
+	if (chid != CHANNEL_DEFAULT_ID) {
+		metrics_msg_out(sock, MSG_ARCHRESP_CH, snap->len + 4);
+	}
 	else {
-		free(new_archive->str);
-		free(new_archive);
+		metrics_msg_out(sock, MSG_ARCHRESP, snap->len);
 	}
-	pthread_rwlock_unlock(&archive_lock);
-	fprintf(logfile, "----------Done processing ArchiveResponse!----------\n\n");
+	return 0;
+}
+
+/*Sends an archive snapshot to the given socket. The type+size header goes out
+  from memory, and the rest of the archive is sendfile()d straight from the
+  snapshot's memfd, so the kernel never needs us to copy it around. All of it
+  goes out under the socket's send lock, so nothing else we send the peer
+  ends up in the middle of it. Returns 0 on success, -1 if the send failed.*/
+int send_snapshot (int sock, struct archive_snapshot *snap, uint32_t chid) {
+	pthread_mutex_lock(send_lock(sock));
+	int rv = write_snapshot(sock, snap, chid);
+	pthread_mutex_unlock(send_lock(sock));
+	return rv;
 }
 
-/*Publishes a newly created archive by iterating over the peerlist and sending
-  the currently active archive to each peer. This function looks weird, because
-	all the data it accesses is contained in both of our global data structures,
-	the peerlist structure and the active archive structure.*/
-void publish_archive() {
+/*Publishes a channel's newly created archive by sending a snapshot of it
+  to each peer in the peerlist (for the default channel), or to each peer that
+  asked for the channel (for any other). This function looks weird, because
+	all the data it accesses is contained in our global data structures, the
+	peerlist structure and the snapshot.*/
+void publish_archive(struct channel *ch, struct archive_snapshot *snap) {
 	struct node *aux;
+	int *socks = NULL, cap = 0, n = 0, i;
 
 	fprintf(stdout, "\n----------Publishing new archive!----------\n");
 
-	aux = peerlist->head->next;
+	/*copy the sockets of every peer in the peer list under its lock, peers
+	  may come and go while we send*/
+	if (ch->id == CHANNEL_DEFAULT_ID) {
+		peerlist_lock();
+		socks = malloc((peerlist->size + 1) * sizeof(int));
+		for (aux = peerlist->head->next; aux != NULL; aux = aux->next) {
+			socks[n++] = aux->sock;
+		}
+		peerlist_unlock();
+	}
+
+	/*or of the channel's peers*/
+	else {
+		n = channel_peers(ch, &socks, &cap);
+	}
 
-	/*iterate over peer list, and send archive to each peer*/
-	while (aux != NULL) {
-		fprintf(stdout, "Sending to peer at sock %u\n", aux->sock);
-		send(aux->sock, active_arch->str, active_arch->len, 0);
-		aux = aux->next;
+	/*and send the archive to each one, without holding any lock*/
+	for (i = 0; i < n; i++) {
+		fprintf(stdout, "Sending to peer at sock %u\n", socks[i]);
+		SPAN_BEGIN(span_start);
+		send_snapshot(socks[i], snap, ch->id);
+		SPAN_END(span_start, SP_PUBLISH_SEND, socks[i]);
 	}
+	free(socks);
 
 	fprintf(stdout, "----------Done publishing!---------\n\n");
 }
 
-/*Implements the work done by threads launched for each peer, that periodically
-  send PeerRequest messages ("0x1") to the connected peer. It takes the socket
-  associated to the peer as input, and simply loops forever, sending out request
-  messages in a given interval (5 seconds)
-  As a bonus, since the specification did not mention when we should send
-  ArchiveRequests, we'll send them periodically as well, on a longer interval
- (every 60 seconds)*/
-void *peer_requester_thread (void *sock) {
-	int peersock = *((int*) sock);
-	uint8_t msg[2];
-
-	/*open logfile for thread's socket*/
-	char filename[7];
-	memset(filename, 0, 7);
-	snprintf(filename, 7, "%d.log", peersock);
-	FILE *logfile = fopen(filename, "a");
-
-	/*we have two msg bytes, one for peer requests, the other for archive*/
+/*Sends a request (a few bytes) to the peer on the given socket without
+  waiting for room in its send buffer, so the timer wheel's thread (which sends
+  most requests) never blocks on a peer that stopped reading. Returns 0 if it
+  was sent, 1 if the buffer was full (or someone else is sending the peer
+  something, an archive, say) and nothing was sent, or -1 if the send failed.
+  A request that only got partly sent leaves half a message in the stream, so
+  we hang up on the peer then*/
+static int try_send (int sock, const void *buf, size_t len) {
+	if (pthread_mutex_trylock(send_lock(sock)) != 0) {
+		return 1;
+	}
+	ssize_t n = transport->send(sock, buf, len, MSG_DONTWAIT);
+	int busy = n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	pthread_mutex_unlock(send_lock(sock));
+
+	if (n == (ssize_t) len) {
+		return 0;
+	}
+	if (busy) {
+		return 1;
+	}
+	if (n > 0) {
+		transport->hangup(sock);
+	}
+	return -1;
+}
+
+/*Sends the periodic requests to the peer on the given socket: if peerreq is
+  set, a PeerRequestExt, plus an original PeerRequest unless the peer has
+  already shown us it speaks the extended format, and an ArchiveRequest if
+  archreq is set (plus an ArchiveRequestCh for every other channel we're in, if
+  the peer speaks the extended format). Peers that answered our HelloRequest
+  get a TipRequest instead of the ArchiveRequest, if fork-point searches are
+  on, so they only send us what we don't have (see seek.h). Never blocks (see
+  try_send). Returns 0 on success, 1 if the peer's send buffer is full, so the
+  rest of the requests are skipped until the next time they're due, -1 if the
+  connection is broken*/
+int send_requests (int peersock, int peerreq, int archreq) {
+	struct node peer;
+	uint8_t msg[3];
+	int ext = 0, hello = 0, rv;
+
+	/*we have three msg bytes, two for peer requests, the other for archive*/
 	msg[0] = MSG_PEERREQ;
 	msg[1] = MSG_ARCHREQ;
+	msg[2] = MSG_PEERREQ_EX;
+
+	peerlist_lock();
+	ext = peer_is_ext(peerlist, peersock);
+	hello = get_peer(peerlist, peersock, &peer) && peer.id != 0;
+	peerlist_unlock();
+
+	if (peerreq) {
+		if ((rv = try_send(peersock, msg+2, 1)) != 0 ||
+			(!ext && (rv = try_send(peersock, msg, 1)) != 0)) {
+			if (rv == -1) {
+				log_event(LOG_WARN, EV_PEERREQ_SEND_FAIL, peersock, 0, 0);
+			}
+			return rv;
+		}
+		metrics_msg_out(peersock, MSG_PEERREQ_EX, 1);
+		if (!ext) {
+			metrics_msg_out(peersock, MSG_PEERREQ, 1);
+		}
+	}
 
-	/*send PeerRequests every 5 seconds, exit if broken pipe*/
-	int count = 0;
-	while (1) {
-		if (send(peersock, msg, 1, 0) == -1) {
-			fprintf(logfile,"Error sending peer request, broken pipe?\n");
-			fprintf(logfile,"Terminating requester thread.\n");
-			pthread_exit(NULL);
+	/*a TipRequest that didn't fit is skipped like any other request, if
+	  fork-point searches are off (or the peer didn't answer our HelloRequest)
+	  it's an ArchiveRequest instead*/
+	int tip = archreq && hello ? seek_peer(peersock, CHANNEL_DEFAULT_ID) : -1;
+	if (tip == 1) {
+		return 1;
+	}
+	if (archreq && tip != 0) {
+		if ((rv = try_send(peersock, msg+1, 1)) != 0) {
+			if (rv == -1) {
+				log_event(LOG_WARN, EV_ARCHREQ_SEND_FAIL, peersock, 0, 0);
+			}
+			return rv;
 		}
-		count++;
+		metrics_msg_out(peersock, MSG_ARCHREQ, 1);
+	}
 
-		/*send ArchiveRequests every 60 seconds (5*12 = 60)*/
-		if (count == 12) {
-			if (send(peersock, msg+1, 1, 0) == -1) {
-				fprintf(logfile,"Error sending archive request, broken pipe?\n");
-				fprintf(logfile, "Terminating requester thread.\n");
-				pthread_exit(NULL);
+	/*peers that only speak the original protocol wouldn't know what to make of
+	  these, and only have the default channel anyway*/
+	if (archreq && ext) {
+		int i, count = __atomic_load_n(&channels->count, __ATOMIC_ACQUIRE);
+		uint8_t req[5];
+
+		for (i = 1; i < count; i++) {
+			uint32_t id = channels->list[i]->id;
+			req[0] = MSG_ARCHREQ_CH;
+			req[1] = (id >> 24) & 0xFF;
+			req[2] = (id >> 16) & 0xFF;
+			req[3] = (id >> 8) & 0xFF;
+			req[4] = id & 0xFF;
+			if ((rv = try_send(peersock, req, 5)) != 0) {
+				if (rv == -1) {
+					log_event(LOG_WARN, EV_ARCHREQ_SEND_FAIL, peersock, 0, 0);
+				}
+				return rv;
 			}
-			count = 0;
+			metrics_msg_out(peersock, MSG_ARCHREQ_CH, 5);
 		}
-		sleep(5);
 	}
+	return 0;
 }
 
-/*Implements the work done by threads launched for each peer that receive and
-  process data sent by the connected peer. It takes the socket associated to the
-  peer as input, and recv()s on the socket, waiting for messages to arrive, and
-  processes each type of message accordingly.
-	The socket is configured with a timeout. If a recv() operation times out, we
-	assume the connection was interrupted, and close the socket, disconnect from
-	the peer and remove them from the list of connected peers.*/
-void *peer_receiver_thread (void *sock) {
-	int peersock = *((int*) sock);
-
-	/*open logfile for thread's socket*/
-	char filename[7];
-	memset(filename, 0, 7);
-	snprintf(filename, 7, "%d.log", peersock);
-	FILE *logfile = fopen(filename, "a");
-
-	/*get peer name+ip information*/
-	struct sockaddr_storage peeraddr;
-	socklen_t peersize = sizeof(peeraddr);
-	getpeername(peersock, (struct sockaddr*)&peeraddr, &peersize);
-	struct sockaddr_in *peeraddr_in = (struct sockaddr_in*) &peeraddr;
-	uint32_t upeerip = peeraddr_in->sin_addr.s_addr;
-	char *cpeerip = inet_ntoa(peeraddr_in->sin_addr);
+/*Adds a newly connected peer, listening on the given port, to the list of
+  connected peers, and asks it who it is*/
+void peer_connected (int peersock, uint16_t port, int outgoing) {
+	uint32_t upeerip = transport->peer_ip(peersock);
+	struct in_addr addr;
+	uint8_t type = MSG_HELLOREQ;
+
+	addr.s_addr = upeerip;
+	peerlist_lock();
+	add_peer(peerlist, upeerip, port, peersock, outgoing);
+	admit_open(peersock);
+	metrics_peer_open(peersock, upeerip);
+	metrics_gauge(G_PEERS, peerlist->size);
+	log_event(LOG_INFO, EV_PEER_CONNECTED, peersock, upeerip, 0);
+	fprintf(stdout, "Successfully connected to peer %s\n", inet_ntoa(addr));
+	peerlist_unlock();
+
+	/*a single byte, so peers that only speak the original protocol just
+	  ignore it, and we never send them a Hello*/
+	if (send_message(peersock, &type, 1)) {
+		metrics_msg_out(peersock, MSG_HELLOREQ, 1);
+	}
+}
 
-	/*add peer to list of connected peers*/
-	pthread_mutex_lock(&peerlist_mutex);
-	add_peer(peerlist, upeerip, peersock);
-	fprintf(stdout, "Successfully connected to peer %s\n", cpeerip);
-	pthread_mutex_unlock(&peerlist_mutex);
+/*Closes the connection to a peer, and removes it from the list of connected
+  peers*/
+void peer_disconnected (int peersock) {
+	log_event(LOG_INFO, EV_PEER_DISCONNECTED, peersock,
+		transport->peer_ip(peersock), 0);
+	boot_peer_gone(peersock);
+	seek_peer_gone(peersock);
+	transport->close(peersock);
+
+	/*it won't be getting any channel's archive from now on*/
+	int i, count = __atomic_load_n(&channels->count, __ATOMIC_ACQUIRE);
+	for (i = 1; i < count; i++) {
+		channel_remove_peer(channels->list[i], peersock);
+	}
 
-	/*set socket to timeout on receive operations after 60 seconds*/
-	struct timeval tout;
-	tout.tv_sec = 60;
-	tout.tv_usec = 0;
-	setsockopt(peersock,SOL_SOCKET,SO_RCVTIMEO,(char*)&tout,sizeof(tout));
+	peerlist_lock();
+	remove_peer(peerlist, peersock);
+	admit_close(peersock);
+	metrics_peer_close(peersock);
+	metrics_gauge(G_PEERS, peerlist->size);
+	peerlist_unlock();
+}
 
-	/*loop waiting for messages*/
-	while (1) {
-		/*get first byte to determine message type*/
-		uint8_t type;
-		if(recv(peersock, &type, 1, MSG_WAITALL) <= 0) {
-			/*connection was closed or socket timed out*/
-			fprintf(stderr, "Timed out when waiting for peer %s.\n", cpeerip);
-			fprintf(stderr, "Peer likely disconnected. Closing connection...\n");
-			close(peersock);
-			pthread_mutex_lock(&peerlist_mutex);
-			remove_peer(peerlist, upeerip);
-			pthread_mutex_unlock(&peerlist_mutex);
-			pthread_exit(NULL);
-		}
-
-		/*process each message type accordingly*/
-		switch(type) {
-			case MSG_PEERREQ: {
-				fprintf(logfile, "Received PeerRequest, sending list!\n");
-				send(peersock, peerlist->str, (5+(4*peerlist->size)), 0);
-				break;
-			}
+/*Sends a Hello to the peer on the given socket: our node id and listen port*/
+static void send_hello (int peersock) {
+	uint8_t buf[11];
+	int i;
 
-			case MSG_PEERLIST: {
-				process_peerlist(peersock, logfile);
-				break;
-			}
+	buf[0] = MSG_HELLO;
+	for (i = 0; i < 8; i++) {
+		buf[1+i] = (node_id >> (56 - 8*i)) & 0xFF;
+	}
+	buf[9] = (myport >> 8) & 0xFF;
+	buf[10] = myport & 0xFF;
+	if (send_message(peersock, buf, 11)) {
+		metrics_msg_out(peersock, MSG_HELLO, 11);
+	}
+}
 
-			case MSG_ARCHREQ: {
-				fprintf(logfile, "Received ArchiveRequest!\n");
-				if (!active_arch->size) {
-					fprintf(logfile, "Current archive is empty, ignoring request!\n");
-					break;
-				}
-				fprintf(logfile, "Sending archive!\n");
-				send(peersock, active_arch->str, active_arch->len, 0);
-				break;
-			}
+/*Processes a Hello received on the given socket. Now we know the peer's node
+  id and listen port, and if we already have another connection to the same
+  node (it connected to us while we were connecting to it, say), one of them
+  goes. Both nodes apply the same rule, so they drop the same connection: the
+  one that stays is the one opened by the node with the lower id. If both were
+  opened by the same node, that node drops the newer one, and the other one
+  leaves it to it. A Hello with our own id means we connected to ourselves*/
+static void process_hello (int peersock) {
+	uint8_t buf[10];
+	uint64_t id = 0;
+	int i, drop = -1;
+
+	if (recv_bytes(peersock, buf, 10) != 10) {
+		return;
+	}
+	for (i = 0; i < 8; i++) {
+		id = (id << 8) | buf[i];
+	}
+	uint16_t port = (buf[8] << 8) | buf[9];
+	log_event(LOG_DEBUG, EV_HELLO_RECV, peersock, id, port);
 
-			case MSG_ARCHRESP: {
-				process_archive(peersock, logfile);
-				break;
+	peerlist_lock();
+	set_peer_id(peerlist, peersock, id);
+	if (id == node_id) {
+		drop = peersock;
+	}
+	else {
+		set_peer_port(peerlist, peersock, port);
+
+		int other = peer_with_id(peerlist, id, peersock);
+		if (other != -1) {
+			uint64_t mine = peer_is_outgoing(peerlist, peersock) ? node_id : id;
+			uint64_t theirs = peer_is_outgoing(peerlist, other) ? node_id : id;
+			if (mine != theirs) {
+				drop = mine < theirs ? other : peersock;
 			}
-
-			default: {
-				fprintf(logfile, "Unknown msg type, ignoring... (byte = %d)\n", type);
-				break;
+			else if (mine == node_id) {
+				drop = peersock;
 			}
 		}
 	}
-}
+	peerlist_unlock();
 
-/*This function implements all the work that must be done by the thread that
-  treats incoming peer connections. It initializes a passive socket, binds to
-  it, then listens and waits for incoming connections, accept()ing them and
-  launching threads to exchange data with each peer.
-  The thread that runs this function will be called once at the beginning of
-  program execution, and run indefinitely.*/
-void *incoming_peers_thread () {
-	int mysock, peersock;
-	struct sockaddr_storage peeraddr;
-	socklen_t peersize;
+	if (drop != -1) {
+		metrics_add(M_DUPLICATE_DROPPED, 1);
+		log_event(LOG_INFO, EV_DUPLICATE_DROPPED, drop, id, 0);
+		transport->hangup(drop);
+	}
 
-	/*initialize the listen socket*/
-	mysock = init_incoming_socket();
+	/*a peer we keep that speaks the handshake can help us bootstrap, or once
+	  we're done with that, have messages we don't (see seek.h)*/
+	if (drop != peersock && !boot_peer(peersock)) {
+		seek_peer(peersock, CHANNEL_DEFAULT_ID);
+	}
+}
 
-	/*attempt to listen on the created socket*/
-	if (listen(mysock, 10) == -1) {
-		fprintf(stderr, "Failed to listen on incoming peer socket!\n");
-		pthread_exit(NULL);
+/*Sends the channel's active archive to the peer on the given socket, if it has
+  anything in it*/
+static void send_channel (int peersock, struct channel *ch) {
+	/*grab a snapshot under the read lock, then send it without holding
+	  the lock, the snapshot stays alive even if the archive is replaced*/
+	archive_rdlock(ch);
+	struct archive_snapshot *snap = NULL;
+	uint32_t size = ch->arch->size;
+	if (size) {
+		snap = acquire_snapshot(ch->arch);
 	}
+	archive_unlock(ch);
 
-	fprintf(stdout, "[Incoming peers thread is awaiting connections]\n");
+	if (snap == NULL) {
+		log_event(LOG_DEBUG, EV_ARCHREQ_EMPTY, peersock, 0, 0);
+		return;
+	}
+	send_snapshot(peersock, snap, ch->id);
+	log_event(LOG_INFO, EV_ARCHREQ_SENT, peersock, size, snap->len);
+	release_snapshot(snap);
+}
 
-	/*while (hopefully) forever, accept incoming connections from peers*/
-	char pigs_can_fly = 0;
-	while (!pigs_can_fly) {
-		peersize = sizeof(peeraddr);
-		if ((peersock = accept(mysock, (struct sockaddr*) &peeraddr, &peersize))
-			== -1) {
-			fprintf(stderr, "Error, could not accept connection from peer!\n");
-			continue;
+/*big-endian 32 bit fields, which every count and id in the Tip and Range
+  messages is*/
+static void put_be32 (uint8_t *buf, uint32_t v) {
+	buf[0] = (v >> 24) & 0xFF;
+	buf[1] = (v >> 16) & 0xFF;
+	buf[2] = (v >> 8) & 0xFF;
+	buf[3] = v & 0xFF;
+}
+
+static uint32_t get_be32 (const uint8_t *buf) {
+	return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+/*Answers a TipRequest for a channel with a Tip: the channel's id, the size of
+  its active archive, and the hash of its last message (size and hash are
+  zeroes if it's empty, or if we're not in that channel)*/
+static void send_tip (int peersock, uint32_t chid) {
+	struct channel *ch = channel_find(channels, chid);
+	uint8_t buf[25];
+
+	memset(buf, 0, 25);
+	buf[0] = MSG_TIP;
+	put_be32(buf+1, chid);
+	if (ch != NULL) {
+		archive_rdlock(ch);
+		put_be32(buf+5, ch->arch->size);
+		if (ch->arch->size) {
+			memcpy(buf+9, ch->arch->str + ch->arch->len - 16, 16);
 		}
+		archive_unlock(ch);
+	}
+	if (send_message(peersock, buf, 25)) {
+		metrics_msg_out(peersock, MSG_TIP, 25);
+	}
+}
 
-		/*launch request and receiver threads for incoming peer*/
-		fprintf(stdout, "Accepted incoming peer connection!\n");
-		pthread_t peerReq, peerRecv;
-		pthread_create(&peerReq, NULL, peer_requester_thread, &peersock);
-		pthread_create(&peerRecv, NULL, peer_receiver_thread, &peersock);
+/*Writes a Range's 17 byte header to the given socket, followed by the records
+  from begin to end of the snapshot (if any), see send_range, which holds the
+  socket's send lock while we're at it. Returns 0 on success, -1 if the send
+  failed*/
+static int write_range (int sock, const uint8_t *hdr,
+	struct archive_snapshot *snap, uint32_t begin, uint32_t end) {
+	if (transport->send(sock, hdr, 17, end > begin ? MSG_MORE : 0) != 17) {
+		return -1;
 	}
 
-	pthread_exit(NULL);
+	/*no memfd, just send from the fallback copy*/
+	if (snap != NULL && snap->fd == -1 && end > begin) {
+		if (transport->send(sock, snap->buf + begin, end - begin, 0) !=
+			(ssize_t) (end - begin)) {
+			return -1;
+		}
+	}
+	else if (end > begin) {
+		off_t off = begin;
+		while (off < end) {
+			ssize_t sent = transport->sendfile(sock, snap->fd, &off, end - off);
+			if (sent <= 0) {
+				return -1;
+			}
+		}
+	}
+	return 0;
 }
 
-/*Beginning of program execution*/
-int main(int argc, char *argv[]) {
-	/*insufficient arguments, we need an initial peer to connect to and the
-	 public IP address for the local device*/
-	if (argc != 3) {
-		fprintf(stderr, "Usage: ./blockchain <ip/hostname> <public IP>\n");
-		return 0;
+/*Answers a RangeRequest for count messages of a channel from first on (at most
+  BOOT_MAX_RANGE of them) with a Range: the channel's id, first, how many
+  messages of lead-in come before the range (up to BOOT_LEAD) and how many are
+  in it, followed by all of their records. Like an ArchiveResponse, the records
+  are sendfile()d straight from a snapshot of the active archive. A range past
+  the end of the archive (or of a channel we're not in) has no messages*/
+static void send_range (int peersock, uint32_t chid, uint32_t first,
+	uint32_t count) {
+	struct channel *ch = channel_find(channels, chid);
+	struct archive_snapshot *snap = NULL;
+	uint32_t lead = 0, begin = 5, end = 5;
+	uint8_t hdr[17];
+
+	if (count > BOOT_MAX_RANGE) {
+		count = BOOT_MAX_RANGE;
 	}
 
-	/*get int representation for public IP and store it, to avoid self-connect*/
-	struct in_addr testing;
-	inet_aton(argv[2], &testing);
-	myaddr = testing.s_addr;
+	/*look up where the lead-in starts and the range ends, under the read lock,
+	  so the snapshot we get has them both*/
+	if (ch != NULL) {
+		archive_rdlock(ch);
+		struct archive *arch = ch->arch;
+		if (first < arch->size) {
+			if (count > arch->size - first) {
+				count = arch->size - first;
+			}
+			lead = first < BOOT_LEAD ? first : BOOT_LEAD;
+			begin = arch->index[first - lead];
+			end = first + count < arch->size ? arch->index[first + count] : arch->len;
+			snap = acquire_snapshot(arch);
+		}
+		archive_unlock(ch);
+	}
+
+	if (snap == NULL || end > snap->len) {
+		lead = count = 0;
+		begin = end = 5;
+	}
+
+	hdr[0] = MSG_RANGE;
+	put_be32(hdr+1, chid);
+	put_be32(hdr+5, first);
+	put_be32(hdr+9, lead);
+	put_be32(hdr+13, count);
+
+	/*header and records go out under the peer's send lock, in one piece*/
+	pthread_mutex_lock(send_lock(peersock));
+	int rv = write_range(peersock, hdr, snap, begin, end);
+	pthread_mutex_unlock(send_lock(peersock));
+	if (rv == 0) {
+		metrics_msg_out(peersock, MSG_RANGE, 17 + end - begin);
+		log_event(LOG_DEBUG, EV_RANGE_SENT, peersock, count, first);
+	}
+
+	if (snap != NULL) {
+		release_snapshot(snap);
+	}
+}
+
+/*Fills in our hashes for the messages that end the given n prefixes of a
+  channel's active archive (zeroes for prefixes longer than it, and for
+  channels we're not in), and returns its size*/
+static uint32_t probe_hashes (uint32_t chid, const uint32_t *probes, int n,
+	uint8_t *hashes) {
+	struct channel *ch = channel_find(channels, chid);
+	uint32_t size = 0;
+	int i;
+
+	if (n > 0) {
+		memset(hashes, 0, n * 16);
+	}
+	if (ch == NULL) {
+		return 0;
+	}
+
+	archive_rdlock(ch);
+	size = ch->arch->size;
+	for (i = 0; i < n; i++) {
+		if (probes[i] >= 1 && probes[i] <= size) {
+			memcpy(hashes + 16*i, message_hash(ch->arch, probes[i] - 1), 16);
+		}
+	}
+	archive_unlock(ch);
+	return size;
+}
+
+/*Answers a ProbeRequest for the hashes of the messages that end n prefixes of
+  a channel's archive with a Probe: the channel's id, n, and every prefix's
+  length followed by its hash*/
+static void send_probe (int peersock, uint32_t chid, int n,
+	const uint32_t *probes) {
+	uint8_t buf[6 + 255*20], hashes[255*16];
+	int i;
+
+	probe_hashes(chid, probes, n, hashes);
+	buf[0] = MSG_PROBE;
+	put_be32(buf+1, chid);
+	buf[5] = n;
+	for (i = 0; i < n; i++) {
+		put_be32(buf + 6 + 20*i, probes[i]);
+		memcpy(buf + 10 + 20*i, hashes + 16*i, 16);
+	}
+	if (send_message(peersock, buf, 6 + 20*n)) {
+		metrics_msg_out(peersock, MSG_PROBE, 6 + 20*n);
+	}
+}
+
+/*Processes the Range a fork-point search asked for: the messages past the last
+  one our archives share (first of them), with the lead-in before them, which
+  must be our own last messages before first. Our first messages and the ones
+  it sent make up an archive that's offered like an ArchiveResponse would be,
+  but only the messages it sent need validating*/
+static void process_suffix (int peersock, uint32_t chid, uint32_t first,
+	uint32_t lead, uint32_t count, uint8_t *recs, uint32_t len) {
+	struct channel *ch = channel_find(channels, chid);
+	struct archive *new_archive = NULL;
+	uint32_t leadlen = 0, i;
+
+	for (i = 0; i < lead; i++) {
+		leadlen += recs[leadlen] + 33;
+	}
+
+	if (ch != NULL) {
+		archive_rdlock(ch);
+		struct archive *arch = ch->arch;
+		if (first <= arch->size && lead == (first < BOOT_LEAD ? first : BOOT_LEAD)) {
+			/*an empty archive has no index, and its lead-in starts right after
+			  the header*/
+			uint32_t begin = first - lead == 0 ? 5 : arch->index[first - lead];
+			uint32_t end = first < arch->size ? arch->index[first] : arch->len;
+			if (end - begin == leadlen &&
+				memcmp(arch->str + begin, recs, leadlen) == 0) {
+				new_archive = init_archive();
+				new_archive->str = realloc(new_archive->str, end + len - leadlen);
+				memcpy(new_archive->str, arch->str, end);
+				memcpy(new_archive->str + end, recs + leadlen, len - leadlen);
+				new_archive->len = end + len - leadlen;
+				new_archive->size = first + count;
+				put_be32(new_archive->str + 1, new_archive->size);
+			}
+		}
+		archive_unlock(ch);
+	}
+	free(recs);
+
+	if (new_archive == NULL) {
+		log_event(LOG_INFO, EV_SEEK_MISMATCH, peersock, first, 0);
+		return;
+	}
+	log_event(LOG_INFO, EV_ARCHRESP_RECEIVED, peersock, new_archive->size,
+		new_archive->len);
+	offer_candidate(peersock, ch, new_archive, first);
+}
+
+/*a Range for the bootstrap, waiting to be validated in the compute pool.
+  Brief description:
+  sock          ->  socket of the peer who sent it
+  chid          ->  the channel it's for
+  first, lead   ->  number of its first message, and of messages before it
+  count         ->  messages in it
+  recs, len     ->  its records, lead-in first, and how many bytes they take*/
+struct range_task {
+	int sock;
+	uint32_t chid, first, lead, count;
+	uint8_t *recs;
+	uint32_t len;
+};
+
+/*Compute pool task for a bootstrap Range: the bootstrap validates it (see
+  boot_range) and files it away, on a worker rather than on the receiver
+  thread, which gets back to reading. The peer pays for the CPU time*/
+static void validate_range (void *arg) {
+	struct range_task *t = (struct range_task*) arg;
+	struct timespec cpu_start, cpu_end;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+	boot_range(t->sock, t->chid, t->first, t->lead, t->count, t->recs, t->len);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+	admit_validation_done(t->sock, (cpu_end.tv_sec - cpu_start.tv_sec) *
+		1000000000ULL + cpu_end.tv_nsec - cpu_start.tv_nsec);
+	free(t);
+}
+
+/*Processes a Range received on the given socket: its records are read one by
+  one, like an ArchiveResponse's. If it's the one a fork-point search asked
+  for, it goes after our own messages, otherwise it's handed to the compute
+  pool, to be validated by the bootstrap (see validate_range). The node is of
+  little use until it's done bootstrapping, so ranges get the highest
+  priority*/
+static void process_range (int peersock) {
+	uint8_t buf[16];
+	uint32_t len = 0, i;
+
+	if (recv_bytes(peersock, buf, 16) != 16) {
+		return;
+	}
+	uint32_t chid = get_be32(buf), first = get_be32(buf+4);
+	uint32_t lead = get_be32(buf+8), count = get_be32(buf+12);
+
+	/*nobody sends that much in a Range, and we're not reading it*/
+	if (lead > BOOT_LEAD || count > BOOT_MAX_RANGE) {
+		transport->hangup(peersock);
+		return;
+	}
+	if (admit_claim(peersock, (uint64_t) (lead + count) * 33) == -1) {
+		return;
+	}
+
+	/*every record is at most 289 bytes long*/
+	uint8_t *recs = malloc((lead + count) * 289 + 1), *aux = recs;
+	for (i = 0; i < lead + count; i++) {
+		if (recv_bytes(peersock, aux, 1) != 1 ||
+			(*aux && recv_bytes(peersock, aux+1, *aux) != *aux) ||
+			recv_bytes(peersock, aux+1 + *aux, 32) != 32) {
+			free(recs);
+			return;
+		}
+		len += *aux + 33;
+		aux += *aux + 33;
+	}
+	recs = realloc(recs, len + 1);
+
+	if (seek_range(peersock, chid, first)) {
+		process_suffix(peersock, chid, first, lead, count, recs, len);
+		return;
+	}
+
+	/*a peer out of CPU budget doesn't get this one validated, it's fetched from
+	  someone else*/
+	if (admit_validation(peersock) != ADMIT_OK) {
+		free(recs);
+		boot_range(peersock, chid, first, lead, count, NULL, 0);
+		return;
+	}
+
+	struct range_task *t = (struct range_task*) malloc(sizeof(struct range_task));
+	t->sock = peersock;
+	t->chid = chid;
+	t->first = first;
+	t->lead = lead;
+	t->count = count;
+	t->recs = recs;
+	t->len = len;
+	pool_submit(NULL, POOL_HIGH, validate_range, t);
+}
+
+/*Processes a message of the given type (whose type byte was already read) from
+  the peer on the given socket, reading the rest of it and answering it if
+  need be*/
+void handle_message (int peersock, uint8_t type) {
+	/*process each message type accordingly, counting every byte it takes*/
+	recv_total = 1;
+	switch(type) {
+		case MSG_PEERREQ: {
+			log_event(LOG_DEBUG, EV_PEERREQ_RECV, peersock, peerlist->size, 0);
+			send_peerlist(peersock, 0);
+			break;
+		}
+
+		case MSG_PEERLIST: {
+			process_peerlist(peersock, 0);
+			break;
+		}
+
+		/*a peer asking for the extended list obviously speaks it too*/
+		case MSG_PEERREQ_EX: {
+			log_event(LOG_DEBUG, EV_PEERREQ_RECV, peersock, peerlist->size, 1);
+			peerlist_lock();
+			set_peer_ext(peerlist, peersock);
+			peerlist_unlock();
+			send_peerlist(peersock, 1);
+			break;
+		}
+
+		case MSG_PEERLIST_EX: {
+			process_peerlist(peersock, 1);
+			break;
+		}
+
+		case MSG_ARCHREQ: {
+			log_event(LOG_DEBUG, EV_ARCHREQ_RECV, peersock, 0, 0);
+			send_channel(peersock, channels->list[0]);
+			break;
+		}
+
+		case MSG_ARCHRESP: {
+			process_archive(peersock, channels->list[0]);
+			break;
+		}
+
+		/*a peer asking for a channel's archive wants it whenever it changes too,
+		  unless we're not in that channel*/
+		case MSG_ARCHREQ_CH: {
+			uint8_t buf[4];
+			if (recv_bytes(peersock, buf, 4) != 4) {
+				break;
+			}
+			uint32_t id = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+			struct channel *ch = channel_find(channels, id);
+
+			log_event(LOG_DEBUG, EV_ARCHREQ_RECV, peersock, id, 0);
+			if (ch == NULL) {
+				break;
+			}
+			channel_add_peer(ch, peersock);
+			send_channel(peersock, ch);
+			break;
+		}
+
+		/*an archive of a channel we're not in is read and dropped*/
+		case MSG_ARCHRESP_CH: {
+			uint8_t buf[4];
+			if (recv_bytes(peersock, buf, 4) != 4) {
+				break;
+			}
+			uint32_t id = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+			process_archive(peersock, channel_find(channels, id));
+			break;
+		}
+
+		/*a peer asking who we are speaks the handshake too*/
+		case MSG_HELLOREQ: {
+			send_hello(peersock);
+			break;
+		}
+
+		case MSG_HELLO: {
+			process_hello(peersock);
+			break;
+		}
+
+		case MSG_TIPREQ: {
+			uint8_t buf[4];
+			if (recv_bytes(peersock, buf, 4) != 4) {
+				break;
+			}
+			send_tip(peersock, get_be32(buf));
+			break;
+		}
+
+		/*a tip the bootstrap doesn't care for may start a fork-point search*/
+		case MSG_TIP: {
+			uint8_t buf[24];
+			if (recv_bytes(peersock, buf, 24) != 24) {
+				break;
+			}
+			if (!boot_tip(peersock, get_be32(buf), get_be32(buf+4), buf+8)) {
+				seek_tip(peersock, get_be32(buf), get_be32(buf+4));
+			}
+			break;
+		}
+
+		case MSG_RANGEREQ: {
+			uint8_t buf[12];
+			if (recv_bytes(peersock, buf, 12) != 12) {
+				break;
+			}
+			send_range(peersock, get_be32(buf), get_be32(buf+4), get_be32(buf+8));
+			break;
+		}
+
+		case MSG_RANGE: {
+			process_range(peersock);
+			break;
+		}
+
+		case MSG_PROBEREQ: {
+			uint8_t buf[5], raw[255*4];
+			uint32_t probes[255];
+			int i;
+			if (recv_bytes(peersock, buf, 5) != 5 || (buf[4] &&
+				recv_bytes(peersock, raw, buf[4] * 4) != buf[4] * 4)) {
+				break;
+			}
+			for (i = 0; i < buf[4]; i++) {
+				probes[i] = get_be32(raw + 4*i);
+			}
+			send_probe(peersock, get_be32(buf), buf[4], probes);
+			break;
+		}
+
+		case MSG_PROBE: {
+			uint8_t buf[5], raw[255*20], hashes[255*16];
+			uint32_t probes[255];
+			int i;
+			if (recv_bytes(peersock, buf, 5) != 5 || (buf[4] &&
+				recv_bytes(peersock, raw, buf[4] * 20) != buf[4] * 20)) {
+				break;
+			}
+			for (i = 0; i < buf[4]; i++) {
+				probes[i] = get_be32(raw + 20*i);
+				memcpy(hashes + 16*i, raw + 20*i + 4, 16);
+			}
+			seek_probe(peersock, get_be32(buf), buf[4], probes, hashes);
+			break;
+		}
+
+		default: {
+			log_event(LOG_WARN, EV_UNKNOWN_MSG, peersock, type, 0);
+			break;
+		}
+	}
+	metrics_msg_in(peersock, type, recv_total);
+}
+
+/*Timer callbacks for a connected peer's periodic requests, which every
+  connected peer gets (the first PeerRequest right away, see schedule_peer). We
+  send a PeerRequestExt every time, and keep sending original PeerRequests only
+  until the peer answers one of those, since peers that only speak the original
+  protocol just ignore it.
+  As a bonus, since the specification did not mention when we should send
+  ArchiveRequests, we'll send them periodically as well, on a longer interval.
+  If a send fails the connection is broken, so we hang up on the peer and its
+  receiver thread cleans up. If the peer's send buffer is full (it stopped
+  reading), the requests are skipped until they're due again, rather than
+  holding up every other peer's timers*/
+static void requests_due (void *arg) {
+	struct peer_sched *sched = (struct peer_sched*) arg;
+
+	if (send_requests(sched->sock, 1, 0) == -1) {
+		transport->hangup(sched->sock);
+		return;
+	}
+	timer_add(&sched->requests, timer_jitter(timing.peerreq, timing.jitter));
+}
+
+static void archive_due (void *arg) {
+	struct peer_sched *sched = (struct peer_sched*) arg;
+
+	if (send_requests(sched->sock, 0, 1) == -1) {
+		transport->hangup(sched->sock);
+		return;
+	}
+	timer_add(&sched->archive, timer_jitter(timing.archreq, timing.jitter));
+}
+
+/*Timer callback that checks whether a peer went quiet: if we haven't heard
+  from it in timing.idle, we assume the connection was interrupted and hang up
+  on it, otherwise we check again once it would have been quiet for that long*/
+static void idle_due (void *arg) {
+	struct peer_sched *sched = (struct peer_sched*) arg;
+	uint64_t last = __atomic_load_n(&sched->last_recv, __ATOMIC_RELAXED);
+	uint64_t quiet = (metrics_now() - last) / 1000000;
+
+	if (quiet >= timing.idle) {
+		metrics_add(M_IDLE_TIMEOUTS, 1);
+		log_event(LOG_INFO, EV_PEER_IDLE, sched->sock, quiet, 0);
+		transport->hangup(sched->sock);
+		return;
+	}
+	timer_add(&sched->idle, timing.idle - quiet);
+}
+
+/*Puts a newly connected peer's periodic requests and idle checks on the timer
+  wheel: PeerRequests go out right away, ArchiveRequests after a whole
+  (jittered) interval*/
+static struct peer_sched *schedule_peer (int peersock) {
+	struct peer_sched *sched = malloc(sizeof(struct peer_sched));
+
+	sched->sock = peersock;
+	sched->last_recv = metrics_now();
+	timer_init(&sched->requests, requests_due, sched);
+	timer_init(&sched->archive, archive_due, sched);
+	timer_init(&sched->idle, idle_due, sched);
+	timer_add(&sched->requests, 0);
+	timer_add(&sched->archive, timer_jitter(timing.archreq, timing.jitter));
+	timer_add(&sched->idle, timing.idle);
+	return sched;
+}
+
+/*Takes a peer's timers off the wheel (waiting for any that's firing), before
+  its socket is closed and its number can be reused*/
+static void unschedule_peer (struct peer_sched *sched) {
+	timer_cancel(&sched->requests);
+	timer_cancel(&sched->archive);
+	timer_cancel(&sched->idle);
+	free(sched);
+}
+
+/*how long to wait before a redial attempt, after the given failed ones*/
+static uint64_t redial_backoff (int attempt) {
+	uint64_t ms = timing.redial;
+
+	while (attempt-- > 0 && ms < timing.redial_max) {
+		ms *= 2;
+	}
+	return timer_jitter(ms < timing.redial_max ? ms : timing.redial_max,
+		timing.jitter);
+}
+
+/*Tries to connect to a peer we lost again, unless we're connected to it
+  already (it may have connected to us in the meantime). Runs in a thread of
+  its own, so the connect's timeout doesn't hold up the timer wheel, and puts
+  the next attempt back on the wheel if this one failed*/
+static void *redial_thread (void *arg) {
+	struct redial *redial = (struct redial*) arg;
+	struct in_addr addr;
+	int numeric = inet_aton(redial->host, &addr), sock = -1, connected = 0;
+
+	metrics_add(M_REDIALS, 1);
+	log_event(LOG_INFO, EV_REDIAL, -1, numeric ? addr.s_addr : 0, redial->port);
+
+	/*hold the list while connecting, like process_peerlist, to avoid doubles*/
+	peerlist_lock();
+	connected = numeric && is_connected(peerlist, addr.s_addr, redial->port);
+	if (!connected) {
+		sock = transport->connect(redial->host, redial->port);
+		if (sock != -1) {
+			transport->start(sock, redial->port);
+		}
+	}
+	peerlist_unlock();
+
+	if (connected || sock != -1) {
+		fprintf(stdout, "Reconnected to peer %s:%u\n", redial->host, redial->port);
+		free(redial);
+		return NULL;
+	}
+
+	redial->attempt++;
+	if (redial->tries > 0 && redial->attempt >= redial->tries) {
+		fprintf(stderr, "Giving up on peer %s:%u!\n", redial->host, redial->port);
+		free(redial);
+		return NULL;
+	}
+	timer_add(&redial->timer, redial_backoff(redial->attempt));
+	return NULL;
+}
+
+/*timer callback for a redial attempt*/
+static void redial_due (void *arg) {
+	struct redial *redial = (struct redial*) arg;
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, redial_thread, redial) != 0) {
+		timer_add(&redial->timer, redial_backoff(redial->attempt));
+		return;
+	}
+	pthread_detach(thread);
+}
+
+/*Starts trying to connect to the peer on host:port again, backing off after
+  every failed attempt and giving up after tries of them (0 for never)*/
+static void schedule_redial (const char *host, uint16_t port, int tries) {
+	struct redial *redial = malloc(sizeof(struct redial));
+
+	strncpy(redial->host, host, sizeof(redial->host) - 1);
+	redial->host[sizeof(redial->host) - 1] = 0;
+	redial->port = port;
+	redial->attempt = 0;
+	redial->tries = tries;
+	timer_init(&redial->timer, redial_due, redial);
+	timer_add(&redial->timer, redial_backoff(0));
+}
+
+/*Cleans up after a peer whose receiver thread is done with it: its timers go,
+  it's disconnected, and if we opened the connection and lost it, rather than
+  dropping it ourselves (for flooding us, if kicked is set, or for being a
+  duplicate connection, or a connection to ourselves), we redial it*/
+static void peer_gone (int peersock, struct peer_sched *sched, int kicked) {
+	struct node peer;
+	int redial = 0;
+
+	unschedule_peer(sched);
+
+	peerlist_lock();
+	if (!kicked && get_peer(peerlist, peersock, &peer) && peer.outgoing &&
+		peer.id != node_id &&
+		(peer.id == 0 || peer_with_id(peerlist, peer.id, peersock) == -1)) {
+		redial = 1;
+	}
+	peerlist_unlock();
+
+	peer_disconnected(peersock);
+
+	if (redial) {
+		char ip[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &peer.ip, ip, sizeof(ip));
+		schedule_redial(ip, peer.port, REDIAL_TRIES);
+	}
+}
+
+/*Implements the work done by threads launched for each peer that receive and
+  process data sent by the connected peer. It takes the socket associated to the
+  peer as input, and recv()s on the socket, waiting for messages to arrive, and
+  processes each type of message accordingly.
+	The peer's periodic requests and idle checks are on the timer wheel. If the
+	peer goes quiet for too long, the idle check hangs up on it, so a recv()
+	fails, and we close the socket, disconnect from the peer and remove them
+	from the list of connected peers.*/
+void *peer_receiver_thread (void *args) {
+	int peersock = ((struct peer_args*) args)->sock;
+	uint16_t peerport = ((struct peer_args*) args)->port;
+	int outgoing = ((struct peer_args*) args)->outgoing;
+	int kicked = 0;
+	free(args);
+
+	/*add peer to list of connected peers, and start its timers*/
+	struct in_addr peeraddr;
+	peeraddr.s_addr = transport->peer_ip(peersock);
+	peer_connected(peersock, peerport, outgoing);
+	struct peer_sched *sched = schedule_peer(peersock);
+	my_sched = sched;
+	if (use_uring) {
+		my_stream = uring_watch(peersock);
+	}
+
+	/*a peer that stops reading only holds up a send for so long*/
+	struct timeval tout;
+	tout.tv_sec = SEND_TIMEOUT;
+	tout.tv_usec = 0;
+	setsockopt(peersock,SOL_SOCKET,SO_SNDTIMEO,(char*)&tout,sizeof(tout));
+
+	/*loop waiting for messages*/
+	while (1) {
+		/*get first byte to determine message type*/
+		uint8_t type;
+		if(transport->recv(peersock, &type, 1) <= 0) {
+			/*connection was closed or we hung up on it*/
+			fprintf(stderr, "Timed out when waiting for peer %s.\n",
+				inet_ntoa(peeraddr));
+			fprintf(stderr, "Peer likely disconnected. Closing connection...\n");
+			break;
+		}
+		__atomic_store_n(&sched->last_recv, metrics_now(), __ATOMIC_RELAXED);
+
+		/*peers only get so many messages of each type, and so many bytes, and
+		  we stop reading from them until they're back within their budgets*/
+		if ((kicked = admit_message(peersock, type) == -1)) {
+			break;
+		}
+
+		/*if we're capturing traffic, the whole message becomes a frame*/
+		if (trace_enabled) {
+			trace_begin();
+		}
+		handle_message(peersock, type);
+		if (trace_enabled) {
+			trace_end(peersock, peeraddr.s_addr, type);
+		}
+
+		if ((kicked = admit_bytes(peersock, recv_total) == -1)) {
+			break;
+		}
+	}
+
+	/*the peer went way over its budgets, so we're done with it*/
+	if (kicked) {
+		fprintf(stderr, "Peer %s is flooding us, closing connection...\n",
+			inet_ntoa(peeraddr));
+	}
+	my_sched = NULL;
+	if (my_stream != NULL) {
+		uring_unwatch(my_stream);
+		my_stream = NULL;
+	}
+	peer_gone(peersock, sched, kicked);
+	return NULL;
+}
+
+/*This function implements all the work that must be done by the thread that
+  treats incoming peer connections. It initializes a passive socket, binds to
+  it, then listens and waits for incoming connections, accept()ing them and
+  launching threads to exchange data with each peer.
+  The thread that runs this function will be called once at the beginning of
+  program execution, and run indefinitely.*/
+void *incoming_peers_thread () {
+	int mysock, peersock;
+	struct sockaddr_storage peeraddr;
+	socklen_t peersize;
+
+	/*initialize the listen socket*/
+	mysock = init_incoming_socket();
+
+	/*attempt to listen on the created socket*/
+	if (listen(mysock, 10) == -1) {
+		fprintf(stderr, "Failed to listen on incoming peer socket!\n");
+		pthread_exit(NULL);
+	}
+
+	fprintf(stdout, "[Incoming peers thread is awaiting connections]\n");
+
+	/*with io_uring, a single multishot accept hands us every new connection*/
+	if (use_uring) {
+		uring_accept_loop(mysock, launch_incoming_peer);
+		pthread_exit(NULL);
+	}
+
+	/*while (hopefully) forever, accept incoming connections from peers*/
+	char pigs_can_fly = 0;
+	while (!pigs_can_fly) {
+		peersize = sizeof(peeraddr);
+		if ((peersock = accept(mysock, (struct sockaddr*) &peeraddr, &peersize))
+			== -1) {
+			fprintf(stderr, "Error, could not accept connection from peer!\n");
+			continue;
+		}
+
+		/*launch request and receiver threads for incoming peer*/
+		fprintf(stdout, "Accepted incoming peer connection!\n");
+		launch_incoming_peer(peersock);
+	}
+
+	pthread_exit(NULL);
+}
+
+/*How the bootstrap (see boot.h) and fork-point searches (see seek.h) talk to
+  us: they send TipRequests, RangeRequests, ProbeRequests and ArchiveRequests,
+  and look at the active archive. The bootstrap hands us the archive it put
+  together, which replaces the active one if it's still larger, like a
+  validated ArchiveResponse would. The requests go out with try_send, since
+  the bootstrap sends them from the timer wheel's thread (and so does
+  send_requests, for TipRequests): one that doesn't fit in a peer's send buffer
+  is just skipped, and times out like a request that got lost would*/
+static int send_tipreq (int sock, uint32_t chid) {
+	uint8_t req[5];
+	int rv;
+
+	req[0] = MSG_TIPREQ;
+	put_be32(req+1, chid);
+	if ((rv = try_send(sock, req, 5)) != 0) {
+		return rv;
+	}
+	metrics_msg_out(sock, MSG_TIPREQ, 5);
+	return 0;
+}
+
+static int send_rangereq (int sock, uint32_t chid, uint32_t first,
+	uint32_t count) {
+	uint8_t req[13];
+
+	req[0] = MSG_RANGEREQ;
+	put_be32(req+1, chid);
+	put_be32(req+5, first);
+	put_be32(req+9, count);
+	if (try_send(sock, req, 13) != 0) {
+		return -1;
+	}
+	metrics_msg_out(sock, MSG_RANGEREQ, 13);
+	return 0;
+}
+
+static int send_probereq (int sock, uint32_t chid, const uint32_t *probes,
+	int n) {
+	uint8_t req[6 + SEEK_PROBES*4];
+	int i;
+
+	req[0] = MSG_PROBEREQ;
+	put_be32(req+1, chid);
+	req[5] = n;
+	for (i = 0; i < n; i++) {
+		put_be32(req + 6 + 4*i, probes[i]);
+	}
+	if (try_send(sock, req, 6 + 4*n) != 0) {
+		return -1;
+	}
+	metrics_msg_out(sock, MSG_PROBEREQ, 6 + 4*n);
+	return 0;
+}
+
+static int send_archreq (int sock, uint32_t chid) {
+	uint8_t req[5];
+	int len = 1;
+
+	req[0] = MSG_ARCHREQ;
+	if (chid != CHANNEL_DEFAULT_ID) {
+		req[0] = MSG_ARCHREQ_CH;
+		put_be32(req+1, chid);
+		len = 5;
+	}
+	if (try_send(sock, req, len) != 0) {
+		return -1;
+	}
+	metrics_msg_out(sock, req[0], len);
+	return 0;
+}
+
+static uint32_t boot_size (uint32_t chid) {
+	struct channel *ch = channel_find(channels, chid);
+	uint32_t size = 0;
+
+	if (ch != NULL) {
+		archive_rdlock(ch);
+		size = ch->arch->size;
+		archive_unlock(ch);
+	}
+	return size;
+}
+
+static void boot_done (uint32_t chid, struct archive *arch, int sock) {
+	struct channel *ch = channel_find(channels, chid);
+
+	if (ch != NULL) {
+		archive_wrlock(ch);
+		if (arch->size > ch->arch->size) {
+			uint64_t id;
+			int bad;
+			api_notify(ch, common_messages(ch->arch, arch));
+			free_archive(ch->arch);
+			ch->arch = arch;
+			sync_snapshot(ch->arch);
+			if (ch->forks != NULL) {
+				fork_offer(ch->forks, ch->arch, 1, &id, &bad);
+			}
+			metrics_add(M_ARCH_REPLACED, 1);
+			archive_gauges(ch);
+			log_event(LOG_INFO, EV_ARCHRESP_REPLACED, sock, ch->arch->size, 0);
+			fprintf(stdout, "---------- Active archive replaced! ----------\n");
+			archive_unlock(ch);
+			return;
+		}
+		archive_unlock(ch);
+	}
+	free_archive(arch);
+}
+
+const struct boot_ops node_boot_ops = {send_tipreq, send_rangereq,
+	boot_size, boot_done};
+
+const struct seek_ops node_seek_ops = {send_tipreq, send_probereq,
+	send_rangereq, send_archreq, probe_hashes};
+
+/*main is left out when building the node's code into other programs (like the
+  benchmarks), which provide their own*/
+#ifndef NO_MAIN
+
+/*one share of the codes to try when mining a message, for a compute pool task*/
+struct mine_share {
+	struct mining *m;
+	uint64_t first, step;
+};
+
+static void mine_task (void *arg) {
+	struct mine_share *share = (struct mine_share*) arg;
+	mine_range(share->m, share->first, share->step);
+}
+
+/*Mines a message the user (or an API client) typed and adds it to the
+  channel's active archive. The codes to try are split between every worker of
+  the compute pool, at the highest priority, and no lock is held while they're
+  at it. If the active archive got replaced in the meantime, we start over on
+  top of the new one. Messages for different channels are mined side by side.
+  Returns the message's number in the archive once it's in (and published), 0
+  if it's invalid*/
+static int commit_message (struct channel *ch, uint8_t *msg) {
+	int nshares = pool_size() > 0 ? pool_size() : 1, i;
+	struct mine_share shares[nshares];
+	struct pool_group group;
+
+	SPAN_BEGIN(span_start);
+	pool_group_init(&group);
+	pthread_mutex_lock(&ch->commit_mutex);
+	while (1) {
+		archive_rdlock(ch);
+		struct archive *base = ch->arch;
+		struct mining *m = start_mining(ch->arch, msg);
+		archive_unlock(ch);
+
+		if (m == NULL) {
+			pthread_mutex_unlock(&ch->commit_mutex);
+			SPAN_END(span_start, SP_COMMIT, 0);
+			return 0;
+		}
+
+		uint64_t start = metrics_now();
+		for (i = 0; i < nshares; i++) {
+			shares[i].m = m;
+			shares[i].first = i;
+			shares[i].step = nshares;
+			pool_submit(&group, POOL_HIGH, mine_task, &shares[i]);
+		}
+		pool_wait(&group);
+		metrics_add(M_MINED, 1);
+		metrics_observe(H_MINE, metrics_now() - start);
+		SPAN_RECORD(SP_MINE, start, metrics_now(), strlen((char*) msg));
+
+		/*we'll write to the archive, so writelock it*/
+		archive_wrlock(ch);
+		if (ch->arch == base && finish_mining(ch->arch, m)) {
+			/*added message to archive, unlock and publish it. We know it's valid,
+			  so tell the fork store too, and API subscribers get the new message*/
+			sync_snapshot(ch->arch);
+			uint64_t id;
+			int bad, position = ch->arch->size;
+			fork_offer(ch->forks, ch->arch, 1, &id, &bad);
+			api_notify(ch, position - 1);
+			archive_gauges(ch);
+			fprintf(stdout, "Message successfully added to archive!\n");
+
+			/*sending may take a while with a slow peer, so it's done from a
+			  snapshot, once everyone else can get at the archive again*/
+			struct archive_snapshot *snap = acquire_snapshot(ch->arch);
+			archive_unlock(ch);
+			if (snap != NULL) {
+				publish_archive(ch, snap);
+				release_snapshot(snap);
+			}
+			free_mining(m);
+			pthread_mutex_unlock(&ch->commit_mutex);
+			SPAN_END(span_start, SP_COMMIT, position);
+			return position;
+		}
+		archive_unlock(ch);
+		free_mining(m);
+		fprintf(stdout, "Active archive changed while mining, mining again!\n");
+	}
+}
+
+/*Beginning of program execution*/
+int main(int argc, char *argv[]) {
+	/*parse option flags first, positional arguments come after them*/
+	int opt, loglevel = LOG_INFO, metricsport = 0, workers = 0;
+	char *logpath = "blockchain.blog", *tracepath = NULL, *apipath = NULL;
+	char *joins[MAX_CHANNELS];
+	int njoins = 0, i;
+	while ((opt = getopt(argc, argv, "ubp:l:L:m:R:P:C:c:t:j:")) != -1) {
+		switch (opt) {
+			case 'u': {
+				use_uring = 1;
+				break;
+			}
+
+			case 'b': {
+				bind_local = 1;
+				break;
+			}
+
+			case 'p': {
+				myport = atoi(optarg);
+				break;
+			}
+
+			case 'l': {
+				loglevel = atoi(optarg);
+				break;
+			}
+
+			case 'L': {
+				logpath = optarg;
+				break;
+			}
+
+			case 'm': {
+				metricsport = atoi(optarg);
+				break;
+			}
+
+			case 'R': {
+				tracepath = optarg;
+				break;
+			}
+
+			case 'P': {
+				workers = atoi(optarg);
+				break;
+			}
+
+			case 'C': {
+				apipath = optarg;
+				break;
+			}
+
+			case 'c': {
+				if (njoins < MAX_CHANNELS - 1) {
+					joins[njoins++] = optarg;
+				}
+				break;
+			}
+
+			/*intervals in seconds, peerreq[,archreq[,idle]], any left out stay
+			  as they are*/
+			case 't': {
+				uint64_t *intervals[3] = {&timing.peerreq, &timing.archreq,
+					&timing.idle};
+				char *next = optarg;
+				for (i = 0; i < 3 && *next; i++) {
+					double secs = strtod(next, &next);
+					if (secs > 0) {
+						*intervals[i] = (uint64_t) (secs * 1000);
+					}
+					if (*next == ',') {
+						next++;
+					}
+				}
+				break;
+			}
+
+			case 'j': {
+				timing.jitter = atoi(optarg);
+				if (timing.jitter < 0 || timing.jitter > 100) {
+					timing.jitter = timing.jitter < 0 ? 0 : 100;
+				}
+				break;
+			}
+
+			default: {
+				fprintf(stderr, "Usage: ./blockchain [-u] [-b] [-p port] [-l level] "
+					"[-L logfile] [-m port] [-R tracefile] [-P workers] [-C socket] "
+					"[-c channel]... [-t peerreq,archreq,idle] [-j jitter] "
+					"<ip/hostname[:port]> <public IP>\n");
+				return 0;
+			}
+		}
+	}
+
+	/*insufficient arguments, we need an initial peer to connect to and the
+	 public IP address for the local device*/
+	if (argc - optind != 2) {
+		fprintf(stderr, "Usage: ./blockchain [-u] [-b] [-p port] [-l level] "
+			"[-L logfile] [-m port] [-R tracefile] [-P workers] [-C socket] "
+			"[-c channel]... [-t peerreq,archreq,idle] [-j jitter] "
+			"<ip/hostname[:port]> <public IP>\n");
+		return 0;
+	}
+
+	/*a peer that goes away while we're answering it (say, one we were making
+	  wait for its budgets) is dealt with by its receiver thread, it doesn't
+	  get to kill us with a SIGPIPE*/
+	signal(SIGPIPE, SIG_IGN);
+
+	/*start the logger before anything else, it has to be there for every thread,
+	 and make sure it gets flushed however we end up exiting*/
+	if (log_init(logpath, loglevel) == -1) {
+		fprintf(stderr, "Could not open log file %s, logging disabled!\n", logpath);
+	}
+	atexit(log_shutdown);
+
+	/*record every message peers send us, if asked to*/
+	if (tracepath != NULL) {
+		if (trace_open(tracepath) == -1) {
+			fprintf(stderr, "Could not create trace file %s!\n", tracepath);
+		}
+		else {
+			atexit(trace_close);
+		}
+	}
+
+	/*serve metrics on localhost, if asked to*/
+	if (metricsport && metrics_serve(metricsport) == -1) {
+		fprintf(stderr, "Could not serve metrics on port %d!\n", metricsport);
+	}
+
+	/*start the compute pool for mining and validation, one worker per core
+	  unless told otherwise*/
+	if (pool_init(workers) == -1) {
+		fprintf(stderr, "Could not start compute pool, hashing on the spot!\n");
+	}
+
+	/*and hold peers to their budgets, letting them have at most half the
+	  workers validating their archives at once*/
+	admit_init(pool_size() / 2);
+
+	/*fall back to the blocking calls if the kernel can't do io_uring*/
+	if (use_uring && (!uring_supported() || uring_loop_start() == -1)) {
+		fprintf(stderr, "io_uring not supported by kernel, falling back!\n");
+		use_uring = 0;
+	}
+
+	/*pick a random node id, so peers can tell us apart from whoever else is on
+	  our IP (or behind our port)*/
+	FILE *urandom = fopen("/dev/urandom", "r");
+	if (urandom == NULL || fread(&node_id, sizeof(node_id), 1, urandom) != 1) {
+		node_id = ((uint64_t) time(NULL) << 32) ^ getpid();
+	}
+	if (urandom != NULL) {
+		fclose(urandom);
+	}
+	node_id |= node_id == 0;
+
+	/*get int representation for public IP and store it, to avoid self-connect*/
+	struct in_addr testing;
+	inet_aton(argv[optind+1], &testing);
+	myaddr = testing.s_addr;
 
 	/*initialize our peer list structure and its mutex variable*/
 	peerlist = init_list();
+	peerlist->port = myport;
 	pthread_mutex_init(&peerlist_mutex, NULL);
 
-	/*and the active archive, which is initially empty*/
-	active_arch = init_archive();
-	pthread_rwlock_init(&archive_lock, NULL);
+	/*and the channels, with their initially empty archives and fork stores*/
+	channels = channels_init(1);
+	for (i = 0; i < njoins; i++) {
+		if (channel_join(channels, joins[i]) == NULL) {
+			fprintf(stderr, "Could not join channel %s!\n", joins[i]);
+		}
+	}
+
+	/*let local clients submit and follow messages, if asked to*/
+	if (apipath != NULL && api_serve(apipath, commit_message) == -1) {
+		fprintf(stderr, "Could not serve the client API at %s!\n", apipath);
+	}
+
+	/*every peer's periodic requests and idle checks run on the timer wheel*/
+	if (timer_start() == -1) {
+		fprintf(stderr, "Could not start the timer wheel!\n");
+		return 0;
+	}
+
+	/*fetch the default channel's archive from every peer we meet at once,
+	  instead of waiting for whoever answers an ArchiveRequest first*/
+	boot_start(CHANNEL_DEFAULT_ID, &node_boot_ops);
+
+	/*and once we're there, only fetch what we don't have of anyone's archive*/
+	seek_init(&node_seek_ops);
 
 	/*first thing we do is start a thread to accept incoming connections*/
 	pthread_t incoming_thread;
 	pthread_create(&incoming_thread, NULL, incoming_peers_thread, NULL);
 
-	/*now init a socket for the first peer and launch threads to talk to them*/
-	int sock = init_peer_socket(argv[1]);
+	/*now init a socket for the first peer and launch threads to talk to them.
+	  The initial peer may be given as host:port, if it's not on the default*/
+	uint16_t peerport = DEFAULT_PORT;
+	char *colon = strrchr(argv[optind], ':');
+	if (colon != NULL) {
+		*colon = 0;
+		peerport = atoi(colon+1);
+	}
+
+	int sock = init_peer_socket(argv[optind], peerport);
 	if (sock == -1) {
-		fprintf(stderr, "Failed to connect to initial peer!\n");
+		fprintf(stderr, "Failed to connect to initial peer, will keep trying!\n");
+		schedule_redial(argv[optind], peerport, 0);
 	}
 
 	else {
-		pthread_t reqthread, recvthread;
-		pthread_create(&reqthread, NULL, peer_requester_thread, &sock);
-		pthread_create(&recvthread, NULL, peer_receiver_thread, &sock);
+		launch_outgoing_peer(sock, peerport);
 	}
 
-	/*prompt the user for messages to add to archive*/
+	/*prompt the user for messages to add to archive, in the default channel
+	  until they switch to another one*/
+	struct channel *current = channels->list[0];
 	while(1) {
 		uint8_t msg[256];
 
 		memset(msg, 0, 256);
-		fprintf(stdout, "Input a chat message to send (255 chars max):\n");
+		fprintf(stdout, "Input a chat message to send to #%s (255 chars max), or "
+			"/channel <name> to switch channels:\n", current->name);
+		SPAN_BEGIN(span_start);
 		fgets((char*)msg, 256, stdin);
-
-		/*we'll write to the archive, so writelock it*/
-		pthread_rwlock_wrlock(&archive_lock);
+		SPAN_END(span_start, SP_STDIN_READ, strlen((char*) msg));
 
 		if (strcmp((char*) msg, "exit\n") == 0) {
 			exit(0);
 		}
 
+		/*dump every thread's spans (see spans.h) into a file*/
+		if (strncmp((char*) msg, "/spans ", 7) == 0) {
+			msg[strcspn((char*) msg, "\n")] = 0;
+			int n = spans_dump((char*) msg + 7);
+			if (n == -1) {
+				fprintf(stderr, "Could not dump spans to %s (built without "
+					"-DSPANS?)\n", msg + 7);
+				continue;
+			}
+			fprintf(stdout, "Dumped %d spans to %s\n", n, msg + 7);
+			continue;
+		}
+
+		/*switch channels, joining the new one if need be*/
+		if (strncmp((char*) msg, "/channel ", 9) == 0) {
+			msg[strcspn((char*) msg, "\n")] = 0;
+			struct channel *ch = channel_join(channels, (char*) msg + 9);
+			if (ch == NULL) {
+				fprintf(stderr, "Could not join channel %s!\n", msg + 9);
+				continue;
+			}
+			current = ch;
+			archive_rdlock(current);
+			fprintf(stdout, "Now in #%s, active archive:\n", current->name);
+			SPAN_BEGIN(print_start);
+			print_archive(current->arch, stdout);
+			SPAN_END(print_start, SP_PRINT_ARCHIVE, current->arch->size);
+			archive_unlock(current);
+			continue;
+		}
+
 		/*couldn't add message, probably illegal message content*/
-		if (!add_message(active_arch, msg)) {
+		if (!commit_message(current, msg)) {
 			fprintf(stderr, "Invalid message! Try again :)\n");
-			pthread_rwlock_unlock(&archive_lock);
 			continue;
 		}
 
-		/*added message to archive, print new archive, publish and unlock it*/
-		fprintf(stdout, "Message successfully added to archive!\n");
+		/*print the new archive*/
+		archive_rdlock(current);
 		fprintf(stdout, "New active archive:\n");
-		print_archive(active_arch, stdout);
-
-		publish_archive();
-		pthread_rwlock_unlock(&archive_lock);
+		SPAN_BEGIN(print_start);
+		print_archive(current->arch, stdout);
+		SPAN_END(print_start, SP_PRINT_ARCHIVE, current->arch->size);
+		archive_unlock(current);
 	}
 }
+
+#endif
@@ -6,19 +6,42 @@
 #include <string.h>				//memsets and general string manipulation shenanigans
 #include <sys/types.h>		//timers, mutexes and other useful stuff
 #include <fcntl.h>				//file descriptor manipulation (sockopts, etc)
+#include <errno.h>				//telling a full send buffer from a broken socket
 
 /*network headers*/
 #include <netdb.h>				//addrinfos and other networking automagic
 #include <sys/socket.h>		//SOCKETS WE LOVE SOCKETS WHO DOESN'T LOVE SUM SOCKETS
 #include <arpa/inet.h>		//inet ntoas, atons and others
+#include <sys/sendfile.h>	//zero-copy archive sends
 
 /*multi-threading headers*/
 #include <pthread.h>			//Threads and stuff
+#include <signal.h>				//ignoring SIGPIPEs
+#include <time.h>					//node ids, when there's no /dev/urandom
 
-/*Initializes a TCP socket for a given peer's IP in port 51511, establishes the
+/*defined in archive.h, channel.h, boot.h and seek.h*/
+struct archive_snapshot;
+struct channel;
+struct boot_ops;
+struct seek_ops;
+
+/*how the bootstrap and fork-point searches talk to the node, for boot_start
+  and seek_init*/
+extern const struct boot_ops node_boot_ops;
+extern const struct seek_ops node_seek_ops;
+
+/*Take and release a channel's archive lock (ch->lock), recording how long we
+  waited for it (H_ARCHLOCK_WAIT, and an archive_lock_wait span) and how long
+  we held it (H_ARCHLOCK_HOLD). Everyone outside of the archive code itself
+  should lock archives through these, so every wait shows up*/
+void archive_rdlock(struct channel *ch);
+void archive_wrlock(struct channel *ch);
+void archive_unlock(struct channel *ch);
+
+/*Initializes a TCP socket for a given peer's IP and port, establishes the
   TCP connection to the peer, and returns the socket's file descriptor ID.
   Returns -1 if it's not able to setup the connection.*/
-int init_peer_socket (char *ip);
+int init_peer_socket (char *ip, uint16_t port);
 
 /*Initializes a TCP socket that binds to the local address, and returns its
   file descriptor id. This socket will be used to accept incoming connections
@@ -27,39 +50,68 @@ int init_incoming_socket ();
 
 /*Processes a PeerList message received on the given socket, checking if there
   are any peers in it to which we are not currently connected, and connecting
-  to any potential new peers.*/
-void process_peerlist (int peersock, FILE *logfile);
-
-/*Processes an ArchiveResponse received on the given socket. First, we parse and
-  store the content of the received archive appropriately. Then, we check if the
-	new archive is larger than the one currently active. If so, we validate this
-	new archive. If the validity check is successful, we replace the current
-	archive by the new one, and dump the old archive*/
-void process_archive (int peersock, FILE *logfile);
-
-/*Publishes a newly created archive by iterating over the peerlist and sending
-  the currently active archive to each peer. This function looks weird, because
-	all the data it accesses is contained in both of our global data structures,
-	the peerlist structure and the active archive structure.*/
-void publish_archive();
-
-/*Implements the work done by threads launched for each peer, that periodically
-  send PeerRequest messages ("0x1") to the connected peer. It takes the socket
-  associated to the peer as input, and simply loops forever, sending out request
-  messages in a given interval (5 seconds)
-  As a bonus, since the specification did not mention when we should send
-  ArchiveRequests, we'll send them periodically as well, on a longer interval
- (every 60 seconds)*/
-void *peer_requester_thread (void *sock);
+  to any potential new peers. If ext is set, the list is in the extended format
+  (with listen ports), otherwise every peer in it listens on the default port.*/
+void process_peerlist (int peersock, int ext);
+
+/*Processes an ArchiveResponse received on the given socket, for the given
+  channel. First, we parse and store the content of the received archive
+	appropriately. Then, we check if the new archive is larger than the channel's
+	active one. If so, we hand it to the compute pool to be validated (and
+	replace the active archive if it's valid), without waiting for it, otherwise
+	we dump it right away. A NULL channel (one we're not in) always gets it
+	dumped*/
+void process_archive (int peersock, struct channel *ch);
+
+/*Sends an archive snapshot to the given socket. The type+size header goes out
+  from memory, and the rest of the archive is sendfile()d straight from the
+  snapshot's memfd, so the kernel never needs us to copy it around. Archives
+  of a channel other than the default one (chid) go in an ArchiveResponseCh.
+  Returns 0 on success, -1 if the send failed.*/
+int send_snapshot (int sock, struct archive_snapshot *snap, uint32_t chid);
+
+/*Publishes a channel's newly created archive by sending a snapshot of it
+  (see acquire_snapshot) to each peer in the peerlist (default channel), or to
+  each peer that asked for the channel (any other). Sends may block on slow
+  peers, so the archive's lock shouldn't be held, the caller still owns its
+  reference to the snapshot afterwards. This function looks weird, because
+	all the data it accesses is contained in our global data structures, the
+	peerlist structure and the snapshot.*/
+void publish_archive(struct channel *ch, struct archive_snapshot *snap);
+
+/*Sends the periodic requests to the peer on the given socket: if peerreq is
+  set, a PeerRequestExt, plus an original PeerRequest unless the peer has
+  already shown us it speaks the extended format, and an ArchiveRequest if
+  archreq is set (plus an ArchiveRequestCh for every other channel we're in, if
+  the peer speaks the extended format). Never blocks, since it runs on the
+  timer wheel's thread. Returns 0 on success, 1 if the peer isn't reading what
+  we send it (its send buffer is full), so the requests were skipped this time,
+  or -1 if the connection is broken*/
+int send_requests (int peersock, int peerreq, int archreq);
+
+/*Adds a newly connected peer, listening on the given port, to the list of
+  connected peers (outgoing says whether we opened the connection), and asks
+  it who it is*/
+void peer_connected (int peersock, uint16_t port, int outgoing);
+
+/*Closes the connection to a peer, and removes it from the list of connected
+  peers*/
+void peer_disconnected (int peersock);
+
+/*Processes a message of the given type (whose type byte was already read) from
+  the peer on the given socket, reading the rest of it and answering it if
+  need be*/
+void handle_message (int peersock, uint8_t type);
 
 /*Implements the work done by threads launched for each peer that receive and
   process data sent by the connected peer. It takes the socket associated to the
   peer as input, and recv()s on the socket, waiting for messages to arrive, and
   processes each type of message accordingly.
-	The socket is configured with a timeout. If a recv() operation times out, we
-	assume the connection was interrupted, and close the socket, disconnect from
-	the peer and remove them from the list of connected peers.*/
-void *peer_receiver_thread (void *sock);
+	The peer's periodic requests and idle checks are on the timer wheel. If the
+	peer goes quiet for too long, the idle check hangs up on it, so a recv()
+	fails, and we close the socket, disconnect from the peer and remove them
+	from the list of connected peers.*/
+void *peer_receiver_thread (void *args);
 
 /*This function implements all the work that must be done by the thread that
   treats incoming peer connections. It initializes a passive socket, binds to
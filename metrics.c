@@ -0,0 +1,433 @@
+#include "metrics.h"
+
+/*This file implements the node's built-in metrics: counters, gauges and latency
+  histograms for mining, validation, traffic, connections and lock contention.
+  Recording is meant to be as cheap as possible, so every thread gets its own
+  shard of counters and histograms that only it writes to (no atomics with lock
+  prefixes, no shared cache lines). Shards are only added up when the metrics
+  are read, which happens way less often than they are written.
+  Per-peer traffic is the exception, since several threads talk to the same
+  peer, so those counters live in a table indexed by socket, with atomic adds.*/
+
+/*a thread's private set of metrics
+  dead  ->  set when the owning thread exits, its values then get folded into
+            the retired shard and the shard is freed*/
+struct metrics_shard {
+	uint64_t counters[M_COUNT];
+	uint64_t hist[H_COUNT][HIST_BUCKETS];
+	uint64_t hist_sum[H_COUNT];
+	uint64_t type_in_msgs[METRICS_TYPES], type_in_bytes[METRICS_TYPES];
+	uint64_t type_out_msgs[METRICS_TYPES], type_out_bytes[METRICS_TYPES];
+	int dead;
+	struct metrics_shard *next;
+};
+
+/*traffic counters for a single peer*/
+struct peer_metrics {
+	int open;
+	uint32_t ip;
+	uint64_t in_msgs, in_bytes, out_msgs, out_bytes;
+};
+
+/*names and help strings for the exposition*/
+static const char *counter_names[M_COUNT][2] = {
+	{"blockchain_mining_hashes_total", "MD5 hashes computed while mining"},
+	{"blockchain_mined_messages_total", "Messages successfully mined"},
+	{"blockchain_validated_bytes_total", "Archive bytes checked by is_valid"},
+	{"blockchain_validations_total", "Number of archive validations"},
+	{"blockchain_validation_skipped_messages_total",
+		"Archive messages not validated again, already known valid"},
+	{"blockchain_archive_replaced_total", "Received archives that were accepted"},
+	{"blockchain_archive_smaller_total", "Received archives that were not longer"},
+	{"blockchain_archive_invalid_total", "Received archives that failed validation"},
+	{"blockchain_archive_malformed_total", "Received archives with malformed records"},
+	{"blockchain_connect_success_total", "Successful outgoing peer connections"},
+	{"blockchain_connect_failure_total", "Failed outgoing peer connections"},
+	{"blockchain_pool_tasks_total", "Tasks run by the compute pool"},
+	{"blockchain_pool_steals_total", "Pool tasks stolen from another worker"},
+	{"blockchain_admission_throttled_total", "Times a peer was throttled"},
+	{"blockchain_admission_skipped_total", "Archives dropped, peer out of CPU budget"},
+	{"blockchain_admission_kicked_total", "Peers disconnected for going over budget"},
+	{"blockchain_duplicate_connections_total", "Duplicate peer connections dropped"},
+	{"blockchain_idle_timeouts_total", "Peers disconnected for going quiet"},
+	{"blockchain_redials_total", "Attempts to reconnect to a lost peer"},
+	{"blockchain_boot_ranges_total", "Archive ranges fetched by the bootstrap"},
+	{"blockchain_boot_retries_total", "Archive ranges the bootstrap fetched again"},
+	{"blockchain_seeks_total", "Fork-point searches that found the fork point"},
+	{"blockchain_seek_rounds_total", "Probe round trips of fork-point searches"},
+	{"blockchain_searches_total", "Full-text searches run for API clients"}
+};
+
+static const char *hist_names[H_COUNT][2] = {
+	{"blockchain_mining_seconds", "Time to mine a message"},
+	{"blockchain_validation_seconds", "Time to validate an archive"},
+	{"blockchain_connect_seconds", "Time to connect to a peer"},
+	{"blockchain_archive_lock_wait_seconds", "Time waiting for the archive lock"},
+	{"blockchain_archive_lock_hold_seconds", "Time the archive lock is held"},
+	{"blockchain_peerlist_lock_wait_seconds", "Time waiting for the peer list lock"},
+	{"blockchain_peerlist_lock_hold_seconds", "Time the peer list lock is held"},
+	{"blockchain_pool_queue_seconds", "Time tasks wait in the compute pool"},
+	{"blockchain_timer_lag_seconds", "How late timers fire past their tick"},
+	{"blockchain_search_seconds", "Time to run a full-text search"}
+};
+
+static const char *gauge_names[G_COUNT][2] = {
+	{"blockchain_archive_messages", "Messages in the active archive"},
+	{"blockchain_archive_bytes", "Length of the active archive in bytes"},
+	{"blockchain_peers", "Number of connected peers"},
+	{"blockchain_fork_branches", "Candidate archives kept by the fork store"},
+	{"blockchain_validations", "Archives being validated right now"},
+	{"blockchain_search_index_bytes", "Memory taken by the full-text indexes"}
+};
+
+static const char *type_names[METRICS_TYPES] = {
+	"unknown", "peer_request", "peer_list", "archive_request", "archive_response",
+	"peer_request_ext", "peer_list_ext", "archive_request_ch",
+	"archive_response_ch", "hello_request", "hello",
+	"tip_request", "tip", "range_request", "range", "probe_request", "probe"
+};
+
+/*list of shards, and the shard that accumulates those of exited threads*/
+static struct metrics_shard *shards = NULL;
+static struct metrics_shard retired;
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*each thread's own shard, and the key used to retire it when the thread exits*/
+static __thread struct metrics_shard *my_shard = NULL;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+
+/*per-peer counters and gauges*/
+static struct peer_metrics peers[METRICS_MAX_SOCK];
+static uint64_t gauges[G_COUNT];
+
+/*exposition listening socket*/
+static int metrics_sock = -1;
+
+/*single-writer increment, the owning thread is the only one writing, so a
+  relaxed load+store is enough (no locked instruction), and readers never see
+  torn values*/
+#define SHARD_ADD(field, v) \
+	__atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + (v), \
+		__ATOMIC_RELAXED)
+
+static void shard_destructor(void *ptr) {
+	struct metrics_shard *shard = (struct metrics_shard*) ptr;
+	__atomic_store_n(&shard->dead, 1, __ATOMIC_RELEASE);
+}
+
+static void make_shard_key() {
+	pthread_key_create(&shard_key, shard_destructor);
+}
+
+/*returns the calling thread's shard, creating and registering it if needed*/
+static struct metrics_shard *thread_shard() {
+	if (my_shard != NULL) {
+		return my_shard;
+	}
+
+	pthread_once(&shard_key_once, make_shard_key);
+	my_shard = (struct metrics_shard*) calloc(1, sizeof(struct metrics_shard));
+
+	pthread_mutex_lock(&shards_mutex);
+	my_shard->next = shards;
+	shards = my_shard;
+	pthread_mutex_unlock(&shards_mutex);
+
+	pthread_setspecific(shard_key, my_shard);
+	return my_shard;
+}
+
+/*Returns the current monotonic time in nanoseconds, for timing things*/
+uint64_t metrics_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*Adds v to one of the calling thread's counters*/
+void metrics_add(int counter, uint64_t v) {
+	struct metrics_shard *shard = thread_shard();
+	SHARD_ADD(shard->counters[counter], v);
+}
+
+/*Records a latency sample (in nanoseconds) into one of the calling thread's
+  histograms*/
+void metrics_observe(int hist, uint64_t ns) {
+	struct metrics_shard *shard = thread_shard();
+
+	/*bucket index is the position of the highest set bit, clamped to range*/
+	int exp = ns ? 64 - __builtin_clzll(ns) : 0;
+	if (exp < HIST_MIN_EXP) {
+		exp = HIST_MIN_EXP;
+	}
+	if (exp > HIST_MAX_EXP) {
+		exp = HIST_MAX_EXP;
+	}
+
+	SHARD_ADD(shard->hist[hist][exp - HIST_MIN_EXP], 1);
+	SHARD_ADD(shard->hist_sum[hist], ns);
+}
+
+/*Sets a gauge to the given value*/
+void metrics_gauge(int gauge, uint64_t v) {
+	__atomic_store_n(&gauges[gauge], v, __ATOMIC_RELAXED);
+}
+
+/*Starts tracking traffic for the peer connected on the given socket*/
+void metrics_peer_open(int sock, uint32_t ip) {
+	if (sock < 0 || sock >= METRICS_MAX_SOCK) {
+		return;
+	}
+
+	struct peer_metrics *p = &peers[sock];
+	__atomic_store_n(&p->in_msgs, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&p->in_bytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&p->out_msgs, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&p->out_bytes, 0, __ATOMIC_RELAXED);
+	p->ip = ip;
+	__atomic_store_n(&p->open, 1, __ATOMIC_RELEASE);
+}
+
+/*Stops tracking traffic for the peer connected on the given socket*/
+void metrics_peer_close(int sock) {
+	if (sock < 0 || sock >= METRICS_MAX_SOCK) {
+		return;
+	}
+	__atomic_store_n(&peers[sock].open, 0, __ATOMIC_RELEASE);
+}
+
+/*Accounts for a message of the given type and size (in bytes, including the
+  type byte) received from/sent to the peer on the given socket*/
+void metrics_msg_in(int sock, uint8_t type, uint64_t bytes) {
+	struct metrics_shard *shard = thread_shard();
+
+	if (type >= METRICS_TYPES) {
+		type = 0;
+	}
+	SHARD_ADD(shard->type_in_msgs[type], 1);
+	SHARD_ADD(shard->type_in_bytes[type], bytes);
+
+	if (sock >= 0 && sock < METRICS_MAX_SOCK) {
+		__atomic_add_fetch(&peers[sock].in_msgs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&peers[sock].in_bytes, bytes, __ATOMIC_RELAXED);
+	}
+}
+
+void metrics_msg_out(int sock, uint8_t type, uint64_t bytes) {
+	struct metrics_shard *shard = thread_shard();
+
+	if (type >= METRICS_TYPES) {
+		type = 0;
+	}
+	SHARD_ADD(shard->type_out_msgs[type], 1);
+	SHARD_ADD(shard->type_out_bytes[type], bytes);
+
+	if (sock >= 0 && sock < METRICS_MAX_SOCK) {
+		__atomic_add_fetch(&peers[sock].out_msgs, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&peers[sock].out_bytes, bytes, __ATOMIC_RELAXED);
+	}
+}
+
+/*adds every value of one shard into another*/
+static void shard_fold(struct metrics_shard *dst, struct metrics_shard *src) {
+	int i, j;
+
+	for (i = 0; i < M_COUNT; i++) {
+		dst->counters[i] += __atomic_load_n(&src->counters[i], __ATOMIC_RELAXED);
+	}
+	for (i = 0; i < H_COUNT; i++) {
+		for (j = 0; j < HIST_BUCKETS; j++) {
+			dst->hist[i][j] += __atomic_load_n(&src->hist[i][j], __ATOMIC_RELAXED);
+		}
+		dst->hist_sum[i] += __atomic_load_n(&src->hist_sum[i], __ATOMIC_RELAXED);
+	}
+	for (i = 0; i < METRICS_TYPES; i++) {
+		dst->type_in_msgs[i] += __atomic_load_n(&src->type_in_msgs[i],
+			__ATOMIC_RELAXED);
+		dst->type_in_bytes[i] += __atomic_load_n(&src->type_in_bytes[i],
+			__ATOMIC_RELAXED);
+		dst->type_out_msgs[i] += __atomic_load_n(&src->type_out_msgs[i],
+			__ATOMIC_RELAXED);
+		dst->type_out_bytes[i] += __atomic_load_n(&src->type_out_bytes[i],
+			__ATOMIC_RELAXED);
+	}
+}
+
+/*adds up every shard (folding dead ones into the retired shard) into total*/
+static void aggregate(struct metrics_shard *total) {
+	struct metrics_shard **aux, *shard;
+
+	memset(total, 0, sizeof(struct metrics_shard));
+
+	pthread_mutex_lock(&shards_mutex);
+	aux = &shards;
+	while ((shard = *aux) != NULL) {
+		if (__atomic_load_n(&shard->dead, __ATOMIC_ACQUIRE)) {
+			shard_fold(&retired, shard);
+			*aux = shard->next;
+			free(shard);
+			continue;
+		}
+		shard_fold(total, shard);
+		aux = &shard->next;
+	}
+	shard_fold(total, &retired);
+	pthread_mutex_unlock(&shards_mutex);
+}
+
+/*Writes every metric, aggregated over all threads, to the given stream in the
+  Prometheus text exposition format*/
+void metrics_dump(FILE *stream) {
+	struct metrics_shard *total = malloc(sizeof(struct metrics_shard));
+	int i, j;
+
+	aggregate(total);
+
+	for (i = 0; i < M_COUNT; i++) {
+		fprintf(stream, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+			counter_names[i][0], counter_names[i][1], counter_names[i][0],
+			counter_names[i][0], (unsigned long long) total->counters[i]);
+	}
+
+	for (i = 0; i < G_COUNT; i++) {
+		fprintf(stream, "# HELP %s %s\n# TYPE %s gauge\n%s %llu\n",
+			gauge_names[i][0], gauge_names[i][1], gauge_names[i][0],
+			gauge_names[i][0],
+			(unsigned long long) __atomic_load_n(&gauges[i], __ATOMIC_RELAXED));
+	}
+
+	/*histograms, with cumulative buckets in seconds as Prometheus expects*/
+	for (i = 0; i < H_COUNT; i++) {
+		const char *name = hist_names[i][0];
+		uint64_t cumulative = 0;
+
+		fprintf(stream, "# HELP %s %s\n# TYPE %s histogram\n", name,
+			hist_names[i][1], name);
+		for (j = 0; j < HIST_BUCKETS; j++) {
+			cumulative += total->hist[i][j];
+			fprintf(stream, "%s_bucket{le=\"%g\"} %llu\n", name,
+				(double) (1ULL << (j + HIST_MIN_EXP)) / 1e9,
+				(unsigned long long) cumulative);
+		}
+		fprintf(stream, "%s_bucket{le=\"+Inf\"} %llu\n", name,
+			(unsigned long long) cumulative);
+		fprintf(stream, "%s_sum %g\n%s_count %llu\n", name,
+			(double) total->hist_sum[i] / 1e9, name, (unsigned long long) cumulative);
+	}
+
+	/*traffic per message type*/
+	fprintf(stream, "# HELP blockchain_messages_total Messages by type and "
+		"direction\n# TYPE blockchain_messages_total counter\n");
+	for (i = 0; i < METRICS_TYPES; i++) {
+		fprintf(stream, "blockchain_messages_total{type=\"%s\",dir=\"in\"} %llu\n"
+			"blockchain_messages_total{type=\"%s\",dir=\"out\"} %llu\n",
+			type_names[i], (unsigned long long) total->type_in_msgs[i],
+			type_names[i], (unsigned long long) total->type_out_msgs[i]);
+	}
+	fprintf(stream, "# HELP blockchain_message_bytes_total Bytes by type and "
+		"direction\n# TYPE blockchain_message_bytes_total counter\n");
+	for (i = 0; i < METRICS_TYPES; i++) {
+		fprintf(stream, "blockchain_message_bytes_total{type=\"%s\",dir=\"in\"} "
+			"%llu\nblockchain_message_bytes_total{type=\"%s\",dir=\"out\"} %llu\n",
+			type_names[i], (unsigned long long) total->type_in_bytes[i],
+			type_names[i], (unsigned long long) total->type_out_bytes[i]);
+	}
+
+	/*traffic per connected peer*/
+	fprintf(stream, "# HELP blockchain_peer_bytes_total Bytes exchanged per "
+		"peer\n# TYPE blockchain_peer_bytes_total counter\n");
+	for (i = 0; i < METRICS_MAX_SOCK; i++) {
+		struct peer_metrics *p = &peers[i];
+		char ip[INET_ADDRSTRLEN];
+
+		if (!__atomic_load_n(&p->open, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		inet_ntop(AF_INET, &p->ip, ip, sizeof(ip));
+		fprintf(stream,
+			"blockchain_peer_bytes_total{peer=\"%s\",sock=\"%d\",dir=\"in\"} %llu\n"
+			"blockchain_peer_bytes_total{peer=\"%s\",sock=\"%d\",dir=\"out\"} %llu\n",
+			ip, i, (unsigned long long) p->in_bytes,
+			ip, i, (unsigned long long) p->out_bytes);
+	}
+	fprintf(stream, "# HELP blockchain_peer_messages_total Messages exchanged "
+		"per peer\n# TYPE blockchain_peer_messages_total counter\n");
+	for (i = 0; i < METRICS_MAX_SOCK; i++) {
+		struct peer_metrics *p = &peers[i];
+		char ip[INET_ADDRSTRLEN];
+
+		if (!__atomic_load_n(&p->open, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		inet_ntop(AF_INET, &p->ip, ip, sizeof(ip));
+		fprintf(stream,
+			"blockchain_peer_messages_total{peer=\"%s\",sock=\"%d\",dir=\"in\"} "
+			"%llu\n"
+			"blockchain_peer_messages_total{peer=\"%s\",sock=\"%d\",dir=\"out\"} "
+			"%llu\n",
+			ip, i, (unsigned long long) p->in_msgs,
+			ip, i, (unsigned long long) p->out_msgs);
+	}
+
+	free(total);
+}
+
+/*serves one scrape per connection, we don't care about the request itself,
+  everyone gets the same answer*/
+static void *metrics_thread() {
+	while (1) {
+		int client = accept(metrics_sock, NULL, NULL);
+		if (client == -1) {
+			continue;
+		}
+
+		/*read (and ignore) whatever request line the client sent*/
+		char req[1024];
+		struct timeval tout = {1, 0};
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &tout, sizeof(tout));
+		recv(client, req, sizeof(req), 0);
+
+		FILE *stream = fdopen(client, "w");
+		if (stream == NULL) {
+			close(client);
+			continue;
+		}
+		fprintf(stream, "HTTP/1.0 200 OK\r\n"
+			"Content-Type: text/plain; version=0.0.4\r\n\r\n");
+		metrics_dump(stream);
+		fclose(stream);
+	}
+
+	return NULL;
+}
+
+/*Launches a thread that serves the metrics over HTTP on 127.0.0.1 at the given
+  port, so anything that speaks Prometheus (or curl) can scrape them. Returns 0
+  on success, -1 if the port couldn't be bound.*/
+int metrics_serve(int port) {
+	struct sockaddr_in addr;
+	int re = 1;
+
+	if ((metrics_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		return -1;
+	}
+	setsockopt(metrics_sock, SOL_SOCKET, SO_REUSEADDR, &re, sizeof(re));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(metrics_sock, (struct sockaddr*) &addr, sizeof(addr)) == -1 ||
+		listen(metrics_sock, 10) == -1) {
+		close(metrics_sock);
+		metrics_sock = -1;
+		return -1;
+	}
+
+	pthread_t thread;
+	pthread_create(&thread, NULL, metrics_thread, NULL);
+	pthread_detach(thread);
+	return 0;
+}
@@ -0,0 +1,111 @@
+#include <stdio.h>				//the exposition is just fprintfs into a socket stream
+#include <stdlib.h>				//mallocs, callocs, frees and the like
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <string.h>				//memsets
+#include <time.h>					//monotonic clock, for latencies
+#include <unistd.h>				//close
+#include <pthread.h>			//exposition thread, thread keys for per-thread shards
+#include <sys/socket.h>		//exposition socket
+#include <netinet/in.h>		//sockaddr_in, to bind the exposition to localhost
+#include <arpa/inet.h>		//inet_ntop, for peer labels
+
+/*counters. Each thread bumps its own private copy of these, and copies are only
+  added up when someone scrapes the metrics endpoint*/
+enum {
+	M_HASHES = 0,				//MD5 hashes computed while mining
+	M_MINED,						//messages successfully mined
+	M_VALID_BYTES,			//archive bytes checked by is_valid
+	M_VALID_RUNS,				//number of is_valid calls
+	M_VALID_SKIPPED,		//archive messages validation skipped, already known valid
+	M_ARCH_REPLACED,		//received archives that replaced the active one
+	M_ARCH_SMALLER,			//received archives dropped for not being longer
+	M_ARCH_INVALID,			//received archives dropped for failing validation
+	M_ARCH_MALFORMED,		//received archives dropped by the structural scan, unhashed
+	M_CONNECT_OK,				//successful init_peer_socket calls
+	M_CONNECT_FAIL,			//failed init_peer_socket calls
+	M_POOL_TASKS,				//tasks run by the compute pool
+	M_POOL_STEALS,			//tasks a pool worker took from another worker's queue
+	M_ADMIT_THROTTLED,	//times a peer was made to wait for its budgets
+	M_ADMIT_SKIPPED,		//archives not validated, their peer was out of CPU budget
+	M_ADMIT_KICKED,			//peers disconnected for going way over their budgets
+	M_DUPLICATE_DROPPED,	//connections dropped for being a second link to a node
+	M_IDLE_TIMEOUTS,		//peers hung up on for going quiet
+	M_REDIALS,					//attempts to connect again to a peer we lost
+	M_BOOT_RANGES,			//ranges the bootstrap got and validated
+	M_BOOT_RETRIES,			//ranges the bootstrap had to fetch again
+	M_SEEKS,						//fork-point searches that found the fork point
+	M_SEEK_ROUNDS,			//probe round trips of fork-point searches
+	M_SEARCHES,					//full-text searches run for API clients
+	M_COUNT
+};
+
+/*latency histograms, all in nanoseconds, bucketed by powers of two*/
+enum {
+	H_MINE = 0,					//time to solution in add_message
+	H_VALIDATE,					//duration of is_valid calls
+	H_CONNECT,					//duration of init_peer_socket calls
+	H_ARCHLOCK_WAIT,		//time spent waiting for archive_lock
+	H_ARCHLOCK_HOLD,		//time archive_lock is held for
+	H_PEERLOCK_WAIT,		//time spent waiting for peerlist_mutex
+	H_PEERLOCK_HOLD,		//time peerlist_mutex is held for
+	H_POOL_QUEUE,				//time tasks wait in the compute pool before running
+	H_TIMER_LAG,				//how late timers fire, past their tick
+	H_SEARCH,						//duration of full-text searches
+	H_COUNT
+};
+
+/*gauges, simply set to the latest value by whoever changes them*/
+enum {
+	G_ARCHIVE_SIZE = 0,
+	G_ARCHIVE_LEN,
+	G_PEERS,
+	G_FORK_BRANCHES,		//candidate archives kept by the fork store
+	G_VALIDATIONS,			//archives being validated right now
+	G_SEARCH_BYTES,			//memory taken by the full-text indexes
+	G_COUNT
+};
+
+/*histogram buckets go from 2^HIST_MIN_EXP ns (~1us) to 2^HIST_MAX_EXP ns (~68s),
+  anything outside that range ends up in the first/last bucket*/
+#define HIST_MIN_EXP 10
+#define HIST_MAX_EXP 36
+#define HIST_BUCKETS (HIST_MAX_EXP - HIST_MIN_EXP + 1)
+
+/*message types we keep per-type traffic counters for (1 to METRICS_TYPES-1)*/
+#define METRICS_TYPES 17
+
+/*highest socket number we keep per-peer counters for*/
+#define METRICS_MAX_SOCK 4096
+
+/*Returns the current monotonic time in nanoseconds, for timing things*/
+uint64_t metrics_now();
+
+/*Adds v to one of the calling thread's counters*/
+void metrics_add(int counter, uint64_t v);
+
+/*Records a latency sample (in nanoseconds) into one of the calling thread's
+  histograms*/
+void metrics_observe(int hist, uint64_t ns);
+
+/*Sets a gauge to the given value*/
+void metrics_gauge(int gauge, uint64_t v);
+
+/*Starts tracking traffic for the peer connected on the given socket*/
+void metrics_peer_open(int sock, uint32_t ip);
+
+/*Stops tracking traffic for the peer connected on the given socket*/
+void metrics_peer_close(int sock);
+
+/*Accounts for a message of the given type and size (in bytes, including the
+  type byte) received from/sent to the peer on the given socket*/
+void metrics_msg_in(int sock, uint8_t type, uint64_t bytes);
+void metrics_msg_out(int sock, uint8_t type, uint64_t bytes);
+
+/*Writes every metric, aggregated over all threads, to the given stream in the
+  Prometheus text exposition format*/
+void metrics_dump(FILE *stream);
+
+/*Launches a thread that serves the metrics over HTTP on 127.0.0.1 at the given
+  port, so anything that speaks Prometheus (or curl) can scrape them. Returns 0
+  on success, -1 if the port couldn't be bound.*/
+int metrics_serve(int port);
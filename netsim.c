@@ -0,0 +1,367 @@
+#include "main.h"
+#include "peerlist.h"
+#include "archive.h"
+#include "transport.h"
+#include "forks.h"
+#include "channel.h"
+#include "sim.h"
+#include "boot.h"
+#include "seek.h"
+#include <sys/resource.h>	//file descriptor limits, every archive has a memfd
+
+/*Network simulator driver. Builds a network of simulated nodes, each one
+  connecting to a few random nodes that joined before it, then injects
+  messages into random nodes, one at a time, and measures (in virtual time)
+  how long each one takes to reach half, 90% and all of the nodes. Each message
+  gets a line of JSON, and a summary line comes at the end. With -J, fresh
+  nodes join the network afterwards, one at a time, and bootstrap (see boot.h)
+  from the nodes that are there, and each one gets a line of JSON too.
+
+  Usage: ./netsim [-n nodes] [-f fanout] [-r peer request s]
+                  [-a archive request s] [-k messages] [-l latency ms]
+                  [-j jitter ms] [-b bandwidth KB/s] [-p loss %] [-s seed]
+                  [-w warmup s] [-i interval s] [-t timeout s] [-F]
+                  [-J joiners]
+    -n  number of nodes (default 1000)
+    -f  initial connections per node (default 4)
+    -r  interval between PeerRequests (default 0, never). Nodes connect to
+        every peer they hear about, so with this they end up connected to
+        everyone, careful with big networks
+    -a  interval between ArchiveRequests (default 60s, like the real thing).
+        Nodes don't publish archives they receive, so without these, messages
+        don't make it past the injecting node's peers
+    -k  messages to inject (default 10)
+    -l  one way latency of every connection (default 50ms)
+    -j  extra random latency per connection, up to this much (default 10ms)
+    -b  bandwidth of each direction of a connection (default 0, unlimited)
+    -p  probability that a delivery is lost and has to be retransmitted
+        (default 0%, retransmissions take 200ms)
+    -s  seed (default 51511), same seed and options always give the same run
+    -w  virtual time to let the network settle before injecting (default 10s)
+    -i  virtual time between a message converging and the next one (default 1s)
+    -t  how long to wait for a message to converge (default 600s)
+    -F  fork-point searches on (see seek.h): nodes that answered our
+        HelloRequest get TipRequests instead of ArchiveRequests
+    -J  fresh nodes to join once the messages are in (default 0). Each one
+        connects to fanout nodes, but to BOOT_TIPS at least, since the
+        bootstrap only stops waiting for tips before that on the timer wheel,
+        which doesn't tick in virtual time. It has up to the -t timeout to get
+        the largest archive around*/
+
+/*globals owned by main.c*/
+extern struct channel_table *channels;
+
+/*where results go (the real stdout, since we silence the stdout stream)*/
+static FILE *results;
+
+/*the message being tracked: the archive size it makes, how many nodes have
+  reached that size, and when they got to half, 90% and all of the nodes (in
+  seconds, -1 until they do)*/
+static uint32_t target;
+static int reached, *done;
+
+/*the joiner being tracked, -1 while tracking messages*/
+static int joiner = -1;
+static uint64_t injected;
+static double t50, t90, t100;
+
+static double now_s() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*called by the simulator whenever a node's archive changes size*/
+static void on_archive(int node, uint32_t size) {
+	int n = sim_nodes();
+
+	if (joiner != -1) {
+		if (node == joiner && size >= target) {
+			sim_stop();
+		}
+		return;
+	}
+	if (size < target || done[node]) {
+		return;
+	}
+
+	double elapsed = (double) (sim_now() - injected) / SIM_SECOND;
+	done[node] = 1;
+	reached++;
+	if (reached * 2 >= n && t50 < 0) {
+		t50 = elapsed;
+	}
+	if (reached * 10 >= n * 9 && t90 < 0) {
+		t90 = elapsed;
+	}
+	if (reached == n) {
+		t100 = elapsed;
+		sim_stop();
+	}
+}
+
+/*what a node does when someone types a message into it (see main.c)*/
+static void inject(void *msg) {
+	struct channel *ch = channels->list[0];
+	uint64_t id;
+	int bad;
+
+	add_message(ch->arch, (uint8_t*) msg);
+	sync_snapshot(ch->arch);
+	fork_offer(ch->forks, ch->arch, 1, &id, &bad);
+	struct archive_snapshot *snap = acquire_snapshot(ch->arch);
+	publish_archive(ch, snap);
+	release_snapshot(snap);
+}
+
+/*what a fresh node does before it meets anyone, when bootstrapping (see
+  main.c)*/
+static void start_boot(void *arg) {
+	(void) arg;
+	boot_start(CHANNEL_DEFAULT_ID, &node_boot_ops);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(double*) a, y = *(double*) b;
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[]) {
+	struct sim_config config;
+	int opt, n = 1000, fanout = 4, k = 10, joiners = 0, seek = 0, i, j;
+	uint64_t warmup = 10, interval = 1, timeout = 600;
+
+	memset(&config, 0, sizeof(config));
+	config.latency = 50000;
+	config.jitter = 10000;
+	config.rto = 200000;
+	config.archreq = 60 * SIM_SECOND;
+	config.seed = 51511;
+	config.on_archive = on_archive;
+
+	while ((opt = getopt(argc, argv, "n:f:r:a:k:l:j:b:p:s:w:i:t:FJ:")) != -1) {
+		switch (opt) {
+			case 'n': {
+				n = atoi(optarg);
+				break;
+			}
+
+			case 'f': {
+				fanout = atoi(optarg);
+				break;
+			}
+
+			case 'r': {
+				config.peerreq = atof(optarg) * SIM_SECOND;
+				break;
+			}
+
+			case 'a': {
+				config.archreq = atof(optarg) * SIM_SECOND;
+				break;
+			}
+
+			case 'k': {
+				k = atoi(optarg);
+				break;
+			}
+
+			case 'l': {
+				config.latency = atof(optarg) * 1000;
+				break;
+			}
+
+			case 'j': {
+				config.jitter = atof(optarg) * 1000;
+				break;
+			}
+
+			case 'b': {
+				config.bandwidth = atof(optarg) * 1000;
+				break;
+			}
+
+			case 'p': {
+				config.loss = atof(optarg) / 100;
+				break;
+			}
+
+			case 's': {
+				config.seed = strtoull(optarg, NULL, 10);
+				break;
+			}
+
+			case 'w': {
+				warmup = atoi(optarg);
+				break;
+			}
+
+			case 'i': {
+				interval = atoi(optarg);
+				break;
+			}
+
+			case 't': {
+				timeout = atoi(optarg);
+				break;
+			}
+
+			case 'F': {
+				seek = 1;
+				break;
+			}
+
+			case 'J': {
+				joiners = atoi(optarg);
+				break;
+			}
+
+			default: {
+				fprintf(stderr, "Usage: ./netsim [-n nodes] [-f fanout] "
+					"[-r peer request s] [-a archive request s] [-k messages] [-l latency ms] [-j jitter ms] [-b bandwidth KB/s] "
+					"[-p loss %%] [-s seed] [-w warmup s] [-i interval s] "
+					"[-t timeout s] [-F] [-J joiners]\n");
+				return 1;
+			}
+		}
+	}
+
+	if (n < 2 || k < 1 || fanout < 1) {
+		fprintf(stderr, "Need at least 2 nodes, 1 message and a fanout of 1!\n");
+		return 1;
+	}
+	if (joiners > 0 && n < BOOT_TIPS) {
+		fprintf(stderr, "Joiners need at least %d nodes to get tips from!\n",
+			BOOT_TIPS);
+		return 1;
+	}
+
+	/*every node's archive has a memfd (and its snapshot a dup of it), raise the
+	  limit as far as we're allowed. Past it, archives just get copied instead*/
+	struct rlimit lim;
+	getrlimit(RLIMIT_NOFILE, &lim);
+	lim.rlim_cur = lim.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &lim);
+
+	/*keep the real stdout for results, and silence everything else*/
+	results = fdopen(dup(STDOUT_FILENO), "w");
+	setvbuf(results, NULL, _IOLBF, 0);
+	freopen("/dev/null", "w", stdout);
+
+	double wall = now_s();
+	sim_init(&config);
+	if (seek) {
+		seek_init(&node_seek_ops);
+	}
+
+	/*nodes are 10.0.0.1, 10.0.0.2... all on the default port, and each one
+	  connects to up to fanout distinct random nodes that are already there*/
+	done = calloc(n, sizeof(int));
+	for (i = 0; i < n; i++) {
+		sim_add_node(htonl(0x0A000000 + i + 1), DEFAULT_PORT);
+	}
+	for (i = 1; i < n; i++) {
+		int chosen[fanout], nchosen = 0, c;
+
+		while (nchosen < fanout && nchosen < i) {
+			int peer = sim_rand() % i, dup = 0;
+			for (c = 0; c < nchosen; c++) {
+				dup |= chosen[c] == peer;
+			}
+			if (!dup) {
+				chosen[nchosen++] = peer;
+				sim_connect(i, peer);
+			}
+		}
+	}
+	sim_run(warmup * SIM_SECOND);
+
+	/*inject messages one at a time, each one once the previous one is done*/
+	double *latencies = malloc(k * sizeof(double));
+	int converged = 0;
+	for (j = 0; j < k; j++) {
+		int node = sim_rand() % n;
+		uint8_t msg[64];
+
+		snprintf((char*) msg, sizeof(msg), "sim message %d\n", j);
+		memset(done, 0, n * sizeof(int));
+		reached = 0;
+		t50 = t90 = t100 = -1;
+		target = sim_archive(node)->size + 1;
+		injected = sim_now();
+
+		sim_call(node, inject, msg);
+		sim_run(injected + timeout * SIM_SECOND);
+
+		latencies[j] = reached == n ? t100 : timeout;
+		converged += reached == n;
+		fprintf(results, "{\"message\":%d,\"node\":%d,\"size\":%u,\"reached\":%d,"
+			"\"t50\":%.6f,\"t90\":%.6f,\"t100\":%.6f}\n", j, node, target, reached,
+			t50, t90, t100);
+
+		sim_run(sim_now() + interval * SIM_SECOND);
+	}
+
+	/*then the joiners, one at a time, each one bootstrapping from nodes that
+	  are already there (the joiners before it included), up to the largest
+	  archive among them*/
+	int booted = 0;
+	for (j = 0; j < joiners; j++) {
+		int peers = fanout > BOOT_TIPS ? fanout : BOOT_TIPS, nchosen = 0, c;
+		int chosen[peers];
+
+		target = 0;
+		for (i = 0; i < n + j; i++) {
+			if (sim_archive(i)->size > target) {
+				target = sim_archive(i)->size;
+			}
+		}
+		joiner = sim_add_node(htonl(0x0A000000 + n + j + 1), DEFAULT_PORT);
+		injected = sim_now();
+		sim_call(joiner, start_boot, NULL);
+		while (nchosen < peers && nchosen < joiner) {
+			int peer = sim_rand() % joiner, dup = 0;
+			for (c = 0; c < nchosen; c++) {
+				dup |= chosen[c] == peer;
+			}
+			if (!dup) {
+				chosen[nchosen++] = peer;
+				sim_connect(joiner, peer);
+			}
+		}
+		sim_run(injected + timeout * SIM_SECOND);
+
+		uint32_t size = sim_archive(joiner)->size;
+		booted += size >= target;
+		fprintf(results, "{\"joiner\":%d,\"peers\":%d,\"size\":%u,\"got\":%u,"
+			"\"t\":%.6f}\n", joiner, nchosen, target, size,
+			size >= target ? (double) (sim_now() - injected) / SIM_SECOND : -1.0);
+
+		sim_run(sim_now() + interval * SIM_SECOND);
+	}
+	joiner = -1;
+
+	struct sim_stats stats = sim_stats();
+	qsort(latencies, k, sizeof(double), compare_doubles);
+	fprintf(results, "{\"nodes\":%d,\"fanout\":%d,\"peerreq_s\":%.3f,"
+		"\"archreq_s\":%.3f,\"latency_ms\":%.3f,\"jitter_ms\":%.3f,\"bandwidth\":%llu,\"loss\":%.4f,"
+		"\"seed\":%llu,\"seek\":%d,\"messages\":%d,\"converged\":%d,\"joiners\":%d,"
+		"\"booted\":%d,\"t100_p50\":%.6f,"
+		"\"t100_p99\":%.6f,\"t100_max\":%.6f,\"connections\":%llu,"
+		"\"events\":%llu,\"deliveries\":%llu,\"bytes\":%llu,\"lost\":%llu,"
+		"\"virtual_seconds\":%.3f,\"wall_seconds\":%.3f}\n", n, fanout,
+		(double) config.peerreq / SIM_SECOND, (double) config.archreq / SIM_SECOND,
+		config.latency / 1000.0, config.jitter / 1000.0,
+		(unsigned long long) config.bandwidth, config.loss,
+		(unsigned long long) config.seed, seek, k, converged, joiners, booted,
+		latencies[(k - 1) / 2], latencies[(int) (0.99 * (k - 1) + 0.5)],
+		latencies[k-1],
+		(unsigned long long) stats.connections, (unsigned long long) stats.events,
+		(unsigned long long) stats.deliveries, (unsigned long long) stats.bytes,
+		(unsigned long long) stats.lost, (double) sim_now() / SIM_SECOND,
+		now_s() - wall);
+
+	free(latencies);
+	free(done);
+	return 0;
+}
@@ -11,7 +11,7 @@
   mentations would have been more time consuming, and given that the size of the
   list is unlikely to grow significantly, not worth the commitment*/
 
-/*Recomputes the list's string representation, to update connected peers after
+/*Recomputes the list's string representations, to update connected peers after
   the removal or addition of a peer*/
 void list_to_str(struct peer_list *list) {
 	uint8_t *buf;
@@ -45,18 +45,44 @@ void list_to_str(struct peer_list *list) {
 	}
 
 	list->str = buf;
+
+	/*extended format: type (6), our listen port, number of peers, and then IP
+	  and listen port for each peer, all in network byte order*/
+	free(list->ext_str);
+	buf = (uint8_t *) malloc(LIST_EXT_STR_LEN(size) * sizeof(uint8_t));
+
+	buf[0] = 6;
+	buf[1] = (list->port >> 8) & 0xFF;
+	buf[2] = list->port & 0xFF;
+	memcpy(buf+3, list->str+1, 4);
+
+	aux = list->head->next;
+	for (i = 7; i < LIST_EXT_STR_LEN(size); i+=6) {
+		memcpy(buf+i, &aux->ip, 4);
+		buf[i+4] = (aux->port >> 8) & 0xFF;
+		buf[i+5] = aux->port & 0xFF;
+
+		aux = aux->next;
+	}
+
+	list->ext_str = buf;
 }
 
-/*Adds a given IP to the list of connected peers, and updates the list's size
-  and string representation accordingly*/
-void add_peer(struct peer_list *list, uint32_t ip, uint32_t sock) {
+/*Adds a given IP/port to the list of connected peers, and updates the list's
+  size and string representations accordingly*/
+void add_peer(struct peer_list *list, uint32_t ip, uint16_t port,
+	uint32_t sock, uint8_t outgoing) {
 	struct node *aux;
 
 	aux = list->last;
 
 	aux->next = (struct node*) malloc(sizeof(struct node));
 	aux->next->ip = ip;
+	aux->next->port = port;
+	aux->next->ext = 0;
+	aux->next->outgoing = outgoing;
 	aux->next->sock = sock;
+	aux->next->id = 0;
 	aux->next->next = NULL;
 	list->last = aux->next;
 
@@ -65,22 +91,23 @@ void add_peer(struct peer_list *list, uint32_t ip, uint32_t sock) {
 	list_to_str(list);
 }
 
-/*Removes a given IP from the list of connected peers, and updates the list's
-  size and string representation accordingly*/
-void remove_peer(struct peer_list *list, uint32_t ip) {
+/*Removes the peer connected on the given socket from the list of connected
+  peers, and updates the list's size and string representations accordingly.
+  We go by socket rather than IP, since several peers may share an IP*/
+void remove_peer(struct peer_list *list, uint32_t sock) {
 	struct node *prev;
 
 	prev = list->head;
 
-	/*try to find IP in list, if we find it break with prev = previous node*/
+	/*try to find socket in list, if we find it break with prev = previous node*/
 	while (prev != list->last) {
-		if (prev->next->ip == ip) {
+		if (prev->next->sock == sock) {
 			break;
 		}
 		prev = prev->next;
 	}
 
-	/*IP is not in the list, return!*/
+	/*peer is not in the list, return!*/
 	if (prev->next == NULL) {
 		return;
 	}
@@ -103,16 +130,111 @@ void remove_peer(struct peer_list *list, uint32_t ip) {
 	list_to_str(list);
 }
 
-/*returns 1 if the given ip is currently in the list of connected peers, 0
-  otherwise, obviously used to check whether we are already connected to an ip*/
-int is_connected(struct peer_list *list, uint32_t ip) {
+/*Updates the listen port of the peer connected on the given socket, once the
+  peer tells us what it is, and updates the string representations*/
+void set_peer_port(struct peer_list *list, uint32_t sock, uint16_t port) {
+	struct node *aux;
+
+	for (aux = list->head->next; aux != NULL; aux = aux->next) {
+		if (aux->sock == sock) {
+			/*only rebuild the strings if something actually changed*/
+			if (aux->port != port) {
+				aux->port = port;
+				list_to_str(list);
+			}
+			return;
+		}
+	}
+}
+
+/*Marks the peer connected on the given socket as speaking the extended PeerList
+  format, so we can stop sending it original PeerRequests*/
+void set_peer_ext(struct peer_list *list, uint32_t sock) {
 	struct node *aux;
 
-	aux = list->head;
+	for (aux = list->head->next; aux != NULL; aux = aux->next) {
+		if (aux->sock == sock) {
+			aux->ext = 1;
+			return;
+		}
+	}
+}
+
+/*returns 1 if the peer connected on the given socket speaks the extended
+  PeerList format, 0 otherwise (or if it isn't in the list at all)*/
+int peer_is_ext(struct peer_list *list, uint32_t sock) {
+	struct node *aux;
+
+	for (aux = list->head->next; aux != NULL; aux = aux->next) {
+		if (aux->sock == sock) {
+			return aux->ext;
+		}
+	}
+	return 0;
+}
+
+/*Records the node id of the peer connected on the given socket*/
+void set_peer_id(struct peer_list *list, uint32_t sock, uint64_t id) {
+	struct node *aux;
+
+	for (aux = list->head->next; aux != NULL; aux = aux->next) {
+		if (aux->sock == sock) {
+			aux->id = id;
+			return;
+		}
+	}
+}
+
+/*returns 1 if we opened the connection to the peer on the given socket, 0
+  otherwise (or if it isn't in the list at all)*/
+int peer_is_outgoing(struct peer_list *list, uint32_t sock) {
+	struct node *aux;
+
+	for (aux = list->head->next; aux != NULL; aux = aux->next) {
+		if (aux->sock == sock) {
+			return aux->outgoing;
+		}
+	}
+	return 0;
+}
+
+/*returns the socket of a connection, other than the one on socket except, to
+  the peer with the given node id, or -1 if there's none*/
+int peer_with_id(struct peer_list *list, uint64_t id, uint32_t except) {
+	struct node *aux;
+
+	for (aux = list->head->next; aux != NULL; aux = aux->next) {
+		if (aux->id == id && aux->sock != except) {
+			return aux->sock;
+		}
+	}
+	return -1;
+}
+
+/*Copies the node of the peer connected on the given socket into peer. Returns
+  1 if it's in the list, 0 otherwise*/
+int get_peer(struct peer_list *list, uint32_t sock, struct node *peer) {
+	struct node *aux;
+
+	for (aux = list->head->next; aux != NULL; aux = aux->next) {
+		if (aux->sock == sock) {
+			*peer = *aux;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*returns 1 if the given ip/port is currently in the list of connected peers, 0
+  otherwise, obviously used to check whether we are already connected to a peer*/
+int is_connected(struct peer_list *list, uint32_t ip, uint16_t port) {
+	struct node *aux;
+
+	aux = list->head->next;
 
-	/*look for IP in the list, return 1 if we find it*/
+	/*look for IP/port in the list, return 1 if we find it*/
 	while (aux != NULL) {
-		if (aux->ip == ip) {
+		if (aux->ip == ip && aux->port == port) {
 			return 1;
 		}
 		aux = aux->next;
@@ -139,15 +261,15 @@ void print_list(struct peer_list *list) {
 	/*print all nodes, then the last*/
 	while (aux != list->last) {
 		/*since this is for debugging only, don't bother converting to string*/
-		fprintf(stderr, "%u[%u] -> ", aux->ip, aux->sock);
+		fprintf(stderr, "%u:%u[%u] -> ", aux->ip, aux->port, aux->sock);
 		aux = aux->next;
 	}
-	fprintf(stderr, "%u[%u]\n", aux->ip, aux->sock);
+	fprintf(stderr, "%u:%u[%u]\n", aux->ip, aux->port, aux->sock);
 }
 
 /*Initializes a peer list structure. Initially the list has size 0, and the
-  last and head nodes are the same (no data). Its string representation is
-  also a NULL pointer*/
+  last and head nodes are the same (no data). Its string representations are
+  also NULL pointers, and our listen port is the default one until set*/
 struct peer_list *init_list() {
 	struct peer_list *newlist;
 
@@ -160,6 +282,8 @@ struct peer_list *init_list() {
 	newlist->last = newlist->head;
 
 	newlist->str = NULL;
+	newlist->ext_str = NULL;
+	newlist->port = DEFAULT_PORT;
 
 	return newlist;
 }
@@ -2,45 +2,97 @@
 #include <stdlib.h>	//mallocs, frees and whatnot
 #include <stdint.h>	//portable size types (uint8_t, uint32_t, etc)
 
+#include <string.h>	//memcpys
+
+/*port peers listen on unless they tell us otherwise, this is also the port of
+  every peer that only speaks the original protocol*/
+#define DEFAULT_PORT 51511
+
 /*struct that represents a node in a list of connected peers, we store IPs as
  4 byte unsigned integers for faster comparison. This is safe because all IPs
- are guaranteed to be IPv4. We also store the socket associated with that peer,
- so we can broadcast messages by iterating across the list*/
+ are guaranteed to be IPv4. A peer is identified by its IP and the port it
+ listens on (in host byte order), so several peers can share the same host.
+ We also store the socket associated with that peer, so we can broadcast
+ messages by iterating across the list, whether the peer has shown us it
+ speaks the extended PeerList format, whether we're the ones who opened the
+ connection, and the peer's node id once it tells us (0 until then)*/
 struct node {
 	uint32_t ip;
+	uint16_t port;
+	uint8_t ext;
+	uint8_t outgoing;
   uint32_t sock;
+	uint64_t id;
 	struct node *next;
 };
 
 /*struct that represents an entire list of peers, with pointers to first and
-  last nodes, size (in number of nodes) and string representation, for faster
-  message building*/
+  last nodes, size (in number of nodes) and string representations, for faster
+  message building. str is the original PeerList format (IPs only), ext_str is
+  the extended format (IP+port, and our own listen port in the header), and
+  port is our own listen port, used to build the latter*/
 struct peer_list {
 	struct node *head, *last;
 	uint32_t size;
 	uint8_t *str;
+	uint8_t *ext_str;
+	uint16_t port;
 };
 
-/*Recomputes the list's string representation, to update connected peers after
+/*length of each string representation, for a list with the given size*/
+#define LIST_STR_LEN(size) (5 + (4 * (size)))
+#define LIST_EXT_STR_LEN(size) (7 + (6 * (size)))
+
+/*Recomputes the list's string representations, to update connected peers after
   the removal or addition of a peer*/
 void list_to_str(struct peer_list *list);
 
-/*Adds a given IP to the list of connected peers, and updates the list's size
-  and string representation accordingly*/
-void add_peer(struct peer_list *list, uint32_t ip, uint32_t sock);
+/*Adds a given IP/port to the list of connected peers, and updates the list's
+  size and string representations accordingly. outgoing says whether we
+  opened the connection*/
+void add_peer(struct peer_list *list, uint32_t ip, uint16_t port,
+	uint32_t sock, uint8_t outgoing);
+
+/*Removes the peer connected on the given socket from the list of connected
+  peers, and updates the list's size and string representations accordingly.
+  We go by socket rather than IP, since several peers may share an IP*/
+void remove_peer(struct peer_list *list, uint32_t sock);
+
+/*Updates the listen port of the peer connected on the given socket, once the
+  peer tells us what it is, and updates the string representations*/
+void set_peer_port(struct peer_list *list, uint32_t sock, uint16_t port);
+
+/*Marks the peer connected on the given socket as speaking the extended PeerList
+  format, so we can stop sending it original PeerRequests*/
+void set_peer_ext(struct peer_list *list, uint32_t sock);
+
+/*returns 1 if the peer connected on the given socket speaks the extended
+  PeerList format, 0 otherwise (or if it isn't in the list at all)*/
+int peer_is_ext(struct peer_list *list, uint32_t sock);
+
+/*Records the node id of the peer connected on the given socket*/
+void set_peer_id(struct peer_list *list, uint32_t sock, uint64_t id);
+
+/*returns 1 if we opened the connection to the peer on the given socket, 0
+  otherwise (or if it isn't in the list at all)*/
+int peer_is_outgoing(struct peer_list *list, uint32_t sock);
+
+/*returns the socket of a connection, other than the one on socket except, to
+  the peer with the given node id, or -1 if there's none*/
+int peer_with_id(struct peer_list *list, uint64_t id, uint32_t except);
 
-/*Removes a given IP from the list of connected peers, and updates the list's
-  size and string representation accordingly*/
-void remove_peer(struct peer_list *list, uint32_t ip);
+/*Copies the node of the peer connected on the given socket into peer. Returns
+  1 if it's in the list, 0 otherwise*/
+int get_peer(struct peer_list *list, uint32_t sock, struct node *peer);
 
-/*returns 1 if the given ip is currently in the list of connected peers, 0
-  otherwise, obviously used to check whether we are already connected to an ip*/
-int is_connected(struct peer_list *list, uint32_t ip);
+/*returns 1 if the given ip/port is currently in the list of connected peers, 0
+  otherwise, obviously used to check whether we are already connected to a peer*/
+int is_connected(struct peer_list *list, uint32_t ip, uint16_t port);
 
 /*prints a list of connected peers. Only for debugging purposes*/
 void print_list(struct peer_list *list);
 
 /*Initializes a peer list structure. Initially the list has size 0, and the
-  last and head nodes are the same (no data). Its string representation is
-  also a NULL pointer*/
+  last and head nodes are the same (no data). Its string representations are
+  also NULL pointers, and our listen port is the default one until set*/
 struct peer_list *init_list();
@@ -0,0 +1,225 @@
+#include "pool.h"
+#include "metrics.h"
+
+/*This file implements the shared compute pool, see pool.h*/
+
+/*a task waiting in a queue, and when it got there (for the metrics)*/
+struct pool_task {
+	void (*fn)(void*);
+	void *arg;
+	struct pool_group *group;
+	uint64_t queued;
+};
+
+/*a worker's queue for one priority, a ring buffer used as a deque. The owner
+  pushes and pops at the back, thieves take from the front.
+  mutex ->  protects everything else (every access is short, so a plain mutex
+            per queue does the job)
+  tasks ->  ring buffer, cap tasks long
+  head  ->  position of the oldest task
+  count ->  number of tasks in the queue*/
+struct pool_queue {
+	pthread_mutex_t mutex;
+	struct pool_task *tasks;
+	uint32_t head, count, cap;
+};
+
+struct pool_worker {
+	pthread_t thread;
+	struct pool_queue queues[POOL_PRIOS];
+};
+
+static struct pool_worker *workers = NULL;
+static int nworkers = 0;
+
+/*tasks in every queue, and what idle workers sleep on until there are some.
+  Submitters only bump it after their task is in a queue, so a worker that sees
+  it above 0 will find something (or someone else got it first, and it'll
+  check again)*/
+static int queued = 0;
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+/*where tasks submitted from outside the pool go next, round robin*/
+static unsigned int next_worker = 0;
+
+/*index of the worker running on the calling thread, -1 for other threads*/
+static __thread int my_worker = -1;
+
+static void queue_push(struct pool_queue *q, struct pool_task *task) {
+	pthread_mutex_lock(&q->mutex);
+	if (q->count == q->cap) {
+		uint32_t newcap = q->cap ? q->cap * 2 : 16, i;
+		struct pool_task *tasks = malloc(newcap * sizeof(struct pool_task));
+
+		for (i = 0; i < q->count; i++) {
+			tasks[i] = q->tasks[(q->head + i) % q->cap];
+		}
+		free(q->tasks);
+		q->tasks = tasks;
+		q->head = 0;
+		q->cap = newcap;
+	}
+	q->tasks[(q->head + q->count) % q->cap] = *task;
+	q->count++;
+	pthread_mutex_unlock(&q->mutex);
+}
+
+/*takes the newest task (back) if back is set, the oldest (front) otherwise.
+  Returns 1 if there was one*/
+static int queue_take(struct pool_queue *q, struct pool_task *task, int back) {
+	int found = 0;
+
+	pthread_mutex_lock(&q->mutex);
+	if (q->count > 0) {
+		if (back) {
+			*task = q->tasks[(q->head + q->count - 1) % q->cap];
+		}
+		else {
+			*task = q->tasks[q->head];
+			q->head = (q->head + 1) % q->cap;
+		}
+		q->count--;
+		found = 1;
+	}
+	pthread_mutex_unlock(&q->mutex);
+	return found;
+}
+
+/*finds the next task for worker self: its own newest task of the highest
+  priority there is, or failing that, the oldest one of another worker*/
+static int find_task(int self, struct pool_task *task) {
+	int prio, i;
+
+	for (prio = 0; prio < POOL_PRIOS; prio++) {
+		if (queue_take(&workers[self].queues[prio], task, 1)) {
+			return 1;
+		}
+		for (i = 1; i < nworkers; i++) {
+			int victim = (self + i) % nworkers;
+			if (queue_take(&workers[victim].queues[prio], task, 0)) {
+				metrics_add(M_POOL_STEALS, 1);
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static void run_task(struct pool_task *task) {
+	task->fn(task->arg);
+
+	if (task->group != NULL) {
+		pthread_mutex_lock(&task->group->mutex);
+		if (--task->group->pending == 0) {
+			pthread_cond_broadcast(&task->group->cond);
+		}
+		pthread_mutex_unlock(&task->group->mutex);
+	}
+}
+
+static void *worker_thread(void *args) {
+	struct pool_task task;
+
+	my_worker = (int) (intptr_t) args;
+
+	while (1) {
+		if (find_task(my_worker, &task)) {
+			__sync_fetch_and_sub(&queued, 1);
+			metrics_observe(H_POOL_QUEUE, metrics_now() - task.queued);
+			metrics_add(M_POOL_TASKS, 1);
+			run_task(&task);
+			continue;
+		}
+
+		/*nothing anywhere, sleep until something gets submitted*/
+		pthread_mutex_lock(&idle_mutex);
+		while (__sync_fetch_and_add(&queued, 0) <= 0) {
+			pthread_cond_wait(&idle_cond, &idle_mutex);
+		}
+		pthread_mutex_unlock(&idle_mutex);
+	}
+	return NULL;
+}
+
+int pool_init(int nthreads) {
+	int i, p;
+
+	if (nthreads <= 0) {
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (nthreads <= 0) {
+			nthreads = 1;
+		}
+	}
+
+	workers = calloc(nthreads, sizeof(struct pool_worker));
+	for (i = 0; i < nthreads; i++) {
+		for (p = 0; p < POOL_PRIOS; p++) {
+			pthread_mutex_init(&workers[i].queues[p].mutex, NULL);
+		}
+	}
+
+	/*workers only look at nworkers queues, so they can start as we go*/
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_thread,
+			(void*) (intptr_t) i) != 0) {
+			break;
+		}
+		pthread_detach(workers[i].thread);
+		__sync_fetch_and_add(&nworkers, 1);
+	}
+
+	return nworkers > 0 ? nworkers : -1;
+}
+
+int pool_size() {
+	return nworkers;
+}
+
+void pool_submit(struct pool_group *group, int prio, void (*fn)(void*),
+	void *arg) {
+	struct pool_task task;
+
+	task.fn = fn;
+	task.arg = arg;
+	task.group = group;
+
+	if (group != NULL) {
+		pthread_mutex_lock(&group->mutex);
+		group->pending++;
+		pthread_mutex_unlock(&group->mutex);
+	}
+
+	/*no pool, do it ourselves*/
+	if (nworkers == 0) {
+		run_task(&task);
+		return;
+	}
+
+	/*workers keep what they submit, everyone else spreads tasks around*/
+	int w = my_worker;
+	if (w == -1) {
+		w = __sync_fetch_and_add(&next_worker, 1) % nworkers;
+	}
+	task.queued = metrics_now();
+	queue_push(&workers[w].queues[prio], &task);
+
+	pthread_mutex_lock(&idle_mutex);
+	__sync_fetch_and_add(&queued, 1);
+	pthread_cond_signal(&idle_cond);
+	pthread_mutex_unlock(&idle_mutex);
+}
+
+void pool_group_init(struct pool_group *group) {
+	pthread_mutex_init(&group->mutex, NULL);
+	pthread_cond_init(&group->cond, NULL);
+	group->pending = 0;
+}
+
+void pool_wait(struct pool_group *group) {
+	pthread_mutex_lock(&group->mutex);
+	while (group->pending > 0) {
+		pthread_cond_wait(&group->cond, &group->mutex);
+	}
+	pthread_mutex_unlock(&group->mutex);
+}
@@ -0,0 +1,54 @@
+#include <stdlib.h>				//mallocs, reallocs and frees
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <unistd.h>				//sysconf, for the core count
+#include <pthread.h>			//worker threads, and the locks for their queues
+
+/*Shared compute pool for the CPU heavy work (mining and archive validation), so
+  it doesn't run on whichever thread happens to trigger it. There's one worker
+  per core, each with its own queue per priority. Workers run the tasks in
+  their own queues newest first, and when those are empty they steal the
+  oldest task from another worker's queue, so a burst of tasks submitted to one
+  worker gets spread over every core. Higher priority tasks always go first,
+  from any queue, before a worker looks at lower priority ones.
+
+  Until pool_init is called there is no pool, and tasks simply run on the
+  calling thread as they are submitted. Programs that run the node's code
+  single threaded (the simulator, the replay driver) rely on that.*/
+
+/*task priorities, POOL_HIGH is for what the user is waiting on (committing our
+  own message, validating the best archive we've been offered, or the ranges
+  of the bootstrap)*/
+enum {
+	POOL_HIGH = 0,
+	POOL_NORMAL,
+	POOL_PRIOS
+};
+
+/*a group of tasks someone can wait for. Brief description:
+  mutex   ->  protects pending
+  cond    ->  signaled when pending drops to 0
+  pending ->  tasks submitted to the group that haven't finished yet*/
+struct pool_group {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int pending;
+};
+
+/*Starts the pool with the given number of workers, or one per core if it's 0.
+  Returns the number of workers, or -1 if the pool couldn't be started*/
+int pool_init(int nthreads);
+
+/*Returns the number of workers in the pool (0 if there's no pool)*/
+int pool_size();
+
+/*Submits fn(arg) to the pool with the given priority. If group isn't NULL, the
+  task counts towards it, so it can be waited for with pool_wait. Never blocks,
+  unless there's no pool, in which case fn runs right away*/
+void pool_submit(struct pool_group *group, int prio, void (*fn)(void*),
+	void *arg);
+
+/*Initializes a group of tasks*/
+void pool_group_init(struct pool_group *group);
+
+/*Waits until every task submitted to the group so far has finished*/
+void pool_wait(struct pool_group *group);
@@ -0,0 +1,290 @@
+#include "main.h"
+#include "peerlist.h"
+#include "archive.h"
+#include "transport.h"
+#include "trace.h"
+#include "forks.h"
+#include "channel.h"
+#include "metrics.h"
+
+/*Replay driver. Feeds a trace recorded by a node (./blockchain -R) back through
+  the node's message handlers, as fast as possible or at the original timing,
+  so load seen in production (say, a storm of big ArchiveResponses) can be
+  reproduced and profiled offline. Replies the node would send are counted and
+  thrown away, and peers it would connect to are "connected" to on the spot.
+  Results are printed as lines of JSON: one per message type, with how much
+  time the handlers took, and a summary.
+
+  Usage: ./replay [-t] [-x speed] [-f] [-n loops] [-m] <tracefile>
+    -t  replay at the original timing, instead of as fast as possible
+    -x  replay at this many times the original speed (implies -t)
+    -f  empty the active archive (and the fork store) before every
+        ArchiveResponse, so every archive gets validated whole, instead of only
+        the ones longer than the active one, from where they part ways with
+        the archives seen before
+    -n  replay the whole trace this many times (default 1)
+    -m  print the node's metrics (Prometheus text format) at the end*/
+
+/*globals owned by main.c*/
+extern struct peer_list *peerlist;
+extern pthread_mutex_t peerlist_mutex;
+extern struct channel_table *channels;
+
+/*where results go (the real stdout, since we silence the stdout stream)*/
+static FILE *results;
+
+/*message type names, for results (anything unknown is counted as "other")*/
+#define REPLAY_TYPES 17
+static const char *type_names[REPLAY_TYPES] = {"other", "peer_request",
+	"peer_list", "archive_request", "archive_response", "peer_request_ext",
+	"peer_list_ext", "archive_request_ch", "archive_response_ch",
+	"hello_request", "hello", "tip_request", "tip", "range_request",
+	"range", "probe_request", "probe"};
+
+/*sockets for peers the node connects to during the replay start here, and we
+  remember their IPs*/
+#define REPLAY_SOCK_BASE (1 << 20)
+static uint32_t *fake_ips;
+static int nfake, fakecap;
+
+/*peers to start talking to once the current message is handled (the node
+  connects while holding the peer list lock)*/
+static int *pending_socks;
+static uint16_t *pending_ports;
+static int npending, pendingcap;
+
+/*the frame being replayed, and how much of it was read*/
+static struct trace_frame frame;
+static uint8_t *framebuf;
+static uint32_t framecap, framepos;
+
+/*bytes the node tried to send*/
+static uint64_t sent_bytes;
+
+static double now_s() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*the replay transport: reads come from the current frame, and everything else
+  is pretend*/
+static int replay_connect(char *ip, uint16_t port) {
+	struct in_addr addr;
+	(void) port;
+
+	if (inet_aton(ip, &addr) == 0) {
+		return -1;
+	}
+	if (nfake == fakecap) {
+		fakecap = fakecap ? fakecap * 2 : 64;
+		fake_ips = realloc(fake_ips, fakecap * sizeof(uint32_t));
+	}
+	fake_ips[nfake] = addr.s_addr;
+	return REPLAY_SOCK_BASE + nfake++;
+}
+
+static void replay_start(int sock, uint16_t port) {
+	if (npending == pendingcap) {
+		pendingcap = pendingcap ? pendingcap * 2 : 64;
+		pending_socks = realloc(pending_socks, pendingcap * sizeof(int));
+		pending_ports = realloc(pending_ports, pendingcap * sizeof(uint16_t));
+	}
+	pending_socks[npending] = sock;
+	pending_ports[npending++] = port;
+}
+
+static ssize_t replay_send(int sock, const void *buf, size_t len, int flags) {
+	(void) sock;
+	(void) buf;
+	(void) flags;
+	sent_bytes += len;
+	return len;
+}
+
+static ssize_t replay_sendfile(int sock, int fd, off_t *offset, size_t len) {
+	(void) sock;
+	(void) fd;
+	sent_bytes += len;
+	*offset += len;
+	return len;
+}
+
+static int replay_recv(int sock, void *buf, uint32_t len) {
+	(void) sock;
+	if (frame.len - framepos < len) {
+		framepos = frame.len;
+		return 0;
+	}
+	memcpy(buf, framebuf + framepos, len);
+	framepos += len;
+	return len;
+}
+
+static uint32_t replay_peer_ip(int sock) {
+	if (sock >= REPLAY_SOCK_BASE) {
+		return fake_ips[sock - REPLAY_SOCK_BASE];
+	}
+	return frame.ip;
+}
+
+static void replay_hangup(int sock) {
+	(void) sock;
+}
+
+static int replay_close(int sock) {
+	(void) sock;
+	return 0;
+}
+
+static const struct transport replay_transport = {
+	.connect = replay_connect,
+	.start = replay_start,
+	.send = replay_send,
+	.sendfile = replay_sendfile,
+	.recv = replay_recv,
+	.peer_ip = replay_peer_ip,
+	.hangup = replay_hangup,
+	.close = replay_close
+};
+
+int main(int argc, char *argv[]) {
+	int opt, timing = 0, fresh = 0, loops = 1, dump = 0, loop, i;
+	double speed = 1;
+
+	while ((opt = getopt(argc, argv, "tx:fn:m")) != -1) {
+		switch (opt) {
+			case 't': {
+				timing = 1;
+				break;
+			}
+
+			case 'x': {
+				timing = 1;
+				speed = atof(optarg);
+				break;
+			}
+
+			case 'f': {
+				fresh = 1;
+				break;
+			}
+
+			case 'n': {
+				loops = atoi(optarg);
+				break;
+			}
+
+			case 'm': {
+				dump = 1;
+				break;
+			}
+
+			default: {
+				fprintf(stderr, "Usage: ./replay [-t] [-x speed] [-f] [-n loops] [-m] "
+					"<tracefile>\n");
+				return 1;
+			}
+		}
+	}
+
+	if (argc - optind != 1 || speed <= 0) {
+		fprintf(stderr, "Usage: ./replay [-t] [-x speed] [-f] [-n loops] [-m] "
+			"<tracefile>\n");
+		return 1;
+	}
+
+	FILE *trace = trace_open_read(argv[optind]);
+	if (trace == NULL) {
+		fprintf(stderr, "Could not open trace %s (or it's not a trace)!\n",
+			argv[optind]);
+		return 1;
+	}
+
+	/*keep the real stdout for results, and silence everything else*/
+	results = fdopen(dup(STDOUT_FILENO), "w");
+	setvbuf(results, NULL, _IOLBF, 0);
+	freopen("/dev/null", "w", stdout);
+
+	/*the node's globals, as main() would set them up*/
+	peerlist = init_list();
+	list_to_str(peerlist);
+	pthread_mutex_init(&peerlist_mutex, NULL);
+	channels = channels_init(1);
+	transport = &replay_transport;
+
+	uint64_t frames[REPLAY_TYPES] = {0}, bytes[REPLAY_TYPES] = {0};
+	double seconds[REPLAY_TYPES] = {0}, start = now_s();
+	uint64_t total = 0, short_frames = 0;
+
+	for (loop = 0; loop < loops; loop++) {
+		uint64_t first = 0;
+		double loopstart = now_s();
+
+		fseek(trace, 8, SEEK_SET);
+		while (trace_read(trace, &frame, &framebuf, &framecap)) {
+			int t = frame.type < REPLAY_TYPES ? frame.type : 0;
+
+			/*wait until the frame is due, relative to the first one*/
+			if (timing) {
+				if (first == 0) {
+					first = frame.ts;
+				}
+				double due = loopstart + (frame.ts - first) / 1e9 / speed;
+				double wait = due - now_s();
+				if (wait > 0) {
+					struct timespec ts;
+					ts.tv_sec = (time_t) wait;
+					ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+					nanosleep(&ts, NULL);
+				}
+			}
+
+			if (fresh && frame.type == 4) {
+				free_archive(channels->list[0]->arch);
+				channels->list[0]->arch = init_archive();
+				fork_clear(channels->list[0]->forks);
+			}
+
+			framepos = 0;
+			double handled = now_s();
+			handle_message(frame.sock, frame.type);
+			seconds[t] += now_s() - handled;
+			frames[t]++;
+			bytes[t] += frame.len + 1;
+			total++;
+			short_frames += framepos != frame.len;
+
+			/*now that the handler let go of the peer list, add new peers to it*/
+			for (i = 0; i < npending; i++) {
+				peer_connected(pending_socks[i], pending_ports[i], 1);
+			}
+			npending = 0;
+		}
+	}
+	double elapsed = now_s() - start;
+
+	for (i = 0; i < REPLAY_TYPES; i++) {
+		if (frames[i] == 0) {
+			continue;
+		}
+		fprintf(results, "{\"type\":\"%s\",\"frames\":%llu,\"bytes\":%llu,"
+			"\"seconds\":%.6f,\"us_per_frame\":%.3f,\"mb_per_s\":%.2f}\n",
+			type_names[i], (unsigned long long) frames[i],
+			(unsigned long long) bytes[i], seconds[i], seconds[i] * 1e6 / frames[i],
+			seconds[i] > 0 ? bytes[i] / seconds[i] / 1e6 : 0);
+	}
+	fprintf(results, "{\"frames\":%llu,\"loops\":%d,\"timing\":%d,\"speed\":%.3f,"
+		"\"fresh\":%d,\"seconds\":%.6f,\"frames_per_s\":%.0f,\"sent_bytes\":%llu,"
+		"\"short_frames\":%llu,\"archive_size\":%u,\"peers\":%u}\n",
+		(unsigned long long) total, loops, timing, speed, fresh, elapsed,
+		total / elapsed, (unsigned long long) sent_bytes,
+		(unsigned long long) short_frames, channels->list[0]->arch->size, peerlist->size);
+
+	if (dump) {
+		metrics_dump(results);
+	}
+
+	fclose(trace);
+	return 0;
+}
@@ -0,0 +1,552 @@
+#include "search.h"
+#include "archive.h"
+#include "metrics.h"
+
+/*This file implements the full-text index, see search.h*/
+
+/*"no number", numbers of messages always being smaller*/
+#define NONE UINT32_MAX
+
+/*most cuts an index remembers, once there's this many every list is cut down
+  and they're forgotten*/
+#define MAX_CUTS 256
+
+/*a word in the index, and the list of the messages it's in. Brief description:
+  text    ->  where the word is in the index's text
+  epoch   ->  how many cuts the index had the last time the list was cut down
+  count   ->  how many numbers the list has
+  last    ->  the last of them
+  dlen    ->  bytes of gaps in data, which has room for dcap
+  nblocks ->  blocks in the list, blocks having room for bcap
+  data    ->  the gaps between every number and the one before it, as varints
+              (7 bits per byte, the top bit set on every byte but the last),
+              except for the first number of every block
+  blocks  ->  for every block, its first number, and where its gaps start in
+              data
+  len     ->  length of the word*/
+struct term {
+	uint32_t text;
+	uint32_t epoch, count, last;
+	uint32_t dlen, dcap, nblocks, bcap;
+	uint8_t *data;
+	uint32_t *blocks;
+	uint8_t len;
+};
+
+/*an index. Brief description:
+  mutex     ->  protects everything below, queries change the index too (cutting
+                down lists)
+  indexed   ->  how many messages of the archive are in the index
+  terms     ->  every word in the index, nterms of them (room for termscap)
+  slots     ->  hash table of the words, open addressing, each slot being a
+                word's number plus 1 (0 for empty), nslots of them
+  text      ->  the words themselves, one after the other, tlen bytes (room for
+                tcap)
+  order     ->  numbers of the words in alphabetical order, for prefixes. Only
+                the first nsorted are in order, words added after that are
+                sorted in the next time a prefix is looked for
+  cuts      ->  where the archive was cut (see search_forget), ncuts of them*/
+struct search_index {
+	pthread_mutex_t mutex;
+	uint32_t indexed;
+	struct term *terms;
+	uint32_t nterms, termscap;
+	uint32_t *slots;
+	uint32_t nslots;
+	char *text;
+	uint32_t tlen, tcap;
+	uint32_t *order;
+	uint32_t nsorted;
+	uint32_t cuts[MAX_CUTS];
+	uint32_t ncuts;
+};
+
+/*memory taken by every index, for the metrics*/
+static uint64_t total_bytes = 0;
+
+/*grows an allocation of the index from old bytes to new bytes, keeping count*/
+static void *resize(void *p, size_t old, size_t new) {
+	__atomic_add_fetch(&total_bytes, new - old, __ATOMIC_RELAXED);
+	return realloc(p, new);
+}
+
+static int is_word_char(uint8_t c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		(c >= '0' && c <= '9');
+}
+
+/*Finds the next word in s (len bytes long) from *pos on, and copies it,
+  lowercased, into word (longer words are cut down to 255 characters). Moves
+  *pos past it, and returns its length, or 0 if there are no more words*/
+static int next_word(const uint8_t *s, int len, int *pos, char *word) {
+	int wlen = 0;
+
+	while (*pos < len && !is_word_char(s[*pos])) {
+		(*pos)++;
+	}
+	while (*pos < len && is_word_char(s[*pos])) {
+		if (wlen < 255) {
+			uint8_t c = s[*pos];
+			word[wlen++] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+		}
+		(*pos)++;
+	}
+	return wlen;
+}
+
+static uint32_t hash_word(const char *word, int len) {
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= (uint8_t) word[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*Returns the number of a word, or NONE if it isn't in the index*/
+static uint32_t find_term(struct search_index *idx, const char *word, int len) {
+	uint32_t i, mask = idx->nslots - 1;
+
+	if (idx->nslots == 0) {
+		return NONE;
+	}
+	for (i = hash_word(word, len) & mask; idx->slots[i] != 0; i = (i + 1) & mask) {
+		struct term *t = &idx->terms[idx->slots[i] - 1];
+		if (t->len == len && memcmp(idx->text + t->text, word, len) == 0) {
+			return idx->slots[i] - 1;
+		}
+	}
+	return NONE;
+}
+
+/*puts a word's number in its slot of the hash table*/
+static void put_slot(struct search_index *idx, uint32_t id) {
+	struct term *t = &idx->terms[id];
+	uint32_t i, mask = idx->nslots - 1;
+
+	for (i = hash_word(idx->text + t->text, t->len) & mask; idx->slots[i] != 0;
+		i = (i + 1) & mask);
+	idx->slots[i] = id + 1;
+}
+
+/*Adds a word to the index, with an empty list, and returns its number*/
+static uint32_t add_term(struct search_index *idx, const char *word, int len) {
+	uint32_t i, id = idx->nterms;
+
+	if (idx->nterms == idx->termscap) {
+		uint32_t cap = idx->termscap ? idx->termscap * 2 : 1024;
+		idx->terms = resize(idx->terms, idx->termscap * sizeof(struct term),
+			cap * sizeof(struct term));
+		idx->order = resize(idx->order, idx->termscap * sizeof(uint32_t),
+			cap * sizeof(uint32_t));
+		idx->termscap = cap;
+	}
+	if (idx->tlen + len > idx->tcap) {
+		uint32_t cap = idx->tcap ? idx->tcap : 4096;
+		while (idx->tlen + len > cap) {
+			cap *= 2;
+		}
+		idx->text = resize(idx->text, idx->tcap, cap);
+		idx->tcap = cap;
+	}
+
+	struct term *t = &idx->terms[id];
+	memset(t, 0, sizeof(struct term));
+	t->text = idx->tlen;
+	t->len = len;
+	t->epoch = idx->ncuts;
+	memcpy(idx->text + idx->tlen, word, len);
+	idx->tlen += len;
+	idx->order[id] = id;
+	idx->nterms++;
+
+	/*the hash table is kept at most 70% full*/
+	if (idx->nterms * 10 > idx->nslots * 7) {
+		uint32_t old = idx->nslots;
+		free(idx->slots);
+		__atomic_sub_fetch(&total_bytes, old * sizeof(uint32_t), __ATOMIC_RELAXED);
+		idx->nslots = old ? old * 2 : 2048;
+		idx->slots = resize(NULL, 0, idx->nslots * sizeof(uint32_t));
+		memset(idx->slots, 0, idx->nslots * sizeof(uint32_t));
+		for (i = 0; i < idx->nterms; i++) {
+			put_slot(idx, i);
+		}
+	}
+	else {
+		put_slot(idx, id);
+	}
+	return id;
+}
+
+/*Puts a number at the end of a word's list, it must be larger than the last*/
+static void put_number(struct term *t, uint32_t n) {
+	if (t->count % SEARCH_BLOCK == 0) {
+		if (t->nblocks == t->bcap) {
+			uint32_t cap = t->bcap ? t->bcap * 2 : 1;
+			t->blocks = resize(t->blocks, t->bcap * 2 * sizeof(uint32_t),
+				cap * 2 * sizeof(uint32_t));
+			t->bcap = cap;
+		}
+		t->blocks[2*t->nblocks] = n;
+		t->blocks[2*t->nblocks + 1] = t->dlen;
+		t->nblocks++;
+	}
+	else {
+		uint32_t gap = n - t->last;
+
+		if (t->dlen + 5 > t->dcap) {
+			uint32_t cap = t->dcap ? t->dcap * 2 : 8;
+			t->data = resize(t->data, t->dcap, cap);
+			t->dcap = cap;
+		}
+		while (gap >= 128) {
+			t->data[t->dlen++] = (gap & 127) | 128;
+			gap >>= 7;
+		}
+		t->data[t->dlen++] = gap;
+	}
+	t->last = n;
+	t->count++;
+}
+
+/*Returns the last block of a word's list that starts at or before x, -1 if
+  there's none*/
+static int find_block(struct term *t, uint32_t x) {
+	uint32_t lo = 0, hi = t->nblocks;
+
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (t->blocks[2*mid] <= x) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return (int) lo - 1;
+}
+
+/*Walks a block of a word's list (which must start at or before x) up to the
+  last number that isn't past x, and returns it. end gets where the gaps after
+  that number start in data, and k how many numbers of the block that is*/
+static uint32_t walk_block(struct term *t, uint32_t b, uint32_t x, uint32_t *end,
+	uint32_t *k) {
+	uint32_t v = t->blocks[2*b], pos = t->blocks[2*b + 1], n = 1;
+	uint32_t stop = b + 1 < t->nblocks ? t->blocks[2*b + 3] : t->dlen;
+
+	while (pos < stop) {
+		uint32_t gap = 0, shift = 0, p = pos;
+		do {
+			gap |= (uint32_t) (t->data[p] & 127) << shift;
+			shift += 7;
+		} while (t->data[p++] & 128);
+
+		if (v + gap > x) {
+			break;
+		}
+		v += gap;
+		pos = p;
+		n++;
+	}
+	*end = pos;
+	*k = n;
+	return v;
+}
+
+/*Returns the largest number in a word's list that isn't past x, NONE if
+  there's none*/
+static uint32_t seek_term(struct term *t, uint32_t x) {
+	uint32_t end, k;
+	int b = find_block(t, x);
+
+	return b < 0 ? NONE : walk_block(t, b, x, &end, &k);
+}
+
+/*Takes the numbers from n on out of a word's list*/
+static void cut_term(struct term *t, uint32_t n) {
+	uint32_t end, k;
+	int b;
+
+	if (t->count == 0 || t->last < n) {
+		return;
+	}
+	if (n == 0 || (b = find_block(t, n - 1)) < 0) {
+		t->count = t->nblocks = t->dlen = 0;
+		return;
+	}
+	t->last = walk_block(t, b, n - 1, &end, &k);
+	t->dlen = end;
+	t->nblocks = b + 1;
+	t->count = b * SEARCH_BLOCK + k;
+}
+
+/*Cuts a word's list down to where the archive was cut since it last was*/
+static void settle(struct search_index *idx, struct term *t) {
+	uint32_t i, lowest = NONE;
+
+	if (t->epoch == idx->ncuts) {
+		return;
+	}
+	for (i = t->epoch; i < idx->ncuts; i++) {
+		if (idx->cuts[i] < lowest) {
+			lowest = idx->cuts[i];
+		}
+	}
+	cut_term(t, lowest);
+	t->epoch = idx->ncuts;
+}
+
+static void forget(struct search_index *idx, uint32_t first) {
+	uint32_t i;
+
+	if (first >= idx->indexed) {
+		return;
+	}
+
+	/*too many cuts to remember, so make every list forget them*/
+	if (idx->ncuts == MAX_CUTS) {
+		for (i = 0; i < idx->nterms; i++) {
+			settle(idx, &idx->terms[i]);
+			idx->terms[i].epoch = 0;
+		}
+		idx->ncuts = 0;
+	}
+	idx->cuts[idx->ncuts++] = first;
+	idx->indexed = first;
+}
+
+/*Adds message number n to the lists of the words in it*/
+static void index_message(struct search_index *idx, const uint8_t *msg,
+	uint8_t len, uint32_t n) {
+	char word[256];
+	int pos = 0, wlen;
+
+	while ((wlen = next_word(msg, len, &pos, word)) > 0) {
+		uint32_t id = find_term(idx, word, wlen);
+		if (id == NONE) {
+			id = add_term(idx, word, wlen);
+		}
+
+		/*words that show up more than once in a message are only listed once*/
+		struct term *t = &idx->terms[id];
+		settle(idx, t);
+		if (t->count == 0 || t->last < n) {
+			put_number(t, n);
+		}
+	}
+}
+
+/*compares a word in the index with the given one, like memcmp*/
+static int compare_term(struct search_index *idx, uint32_t id, const char *word,
+	int len) {
+	struct term *t = &idx->terms[id];
+	int c = memcmp(idx->text + t->text, word, t->len < len ? t->len : len);
+
+	return c != 0 ? c : t->len - len;
+}
+
+/*Sorts n word numbers alphabetically (a merge sort, tmp having room for n)*/
+static void sort_terms(struct search_index *idx, uint32_t *ids, uint32_t n,
+	uint32_t *tmp) {
+	uint32_t i, j, k, half = n / 2;
+
+	if (n < 2) {
+		return;
+	}
+	sort_terms(idx, ids, half, tmp);
+	sort_terms(idx, ids + half, n - half, tmp);
+
+	for (i = 0, j = half, k = 0; i < half || j < n; k++) {
+		if (j == n || (i < half && compare_term(idx, ids[i],
+			idx->text + idx->terms[ids[j]].text, idx->terms[ids[j]].len) <= 0)) {
+			tmp[k] = ids[i++];
+		}
+		else {
+			tmp[k] = ids[j++];
+		}
+	}
+	memcpy(ids, tmp, n * sizeof(uint32_t));
+}
+
+/*Sorts the words added since the last time into order*/
+static void sort_new_terms(struct search_index *idx) {
+	if (idx->nsorted == idx->nterms) {
+		return;
+	}
+
+	/*sorting the new ones and merging them with the rest is the same as the last
+	  step of sorting all of them*/
+	uint32_t *tmp = malloc(idx->nterms * sizeof(uint32_t));
+	sort_terms(idx, idx->order + idx->nsorted, idx->nterms - idx->nsorted, tmp);
+	uint32_t i = 0, j = idx->nsorted, k;
+	for (k = 0; k < idx->nterms; k++) {
+		if (j == idx->nterms || (i < idx->nsorted && compare_term(idx,
+			idx->order[i], idx->text + idx->terms[idx->order[j]].text,
+			idx->terms[idx->order[j]].len) <= 0)) {
+			tmp[k] = idx->order[i++];
+		}
+		else {
+			tmp[k] = idx->order[j++];
+		}
+	}
+	memcpy(idx->order, tmp, idx->nterms * sizeof(uint32_t));
+	free(tmp);
+	idx->nsorted = idx->nterms;
+}
+
+/*Adds the numbers of every word that starts with the given prefix to ids
+  (which has room for SEARCH_MAX_EXPAND more). Returns how many there are, or
+  -1 if there's too many*/
+static int expand_prefix(struct search_index *idx, const char *prefix, int len,
+	uint32_t *ids) {
+	uint32_t lo = 0, hi, i;
+	int n = 0;
+
+	sort_new_terms(idx);
+	hi = idx->nsorted;
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+		if (compare_term(idx, idx->order[mid], prefix, len) < 0) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+
+	for (i = lo; i < idx->nsorted; i++) {
+		struct term *t = &idx->terms[idx->order[i]];
+		if (t->len < len || memcmp(idx->text + t->text, prefix, len) != 0) {
+			break;
+		}
+		if (n == SEARCH_MAX_EXPAND) {
+			return -1;
+		}
+		ids[n++] = idx->order[i];
+	}
+	return n;
+}
+
+struct search_index *search_init() {
+	struct search_index *idx = calloc(1, sizeof(struct search_index));
+
+	pthread_mutex_init(&idx->mutex, NULL);
+	__atomic_add_fetch(&total_bytes, sizeof(struct search_index), __ATOMIC_RELAXED);
+	return idx;
+}
+
+void search_forget(struct search_index *idx, uint32_t first) {
+	pthread_mutex_lock(&idx->mutex);
+	forget(idx, first);
+	pthread_mutex_unlock(&idx->mutex);
+}
+
+int search_update(struct search_index *idx, struct archive *arch, uint32_t max) {
+	uint32_t n, end;
+
+	pthread_mutex_lock(&idx->mutex);
+	if (arch->size < idx->indexed) {
+		forget(idx, arch->size);
+	}
+
+	end = arch->size - idx->indexed > max ? idx->indexed + max : arch->size;
+	for (n = idx->indexed; n < end; n++) {
+		uint8_t *rec = arch->str + arch->index[n];
+		index_message(idx, rec + 1, rec[0], n);
+	}
+	idx->indexed = end;
+	pthread_mutex_unlock(&idx->mutex);
+
+	metrics_gauge(G_SEARCH_BYTES, __atomic_load_n(&total_bytes, __ATOMIC_RELAXED));
+	return end == arch->size;
+}
+
+int search_query(struct search_index *idx, const char *query, uint32_t before,
+	int limit, uint32_t *results) {
+	uint32_t *ids = malloc(SEARCH_MAX_TERMS * SEARCH_MAX_EXPAND * sizeof(uint32_t));
+	uint32_t first[SEARCH_MAX_TERMS], count[SEARCH_MAX_TERMS], nids = 0, i;
+	int pos = 0, len = strlen(query), wlen, nterms = 0, found = 0, empty = 0;
+	char word[256];
+	uint64_t start = metrics_now();
+
+	pthread_mutex_lock(&idx->mutex);
+
+	/*every word of the query stands for the words in the index it matches: itself
+	  or, for a prefix, every word that starts with it*/
+	while ((wlen = next_word((const uint8_t*) query, len, &pos, word)) > 0) {
+		if (nterms == SEARCH_MAX_TERMS) {
+			found = -1;
+			break;
+		}
+		first[nterms] = nids;
+		if (pos < len && query[pos] == '*') {
+			int n = expand_prefix(idx, word, wlen, ids + nids);
+			if (n < 0) {
+				found = -1;
+				break;
+			}
+			nids += n;
+		}
+		else {
+			uint32_t id = find_term(idx, word, wlen);
+			if (id != NONE) {
+				ids[nids++] = id;
+			}
+		}
+		count[nterms] = nids - first[nterms];
+		empty |= count[nterms] == 0;
+		nterms++;
+	}
+	if (nterms == 0) {
+		found = -1;
+	}
+	if (limit > SEARCH_MAX_RESULTS) {
+		limit = SEARCH_MAX_RESULTS;
+	}
+
+	for (i = 0; i < nids; i++) {
+		settle(idx, &idx->terms[ids[i]]);
+	}
+
+	/*matches are found newest first, leapfrogging: x is the newest message that
+	  could still match, every word moves it down to the newest message not past
+	  it that has the word, and once every word agrees, it's a match*/
+	uint32_t top = before > 0 && before < idx->indexed ? before : idx->indexed;
+	if (found == 0 && !empty && limit > 0 && top > 0) {
+		uint32_t x = top - 1;
+		int t = 0, agree = 0;
+
+		while (found < limit) {
+			uint32_t y = NONE;
+			for (i = first[t]; i < first[t] + count[t]; i++) {
+				uint32_t v = seek_term(&idx->terms[ids[i]], x);
+				if (v != NONE && (y == NONE || v > y)) {
+					y = v;
+				}
+			}
+			if (y == NONE) {
+				break;
+			}
+
+			agree = y < x ? 1 : agree + 1;
+			x = y;
+			if (agree == nterms) {
+				results[found++] = x;
+				if (x == 0) {
+					break;
+				}
+				x--;
+				agree = 0;
+			}
+			t = (t + 1) % nterms;
+		}
+	}
+	pthread_mutex_unlock(&idx->mutex);
+	free(ids);
+
+	metrics_add(M_SEARCHES, 1);
+	metrics_observe(H_SEARCH, metrics_now() - start);
+	return found;
+}
@@ -0,0 +1,62 @@
+#include <stdlib.h>				//mallocs, reallocs and frees
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <string.h>				//memcmps and memcpys
+#include <pthread.h>			//every index has its own lock
+
+/*defined in archive.h*/
+struct archive;
+
+/*Full-text search over a channel's archive. Every channel keeps an inverted
+  index of its active archive: for every word in it (runs of ASCII letters and
+  digits, lowercased), the numbers of the messages it's in, in order. Those
+  lists are stored in blocks of SEARCH_BLOCK numbers, the first of each block
+  as is and the rest as varint gaps from the one before, so a word that's in
+  every message costs about a byte per message, and any block can be found by
+  binary search on the first numbers without decoding the ones before it.
+
+  The index follows the archive as it changes. Messages added at the end are
+  indexed from where the index left off (search_update), so only the new ones
+  are ever looked at. When the archive is replaced by a branch that parts ways
+  with it, the index is told where (search_forget), and only the messages after
+  that point get indexed again. The numbers past that point aren't taken out of
+  every list right away, which would mean walking the whole index: the index
+  just remembers where it was cut, and every list is cut down the next time
+  it's touched.
+
+  Queries are one or more words, and match the messages that have all of them.
+  A word ending in '*' is a prefix, and matches every word that starts with it
+  (but only up to SEARCH_MAX_EXPAND of them, broader prefixes are refused).
+  Matches come newest first, and a query can ask for only the ones before a
+  given message, which is how results are paged through.*/
+
+/*numbers per block of a word's list, most words per query, most words a prefix
+  may match, and most matches a query can return*/
+#define SEARCH_BLOCK 128
+#define SEARCH_MAX_TERMS 8
+#define SEARCH_MAX_EXPAND 1024
+#define SEARCH_MAX_RESULTS 100
+
+/*defined in search.c*/
+struct search_index;
+
+/*Creates an empty index*/
+struct search_index *search_init();
+
+/*Tells the index that the archive changed from message number first (counting
+  from 0) on, so everything it knows past that point is gone. Must be called
+  while holding the archive's write lock*/
+void search_forget(struct search_index *idx, uint32_t first);
+
+/*Indexes up to max of the archive's messages the index doesn't have yet. Must
+  be called while holding (at least) the archive's read lock. Returns 1 if the
+  index has all of the archive now, 0 if there's more left*/
+int search_update(struct search_index *idx, struct archive *arch, uint32_t max);
+
+/*Looks for the messages that match a query (see above), newest first, among
+  the ones before message number before (or among all of them, for 0). Puts the
+  numbers of at most limit of them in results, and returns how many there are,
+  or -1 if the query has no words, too many of them, or too broad a prefix. The
+  index should be up to date with the archive (and the archive's read lock
+  held) for the results to mean anything*/
+int search_query(struct search_index *idx, const char *query, uint32_t before,
+	int limit, uint32_t *results);
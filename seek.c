@@ -0,0 +1,251 @@
+#include "seek.h"
+#include "metrics.h"
+#include "logger.h"
+
+/*This file implements fork-point searches, see seek.h*/
+
+/*where a search is at: waiting for a Probe, or for the Range past the fork
+  point*/
+enum {
+	SEEK_PROBING = 0,
+	SEEK_FETCHING
+};
+
+/*a search with a peer. Our archives are known to share their first lo
+  messages, and to part ways after at most hi of them. Brief description:
+  sock      ->  the peer's socket
+  chid      ->  channel of the archives
+  state     ->  SEEK_PROBING or SEEK_FETCHING
+  size      ->  size of the peer's archive, as of its tip
+  lo/hi     ->  bounds of the fork point, as above
+  probes    ->  prefixes we asked the peer about (n of them), while probing
+  deadline  ->  when it's considered stalled (metrics_now)*/
+struct seek {
+	int sock;
+	uint32_t chid;
+	int state;
+	uint32_t size, lo, hi;
+	uint32_t probes[SEEK_PROBES];
+	int n;
+	uint64_t deadline;
+};
+
+/*every search going on, protected by mutex, which is never held while talking
+  to peers or looking at our archive*/
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static const struct seek_ops *ops = NULL;
+static struct seek *seeks = NULL;
+static int nseeks = 0, seekscap = 0;
+
+static struct seek *find_seek(int sock) {
+	int i;
+
+	for (i = 0; i < nseeks; i++) {
+		if (seeks[i].sock == sock) {
+			return &seeks[i];
+		}
+	}
+	return NULL;
+}
+
+static void remove_seek(struct seek *s) {
+	*s = seeks[--nseeks];
+}
+
+/*Picks the next round of probes, evenly spread over lo+1 to hi, hi always
+  being the last one*/
+static void next_round(struct seek *s) {
+	uint32_t span = s->hi - s->lo;
+	int j;
+
+	s->n = span < SEEK_PROBES ? span : SEEK_PROBES;
+	for (j = 1; j <= s->n; j++) {
+		s->probes[j-1] = s->lo +
+			(uint32_t) (((uint64_t) span * j + s->n - 1) / s->n);
+	}
+	s->state = SEEK_PROBING;
+	s->deadline = metrics_now() + SEEK_TIMEOUT * 1000000ULL;
+	metrics_add(M_SEEK_ROUNDS, 1);
+}
+
+/*what a search has to send once the lock is released*/
+struct seek_action {
+	enum {SEEK_NONE, SEEK_PROBE, SEEK_RANGE, SEEK_ARCHIVE} what;
+	uint32_t probes[SEEK_PROBES];
+	int n;
+	uint32_t first, count;
+};
+
+/*Moves a search on once the fork point is between lo and hi: probes again if
+  it isn't pinned down yet, or asks for the messages past it (or for the whole
+  archive, if there's too many of them, which ends the search)*/
+static void advance(struct seek *s, struct seek_action *todo) {
+	if (s->lo < s->hi) {
+		next_round(s);
+		todo->what = SEEK_PROBE;
+		todo->n = s->n;
+		memcpy(todo->probes, s->probes, s->n * sizeof(uint32_t));
+		return;
+	}
+
+	metrics_add(M_SEEKS, 1);
+	log_event(LOG_INFO, EV_SEEK_FOUND, s->sock, s->lo, s->size - s->lo);
+	if (s->size - s->lo > SEEK_MAX_SUFFIX) {
+		todo->what = SEEK_ARCHIVE;
+		remove_seek(s);
+		return;
+	}
+	s->state = SEEK_FETCHING;
+	s->deadline = metrics_now() + SEEK_TIMEOUT * 1000000ULL;
+	todo->what = SEEK_RANGE;
+	todo->first = s->lo;
+	todo->count = s->size - s->lo;
+}
+
+/*sends what a search has to send*/
+static void perform(int sock, uint32_t chid, struct seek_action *todo) {
+	switch (todo->what) {
+		case SEEK_PROBE: {
+			ops->probe_request(sock, chid, todo->probes, todo->n);
+			break;
+		}
+
+		case SEEK_RANGE: {
+			ops->range_request(sock, chid, todo->first, todo->count);
+			break;
+		}
+
+		case SEEK_ARCHIVE: {
+			ops->archive_request(sock, chid);
+			break;
+		}
+
+		default: {
+			break;
+		}
+	}
+}
+
+void seek_init(const struct seek_ops *o) {
+	pthread_mutex_lock(&mutex);
+	ops = o;
+	pthread_mutex_unlock(&mutex);
+}
+
+int seek_peer(int sock, uint32_t chid) {
+	if (ops == NULL) {
+		return -1;
+	}
+	return ops->tip_request(sock, chid);
+}
+
+void seek_peer_gone(int sock) {
+	struct seek *s;
+
+	pthread_mutex_lock(&mutex);
+	if ((s = find_seek(sock)) != NULL) {
+		remove_seek(s);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void seek_tip(int sock, uint32_t chid, uint32_t size) {
+	struct seek_action todo = {SEEK_NONE};
+	struct seek *s;
+
+	if (ops == NULL) {
+		return;
+	}
+
+	/*only larger archives could replace ours*/
+	uint32_t ours = ops->hashes(chid, NULL, 0, NULL);
+	if (size <= ours) {
+		return;
+	}
+
+	/*with no messages of our own there's no fork point to look for, the
+	  peer's whole archive is what we'd end up fetching anyway*/
+	if (ours == 0) {
+		ops->archive_request(sock, chid);
+		return;
+	}
+
+	pthread_mutex_lock(&mutex);
+	if ((s = find_seek(sock)) != NULL) {
+		if (s->deadline > metrics_now()) {
+			pthread_mutex_unlock(&mutex);
+			return;
+		}
+		log_event(LOG_INFO, EV_SEEK_STALLED, sock, s->lo, s->hi);
+	}
+	else {
+		if (nseeks == seekscap) {
+			seekscap = seekscap ? seekscap * 2 : 16;
+			seeks = realloc(seeks, seekscap * sizeof(struct seek));
+		}
+		s = &seeks[nseeks++];
+	}
+
+	/*we can only have in common as much as the smaller archive has*/
+	s->sock = sock;
+	s->chid = chid;
+	s->size = size;
+	s->lo = 0;
+	s->hi = ours;
+	advance(s, &todo);
+	pthread_mutex_unlock(&mutex);
+	perform(sock, chid, &todo);
+}
+
+void seek_probe(int sock, uint32_t chid, int n, const uint32_t *probes,
+	const uint8_t *hashes) {
+	struct seek_action todo = {SEEK_NONE};
+	uint8_t mine[SEEK_PROBES * 16];
+	struct seek *s;
+	int j;
+
+	if (ops == NULL || n <= 0 || n > SEEK_PROBES) {
+		return;
+	}
+	uint32_t ours = ops->hashes(chid, probes, n, mine);
+
+	/*only answers to what we asked*/
+	pthread_mutex_lock(&mutex);
+	s = find_seek(sock);
+	if (s == NULL || s->state != SEEK_PROBING || s->chid != chid || s->n != n ||
+		memcmp(s->probes, probes, n * sizeof(uint32_t)) != 0) {
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+
+	/*prefixes up to the first one that differs are shared*/
+	for (j = 0; j < n; j++) {
+		if (probes[j] > ours || memcmp(mine + 16*j, hashes + 16*j, 16) != 0) {
+			s->hi = probes[j] - 1;
+			break;
+		}
+		s->lo = probes[j];
+	}
+	advance(s, &todo);
+	pthread_mutex_unlock(&mutex);
+	perform(sock, chid, &todo);
+}
+
+int seek_range(int sock, uint32_t chid, uint32_t first) {
+	struct seek *s;
+	int ours = 0;
+
+	if (ops == NULL) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&mutex);
+	s = find_seek(sock);
+	if (s != NULL && s->state == SEEK_FETCHING && s->chid == chid &&
+		s->lo == first) {
+		remove_seek(s);
+		ours = 1;
+	}
+	pthread_mutex_unlock(&mutex);
+	return ours;
+}
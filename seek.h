@@ -0,0 +1,89 @@
+#include <stdlib.h>				//mallocs, reallocs and frees
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <string.h>				//memcpys and memcmps
+#include <pthread.h>			//the searches' lock
+
+/*Fork-point search. When a peer's archive is larger than ours, most of it is
+  usually ours already: it may just have a few more messages, or it may have
+  forked off ours some way back. Rather than having it send the whole archive
+  for us to compare, we look for the last message we have in common. Every
+  message's hash covers the 19 records before it, hashes included, so it stands
+  for every message up to its own (see message_hash in archive.h): if our hashes
+  for message i match, so do our first i+1 messages.
+
+  So once a peer's tip (see boot.h) turns out larger than ours, we ask it for
+  the hashes of up to SEEK_PROBES of its messages, evenly spread over the
+  stretch where our archives could part ways (ProbeRequest/Probe), and compare
+  them with ours: the first one that differs narrows the stretch down to the gap
+  between it and the probe before it, SEEK_PROBES+1 times shorter. The last
+  probe is always the end of the stretch, so if its archive just extends ours,
+  one round trip is enough, and otherwise the fork point is found in about
+  log(n)/log(SEEK_PROBES+1) of them. Then only the messages after it are
+  fetched, with a RangeRequest (see boot.h), and put after ours, and only those
+  get validated.
+
+  Peers that speak the Hello handshake get asked for their tip instead of their
+  archive, both when they connect and periodically. Every peer gets at most one
+  search at a time, and one that stalls (say, because the peer never answered)
+  is replaced by the next one after SEEK_TIMEOUT. Searches with peers that
+  forked off too far back end with an ArchiveRequest, like before.*/
+
+/*most probes per round trip, most messages we fetch past the fork point, and
+  how long a search may wait for an answer, in milliseconds*/
+#define SEEK_PROBES 16
+#define SEEK_MAX_SUFFIX 8192
+#define SEEK_TIMEOUT 15000
+
+/*how searches talk to the node. None of the requests may block (they can go
+  out from the timer wheel's thread), one that doesn't fit in the peer's send
+  buffer is just not sent. Brief description:
+  tip_request     ->  sends a TipRequest for the channel to the peer on sock,
+                      returns 0 if it was sent, 1 if the send buffer was full,
+                      -1 if the connection is broken
+  probe_request   ->  sends a ProbeRequest for the hashes of the messages that
+                      end the given n prefixes (a prefix of p messages ends
+                      with message p-1)
+  range_request   ->  sends a RangeRequest for count messages from first on
+  archive_request ->  sends an ArchiveRequest for the channel's whole archive
+  hashes          ->  fills in our own hashes for the given n prefixes (16 bytes
+                      each, zeroes for prefixes longer than our archive) and
+                      returns our archive's size. n may be 0*/
+struct seek_ops {
+	int (*tip_request)(int sock, uint32_t chid);
+	int (*probe_request)(int sock, uint32_t chid, const uint32_t *probes, int n);
+	int (*range_request)(int sock, uint32_t chid, uint32_t first, uint32_t count);
+	int (*archive_request)(int sock, uint32_t chid);
+	uint32_t (*hashes)(uint32_t chid, const uint32_t *probes, int n,
+		uint8_t *hashes);
+};
+
+/*Enables fork-point searches. Until this is called, every other function here
+  does nothing*/
+void seek_init(const struct seek_ops *ops);
+
+/*Asks the peer on sock for its tip of the channel, so we can look for where
+  our archives part ways if it's larger. Returns 0 if it was asked, 1 if the
+  peer's send buffer is full (so it wasn't, this time), -1 if searches aren't
+  enabled or the connection is broken*/
+int seek_peer(int sock, uint32_t chid);
+
+/*Tells the searches about a peer that went away, whatever search we had going
+  with it is over*/
+void seek_peer_gone(int sock);
+
+/*Starts a search with the peer on sock, if its tip of the channel (its
+  archive's size) is larger than ours, and there's none going with it already*/
+void seek_tip(int sock, uint32_t chid, uint32_t size);
+
+/*Hands the searches a Probe the peer on sock sent: the hashes (16 bytes each)
+  of the messages that end the given n prefixes of its archive. The search goes
+  on with another round of probes, or with a RangeRequest for the messages past
+  the fork point once it's found*/
+void seek_probe(int sock, uint32_t chid, int n, const uint32_t *probes,
+	const uint8_t *hashes);
+
+/*Returns 1 if a Range the peer on sock sent, with the messages from first on,
+  is the one a search with it asked for, which ends the search (whoever gets
+  the range puts it after the first messages of our archive). Returns 0 if it's
+  none of our business*/
+int seek_range(int sock, uint32_t chid, uint32_t first);
@@ -0,0 +1,563 @@
+#include "main.h"
+#include "peerlist.h"
+#include "archive.h"
+#include "transport.h"
+#include "channel.h"
+#include "sim.h"
+
+/*This file implements the network simulator: an event queue ordered by virtual
+  time, simulated nodes and connections, and sim_transport, which the node's
+  protocol code talks through while it runs inside the simulation.
+  Every node's state lives in the node's globals (peerlist, channels, myaddr,
+  myport and node_id, all owned by main.c), so whenever the simulator runs code as a
+  node, it swaps that node's state into the globals first, and saves it back
+  when it's done. Locks are still taken as usual, but never contended, since
+  everything runs in a single thread.*/
+
+/*globals owned by main.c*/
+extern struct peer_list *peerlist;
+extern pthread_mutex_t peerlist_mutex;
+extern struct channel_table *channels;
+extern uint32_t myaddr;
+extern uint16_t myport;
+extern uint64_t node_id;
+
+/*a simulated node, with its own copy of the node's global state*/
+struct sim_node {
+	uint32_t ip;
+	uint16_t port;
+	struct peer_list *peerlist;
+	struct channel_table *channels;
+	uint64_t id;
+	uint32_t size;
+};
+
+/*one end of a simulated connection. Brief description:
+  node      ->  node this end belongs to
+  peer      ->  index of the other end
+  latency   ->  one way latency of the connection
+  busy      ->  time at which this end is done pushing its queued bytes out
+  last      ->  arrival time of the last delivery sent from this end, so
+                deliveries never overtake each other
+  in        ->  bytes delivered to this end, not yet read by the node
+  out       ->  bytes the node sent while handling the current event
+  closed    ->  set once the node hung up (or found out the other end did)*/
+struct sim_sock {
+	int node, peer;
+	uint64_t latency, busy, last;
+	uint8_t *in;
+	uint32_t inlen, inpos, incap;
+	uint8_t *out;
+	uint32_t outlen, outcap;
+	int dirty, closed;
+};
+
+/*event types*/
+enum {
+	SIM_DELIVER = 0,		//bytes arrive at a socket
+	SIM_ACCEPT,					//a connection arrives at the node being connected to
+	SIM_START,					//the connecting node starts talking to its new peer
+	SIM_PEERREQ,				//a connection's periodic PeerRequests are due
+	SIM_ARCHREQ,				//a connection's periodic ArchiveRequest is due
+	SIM_HANGUP					//a node finds out a connection was hung up
+};
+
+/*an event, events happening at the same time are ordered by seq (the order in
+  which they were scheduled), so runs are always exactly the same*/
+struct sim_event {
+	uint64_t time, seq;
+	int type, sock;
+	uint16_t port;
+	uint8_t *buf;
+	uint32_t len;
+};
+
+/*the whole simulation*/
+static struct sim_config config;
+static struct sim_stats stats;
+static uint64_t now, seq, rng;
+static int stopped;
+
+static struct sim_node *nodes;
+static int nnodes, nodecap;
+
+static struct sim_sock *socks;
+static int nsocks, sockcap;
+
+static struct sim_event *heap;
+static int nevents, eventcap;
+
+/*sockets written to by the node currently running*/
+static int *dirty;
+static int ndirty, dirtycap;
+
+/*node currently running, -1 if none*/
+static int current = -1;
+
+/*ip:port -> node lookup table (open addressing, -1 means empty)*/
+static int *table;
+static uint32_t tablecap;
+
+/*Random number generator (xorshift64*), seeded from the configuration*/
+uint64_t sim_rand() {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return rng * 0x2545F4914F6CDD1DULL;
+}
+
+static double sim_random_double() {
+	return (sim_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*Schedules an event, keeping the heap ordered by time, then seq*/
+static void schedule(uint64_t time, int type, int sock, uint16_t port,
+	uint8_t *buf, uint32_t len) {
+	if (nevents == eventcap) {
+		eventcap = eventcap ? eventcap * 2 : 1024;
+		heap = realloc(heap, eventcap * sizeof(struct sim_event));
+	}
+
+	struct sim_event ev = {time, seq++, type, sock, port, buf, len};
+	int i = nevents++;
+
+	/*sift up*/
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (heap[parent].time < ev.time ||
+			(heap[parent].time == ev.time && heap[parent].seq < ev.seq)) {
+			break;
+		}
+		heap[i] = heap[parent];
+		i = parent;
+	}
+	heap[i] = ev;
+}
+
+/*Removes and returns the earliest event*/
+static struct sim_event unschedule() {
+	struct sim_event first = heap[0], last = heap[--nevents];
+	int i = 0;
+
+	/*sift down*/
+	while (1) {
+		int child = 2 * i + 1;
+		if (child >= nevents) {
+			break;
+		}
+		if (child + 1 < nevents && (heap[child+1].time < heap[child].time ||
+			(heap[child+1].time == heap[child].time &&
+			heap[child+1].seq < heap[child].seq))) {
+			child++;
+		}
+		if (last.time < heap[child].time ||
+			(last.time == heap[child].time && last.seq < heap[child].seq)) {
+			break;
+		}
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+	return first;
+}
+
+/*slot of ip:port in the lookup table (either where it is, or where it goes)*/
+static uint32_t table_slot(uint32_t ip, uint16_t port) {
+	uint32_t h = (ip * 2654435761U) ^ (port * 40503U);
+
+	h &= tablecap - 1;
+	while (table[h] != -1 &&
+		(nodes[table[h]].ip != ip || nodes[table[h]].port != port)) {
+		h = (h + 1) & (tablecap - 1);
+	}
+	return h;
+}
+
+/*Makes the given node the running one, swapping its state into the globals*/
+static void enter(int node) {
+	current = node;
+	peerlist = nodes[node].peerlist;
+	channels = nodes[node].channels;
+	myaddr = nodes[node].ip;
+	myport = nodes[node].port;
+	node_id = nodes[node].id;
+}
+
+/*Sends out everything written to a socket while handling the current event,
+  as a single delivery to the other end*/
+static void flush(int s) {
+	struct sim_sock *sock = &socks[s];
+	uint64_t start = sock->busy > now ? sock->busy : now, arrival;
+
+	/*bytes queue up behind the ones still going out, then travel the link, and
+	  may get lost (maybe more than once) on the way*/
+	sock->busy = start;
+	if (config.bandwidth) {
+		sock->busy += sock->outlen * SIM_SECOND / config.bandwidth;
+	}
+	arrival = sock->busy + sock->latency;
+	while (config.loss > 0 && sim_random_double() < config.loss) {
+		arrival += config.rto;
+		stats.lost++;
+	}
+
+	/*TCP never reorders, whatever was lost holds up everything behind it*/
+	if (arrival < sock->last) {
+		arrival = sock->last;
+	}
+	sock->last = arrival;
+
+	stats.bytes += sock->outlen;
+	schedule(arrival, SIM_DELIVER, sock->peer, 0, sock->out, sock->outlen);
+	sock->out = NULL;
+	sock->outlen = sock->outcap = 0;
+	sock->dirty = 0;
+}
+
+/*Stops running as the current node: saves its state back, and sends out
+  whatever it wrote*/
+static void leave() {
+	int node = current, i;
+
+	nodes[node].peerlist = peerlist;
+	current = -1;
+
+	for (i = 0; i < ndirty; i++) {
+		flush(dirty[i]);
+	}
+	ndirty = 0;
+
+	/*only the default channel is followed*/
+	struct archive *arch = nodes[node].channels->list[0]->arch;
+	if (arch->size != nodes[node].size) {
+		nodes[node].size = arch->size;
+		if (config.on_archive != NULL) {
+			config.on_archive(node, nodes[node].size);
+		}
+	}
+}
+
+/*Creates both ends of a connection from node a to node b, and lets b know
+  about it after the connection's latency. Returns a's end*/
+static int new_connection(int a, int b) {
+	if (nsocks + 2 > sockcap) {
+		sockcap = sockcap ? sockcap * 2 : 1024;
+		socks = realloc(socks, sockcap * sizeof(struct sim_sock));
+	}
+
+	int sa = nsocks++, sb = nsocks++;
+	uint64_t latency = config.latency;
+	if (config.jitter) {
+		latency += sim_rand() % (config.jitter + 1);
+	}
+
+	memset(&socks[sa], 0, sizeof(struct sim_sock));
+	memset(&socks[sb], 0, sizeof(struct sim_sock));
+	socks[sa].node = a;
+	socks[sa].peer = sb;
+	socks[sb].node = b;
+	socks[sb].peer = sa;
+	socks[sa].latency = socks[sb].latency = latency;
+
+	stats.connections++;
+	schedule(now + latency, SIM_ACCEPT, sb, DEFAULT_PORT, NULL, 0);
+	return sa;
+}
+
+/*the transport's side of things, always called while running as a node, with
+  simulated sockets*/
+static int sim_connect_op(char *ip, uint16_t port) {
+	struct in_addr addr;
+
+	if (inet_aton(ip, &addr) == 0) {
+		return -1;
+	}
+
+	int b = table[table_slot(addr.s_addr, port)];
+	if (b == -1) {
+		return -1;
+	}
+	return SIM_SOCK_BASE + new_connection(current, b);
+}
+
+/*starting the exchange goes through the event queue, since the caller may be
+  holding the peer list lock*/
+static void sim_start_op(int sock, uint16_t port) {
+	schedule(now, SIM_START, sock - SIM_SOCK_BASE, port, NULL, 0);
+}
+
+/*makes room for len more bytes in a socket's outgoing buffer*/
+static uint8_t *out_reserve(struct sim_sock *sock, int s, size_t len) {
+	if (sock->outlen + len > sock->outcap) {
+		sock->outcap = (sock->outlen + len) * 2;
+		sock->out = realloc(sock->out, sock->outcap);
+	}
+
+	if (!sock->dirty) {
+		if (ndirty == dirtycap) {
+			dirtycap = dirtycap ? dirtycap * 2 : 64;
+			dirty = realloc(dirty, dirtycap * sizeof(int));
+		}
+		dirty[ndirty++] = s;
+		sock->dirty = 1;
+	}
+	return sock->out + sock->outlen;
+}
+
+static ssize_t sim_send_op(int sock, const void *buf, size_t len, int flags) {
+	int s = sock - SIM_SOCK_BASE;
+	(void) flags;
+
+	memcpy(out_reserve(&socks[s], s, len), buf, len);
+	socks[s].outlen += len;
+	return len;
+}
+
+static ssize_t sim_sendfile_op(int sock, int fd, off_t *offset, size_t len) {
+	int s = sock - SIM_SOCK_BASE;
+	ssize_t r = pread(fd, out_reserve(&socks[s], s, len), len, *offset);
+
+	if (r > 0) {
+		socks[s].outlen += r;
+		*offset += r;
+	}
+	return r;
+}
+
+/*everything a node reads was delivered whole before it started reading, so
+  coming up short means something is badly wrong. We say so, and act like the
+  connection was closed*/
+static int sim_recv_op(int sock, void *buf, uint32_t len) {
+	struct sim_sock *s = &socks[sock - SIM_SOCK_BASE];
+
+	if (s->inlen - s->inpos < len) {
+		fprintf(stderr, "sim: node %d read past the end of a delivery!\n", s->node);
+		s->inpos = s->inlen;
+		return 0;
+	}
+
+	memcpy(buf, s->in + s->inpos, len);
+	s->inpos += len;
+	return len;
+}
+
+static uint32_t sim_peer_ip_op(int sock) {
+	return nodes[socks[socks[sock - SIM_SOCK_BASE].peer].node].ip;
+}
+
+/*hanging up tears the connection down for both nodes, each one finding out
+  when the news gets to it (right away for the one hanging up)*/
+static void sim_hangup_op(int sock) {
+	int s = sock - SIM_SOCK_BASE;
+
+	schedule(now, SIM_HANGUP, s, 0, NULL, 0);
+	schedule(now + socks[s].latency, SIM_HANGUP, socks[s].peer, 0, NULL, 0);
+}
+
+/*nothing to close, nodes find out about hangups through SIM_HANGUP*/
+static int sim_close_op(int sock) {
+	(void) sock;
+	return 0;
+}
+
+const struct transport sim_transport = {
+	.connect = sim_connect_op,
+	.start = sim_start_op,
+	.send = sim_send_op,
+	.sendfile = sim_sendfile_op,
+	.recv = sim_recv_op,
+	.peer_ip = sim_peer_ip_op,
+	.hangup = sim_hangup_op,
+	.close = sim_close_op
+};
+
+/*Sends one of a connection's periodic requests, and schedules the next one
+  (unless the connection is gone)*/
+static void request(int s, int type) {
+	if (socks[s].closed) {
+		return;
+	}
+
+	if (type == SIM_PEERREQ) {
+		send_requests(SIM_SOCK_BASE + s, 1, 0);
+		schedule(now + config.peerreq, SIM_PEERREQ, s, 0, NULL, 0);
+	}
+	else {
+		send_requests(SIM_SOCK_BASE + s, 0, 1);
+		schedule(now + config.archreq, SIM_ARCHREQ, s, 0, NULL, 0);
+	}
+}
+
+/*Handles bytes arriving at a socket, processing every message in them*/
+static void deliver(struct sim_event *ev) {
+	struct sim_sock *s = &socks[ev->sock];
+
+	stats.deliveries++;
+
+	/*whatever was on its way when the node hung up is lost*/
+	if (s->closed) {
+		free(ev->buf);
+		return;
+	}
+	if (s->inlen + ev->len > s->incap) {
+		s->incap = (s->inlen + ev->len) * 2;
+		s->in = realloc(s->in, s->incap);
+	}
+	memcpy(s->in + s->inlen, ev->buf, ev->len);
+	s->inlen += ev->len;
+	free(ev->buf);
+
+	while (s->inpos < s->inlen) {
+		uint8_t type = s->in[s->inpos++];
+		handle_message(SIM_SOCK_BASE + ev->sock, type);
+
+		/*the socks array may have grown (and moved) while handling the message*/
+		s = &socks[ev->sock];
+	}
+	s->inlen = s->inpos = 0;
+}
+
+void sim_init(struct sim_config *cfg) {
+	config = *cfg;
+	memset(&stats, 0, sizeof(stats));
+	now = seq = 0;
+	rng = config.seed ? config.seed : 51511;
+	current = -1;
+
+	pthread_mutex_init(&peerlist_mutex, NULL);
+
+	/*the node's code talks to us from now on*/
+	transport = &sim_transport;
+}
+
+int sim_add_node(uint32_t ip, uint16_t port) {
+	uint32_t i;
+
+	if (nnodes == nodecap) {
+		nodecap = nodecap ? nodecap * 2 : 64;
+		nodes = realloc(nodes, nodecap * sizeof(struct sim_node));
+	}
+
+	/*keep the lookup table at most half full*/
+	if ((uint32_t) (nnodes + 1) * 2 > tablecap) {
+		tablecap = tablecap ? tablecap * 2 : 128;
+		table = realloc(table, tablecap * sizeof(int));
+		for (i = 0; i < tablecap; i++) {
+			table[i] = -1;
+		}
+		for (i = 0; i < (uint32_t) nnodes; i++) {
+			table[table_slot(nodes[i].ip, nodes[i].port)] = i;
+		}
+	}
+
+	struct sim_node *node = &nodes[nnodes];
+	node->ip = ip;
+	node->port = port;
+	node->peerlist = init_list();
+	node->peerlist->port = port;
+	list_to_str(node->peerlist);
+	node->channels = channels_init(1);
+	/*ids only need to be different, and to leave the random numbers alone*/
+	node->id = (((uint64_t) ip << 17) | ((uint64_t) port << 1) | 1) *
+		0x9E3779B97F4A7C15ULL;
+	node->size = 0;
+	table[table_slot(ip, port)] = nnodes;
+
+	return nnodes++;
+}
+
+int sim_connect(int a, int b) {
+	if (b < 0 || b >= nnodes) {
+		return -1;
+	}
+
+	enter(a);
+	sim_start_op(SIM_SOCK_BASE + new_connection(a, b), nodes[b].port);
+	leave();
+	return 0;
+}
+
+void sim_call(int node, void (*fn)(void*), void *arg) {
+	enter(node);
+	fn(arg);
+	leave();
+}
+
+uint64_t sim_run(uint64_t until) {
+	uint64_t processed = 0;
+
+	stopped = 0;
+	while (nevents && !stopped) {
+		if (heap[0].time > until) {
+			now = until;
+			break;
+		}
+
+		struct sim_event ev = unschedule();
+		struct sim_sock *s = &socks[ev.sock];
+		now = ev.time;
+		processed++;
+		stats.events++;
+
+		enter(s->node);
+		switch (ev.type) {
+			case SIM_DELIVER: {
+				deliver(&ev);
+				break;
+			}
+
+			/*both ends start talking as soon as they know about each other, just
+			  like a real node's peer timers: PeerRequests go out right away, the
+			  first ArchiveRequest only after a whole interval*/
+			case SIM_ACCEPT:
+			case SIM_START: {
+				peer_connected(SIM_SOCK_BASE + ev.sock, ev.port,
+					ev.type == SIM_START);
+				if (config.peerreq) {
+					request(ev.sock, SIM_PEERREQ);
+				}
+				if (config.archreq) {
+					schedule(now + config.archreq, SIM_ARCHREQ, ev.sock, 0, NULL, 0);
+				}
+				break;
+			}
+
+			case SIM_PEERREQ:
+			case SIM_ARCHREQ: {
+				request(ev.sock, ev.type);
+				break;
+			}
+
+			case SIM_HANGUP: {
+				if (!s->closed) {
+					s->closed = 1;
+					peer_disconnected(SIM_SOCK_BASE + ev.sock);
+				}
+				break;
+			}
+		}
+		leave();
+	}
+
+	return processed;
+}
+
+void sim_stop() {
+	stopped = 1;
+}
+
+uint64_t sim_now() {
+	return now;
+}
+
+int sim_nodes() {
+	return nnodes;
+}
+
+struct archive *sim_archive(int node) {
+	return nodes[node].channels->list[0]->arch;
+}
+
+struct sim_stats sim_stats() {
+	return stats;
+}
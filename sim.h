@@ -0,0 +1,102 @@
+#include <stdio.h>				//complaining about impossible things
+#include <stdlib.h>				//mallocs, reallocs and frees
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <string.h>				//memcpys
+#include <unistd.h>				//pread, to "send" snapshots from their memfds
+#include <arpa/inet.h>		//inet_aton, for connect's IP strings
+
+/*Deterministic discrete-event network simulator. Any number of nodes run the
+  node's real protocol code (handle_message, process_peerlist, process_archive,
+  publish_archive...) in a single thread, in virtual time, talking through
+  sim_transport instead of sockets. Every connection has a latency, every
+  direction of it a bandwidth, and every delivery may be lost (and then shows up
+  a retransmission timeout later, since this is TCP after all). The same seed
+  and configuration always give the exact same run.
+  Nodes don't have threads: whatever a node sends while handling an event is
+  delivered to the other side as a single chunk, so messages always arrive
+  whole and can be processed as soon as they do. The periodic PeerRequests and
+  ArchiveRequests (on the timer wheel, in a real node) are simulator events
+  instead, in virtual time.*/
+
+/*defined in archive.h*/
+struct archive;
+
+/*virtual time is kept in microseconds*/
+#define SIM_SECOND 1000000ULL
+
+/*simulated sockets start here, so they never clash with real ones (or with
+  the metrics' per-peer slots)*/
+#define SIM_SOCK_BASE 65536
+
+/*network and protocol settings for a simulation. Brief description:
+  latency     ->  one way latency of every connection, in microseconds
+  jitter      ->  each connection gets latency + a random 0 to jitter
+  bandwidth   ->  bytes per second of each direction of a connection (0 for
+                  unlimited), messages queue up behind each other
+  loss        ->  probability that a delivery is lost, each loss delays it by
+                  rto (and it may be lost again)
+  rto         ->  retransmission timeout, in microseconds
+  peerreq     ->  interval between a connection's periodic PeerRequests (the
+                  nodes use 5s by default), 0 to never send them, so nodes
+                  only know their initial peers
+  archreq     ->  interval between a connection's periodic ArchiveRequests
+                  (nodes use 60s by default), 0 to never send them, so
+                  archives only go as far as they're published
+  seed        ->  seed for every random decision the simulator makes
+  on_archive  ->  called whenever a node's active archive changes size*/
+struct sim_config {
+	uint64_t latency, jitter;
+	uint64_t bandwidth;
+	double loss;
+	uint64_t rto;
+	uint64_t peerreq, archreq;
+	uint64_t seed;
+	void (*on_archive)(int node, uint32_t size);
+};
+
+/*counters for the whole simulation*/
+struct sim_stats {
+	uint64_t events;
+	uint64_t deliveries;
+	uint64_t bytes;
+	uint64_t lost;
+	uint64_t connections;
+};
+
+/*the simulated network, for transport to point at*/
+extern const struct transport sim_transport;
+
+/*Sets up an empty simulation with the given configuration, at time 0*/
+void sim_init(struct sim_config *config);
+
+/*Adds a node listening on ip:port (ip in network byte order, port in host byte
+  order) with an empty archive and no peers. Returns the node's id*/
+int sim_add_node(uint32_t ip, uint16_t port);
+
+/*Makes node a connect to node b, as if b was a's initial peer. Returns 0 on
+  success, -1 if b doesn't exist*/
+int sim_connect(int a, int b);
+
+/*Runs fn(arg) as node, right now, as if it was one of its threads (whatever it
+  sends goes out when it returns)*/
+void sim_call(int node, void (*fn)(void*), void *arg);
+
+/*Runs the simulation until there's nothing left to do, virtual time reaches
+  until, or someone calls sim_stop. Returns the number of events processed*/
+uint64_t sim_run(uint64_t until);
+
+/*Makes sim_run return after the current event*/
+void sim_stop();
+
+/*Current virtual time, in microseconds*/
+uint64_t sim_now();
+
+/*Random number from the simulation's seeded generator*/
+uint64_t sim_rand();
+
+/*Number of nodes, and a given node's active archive*/
+int sim_nodes();
+struct archive *sim_archive(int node);
+
+/*Counters so far*/
+struct sim_stats sim_stats();
@@ -0,0 +1,193 @@
+#include "spans.h"
+#include <unistd.h>				//syscall, to get the thread ids the kernel uses
+#include <sys/syscall.h>	//SYS_gettid
+
+/*This file implements span tracing (see spans.h). Like the logger's rings,
+  every thread has a buffer of its own that only it writes to, so recording a
+  span never takes a lock. Unlike them, nobody drains the buffers as they go:
+  they just keep the latest spans, overwriting the oldest ones, until someone
+  asks for a dump, which reads them while their threads keep writing. A thread
+  only ever publishes a span (moves tail past it) after it's written, so the
+  dump knows which ones are whole, and it checks tail again once it's done
+  copying, to leave out the ones that got overwritten in the meantime.*/
+
+/*per-thread span buffer
+  tail  ->  number of spans ever recorded, the latest SPAN_RING_SIZE of which
+            are still in recs
+  tid   ->  the thread's id, as the kernel (and so top, perf, etc) knows it
+  dead  ->  set when the owning thread exits, its spans are kept (for a while,
+            see SPAN_MAX_DEAD) so they still show up in dumps*/
+struct span_ring {
+	struct span_record recs[SPAN_RING_SIZE];
+	uint64_t tail;
+	int tid;
+	int dead;
+	struct span_ring *next;
+};
+
+/*names of every stage, indexed by span*/
+const char *span_names[SP_COUNT] = {
+	[SP_STDIN_READ] = "stdin_read",
+	[SP_COMMIT] = "commit_message",
+	[SP_MINE] = "mine",
+	[SP_PRINT_ARCHIVE] = "print_archive",
+	[SP_PUBLISH_SEND] = "publish_send",
+	[SP_CONNECT] = "connect",
+	[SP_ARCHIVE_RECV] = "archive_recv",
+	[SP_SCAN] = "scan_archive",
+	[SP_VALIDATE] = "validate",
+	[SP_REPLACE] = "replace",
+	[SP_ARCHLOCK_WAIT] = "archive_lock_wait",
+	[SP_PEERLOCK_WAIT] = "peerlist_lock_wait"
+};
+
+/*list of buffers, newest first, protected by a mutex (only taken when threads
+  create or leave behind their buffer, and by dumps)*/
+static struct span_ring *rings = NULL;
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*each thread's own buffer*/
+static __thread struct span_ring *my_ring = NULL;
+static pthread_key_t ring_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+/*marks the calling thread's buffer as dead when the thread exits, and frees
+  the oldest dead buffers past SPAN_MAX_DEAD*/
+static void ring_destructor(void *ptr) {
+	struct span_ring **aux, *ring;
+	int dead = 0;
+
+	pthread_mutex_lock(&rings_mutex);
+	((struct span_ring*) ptr)->dead = 1;
+	aux = &rings;
+	while ((ring = *aux) != NULL) {
+		if (ring->dead && ++dead > SPAN_MAX_DEAD) {
+			*aux = ring->next;
+			free(ring);
+			continue;
+		}
+		aux = &ring->next;
+	}
+	pthread_mutex_unlock(&rings_mutex);
+}
+
+static void make_key() {
+	pthread_key_create(&ring_key, ring_destructor);
+}
+
+/*gets the calling thread's buffer, creating it on the first call*/
+static struct span_ring *thread_ring() {
+	if (my_ring != NULL) {
+		return my_ring;
+	}
+
+	pthread_once(&key_once, make_key);
+	my_ring = (struct span_ring*) malloc(sizeof(struct span_ring));
+	my_ring->tail = 0;
+	my_ring->tid = (int) syscall(SYS_gettid);
+	my_ring->dead = 0;
+
+	pthread_mutex_lock(&rings_mutex);
+	my_ring->next = rings;
+	rings = my_ring;
+	pthread_mutex_unlock(&rings_mutex);
+
+	pthread_setspecific(ring_key, my_ring);
+	return my_ring;
+}
+
+/*Appends a span to the calling thread's buffer*/
+void spans_record(uint32_t span, uint64_t start, uint64_t end, uint64_t arg) {
+	struct span_ring *ring = thread_ring();
+	struct span_record *rec = &ring->recs[ring->tail & (SPAN_RING_SIZE - 1)];
+
+	rec->start = start;
+	rec->end = end;
+	rec->arg = arg;
+	rec->span = span;
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef SPANS
+/*Copies the whole spans in a buffer into recs (which has room for
+  SPAN_RING_SIZE of them), oldest first, and returns how many there are*/
+static uint32_t copy_ring(struct span_ring *ring, struct span_record *recs) {
+	uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint64_t first = tail > SPAN_RING_SIZE ? tail - SPAN_RING_SIZE : 0, i;
+
+	for (i = first; i < tail; i++) {
+		recs[i - first] = ring->recs[i & (SPAN_RING_SIZE - 1)];
+	}
+
+	/*the thread was free to go on recording while we copied, and any span it
+	  started writing since then took the place of one we may have copied half
+	  of. The one at index after - SPAN_RING_SIZE may be getting written right
+	  now, so everything up to and including it is out*/
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	uint64_t after = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint64_t skip = 0;
+	if (after >= first + SPAN_RING_SIZE) {
+		skip = after - SPAN_RING_SIZE + 1 - first;
+		if (skip > tail - first) {
+			skip = tail - first;
+		}
+		memmove(recs, recs + skip, (tail - first - skip) * sizeof(*recs));
+	}
+	return tail - first - skip;
+}
+
+/*Writes every buffer's spans into the given file, as Chrome trace event JSON:
+  a complete ("X") event per span, timestamps and durations in microseconds,
+  plus a metadata ("M") event naming each thread*/
+int spans_dump(const char *path) {
+	FILE *out;
+	struct span_ring *ring;
+	struct span_record *recs;
+	uint32_t n, i;
+	int total = 0;
+
+	if ((out = fopen(path, "w")) == NULL) {
+		return -1;
+	}
+	recs = (struct span_record*) malloc(SPAN_RING_SIZE *
+		sizeof(struct span_record));
+
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+		"\"args\":{\"name\":\"blockchain\"}}");
+
+	/*hold the list's lock all along, so no dead buffer is freed under us*/
+	pthread_mutex_lock(&rings_mutex);
+	for (ring = rings; ring != NULL; ring = ring->next) {
+		n = copy_ring(ring, recs);
+		fprintf(out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+			"\"tid\":%d,\"args\":{\"name\":\"thread %d%s\"}}", ring->tid, ring->tid,
+			ring->dead ? " (exited)" : "");
+
+		for (i = 0; i < n; i++) {
+			if (recs[i].span >= SP_COUNT) {
+				continue;
+			}
+			fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"node\",\"ph\":\"X\","
+				"\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,"
+				"\"args\":{\"arg\":%llu}}", span_names[recs[i].span],
+				recs[i].start / 1000.0, (recs[i].end - recs[i].start) / 1000.0,
+				ring->tid, (unsigned long long) recs[i].arg);
+			total++;
+		}
+	}
+	pthread_mutex_unlock(&rings_mutex);
+
+	fprintf(out, "\n]}\n");
+	fclose(out);
+	free(recs);
+	return total;
+}
+
+#else
+/*without -DSPANS, nothing was ever recorded*/
+int spans_dump(const char *path) {
+	(void) path;
+	return -1;
+}
+#endif
@@ -0,0 +1,88 @@
+#include <stdio.h>				//the dump goes to a file
+#include <stdlib.h>				//mallocs and frees
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <string.h>				//memcpys
+#include <pthread.h>			//thread keys for per-thread buffers
+
+/*Span tracing, for seeing where a single message spends its time, which the
+  metrics' counters and histograms can't tell. A span is a stage of the node's
+  work (mining a message, validating an archive, waiting on a lock...) with the
+  times it started and ended, and every thread keeps the last SPAN_RING_SIZE
+  spans it went through in a buffer of its own, so recording one is a couple of
+  clock reads and a store. Once a buffer is full, the oldest spans make room
+  for the new ones. On demand (typing "/spans <file>" into the terminal), every
+  buffer is dumped into a file in the Chrome trace event format, which Perfetto
+  (or chrome://tracing) opens, showing every thread's spans on a timeline of
+  its own, so the critical path of a message commit can be followed from the
+  thread that mined it to the ones that sent it out.
+
+  Spans are only recorded if the node is built with -DSPANS (make
+  SPANFLAGS=-DSPANS), otherwise the macros below compile to nothing and there
+  is nothing to dump*/
+
+/*number of spans in each thread's buffer (must be a power of 2)*/
+#define SPAN_RING_SIZE 4096
+
+/*most buffers of threads that already exited we hold on to, so the spans of
+  peers that came and went still show up in the dump. Past that, the oldest
+  ones are freed*/
+#define SPAN_MAX_DEAD 64
+
+/*stages we time. Every one has a name in span_names, which is what the dump
+  shows*/
+enum {
+	SP_STDIN_READ = 0,
+	SP_COMMIT,
+	SP_MINE,
+	SP_PRINT_ARCHIVE,
+	SP_PUBLISH_SEND,
+	SP_CONNECT,
+	SP_ARCHIVE_RECV,
+	SP_SCAN,
+	SP_VALIDATE,
+	SP_REPLACE,
+	SP_ARCHLOCK_WAIT,
+	SP_PEERLOCK_WAIT,
+	SP_COUNT
+};
+
+/*a single span, always 32 bytes long. Brief description:
+  start, end  ->  monotonic timestamps (see metrics_now), in nanoseconds
+  arg         ->  span specific argument (a socket, an archive size...)
+  span        ->  one of the SP_* values above*/
+struct span_record {
+	uint64_t start, end;
+	uint64_t arg;
+	uint32_t span;
+};
+
+/*names of every stage, indexed by span*/
+extern const char *span_names[SP_COUNT];
+
+#ifdef SPANS
+/*starts timing a span, in a variable of the given name*/
+#define SPAN_BEGIN(var) uint64_t var = metrics_now()
+
+/*ends the span started with SPAN_BEGIN, recording it*/
+#define SPAN_END(var, span, arg) \
+	spans_record((span), (var), metrics_now(), (uint64_t) (arg))
+
+/*records a span the caller already timed*/
+#define SPAN_RECORD(span, start, end, arg) \
+	spans_record((span), (start), (end), (uint64_t) (arg))
+#else
+#define SPAN_BEGIN(var)
+#define SPAN_END(var, span, arg) do {} while (0)
+#define SPAN_RECORD(span, start, end, arg) do {} while (0)
+#endif
+
+/*Appends a span to the calling thread's buffer, creating the buffer on the
+  thread's first call. Never blocks (except on that first call)*/
+void spans_record(uint32_t span, uint64_t start, uint64_t end, uint64_t arg);
+
+/*Writes every span in every thread's buffer into the given file, as Chrome
+  trace event JSON. The threads keep recording while it's at it, and any span
+  that gets overwritten while it's being read is left out. Returns the number
+  of spans written, or -1 if the file couldn't be opened or spans aren't built
+  in*/
+int spans_dump(const char *path);
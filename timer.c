@@ -0,0 +1,235 @@
+#include "timer.h"
+#include "metrics.h"
+
+/*This file implements the timer wheel, see timer.h*/
+
+/*the wheel. Every slot is a circular list of timers, with a dummy timer as its
+  head, and so is expired (the timers of the tick being fired). Brief
+  description:
+  tick      ->  next tick to fire, ticks counting from start_ns
+  pending   ->  timers in the wheel, including the ones in expired
+  running   ->  timer whose callback is running right now, if any
+  cond      ->  the thread waits on it for the next tick, or for a timer if
+                there are none
+  done_cond ->  timer_cancel waits on it for a callback to return
+  rng       ->  state of the xorshift generator for the jitter*/
+static struct timer slots[TIMER_LEVELS][TIMER_SLOTS], expired;
+static uint64_t tick = 0, start_ns = 0, rng = 0;
+static int pending = 0, started = 0;
+static struct timer *running = NULL;
+static pthread_t thread;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond, done_cond = PTHREAD_COND_INITIALIZER;
+
+/*the tick we're at in real time*/
+static uint64_t now_tick() {
+	return (metrics_now() - start_ns) / (TIMER_TICK_MS * 1000000ULL);
+}
+
+static void list_init(struct timer *head) {
+	head->prev = head->next = head;
+}
+
+static void list_append(struct timer *head, struct timer *t) {
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+static void list_unlink(struct timer *t) {
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->prev = t->next = NULL;
+}
+
+/*puts a timer in the slot its deadline falls in, relative to the current
+  tick. A timer that's overdue goes in the slot of the current tick*/
+static void place(struct timer *t) {
+	uint64_t diff;
+	int level = 0;
+
+	if (t->expires < tick) {
+		t->expires = tick;
+	}
+	diff = t->expires - tick;
+	while (level < TIMER_LEVELS - 1 &&
+		diff >= (1ULL << (TIMER_BITS * (level + 1)))) {
+		level++;
+	}
+	list_append(&slots[level][(t->expires >> (TIMER_BITS * level)) &
+		(TIMER_SLOTS - 1)], t);
+}
+
+/*spreads the timers in a slot of an upper level over the levels below it*/
+static void cascade(int level, int slot) {
+	struct timer *head = &slots[level][slot];
+
+	while (head->next != head) {
+		struct timer *t = head->next;
+		list_unlink(t);
+		place(t);
+	}
+}
+
+/*Moves the timers due on the current tick into expired, and moves on to the
+  next tick. Whenever a level finishes a turn, the next slot of the level
+  above it comes down first*/
+static void advance() {
+	int slot = tick & (TIMER_SLOTS - 1), level;
+	struct timer *head = &slots[0][slot];
+
+	if (slot == 0) {
+		for (level = 1; level < TIMER_LEVELS; level++) {
+			int upper = (tick >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+			cascade(level, upper);
+			if (upper != 0) {
+				break;
+			}
+		}
+	}
+
+	while (head->next != head) {
+		struct timer *t = head->next;
+		list_unlink(t);
+		list_append(&expired, t);
+	}
+	tick++;
+}
+
+/*The wheel's thread: waits for each tick, and fires whatever's due on it*/
+static void *timer_thread() {
+	pthread_mutex_lock(&mutex);
+	while (1) {
+		/*nothing to do until someone adds a timer*/
+		while (pending == 0) {
+			pthread_cond_wait(&cond, &mutex);
+		}
+
+		/*wait for the next tick, unless we're behind*/
+		if (tick > now_tick()) {
+			uint64_t at = start_ns + tick * TIMER_TICK_MS * 1000000ULL;
+			struct timespec ts;
+			ts.tv_sec = at / 1000000000ULL;
+			ts.tv_nsec = at % 1000000000ULL;
+			pthread_cond_timedwait(&cond, &mutex, &ts);
+			continue;
+		}
+
+		advance();
+		while (expired.next != &expired) {
+			struct timer *t = expired.next;
+			uint64_t due = start_ns + t->expires * TIMER_TICK_MS * 1000000ULL;
+
+			list_unlink(t);
+			pending--;
+			running = t;
+			pthread_mutex_unlock(&mutex);
+
+			uint64_t now = metrics_now();
+			metrics_observe(H_TIMER_LAG, now > due ? now - due : 0);
+			t->fn(t->arg);
+
+			pthread_mutex_lock(&mutex);
+			running = NULL;
+			pthread_cond_broadcast(&done_cond);
+		}
+	}
+	return NULL;
+}
+
+/*empties every slot, once, whether timer_start or timer_add gets here first*/
+static pthread_once_t wheel_once = PTHREAD_ONCE_INIT;
+
+static void init_wheel() {
+	int level, slot;
+
+	for (level = 0; level < TIMER_LEVELS; level++) {
+		for (slot = 0; slot < TIMER_SLOTS; slot++) {
+			list_init(&slots[level][slot]);
+		}
+	}
+	list_init(&expired);
+}
+
+int timer_start() {
+	pthread_condattr_t attr;
+
+	pthread_once(&wheel_once, init_wheel);
+
+	/*the tick deadlines are on the monotonic clock, like metrics_now*/
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	start_ns = metrics_now();
+	rng = start_ns ^ 0x9E3779B97F4A7C15ULL;
+	if (pthread_create(&thread, NULL, timer_thread, NULL) != 0) {
+		return -1;
+	}
+	pthread_detach(thread);
+	started = 1;
+	return 0;
+}
+
+void timer_init(struct timer *t, void (*fn)(void *arg), void *arg) {
+	t->fn = fn;
+	t->arg = arg;
+	t->expires = 0;
+	t->prev = t->next = NULL;
+}
+
+void timer_add(struct timer *t, uint64_t ms) {
+	uint64_t ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+	pthread_once(&wheel_once, init_wheel);
+	pthread_mutex_lock(&mutex);
+	if (t->next != NULL) {
+		list_unlink(t);
+		pending--;
+	}
+
+	/*an empty wheel isn't kept ticking, so it may be behind*/
+	if (pending == 0 && now_tick() > tick) {
+		tick = now_tick();
+	}
+
+	t->expires = tick + (ticks > TIMER_MAX_TICKS ? TIMER_MAX_TICKS : ticks);
+	place(t);
+	if (++pending == 1 && started) {
+		pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void timer_cancel(struct timer *t) {
+	pthread_mutex_lock(&mutex);
+	while (running == t && !(started && pthread_equal(pthread_self(), thread))) {
+		pthread_cond_wait(&done_cond, &mutex);
+	}
+
+	/*only unlink it once its callback is done, since callbacks that re-arm
+	  their own timer would otherwise leave it pending again behind our back*/
+	if (t->next != NULL) {
+		list_unlink(t);
+		pending--;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+uint64_t timer_jitter(uint64_t ms, int percent) {
+	uint64_t span = ms * percent / 100, r;
+
+	if (percent <= 0 || span == 0) {
+		return ms;
+	}
+
+	pthread_mutex_lock(&mutex);
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	r = rng;
+	pthread_mutex_unlock(&mutex);
+	return ms - span + r % (2 * span + 1);
+}
@@ -0,0 +1,66 @@
+#include <stdlib.h>				//mallocs
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <time.h>					//monotonic clock
+#include <pthread.h>			//the wheel's thread and lock
+
+/*Timer wheel. Every periodic thing the node does for its peers (PeerRequests,
+  ArchiveRequests, noticing peers that went quiet, redialing peers we lost) is
+  a timer on a single hierarchical wheel, driven by a single thread, instead of
+  a sleeping thread per peer.
+
+  The wheel has TIMER_LEVELS levels of TIMER_SLOTS slots each. A slot of the
+  first level is one tick (TIMER_TICK_MS) long, and a slot of every other level
+  spans a whole turn of the level below it. A timer goes in the lowest level
+  whose turn reaches its deadline, so adding and cancelling timers is O(1) no
+  matter how many there are, and once a turn of a level is done the timers in
+  the next slot of the level above it are spread over the levels below (a
+  timer moves at most TIMER_LEVELS-1 times before it fires).
+
+  Timers fire in the wheel's thread, one at a time, with no lock held, so their
+  callbacks may add and cancel timers (their own included), but shouldn't take
+  long: everyone else's timers wait for them.
+
+  Until timer_start is called, timers can be added and cancelled but never
+  fire, which is what the programs that run the node's code in virtual time
+  (the simulator) need.*/
+
+/*length of a tick, levels, and slots per level (a power of 2)*/
+#define TIMER_TICK_MS 100
+#define TIMER_LEVELS 4
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+
+/*longest delay a timer can have, about 19 days, anything longer is cut down*/
+#define TIMER_MAX_TICKS ((1ULL << (TIMER_LEVELS * TIMER_BITS)) - 1)
+
+/*a timer. Brief description:
+  fn        ->  called with arg when it fires
+  expires   ->  tick it's due on
+  prev/next ->  its place in the list of its slot, NULL if it's not pending*/
+struct timer {
+	void (*fn)(void *arg);
+	void *arg;
+	uint64_t expires;
+	struct timer *prev, *next;
+};
+
+/*Starts the wheel's thread. Returns 0 on success, -1 if it couldn't be
+  started*/
+int timer_start();
+
+/*Sets up a timer that calls fn(arg) when it fires, not pending*/
+void timer_init(struct timer *t, void (*fn)(void *arg), void *arg);
+
+/*Makes the timer fire in ms milliseconds (rounded up to a tick), rescheduling
+  it if it was pending already*/
+void timer_add(struct timer *t, uint64_t ms);
+
+/*Makes sure the timer won't fire: if it's pending, it isn't anymore, and if
+  it's firing right now, waits for its callback to return (unless it's the
+  callback cancelling its own timer), and then makes sure the callback didn't
+  leave it pending again. Afterwards the timer can be freed*/
+void timer_cancel(struct timer *t);
+
+/*Returns ms plus or minus a random jitter of up to percent% of it, so timers
+  added at the same time with the same interval drift apart*/
+uint64_t timer_jitter(uint64_t ms, int percent);
@@ -0,0 +1,105 @@
+#include "trace.h"
+
+/*This file implements traffic capture and the trace file format, see trace.h*/
+
+/*whether capture is on*/
+int trace_enabled = 0;
+
+/*the trace file, and the lock every thread takes to write whole frames*/
+static FILE *tracefile = NULL;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*each receiver thread's frame in the making*/
+static __thread uint8_t *frame = NULL;
+static __thread uint32_t framelen = 0, framecap = 0;
+static __thread uint64_t framets = 0;
+
+int trace_open(const char *path) {
+	if ((tracefile = fopen(path, "wb")) == NULL) {
+		return -1;
+	}
+
+	/*big archives come in big frames, so buffer generously*/
+	setvbuf(tracefile, NULL, _IOFBF, 1 << 20);
+	fwrite(TRACE_MAGIC, 1, 8, tracefile);
+	trace_enabled = 1;
+	return 0;
+}
+
+void trace_begin() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	framets = (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+	framelen = 0;
+}
+
+void trace_append(const void *buf, uint32_t len) {
+	if (framelen + len > framecap) {
+		framecap = (framelen + len) * 2;
+		frame = (uint8_t*) realloc(frame, framecap);
+	}
+	memcpy(frame + framelen, buf, len);
+	framelen += len;
+}
+
+void trace_end(int sock, uint32_t ip, uint8_t type) {
+	struct trace_frame hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.ts = framets;
+	hdr.ip = ip;
+	hdr.sock = sock;
+	hdr.len = framelen;
+	hdr.type = type;
+
+	pthread_mutex_lock(&trace_mutex);
+	if (tracefile != NULL) {
+		fwrite(&hdr, sizeof(hdr), 1, tracefile);
+		fwrite(frame, 1, framelen, tracefile);
+	}
+	pthread_mutex_unlock(&trace_mutex);
+	framelen = 0;
+}
+
+void trace_close() {
+	pthread_mutex_lock(&trace_mutex);
+	trace_enabled = 0;
+	if (tracefile != NULL) {
+		fclose(tracefile);
+		tracefile = NULL;
+	}
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+FILE *trace_open_read(const char *path) {
+	FILE *trace = fopen(path, "rb");
+	char magic[8];
+
+	if (trace == NULL) {
+		return NULL;
+	}
+	if (fread(magic, 1, 8, trace) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0) {
+		fclose(trace);
+		return NULL;
+	}
+	return trace;
+}
+
+int trace_read(FILE *trace, struct trace_frame *hdr, uint8_t **buf,
+	uint32_t *cap) {
+	if (fread(hdr, sizeof(*hdr), 1, trace) != 1) {
+		return 0;
+	}
+
+	if (hdr->len > *cap) {
+		*cap = hdr->len;
+		*buf = (uint8_t*) realloc(*buf, *cap);
+	}
+
+	/*a frame cut short (the node was killed mid write) ends the trace*/
+	if (fread(*buf, 1, hdr->len, trace) != hdr->len) {
+		return 0;
+	}
+	return 1;
+}
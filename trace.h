@@ -0,0 +1,62 @@
+#include <stdio.h>				//trace files are plain stdio streams
+#include <stdlib.h>				//mallocs, reallocs and frees
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <string.h>				//memcpys and memcmps
+#include <time.h>					//timestamps for frames
+#include <pthread.h>			//writes to the trace file come from every receiver thread
+
+/*Traffic capture. When enabled, every message a receiver thread reads off a
+  peer is recorded, whole, as a frame in a binary trace file, which the replay
+  driver (replay.c) can feed back through the node's message handlers later.
+  Each receiver thread gathers the bytes of the message it's reading in a
+  private buffer, and only takes the file's lock to write the finished frame.
+
+  A trace file is the magic bytes followed by frames, each one a trace_frame
+  header followed by len bytes: the message as it came off the wire, minus the
+  type byte (which is in the header)*/
+
+/*magic bytes at the beginning of every trace file*/
+#define TRACE_MAGIC "BTRC0001"
+
+/*header of a frame in a trace file, always 24 bytes long. Brief description:
+  ts    ->  wall clock time the type byte arrived, in nanoseconds since the epoch
+  ip    ->  IPv4 address of the peer that sent it, in network byte order
+  sock  ->  socket the peer was on
+  len   ->  number of bytes after the type byte
+  type  ->  message type byte*/
+struct trace_frame {
+	uint64_t ts;
+	uint32_t ip;
+	int32_t sock;
+	uint32_t len;
+	uint8_t type;
+};
+
+/*whether capture is on (only ever set by trace_open)*/
+extern int trace_enabled;
+
+/*Creates the given trace file and starts capturing. Returns 0 on success, -1
+  if the file couldn't be created (capture stays off then)*/
+int trace_open(const char *path);
+
+/*Starts a new frame for the calling thread, its type byte just arrived*/
+void trace_begin();
+
+/*Adds bytes read off the wire to the calling thread's current frame*/
+void trace_append(const void *buf, uint32_t len);
+
+/*Writes the calling thread's current frame to the trace file*/
+void trace_end(int sock, uint32_t ip, uint8_t type);
+
+/*Flushes and closes the trace file, capture is off afterwards*/
+void trace_close();
+
+/*Opens a trace file for reading, checking its magic bytes. Returns NULL if it
+  can't be opened or isn't a trace file*/
+FILE *trace_open_read(const char *path);
+
+/*Reads the next frame from a trace file opened with trace_open_read. The
+  frame's bytes go into *buf, which is grown (realloc'd) as needed, *cap being
+  its current size. Returns 1 if a frame was read, 0 at the end of the file*/
+int trace_read(FILE *trace, struct trace_frame *frame, uint8_t **buf,
+	uint32_t *cap);
@@ -0,0 +1,41 @@
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <sys/types.h>		//ssize_t, off_t
+
+/*A transport is whatever moves the protocol's bytes between peers. The node's
+  protocol code (process_peerlist, process_archive, handle_message...) never
+  touches sockets directly, it goes through the active transport, so the exact
+  same code can run over real TCP sockets (socket_transport, in main.c) or over
+  the in-process network simulator (sim_transport, in sim.c).
+  Sockets are plain ints either way, whatever they mean to the transport.
+  Brief description of each operation:
+    connect   ->  connects to the peer listening on ip:port, returns the new
+                  socket, or -1 if it couldn't connect
+    start     ->  starts exchanging messages with a newly connected peer, that
+                  listens on the given port (e.g. launches its threads)
+    send      ->  same as send(), all of the bytes are queued or it fails
+    sendfile  ->  same as sendfile(), from fd at *offset, advancing it
+    recv      ->  receives exactly len bytes, returns len on success or 0/-1 if
+                  the connection was closed or timed out, same as recv()
+    peer_ip   ->  IPv4 address of the peer on the socket, in network byte order
+    hangup    ->  stops talking to the peer on the socket, without closing it
+                  yet: whoever reads from it finds out the connection is gone
+                  (with real sockets, its receiver thread gets an EOF), and
+                  disconnects the peer as usual
+    close     ->  closes the socket, same as close()*/
+struct transport {
+	int (*connect)(char *ip, uint16_t port);
+	void (*start)(int sock, uint16_t port);
+	ssize_t (*send)(int sock, const void *buf, size_t len, int flags);
+	ssize_t (*sendfile)(int sock, int fd, off_t *offset, size_t len);
+	int (*recv)(int sock, void *buf, uint32_t len);
+	uint32_t (*peer_ip)(int sock);
+	void (*hangup)(int sock);
+	int (*close)(int sock);
+};
+
+/*the transport the node is currently using (socket_transport unless whoever
+  runs the node's code says otherwise)*/
+extern const struct transport *transport;
+
+/*real TCP sockets, optionally through io_uring (see uring.h)*/
+extern const struct transport socket_transport;
@@ -0,0 +1,665 @@
+#include "uring.h"
+
+/*This file implements an io_uring based I/O backend, used as an alternative to
+  the blocking socket calls in main.c when the program is launched with the -u
+  flag. It covers the three spots where we spend the most syscalls: accepting
+  peers (multishot accept), connecting to peers (connect with a linked timeout
+  instead of select()) and receiving from peers.
+  Receiving is where the batching happens. A single thread, the shared read
+  loop, owns a ring that always has a recv in flight for every peer, into a
+  buffer of the peer's own. Each time around, it hands the kernel every recv
+  it (re-)armed since the last time and waits for completions, all in one
+  io_uring_enter call, then reaps every completion that came in, however many
+  peers they're for. The peers' threads still parse their messages one field
+  at a time, but out of their buffers, so they only wait (on a condition
+  variable, not a syscall of their own) when they caught up with what came in.
+  Other threads only talk to the loop to ask for a recv it can't arm on its own
+  (a buffer it stopped reading into because it was full, a new peer, a peer
+  going away), through a request list and an eventfd the loop always has a
+  read in flight for.
+  Connects are rare enough that every thread that connects just gets a small
+  ring of its own, created lazily on first use and torn down when the thread
+  exits, and accepts have a ring of their own too.
+
+  NOTE: we use the raw syscalls, because liburing is not installed by default on
+  most distros, and the handful of helpers we need are short enough anyway*/
+
+/*user_data values, so we can tell completions apart (the shared read loop
+  uses the streams' addresses instead, and URING_UD_WAKE for its eventfd)*/
+enum {
+	URING_UD_WAKE = 0,
+	URING_UD_OP,
+	URING_UD_TIMEOUT
+};
+
+/*cached result of the support probe (-1 = not probed yet)*/
+static int supported = -1;
+
+/*per-thread ring, and the key used to destroy it when the thread exits*/
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+/*the shared read loop. Brief description:
+  loop        ->  its ring, only the loop's thread touches it
+  loop_efd    ->  eventfd other threads write to, when they post a request
+  loop_wake   ->  where the loop reads the eventfd's counter into
+  requests    ->  streams that want the loop to look at them, linked through
+                  their next field, protected by req_mutex*/
+static struct uring loop;
+static int loop_efd = -1;
+static uint64_t loop_wake;
+static struct uring_stream *requests = NULL;
+static pthread_mutex_t req_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+	unsigned flags) {
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+		NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+	unsigned nr_args) {
+	return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*Initializes a ring with the given number of entries. Returns 0 on success and
+  -1 if the kernel refused to set it up.*/
+int uring_init(struct uring *ring, unsigned entries) {
+	struct io_uring_params p;
+
+	memset(ring, 0, sizeof(struct uring));
+	memset(&p, 0, sizeof(p));
+
+	if ((ring->fd = sys_io_uring_setup(entries, &p)) < 0) {
+		return -1;
+	}
+
+	/*compute ring sizes, newer kernels map both rings in a single mmap*/
+	ring->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_sz > ring->sq_sz) {
+			ring->sq_sz = ring->cq_sz;
+		}
+		ring->cq_sz = ring->sq_sz;
+	}
+
+	ring->sq_ptr = mmap(NULL, ring->sq_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ptr == MAP_FAILED) {
+		close(ring->fd);
+		return -1;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ptr = ring->sq_ptr;
+	}
+	else {
+		ring->cq_ptr = mmap(NULL, ring->cq_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ptr == MAP_FAILED) {
+			munmap(ring->sq_ptr, ring->sq_sz);
+			close(ring->fd);
+			return -1;
+		}
+	}
+
+	ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_ptr != ring->sq_ptr) {
+			munmap(ring->cq_ptr, ring->cq_sz);
+		}
+		munmap(ring->sq_ptr, ring->sq_sz);
+		close(ring->fd);
+		return -1;
+	}
+
+	/*grab pointers to all the ring fields we care about*/
+	uint8_t *sq = (uint8_t*) ring->sq_ptr, *cq = (uint8_t*) ring->cq_ptr;
+	ring->sq_head = (unsigned*) (sq + p.sq_off.head);
+	ring->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned*) (sq + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+	ring->cq_head = (unsigned*) (cq + p.cq_off.head);
+	ring->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+	return 0;
+}
+
+/*Unmaps and closes a ring*/
+void uring_free(struct uring *ring) {
+	munmap(ring->sqes, ring->sqes_sz);
+	if (ring->cq_ptr != ring->sq_ptr) {
+		munmap(ring->cq_ptr, ring->cq_sz);
+	}
+	munmap(ring->sq_ptr, ring->sq_sz);
+	close(ring->fd);
+}
+
+/*Grabs a free submission entry, zeroes it and queues it in the ring's array.
+  The entry is only made visible to the kernel by uring_submit.*/
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+	unsigned tail = *ring->sq_tail;
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+	if (tail - head >= ring->sq_entries) {
+		return NULL;
+	}
+
+	unsigned idx = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sq_array[idx] = idx;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	return sqe;
+}
+
+/*Takes back the last entry uring_get_sqe handed out, which the kernel hasn't
+  seen yet (nothing was submitted since), when it can't go out after all*/
+static void uring_drop_sqe(struct uring *ring) {
+	__atomic_store_n(ring->sq_tail, *ring->sq_tail - 1, __ATOMIC_RELEASE);
+}
+
+/*Hands the kernel the to_submit entries queued since the last call, and (if
+  wait_nr isn't 0) waits until at least wait_nr completions are in. Returns
+  what io_uring_enter does, retrying it if a signal interrupts it*/
+static int uring_submit(struct uring *ring, unsigned to_submit,
+	unsigned wait_nr) {
+	int rv;
+
+	do {
+		rv = sys_io_uring_enter(ring->fd, to_submit, wait_nr,
+			wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while (rv < 0 && errno == EINTR);
+
+	return rv;
+}
+
+/*Pops the next completion off the ring, blocking until there is one. The
+  result and user data are copied out so the slot can be released right away*/
+static int uring_wait_cqe(struct uring *ring, uint64_t *user_data, int32_t *res,
+	uint32_t *flags) {
+	while (1) {
+		unsigned head = *ring->cq_head;
+		unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+		if (head != tail) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+			*user_data = cqe->user_data;
+			*res = cqe->res;
+			*flags = cqe->flags;
+			__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+			return 0;
+		}
+
+		if (uring_submit(ring, 0, 1) < 0) {
+			return -1;
+		}
+	}
+}
+
+/*destructor for the per-thread rings*/
+static void ring_destructor(void *ptr) {
+	uring_free((struct uring*) ptr);
+	free(ptr);
+}
+
+static void make_ring_key() {
+	pthread_key_create(&ring_key, ring_destructor);
+}
+
+/*returns the calling thread's ring, creating it on first use. Returns NULL if
+  the ring can't be set up*/
+static struct uring *thread_ring() {
+	pthread_once(&ring_key_once, make_ring_key);
+
+	struct uring *ring = pthread_getspecific(ring_key);
+	if (ring != NULL) {
+		return ring;
+	}
+
+	ring = (struct uring*) malloc(sizeof(struct uring));
+	if (uring_init(ring, 8) == -1) {
+		free(ring);
+		return NULL;
+	}
+
+	pthread_setspecific(ring_key, ring);
+	return ring;
+}
+
+/*Submits a single operation linked to a timeout, and waits for both of their
+  completions. Returns the result of the operation (negative errno on error,
+  -ETIME if the timeout fired first, which cancels the operation, -EBUSY if
+  there was no room in the ring for the timeout, so nothing was submitted)*/
+static int uring_run_linked(struct uring *ring, struct io_uring_sqe *op,
+	struct __kernel_timespec *ts) {
+	op->flags |= IOSQE_IO_LINK;
+	op->user_data = URING_UD_OP;
+
+	struct io_uring_sqe *tsqe = uring_get_sqe(ring);
+	if (tsqe == NULL) {
+		/*no room for the timeout, so the operation can't go out either*/
+		uring_drop_sqe(ring);
+		return -EBUSY;
+	}
+	tsqe->opcode = IORING_OP_LINK_TIMEOUT;
+	tsqe->fd = -1;
+	tsqe->addr = (uint64_t) (uintptr_t) ts;
+	tsqe->len = 1;
+	tsqe->user_data = URING_UD_TIMEOUT;
+
+	if (uring_submit(ring, 2, 0) < 0) {
+		return -errno;
+	}
+
+	/*we always get two completions, one for each entry in the link*/
+	int op_res = -ECANCELED, i;
+	for (i = 0; i < 2; i++) {
+		uint64_t ud; int32_t res; uint32_t flags;
+		if (uring_wait_cqe(ring, &ud, &res, &flags) == -1) {
+			return -errno;
+		}
+		if (ud == URING_UD_OP) {
+			op_res = res;
+		}
+	}
+
+	/*a cancelled op means the timeout went off*/
+	if (op_res == -ECANCELED || op_res == -EINTR) {
+		return -ETIME;
+	}
+	return op_res;
+}
+
+/*Checks whether the running kernel supports everything our backend needs
+  (ring setup, accept, connect, recvs, reads and linked timeouts). The result is
+  cached, so calling this more than once is cheap. Returns 1 if supported.*/
+int uring_supported() {
+	if (supported != -1) {
+		return supported;
+	}
+
+	struct uring ring;
+	if (uring_init(&ring, 4) == -1) {
+		supported = 0;
+		return 0;
+	}
+
+	/*ask the kernel which opcodes it knows about*/
+	size_t probe_sz = sizeof(struct io_uring_probe) +
+		IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = (struct io_uring_probe*) calloc(1, probe_sz);
+
+	supported = 0;
+	if (sys_io_uring_register(ring.fd, IORING_REGISTER_PROBE, probe,
+		IORING_OP_LAST) == 0) {
+		uint8_t ops[] = {IORING_OP_ACCEPT, IORING_OP_CONNECT, IORING_OP_RECV,
+			IORING_OP_READ, IORING_OP_LINK_TIMEOUT};
+		unsigned i;
+		supported = 1;
+		for (i = 0; i < sizeof(ops); i++) {
+			if (ops[i] > probe->last_op ||
+				!(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+				supported = 0;
+			}
+		}
+	}
+
+	free(probe);
+	uring_free(&ring);
+	return supported;
+}
+
+/*Connects the given (blocking) socket to the given address through the calling
+  thread's ring, with a linked timeout of timeout_ms milliseconds replacing the
+  old select() trick. Returns 0 once connected, or -1 (the socket is left open,
+  closing it is up to the caller).*/
+int uring_connect(int sock, struct sockaddr *addr, socklen_t addrlen,
+	int timeout_ms) {
+	struct uring *ring = thread_ring();
+	if (ring == NULL) {
+		return -1;
+	}
+
+	struct __kernel_timespec ts;
+	ts.tv_sec = timeout_ms / 1000;
+	ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	if (sqe == NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+	sqe->opcode = IORING_OP_CONNECT;
+	sqe->fd = sock;
+	sqe->addr = (uint64_t) (uintptr_t) addr;
+	sqe->off = addrlen;
+
+	if (uring_run_linked(ring, sqe, &ts) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*Arms a recv from a stream's socket into its buffer, moving what's left to
+  take to the front first, unless more than half of the buffer is waiting to
+  be taken (the socket's thread asks again once it caught up). Only the loop's
+  thread calls this, with the stream's mutex held. queued counts the entries
+  waiting to be submitted, which go out first if the ring is full*/
+static void arm_stream(struct uring_stream *s, unsigned *queued) {
+	if (s->armed || s->eof || s->closing ||
+		s->tail - s->head > URING_BUF_SIZE / 2) {
+		return;
+	}
+
+	if (s->head == s->tail) {
+		s->head = s->tail = 0;
+	}
+	else if (s->head > 0) {
+		memmove(s->buf, s->buf + s->head, s->tail - s->head);
+		s->tail -= s->head;
+		s->head = 0;
+	}
+
+	struct io_uring_sqe *sqe = uring_get_sqe(&loop);
+	if (sqe == NULL) {
+		if (uring_submit(&loop, *queued, 0) >= 0) {
+			*queued = 0;
+		}
+		if ((sqe = uring_get_sqe(&loop)) == NULL) {
+			/*the kernel won't take what we have, nothing to do but give up on
+			  this socket*/
+			s->eof = 1;
+			pthread_cond_signal(&s->cond);
+			return;
+		}
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = s->sock;
+	sqe->addr = (uint64_t) (uintptr_t) (s->buf + s->tail);
+	sqe->len = URING_BUF_SIZE - s->tail;
+	sqe->user_data = (uint64_t) (uintptr_t) s;
+	s->armed = 1;
+	(*queued)++;
+}
+
+/*Arms a read of the loop's eventfd, so posting a request wakes the loop up*/
+static int arm_wake(unsigned *queued) {
+	struct io_uring_sqe *sqe = uring_get_sqe(&loop);
+
+	if (sqe == NULL) {
+		return -EBUSY;
+	}
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = loop_efd;
+	sqe->addr = (uint64_t) (uintptr_t) &loop_wake;
+	sqe->len = sizeof(loop_wake);
+	sqe->user_data = URING_UD_WAKE;
+	(*queued)++;
+	return 0;
+}
+
+/*Puts a stream on the loop's request list (unless it's there already), and
+  wakes the loop up. Called with the stream's mutex held*/
+static void post_request(struct uring_stream *s) {
+	uint64_t one = 1;
+
+	if (s->queued) {
+		return;
+	}
+	s->queued = 1;
+	pthread_mutex_lock(&req_mutex);
+	s->next = requests;
+	requests = s;
+	pthread_mutex_unlock(&req_mutex);
+	if (write(loop_efd, &one, sizeof(one)) != sizeof(one)) {
+		fprintf(stderr, "Error, could not wake up the read loop!\n");
+	}
+}
+
+/*Goes over the requests posted since the last time: streams that need a recv
+  armed, and streams going away, which are told the loop is done with them*/
+static void take_requests(unsigned *queued) {
+	struct uring_stream *s, *next;
+
+	pthread_mutex_lock(&req_mutex);
+	s = requests;
+	requests = NULL;
+	pthread_mutex_unlock(&req_mutex);
+
+	for (; s != NULL; s = next) {
+		pthread_mutex_lock(&s->mutex);
+		next = s->next;
+		s->queued = 0;
+		arm_stream(s, queued);
+		pthread_cond_signal(&s->cond);
+		pthread_mutex_unlock(&s->mutex);
+	}
+}
+
+/*Hands a recv's result to its stream, and arms the next one right away if
+  there's room for it*/
+static void complete_stream(struct uring_stream *s, int32_t res,
+	unsigned *queued) {
+	pthread_mutex_lock(&s->mutex);
+	s->armed = 0;
+	if (res > 0) {
+		s->tail += res;
+	}
+	else if (res != -EAGAIN && res != -EINTR) {
+		s->eof = 1;
+	}
+	arm_stream(s, queued);
+	pthread_cond_signal(&s->cond);
+	pthread_mutex_unlock(&s->mutex);
+}
+
+/*The shared read loop: submits whatever was armed since the last time and
+  waits for at least one completion in a single call, then reaps every
+  completion there is*/
+static void *loop_thread(void *arg) {
+	unsigned queued = 0;
+	(void) arg;
+
+	if (arm_wake(&queued) != 0) {
+		return NULL;
+	}
+
+	while (1) {
+		int rv = uring_submit(&loop, queued, 1);
+		if (rv < 0) {
+			fprintf(stderr, "Error, the io_uring read loop stopped!\n");
+			break;
+		}
+		queued -= (unsigned) rv < queued ? (unsigned) rv : queued;
+
+		/*reap everything that's in, not just the one we waited for*/
+		unsigned head = *loop.cq_head;
+		unsigned tail = __atomic_load_n(loop.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &loop.cqes[head & *loop.cq_mask];
+			uint64_t ud = cqe->user_data;
+			int32_t res = cqe->res;
+
+			if (ud == URING_UD_WAKE) {
+				take_requests(&queued);
+				arm_wake(&queued);
+			}
+			else {
+				complete_stream((struct uring_stream*) (uintptr_t) ud, res, &queued);
+			}
+		}
+		__atomic_store_n(loop.cq_head, head, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/*Starts the shared read loop. Returns 0 on success, -1 if it couldn't be
+  started*/
+int uring_loop_start() {
+	pthread_t thread;
+
+	if (uring_init(&loop, URING_LOOP_ENTRIES) == -1) {
+		return -1;
+	}
+	if ((loop_efd = eventfd(0, 0)) == -1) {
+		uring_free(&loop);
+		return -1;
+	}
+	if (pthread_create(&thread, NULL, loop_thread, NULL) != 0) {
+		close(loop_efd);
+		loop_efd = -1;
+		uring_free(&loop);
+		return -1;
+	}
+	pthread_detach(thread);
+	return 0;
+}
+
+/*Hands a connected socket over to the shared read loop. Returns NULL if the
+  loop isn't running*/
+struct uring_stream *uring_watch(int sock) {
+	struct uring_stream *s;
+
+	if (loop_efd == -1) {
+		return NULL;
+	}
+
+	s = (struct uring_stream*) calloc(1, sizeof(struct uring_stream));
+	s->sock = sock;
+	s->buf = (uint8_t*) malloc(URING_BUF_SIZE);
+	pthread_mutex_init(&s->mutex, NULL);
+	pthread_cond_init(&s->cond, NULL);
+
+	pthread_mutex_lock(&s->mutex);
+	post_request(s);
+	pthread_mutex_unlock(&s->mutex);
+	return s;
+}
+
+/*Takes exactly len bytes the loop received from a watched socket into dst.
+  Returns len on success, or -1 if the connection was closed first*/
+int uring_stream_recv(struct uring_stream *s, uint8_t *dst, uint32_t len) {
+	uint32_t done = 0;
+
+	pthread_mutex_lock(&s->mutex);
+	while (done < len) {
+		uint32_t avail = s->tail - s->head;
+		if (avail > 0) {
+			if (avail > len - done) {
+				avail = len - done;
+			}
+			memcpy(dst + done, s->buf + s->head, avail);
+			s->head += avail;
+			done += avail;
+			continue;
+		}
+		if (s->eof) {
+			break;
+		}
+
+		/*caught up, the loop is reading for us unless the buffer was full*/
+		if (!s->armed) {
+			post_request(s);
+		}
+		pthread_cond_wait(&s->cond, &s->mutex);
+	}
+
+	/*the loop stopped reading into a buffer that was too full, and now has
+	  room to again*/
+	if (!s->armed && !s->eof && s->tail - s->head <= URING_BUF_SIZE / 2) {
+		post_request(s);
+	}
+	pthread_mutex_unlock(&s->mutex);
+
+	return done == len ? (int) len : -1;
+}
+
+/*Takes a socket away from the shared read loop, and frees its stream once the
+  loop is done with it*/
+void uring_unwatch(struct uring_stream *s) {
+	pthread_mutex_lock(&s->mutex);
+	s->closing = 1;
+	if (s->armed) {
+		/*a recv in flight only ends when something comes in, or the socket
+		  can't be read from any more*/
+		shutdown(s->sock, SHUT_RD);
+	}
+	while (s->armed || s->queued) {
+		pthread_cond_wait(&s->cond, &s->mutex);
+	}
+	pthread_mutex_unlock(&s->mutex);
+
+	pthread_mutex_destroy(&s->mutex);
+	pthread_cond_destroy(&s->cond);
+	free(s->buf);
+	free(s);
+}
+
+/*Accepts connections on the given listening socket forever, using a multishot
+  accept (or re-armed single accepts on kernels that lack multishot support),
+  and calls on_accept for each new connected socket. Only returns on error.*/
+void uring_accept_loop(int listensock, void (*on_accept)(int sock)) {
+	struct uring ring;
+	int multishot = 1, armed = 0;
+
+	if (uring_init(&ring, 64) == -1) {
+		fprintf(stderr, "Could not set up io_uring for incoming peers!\n");
+		return;
+	}
+
+	while (1) {
+		/*(re-)arm the accept, a multishot accept stays armed until it errors out*/
+		if (!armed) {
+			struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+			if (sqe == NULL) {
+				fprintf(stderr, "Error, no room in the ring to accept peers!\n");
+				break;
+			}
+			sqe->opcode = IORING_OP_ACCEPT;
+			sqe->fd = listensock;
+			sqe->ioprio = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+			sqe->user_data = URING_UD_OP;
+			if (uring_submit(&ring, 1, 0) < 0) {
+				break;
+			}
+			armed = 1;
+		}
+
+		uint64_t ud; int32_t res; uint32_t flags;
+		if (uring_wait_cqe(&ring, &ud, &res, &flags) == -1) {
+			break;
+		}
+
+		/*no more completions coming from this submission, we'll have to re-arm*/
+		if (!(flags & IORING_CQE_F_MORE)) {
+			armed = 0;
+		}
+
+		if (res < 0) {
+			/*older kernels reject the multishot flag, fall back to single shots*/
+			if (res == -EINVAL && multishot) {
+				multishot = 0;
+				continue;
+			}
+			fprintf(stderr, "Error, could not accept connection from peer!\n");
+			continue;
+		}
+
+		on_accept(res);
+	}
+
+	uring_free(&ring);
+}
@@ -0,0 +1,108 @@
+#include <stdio.h>				//error reporting
+#include <stdlib.h>				//mallocs, frees and whatnot
+#include <stdint.h>				//portable size types (uint8_t, uint32_t, etc)
+#include <string.h>				//memsets and memcpys
+#include <errno.h>				//error codes returned in completion entries
+#include <unistd.h>				//close and syscall
+#include <sys/mman.h>			//mmaps for the submission/completion rings
+#include <sys/syscall.h>	//raw io_uring syscall numbers
+#include <sys/socket.h>		//sockaddrs and socket creation
+#include <pthread.h>			//thread keys, so each thread gets its own ring
+#include <sys/eventfd.h>	//waking up the shared read loop
+#include <linux/io_uring.h>		//io_uring structures and opcodes
+#include <linux/time_types.h>	//__kernel_timespec, for linked timeouts
+
+/*size of every watched socket's receive buffer (see uring_watch). The shared
+  read loop only reads into it while at most half of it is waiting to be taken,
+  so a peer whose thread is busy can't make us buffer more than this*/
+#define URING_BUF_SIZE 65536
+
+/*entries in the shared read loop's ring, it keeps a read in flight for every
+  watched socket, and the completion ring is twice as big*/
+#define URING_LOOP_ENTRIES 1024
+
+/*struct that wraps a single io_uring instance. We talk to the kernel through
+  the raw syscalls instead of liburing, to avoid adding a dependency for what is
+  really just a couple of mmaps and some pointer juggling.
+  fd        ->  ring file descriptor returned by io_uring_setup
+  sq, cq    ->  pointers into the shared submission/completion rings
+  sqes      ->  array of submission queue entries
+  cqes      ->  array of completion queue entries*/
+struct uring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array, sq_entries;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_sz, cq_sz, sqes_sz;
+};
+
+/*a socket the shared read loop receives from (see uring_watch). The loop keeps
+  a recv into buf in flight whenever there's room in it, and the socket's own
+  thread takes the bytes out. Brief description:
+  sock        ->  the socket
+  buf         ->  bytes received, the ones from head to tail not taken yet
+  armed       ->  a recv into buf is in flight
+  queued      ->  the stream is on the loop's request list
+  closing     ->  uring_unwatch was called, no more recvs are armed
+  eof         ->  the socket was closed (or failed), nothing more is coming
+  mutex, cond ->  protect all of the above, and wake up the socket's thread
+  next        ->  next stream on the loop's request list*/
+struct uring_stream {
+	int sock;
+	uint8_t *buf;
+	uint32_t head, tail;
+	int armed, queued, closing, eof;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct uring_stream *next;
+};
+
+/*Checks whether the running kernel supports everything our backend needs
+  (ring setup, accept, connect, recvs, reads and linked timeouts). The result is
+  cached, so calling this more than once is cheap. Returns 1 if supported.*/
+int uring_supported();
+
+/*Initializes a ring with the given number of entries. Returns 0 on success and
+  -1 if the kernel refused to set it up.*/
+int uring_init(struct uring *ring, unsigned entries);
+
+/*Unmaps and closes a ring*/
+void uring_free(struct uring *ring);
+
+/*Connects the given (blocking) socket to the given address through the calling
+  thread's ring, with a linked timeout of timeout_ms milliseconds replacing the
+  old select() trick. Returns 0 once connected, or -1 (the socket is left open,
+  closing it is up to the caller).*/
+int uring_connect(int sock, struct sockaddr *addr, socklen_t addrlen,
+	int timeout_ms);
+
+/*Starts the shared read loop: a single thread with a single ring, that keeps
+  a recv in flight for every watched socket, and submits and reaps all of them
+  together, so however many peers have data for us, one io_uring_enter call
+  hands it all over. Returns 0 on success, -1 if it couldn't be started*/
+int uring_loop_start();
+
+/*Hands a connected socket over to the shared read loop, which starts
+  receiving from it right away. From now on, whatever is read from the socket
+  must be read through uring_stream_recv, by a single thread. Returns NULL if
+  the loop isn't running*/
+struct uring_stream *uring_watch(int sock);
+
+/*Takes exactly len bytes the loop received from a watched socket into dst,
+  waiting for them if they aren't in yet. Only waits on the loop, which never
+  times out, so whoever notices the peer stalled has to shut the socket down.
+  Returns len on success, or -1 if the connection was closed (or failed)
+  first*/
+int uring_stream_recv(struct uring_stream *stream, uint8_t *dst, uint32_t len);
+
+/*Takes a socket away from the shared read loop, shutting its reading side
+  down if a recv is still in flight, and waits until the loop is done with it.
+  Must be called before the socket is closed. Frees the stream*/
+void uring_unwatch(struct uring_stream *stream);
+
+/*Accepts connections on the given listening socket forever, using a multishot
+  accept (or re-armed single accepts on kernels that lack multishot support),
+  and calls on_accept for each new connected socket. Only returns on error.*/
+void uring_accept_loop(int listensock, void (*on_accept)(int sock));